@@ -0,0 +1,511 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "internal.h"
+#include "communication.h"
+
+/*
+ * Microbenchmarks of the protocol codec and the renderers, run over canned
+ * replies of a pack, captured from seplos_simulator. Each operation processes
+ * one whole telemetry reply, or for seplos_decode() and the renderers, one
+ * whole sample, so that the figures are directly frames/s.
+ *
+ * The output is one tab-separated line per benchmark, after a header line:
+ *
+ *   benchmark	iterations	ns_per_op	ops_per_s	bytes_per_s
+ *
+ * bytes_per_s counts the protocol characters that were processed, or for the
+ * compression of the history, the bytes of the uncompressed columns. Each
+ * operation of that is one block of SEPLOS_STORE_BLOCK_SAMPLES samples, of a
+ * pack at rest with its cells drifting together, with the jitter of a real
+ * schedule, and the size of the compressed block goes to stderr.
+ *
+ * seplos_rules_evaluate is one sample through a set of alarm rules of each
+ * kind, as the daemon does after every poll of every pack.
+ *
+ * seplos_shm_publish and seplos_shm_read are the writer and a reader of a
+ * slot of a shared-memory segment, without contention, which is the cost of
+ * the seqlock and the copy of a sample.
+ *
+ * seplos_fleet_update is one new sample of one pack of a site of FLEET packs,
+ * and seplos_fleet_summary reading the summary of the site.
+ *
+ * analyze is the kernel of seplos_analyze() over one span of ANALYSIS_SPAN
+ * samples of a pack of 16 cells, and bytes_per_s counts its columns.
+ *
+ * The checks of the SIMD versions against the scalar versions, and of the
+ * rest of the library, are in ../tests, which "make check" runs.
+ */
+
+/* Telemetry and telecommand replies from address 0, pack 1. */
+static const char telemetry[] =
+ "~2000460010960001100CEE0CEE0CB20CEE0CEE0CEE0CEE0CEE0CEE0CEE0CEE0CEE0CEE0CEE0CEE"
+ "0CEE060BA50BE60BA50BA50BA50BA5FB1E14AA19320A271002852710000A03E814AA000000000000"
+ "0000DBCD\r";
+static const char telecommand[] =
+ "~20004600806200011000000002000000000000000000000000060000000000000000142000000000"
+ "000304001000800000000000000000EB23\r";
+
+#define	NS_PER_SECOND	1000000000LL
+/* Each benchmark runs for at least this long. */
+#define	MINIMUM_TIME	(NS_PER_SECOND / 5)
+
+static volatile unsigned int	sink;
+static FILE *			null;
+
+typedef void (*operation)(void);
+
+static void
+run(const char * name, operation o, size_t bytes)
+{
+  unsigned long	iterations = 1;
+  int64_t	elapsed;
+
+  o(); /* Warm up the caches, and the SIMD dispatch. */
+
+  for ( ; ; ) {
+    const int64_t start = _sp_monotonic_time();
+    for ( unsigned long i = 0; i < iterations; i++ )
+      o();
+    elapsed = _sp_monotonic_time() - start;
+    if ( elapsed >= MINIMUM_TIME )
+      break;
+    iterations *= 2;
+  }
+
+  const double ns = (double)elapsed / iterations;
+  printf("%s\t%lu\t%.2f\t%.0f\t%.0f\n", name, iterations, ns, NS_PER_SECOND / ns, bytes * (NS_PER_SECOND / ns));
+}
+
+/* The info field of the telemetry reply, and its length in characters. */
+#define	INFO		(telemetry + 13)
+#define	INFO_LENGTH	(sizeof(telemetry) - 1 - 18)
+
+static void
+hex2b(void)
+{
+  bool		invalid = false;
+  unsigned int	sum = 0;
+
+  for ( unsigned int i = 0; i < INFO_LENGTH; i += 2 )
+    sum += _sp_hex2b(INFO + i, &invalid);
+  sink = sum + invalid;
+}
+
+static void
+hex4b(void)
+{
+  bool		invalid = false;
+  unsigned int	sum = 0;
+
+  for ( unsigned int i = 0; i + 4 <= INFO_LENGTH; i += 4 )
+    sum += _sp_hex4b(INFO + i, &invalid);
+  sink = sum + invalid;
+}
+
+static uint8_t	binary[SEPLOS_BINARY_INFO_SIZE];
+
+static void
+hex_decode(void)
+{
+  sink = _sp_hex_decode(INFO, binary, INFO_LENGTH / 2) + binary[0];
+}
+
+static void
+hex_decode_scalar(void)
+{
+  sink = _sp_hex_decode_scalar(INFO, binary, INFO_LENGTH / 2) + binary[0];
+}
+
+static void
+checksum(void)
+{
+  sink = _sp_overall_checksum(telemetry + 1, sizeof(telemetry) - 1 - 6);
+}
+
+static void
+checksum_scalar(void)
+{
+  sink = _sp_overall_checksum_scalar(telemetry + 1, sizeof(telemetry) - 1 - 6);
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+static void
+hex_decode_sse2(void)
+{
+  sink = _sp_hex_decode_sse2(INFO, binary, INFO_LENGTH / 2) + binary[0];
+}
+
+static void
+hex_decode_avx2(void)
+{
+  sink = _sp_hex_decode_avx2(INFO, binary, INFO_LENGTH / 2) + binary[0];
+}
+
+static void
+checksum_sse2(void)
+{
+  sink = _sp_overall_checksum_sse2(telemetry + 1, sizeof(telemetry) - 1 - 6);
+}
+
+static void
+checksum_avx2(void)
+{
+  sink = _sp_overall_checksum_avx2(telemetry + 1, sizeof(telemetry) - 1 - 6);
+}
+#endif
+
+/* What the receiver does to each frame: validate the header and checksum, and convert the info. */
+static void
+frame_decode(void)
+{
+  static Seplos_2_0_Reply reply;
+
+  sink = _sp_frame_decode((const Seplos_2_0 *)telemetry, sizeof(telemetry) - 1, &reply) + reply.info[0];
+}
+
+static SeplosData	data;
+
+static void
+decode(void)
+{
+  sink = seplos_decode(telemetry, sizeof(telemetry) - 1, telecommand, sizeof(telecommand) - 1, 1, &data);
+}
+
+static void
+text(void)
+{
+  seplos_text(null, &data, true);
+}
+
+static void
+html(void)
+{
+  seplos_html(null, &data, true);
+}
+
+static void
+json(void)
+{
+  seplos_json(null, &data, true);
+}
+
+static void
+json_format(void)
+{
+  static char buffer[SEPLOS_JSON_SIZE];
+
+  sink = seplos_json_format(buffer, sizeof(buffer), &data, true);
+}
+
+static uint8_t	record[SEPLOS_RECORD_SIZE];
+
+static void
+record_encode(void)
+{
+  seplos_record_encode(record, 0, &data);
+  sink = record[0];
+}
+
+static void
+record_decode(void)
+{
+  static SeplosData	d;
+  int64_t		timestamp;
+
+  seplos_record_decode(record, &timestamp, &d);
+  sink = d.number_of_cells;
+}
+
+/* One block of the store, in columns, and the same compressed and decompressed. */
+#define	SERIES		SEPLOS_STORE_BLOCK_SAMPLES
+#define	BYTE_ALARMS	(SEPLOS_N_CELLS + SEPLOS_N_TEMPERATURES + 2)
+
+static int64_t	timestamps[2][SERIES];
+static uint16_t	values[2][SEPLOS_COLUMN_STATE][SERIES];
+static uint64_t	bit_alarms[2][SERIES];
+static uint8_t	byte_alarms[2][SERIES][BYTE_ALARMS];
+static void *	columns[2][SEPLOS_STORE_COLUMNS];
+static uint8_t	compressed[SEPLOS_SERIES_SIZE(SERIES)];
+static size_t	compressed_length;
+static const size_t series_bytes = SERIES * (sizeof(int64_t) + (SEPLOS_COLUMN_STATE * sizeof(uint16_t)) + sizeof(uint64_t) + BYTE_ALARMS);
+
+static void
+make_series(void)
+{
+  int	common = 3300;
+
+  srandom(2);
+  for ( unsigned int v = 0; v < 2; v++ ) {
+    columns[v][SEPLOS_COLUMN_TIMESTAMP] = timestamps[v];
+    for ( unsigned int c = SEPLOS_COLUMN_CELL_VOLTAGE; c <= SEPLOS_COLUMN_STATE; c++ )
+      columns[v][c] = values[v][c - 1];
+    columns[v][SEPLOS_COLUMN_BIT_ALARMS] = bit_alarms[v];
+    columns[v][SEPLOS_COLUMN_BYTE_ALARMS] = byte_alarms[v];
+  }
+
+  for ( unsigned int i = 0; i < SERIES; i++ ) {
+    /* 5 seconds apart, each up to 2 ms late. */
+    timestamps[0][i] = 1700000000000000LL + (i * 5000000LL) + (random() % 2000);
+    common += (random() % 3) - 1;
+    for ( unsigned int c = 0; c < SEPLOS_N_CELLS; c++ )
+      values[0][SEPLOS_COLUMN_CELL_VOLTAGE - 1 + c][i] = common + (c % 3) + (random() % 8 == 0);
+    for ( unsigned int t = 0; t < SEPLOS_N_TEMPERATURES; t++ )
+      values[0][SEPLOS_COLUMN_TEMPERATURE - 1 + t][i] = 2981 + t + (i / 600);
+    values[0][SEPLOS_COLUMN_CURRENT - 1][i] = (random() % 21) - 10;
+    values[0][SEPLOS_COLUMN_VOLTAGE - 1][i] = (common * SEPLOS_N_CELLS) / 10;
+    values[0][SEPLOS_COLUMN_RESIDUAL_CAPACITY - 1][i] = 20000;
+    values[0][SEPLOS_COLUMN_BATTERY_CAPACITY - 1][i] = 28000;
+    values[0][SEPLOS_COLUMN_STATE_OF_CHARGE - 1][i] = 714;
+    values[0][SEPLOS_COLUMN_RATED_CAPACITY - 1][i] = 28000;
+    values[0][SEPLOS_COLUMN_CYCLES - 1][i] = 12;
+    values[0][SEPLOS_COLUMN_STATE_OF_HEALTH - 1][i] = 1000;
+    values[0][SEPLOS_COLUMN_PORT_VOLTAGE - 1][i] = (common * SEPLOS_N_CELLS) / 10;
+    values[0][SEPLOS_COLUMN_EQUILIBRIUM - 1][i] = (i / 1000) % 2 ? 0x0004 : 0;
+    values[0][SEPLOS_COLUMN_STATE - 1][i] = 0x0308;
+    bit_alarms[0][i] = i > 2000 && i < 2100 ? 0x100 : 0;
+    byte_alarms[0][i][3] = i > 3000 && i < 3010 ? 2 : 0;
+  }
+}
+
+static void
+series_encode(void)
+{
+  compressed_length = seplos_series_encode(compressed, sizeof(compressed), (const void * const *)columns[0], SERIES);
+}
+
+static void
+series_decode(void)
+{
+  unsigned int count;
+
+  sink = seplos_series_decode(compressed, compressed_length, columns[1], SERIES, &count) + count;
+}
+
+static const char	rules_text[] =
+ "any alarm\n"
+ "depleted depleted\n"
+ "hot hot\n"
+ "fault bit 5\n"
+ "cells cell-alarm\n"
+ "cell3 cell-alarm 3\n"
+ "current current-alarm\n"
+ "imbalance spread > 0.05 clear 0.03 for 60\n"
+ "too-hot temperature > 45 clear 42\n"
+ "low soc < 20 clear 25 limit 3600\n"
+ "charging current > 50\n"
+ "high cell > 3.6 clear 3.5\n";
+static SeplosRules *	rules;
+static int64_t		rules_time;
+
+static void
+rules_evaluate(void)
+{
+  static SeplosAlarmEvent	events[16];
+
+  sink = seplos_rules_evaluate(rules, 0, rules_time += 1000000, &data, events);
+}
+
+static SeplosShm *	shm_writer;
+static SeplosShm *	shm_reader;
+
+static void
+shm_publish(void)
+{
+  seplos_shm_publish(shm_writer, 0, 0, &data);
+}
+
+static void
+shm_read(void)
+{
+  static SeplosData	d;
+  int64_t		timestamp;
+
+  sink = seplos_shm_read(shm_reader, 0, &timestamp, &d) + d.number_of_cells;
+}
+
+static uint16_t		span_cells[SEPLOS_N_CELLS][ANALYSIS_SPAN];
+static uint16_t		span_equilibrium[ANALYSIS_SPAN];
+static int16_t		span_steps[ANALYSIS_SPAN];
+static AnalysisSpan	span;
+static const size_t	span_bytes = ANALYSIS_SPAN * ((SEPLOS_N_CELLS + 2) * sizeof(uint16_t));
+
+/* A pack at rest, with a step in the current now and then. */
+static void
+make_span(void)
+{
+  srandom(3);
+  for ( unsigned int c = 0; c < SEPLOS_N_CELLS; c++ ) {
+    for ( unsigned int t = 0; t < ANALYSIS_SPAN; t++ )
+      span_cells[c][t] = 3300 + (random() % 20);
+    span.cells[c] = span_cells[c];
+    span.previous[c] = 3300;
+  }
+  for ( unsigned int t = 0; t < ANALYSIS_SPAN; t++ ) {
+    span_equilibrium[t] = random() % 4 == 0 ? 1 << (random() % SEPLOS_N_CELLS) : 0;
+    span_steps[t] = random() % 60 == 0 ? (random() % 20000) - 10000 : 0;
+  }
+  span.equilibrium = span_equilibrium;
+  span.steps = span_steps;
+  span.number_of_cells = SEPLOS_N_CELLS;
+}
+
+static void
+start_sums(AnalysisSums * sums)
+{
+  memset(sums, 0, sizeof(*sums));
+  for ( unsigned int c = 0; c < SEPLOS_N_CELLS; c++ ) {
+    sums->lowest[c] = INT32_MAX;
+    sums->highest[c] = INT32_MIN;
+  }
+}
+
+static void
+analyze(void)
+{
+  AnalysisSums sums;
+
+  start_sums(&sums);
+  _sp_analyze(&span, ANALYSIS_SPAN, &sums);
+  sink = sums.balancing[0];
+}
+
+static void
+analyze_scalar(void)
+{
+  AnalysisSums sums;
+
+  start_sums(&sums);
+  _sp_analyze_scalar(&span, 0, ANALYSIS_SPAN, &sums);
+  sink = sums.balancing[0];
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+static void
+analyze_avx2(void)
+{
+  AnalysisSums sums;
+
+  start_sums(&sums);
+  _sp_analyze_avx2(&span, ANALYSIS_SPAN, &sums);
+  sink = sums.balancing[0];
+}
+#endif
+
+#define	FLEET	1024
+static SeplosFleet *	fleet;
+static unsigned int	fleet_pack;
+
+static void
+fleet_update(void)
+{
+  fleet_pack = (fleet_pack + 1) % FLEET;
+  seplos_fleet_update(fleet, fleet_pack, &data);
+}
+
+static void
+fleet_summary(void)
+{
+  SeplosFleetSummary s;
+
+  seplos_fleet_summary(fleet, &s);
+  sink = s.packs;
+}
+
+int
+main(void)
+{
+  const size_t	frame = sizeof(telemetry) - 1;
+
+  if ( (null = fopen("/dev/null", "w")) == 0 ) {
+    perror("/dev/null");
+    return 1;
+  }
+  if ( seplos_decode(telemetry, frame, telecommand, sizeof(telecommand) - 1, 1, &data) != 0 ) {
+    fprintf(stderr, "The canned frames don't decode.\n");
+    return 1;
+  }
+
+  make_series();
+  series_encode();
+  fprintf(
+   stderr,
+   "%u samples: %zu bytes in columns, %zu compressed, %.2f bytes per sample.\n",
+   SERIES,
+   series_bytes,
+   compressed_length,
+   (double)compressed_length / SERIES);
+
+  make_span();
+
+#if defined(__x86_64__) || defined(__i386__)
+  const bool sse2 = __builtin_cpu_supports("sse2");
+  const bool avx2 = __builtin_cpu_supports("avx2");
+#endif
+
+  if ( (rules = seplos_rules_parse(rules_text, "rules_text", 1)) == 0 )
+    return 1;
+  if ( (fleet = seplos_fleet_open(FLEET)) == 0 )
+    return 1;
+  for ( unsigned int i = 0; i < FLEET; i++ )
+    seplos_fleet_update(fleet, i, &data);
+
+  char shm_name[32];
+  snprintf(shm_name, sizeof(shm_name), "/seplos-bench-%d", (int)getpid());
+  if ( (shm_writer = seplos_shm_create(shm_name, 1)) == 0 )
+    return 1;
+  if ( (shm_reader = seplos_shm_open(shm_name)) == 0 ) {
+    seplos_shm_close(shm_writer);
+    return 1;
+  }
+
+  printf("benchmark\titerations\tns_per_op\tops_per_s\tbytes_per_s\n");
+  run("hex2b", hex2b, frame);
+  run("hex4b", hex4b, frame);
+  run("hex_decode", hex_decode, frame);
+  run("hex_decode_scalar", hex_decode_scalar, frame);
+#if defined(__x86_64__) || defined(__i386__)
+  if ( sse2 )
+    run("hex_decode_sse2", hex_decode_sse2, frame);
+  if ( avx2 )
+    run("hex_decode_avx2", hex_decode_avx2, frame);
+#endif
+  run("checksum", checksum, frame);
+  run("checksum_scalar", checksum_scalar, frame);
+#if defined(__x86_64__) || defined(__i386__)
+  if ( sse2 )
+    run("checksum_sse2", checksum_sse2, frame);
+  if ( avx2 )
+    run("checksum_avx2", checksum_avx2, frame);
+#endif
+  run("frame_decode", frame_decode, frame);
+  run("seplos_decode", decode, frame + sizeof(telecommand) - 1);
+  run("seplos_text", text, frame + sizeof(telecommand) - 1);
+  run("seplos_html", html, frame + sizeof(telecommand) - 1);
+  run("seplos_json", json, frame + sizeof(telecommand) - 1);
+  run("seplos_json_format", json_format, frame + sizeof(telecommand) - 1);
+  run("seplos_record_encode", record_encode, frame + sizeof(telecommand) - 1);
+  run("seplos_record_decode", record_decode, frame + sizeof(telecommand) - 1);
+  run("seplos_series_encode", series_encode, series_bytes);
+  run("seplos_series_decode", series_decode, series_bytes);
+  run("seplos_rules_evaluate", rules_evaluate, frame + sizeof(telecommand) - 1);
+  run("seplos_shm_publish", shm_publish, frame + sizeof(telecommand) - 1);
+  run("seplos_shm_read", shm_read, frame + sizeof(telecommand) - 1);
+  run("seplos_fleet_update", fleet_update, frame + sizeof(telecommand) - 1);
+  run("seplos_fleet_summary", fleet_summary, 0);
+  run("analyze", analyze, span_bytes);
+  run("analyze_scalar", analyze_scalar, span_bytes);
+#if defined(__x86_64__) || defined(__i386__)
+  if ( avx2 )
+    run("analyze_avx2", analyze_avx2, span_bytes);
+#endif
+
+  seplos_rules_close(rules);
+  seplos_shm_close(shm_reader);
+  seplos_shm_close(shm_writer);
+  seplos_fleet_close(fleet);
+
+  fclose(null);
+  return 0;
+}
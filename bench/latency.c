@@ -0,0 +1,293 @@
+#include <errno.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+#include "internal.h"
+#include "communication.h"
+
+/*
+ * End-to-end acquisition benchmark: the real seplos_open(), _sp_bms_command(),
+ * seplos_data() and scheduler path, against seplos_simulator on a
+ * pseudo-terminal. The simulator emulates the bit rate of the bus and the
+ * latency of the BMS, so the results are what one gateway can expect of a
+ * real bus at that rate, plus the software overhead of both ends.
+ *
+ *   transaction	one telemetry command and reply, _sp_bms_command()
+ *   sample		one pack, seplos_data(): telemetry and alarms
+ *   sweep		every pack on every bus, seplos_scheduler_sweep(),
+ *			for 1 to 16 addresses on one bus, and for several buses
+ *
+ * The output is one tab-separated line per benchmark, after a header line:
+ *
+ *   benchmark	buses	packs	operations	p50_ms	p99_ms	max_ms	samples_per_s	samples_per_s_per_pack
+ *
+ * The percentiles are of the time of each operation. A sweep of n packs is n
+ * samples. With fewer than 100 operations, the p99 would only be the maximum,
+ * so it's printed as "-". Use -n 100 or more for capacity planning.
+ */
+
+#define	NS_PER_MS	1000000LL
+#define	NS_PER_SECOND	1000000000LL
+#define	MAXIMUM_BUSES	16
+#define	MAXIMUM_PACKS	16
+
+struct options {
+  const char *	simulator;
+  unsigned int	baud;
+  unsigned int	latency;
+  unsigned int	operations;
+  unsigned int	buses;
+  unsigned int	pipeline;
+};
+
+static char	directory[] = "/tmp/seplos-bench-XXXXXX";
+static pid_t	simulators[MAXIMUM_BUSES];
+static char	links[MAXIMUM_BUSES][sizeof(directory) + 16];
+static unsigned int n_simulators;
+
+static void
+stop_simulators(void)
+{
+  for ( unsigned int i = 0; i < n_simulators; i++ ) {
+    kill(simulators[i], SIGTERM);
+    waitpid(simulators[i], 0, 0);
+    unlink(links[i]);
+  }
+  n_simulators = 0;
+}
+
+/* Start a simulator of packs at addresses 0 through packs - 1, and wait for its link. */
+static const char *
+start_simulator(const struct options * o, unsigned int packs)
+{
+  char		n[16], baud[16], latency[16];
+  char * const	link = links[n_simulators];
+
+  snprintf(link, sizeof(links[0]), "%s/bus%u", directory, n_simulators);
+  snprintf(n, sizeof(n), "%u", packs);
+  snprintf(baud, sizeof(baud), "%u", o->baud);
+  snprintf(latency, sizeof(latency), "%u", o->latency);
+
+  /* Otherwise the child would write out anything that's buffered, too. */
+  fflush(stdout);
+
+  const pid_t pid = fork();
+  if ( pid == 0 ) {
+    /* The simulator prints the name of the pseudo-terminal, which isn't needed. */
+    freopen("/dev/null", "w", stdout);
+    execl(o->simulator, o->simulator, "--link", link, "--packs", n, "--baud", baud, "--latency", latency, (char *)0);
+    fprintf(stderr, "%s: %s\n", o->simulator, strerror(errno));
+    _exit(1);
+  }
+  else if ( pid < 0 ) {
+    perror("fork");
+    return 0;
+  }
+  simulators[n_simulators++] = pid;
+
+  for ( unsigned int i = 0; i < 500; i++ ) {
+    struct stat s;
+    if ( stat(link, &s) == 0 )
+      return link;
+    if ( waitpid(pid, 0, WNOHANG) == pid ) {
+      n_simulators--;
+      return 0;
+    }
+    usleep(10000);
+  }
+  fprintf(stderr, "%s didn't start.\n", o->simulator);
+  return 0;
+}
+
+static int
+by_value(const void * a, const void * b)
+{
+  const int64_t x = *(const int64_t *)a;
+  const int64_t y = *(const int64_t *)b;
+
+  return (x > y) - (x < y);
+}
+
+/* Print the results of n operations, taking times[] ns each, and sampling samples packs each. */
+static void
+report(const char * name, unsigned int buses, unsigned int packs, int64_t * times, unsigned int n, unsigned int samples)
+{
+  int64_t	total = 0;
+  char		p99[32] = "-";
+
+  qsort(times, n, sizeof(*times), by_value);
+  for ( unsigned int i = 0; i < n; i++ )
+    total += times[i];
+
+  const double rate = total > 0 ? (double)n * samples * NS_PER_SECOND / total : 0.0;
+
+  if ( n >= 100 )
+    snprintf(p99, sizeof(p99), "%.3f", times[((n * 99) + 99) / 100 - 1] / (double)NS_PER_MS);
+
+  printf("%s\t%u\t%u\t%u\t%.3f\t%s\t%.3f\t%.2f\t%.2f\n",
+   name,
+   buses,
+   packs,
+   n,
+   times[n / 2] / (double)NS_PER_MS,
+   p99,
+   times[n - 1] / (double)NS_PER_MS,
+   rate,
+   rate / packs);
+  fflush(stdout);
+}
+
+static int
+transactions(const struct options * o, int64_t * times)
+{
+  Seplos_2_0_Reply	reply;
+  uint8_t		pack_info[2];
+  const char * const	link = start_simulator(o, 1);
+
+  if ( link == 0 )
+    return -1;
+
+  const seplos_device fd = seplos_open(link);
+  if ( fd < 0 )
+    return -1;
+
+  _sp_hex2(1, pack_info);
+  for ( unsigned int i = 0; i < o->operations; i++ ) {
+    const int64_t start = _sp_monotonic_time();
+    if ( _sp_bms_command(fd, 0, TELEMETRY_GET, pack_info, sizeof(pack_info), &reply) != NORMAL ) {
+      seplos_close(fd);
+      return -1;
+    }
+    times[i] = _sp_monotonic_time() - start;
+  }
+  report("transaction", 1, 1, times, o->operations, 1);
+
+  for ( unsigned int i = 0; i < o->operations; i++ ) {
+    SeplosData d;
+    const int64_t start = _sp_monotonic_time();
+    if ( seplos_data(fd, 0, 1, &d) != 0 ) {
+      seplos_close(fd);
+      return -1;
+    }
+    times[i] = _sp_monotonic_time() - start;
+  }
+  report("sample", 1, 1, times, o->operations, 1);
+
+  seplos_close(fd);
+  stop_simulators();
+  return 0;
+}
+
+/* Sweep packs packs on each of buses buses. */
+static int
+sweeps(const struct options * o, unsigned int buses, unsigned int packs, int64_t * times)
+{
+  SeplosTarget	targets[MAXIMUM_BUSES * MAXIMUM_PACKS];
+  SeplosData	data[MAXIMUM_BUSES * MAXIMUM_PACKS];
+  int		status[MAXIMUM_BUSES * MAXIMUM_PACKS];
+  unsigned int	n = 0;
+
+  for ( unsigned int b = 0; b < buses; b++ ) {
+    const char * const link = start_simulator(o, packs);
+    if ( link == 0 )
+      return -1;
+    for ( unsigned int p = 0; p < packs; p++ )
+      targets[n++] = (SeplosTarget){ link, p, 1 };
+  }
+
+  SeplosScheduler * const s = seplos_scheduler_open(targets, n);
+  if ( s == 0 )
+    return -1;
+
+  for ( unsigned int i = 0; i < o->operations; i++ ) {
+    const int64_t start = _sp_monotonic_time();
+    if ( seplos_scheduler_sweep(s, data, status) != 0 ) {
+      seplos_scheduler_close(s);
+      return -1;
+    }
+    times[i] = _sp_monotonic_time() - start;
+  }
+  report("sweep", buses, n, times, o->operations, n);
+
+  seplos_scheduler_close(s);
+  stop_simulators();
+  return 0;
+}
+
+static void
+usage(const char * name)
+{
+  fprintf(stderr,
+   "Usage: %s [-b BAUD] [-l LATENCY_MS] [-n OPERATIONS] [-B BUSES] [-p PIPELINE] [-s SIMULATOR]\n"
+   "Defaults: 19200 baud, 0 ms, 10 operations per benchmark, up to 4 buses, pipeline 0,\n"
+   "../commands/seplos_simulator/seplos_simulator\n",
+   name);
+  exit(1);
+}
+
+int
+main(int argc, char * * argv)
+{
+  struct options	o = { "../commands/seplos_simulator/seplos_simulator", 19200, 0, 10, 4, 0 };
+  int			option;
+  int			status = 0;
+
+  while ( (option = getopt(argc, argv, "b:l:n:B:p:s:")) != -1 ) {
+    switch ( option ) {
+    case 'b':
+      o.baud = strtoul(optarg, 0, 10);
+      break;
+    case 'l':
+      o.latency = strtoul(optarg, 0, 10);
+      break;
+    case 'n':
+      o.operations = strtoul(optarg, 0, 10);
+      break;
+    case 'B':
+      o.buses = strtoul(optarg, 0, 10);
+      break;
+    case 'p':
+      o.pipeline = strtoul(optarg, 0, 10);
+      break;
+    case 's':
+      o.simulator = optarg;
+      break;
+    default:
+      usage(argv[0]);
+    }
+  }
+  if ( o.operations == 0 || o.buses == 0 || o.buses > MAXIMUM_BUSES || o.pipeline > 2 )
+    usage(argv[0]);
+
+  int64_t * const times = calloc(o.operations, sizeof(*times));
+  if ( times == 0 || mkdtemp(directory) == 0 ) {
+    perror("bench");
+    return 1;
+  }
+  seplos_set_pipeline(o.pipeline);
+
+  printf("benchmark\tbuses\tpacks\toperations\tp50_ms\tp99_ms\tmax_ms\tsamples_per_s\tsamples_per_s_per_pack\n");
+
+  status = transactions(&o, times);
+
+  /* How one bus scales with the number of packs on it. */
+  for ( unsigned int packs = 1; status == 0 && packs <= MAXIMUM_PACKS; packs *= 2 )
+    status = sweeps(&o, 1, packs, times);
+
+  /* How a gateway scales with the number of buses, each with several packs. */
+  for ( unsigned int buses = 2; status == 0 && buses <= o.buses; buses *= 2 )
+    status = sweeps(&o, buses, 4, times);
+
+  if ( status != 0 )
+    fprintf(stderr, "The benchmark failed.\n");
+
+  stop_simulators();
+  rmdir(directory);
+  free(times);
+  return status ? 1 : 0;
+}
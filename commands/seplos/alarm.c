@@ -0,0 +1,112 @@
+#define _GNU_SOURCE /* pipe2() */
+#include "./seplos_cmd.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include "internal.h"
+
+/*
+ * Notification of the alarm rules of --alarm-rules, see rules.c in the
+ * library.
+ *
+ * Each notification runs --alarm-command with /bin/sh, without waiting for it,
+ * so that a slow mailer can't delay the next sweep. Its standard input is a
+ * mail message, a Subject header and the text page of the sample, so that the
+ * command can be "sendmail someone@example.com". The environment has the
+ * details, for a command that does something other than mail:
+ *
+ *   SEPLOS_RULE	the name of the rule
+ *   SEPLOS_EVENT	"raised" or "cleared"
+ *   SEPLOS_DEVICE, SEPLOS_ADDRESS, SEPLOS_PACK	the target
+ *   SEPLOS_VALUE	the value of the metric or alarm of the rule
+ *   SEPLOS_CHANGES	changes of the rule since the last notification, 1
+ *			unless its limit held some back
+ *   SEPLOS_TIME	of the sample, seconds since 1970 UTC
+ *
+ * The message is written to a pipe before the command is started, and it's
+ * much smaller than a pipe holds, so the daemon doesn't wait for the command
+ * to read it either. Without --alarm-command, the notifications go to stderr.
+ * The daemon doesn't wait for the commands, so they're reaped by the kernel,
+ * see seplos_daemon().
+ */
+
+#define	N_VARIABLES	8
+
+extern char * *	environ;
+
+void
+seplos_alarm_notify(const struct arguments * arguments, const SeplosAlarmEvent * e, const SeplosData * d, int64_t timestamp)
+{
+  const SeplosTarget * const	t = &(arguments->targets[e->target]);
+  const char * const		event = e->raised ? "raised" : "cleared";
+
+  if ( arguments->alarm_command == 0 ) {
+    fprintf(
+     stderr,
+     "Alarm %s %s: %s address %u pack %u, value %g.\n",
+     e->rule,
+     event,
+     t->device,
+     t->address,
+     t->pack,
+     e->value);
+    return;
+  }
+
+  /* Everything the child needs is made before the fork, since the daemon has threads. */
+  char		variables[N_VARIABLES][256];
+  unsigned int	n_environment = 0;
+  int		message[2];
+
+  while ( environ[n_environment] )
+    n_environment++;
+  char * * const environment = calloc(n_environment + N_VARIABLES + 1, sizeof(*environment));
+  if ( environment == 0 ) {
+    _sp_error("Out of memory.\n");
+    return;
+  }
+  memcpy(environment, environ, n_environment * sizeof(*environment));
+  snprintf(variables[0], sizeof(variables[0]), "SEPLOS_RULE=%s", e->rule);
+  snprintf(variables[1], sizeof(variables[1]), "SEPLOS_EVENT=%s", event);
+  snprintf(variables[2], sizeof(variables[2]), "SEPLOS_DEVICE=%s", t->device);
+  snprintf(variables[3], sizeof(variables[3]), "SEPLOS_ADDRESS=%u", t->address);
+  snprintf(variables[4], sizeof(variables[4]), "SEPLOS_PACK=%u", t->pack);
+  snprintf(variables[5], sizeof(variables[5]), "SEPLOS_VALUE=%g", e->value);
+  snprintf(variables[6], sizeof(variables[6]), "SEPLOS_CHANGES=%u", e->changes);
+  snprintf(variables[7], sizeof(variables[7]), "SEPLOS_TIME=%lld", (long long)(timestamp / 1000000));
+  for ( unsigned int i = 0; i < N_VARIABLES; i++ )
+    environment[n_environment + i] = variables[i];
+
+  if ( pipe2(message, O_CLOEXEC) != 0 ) {
+    _sp_error("Alarm command: %s\n", strerror(errno));
+    free(environment);
+    return;
+  }
+  FILE * const f = fdopen(message[1], "w");
+  if ( f == 0 ) {
+    _sp_error("Alarm command: %s\n", strerror(errno));
+    close(message[0]);
+    close(message[1]);
+    free(environment);
+    return;
+  }
+  fprintf(f, "Subject: SEPLOS alarm %s %s: %s address %u pack %u\n\n", e->rule, event, t->device, t->address, t->pack);
+  seplos_text(f, d, true);
+  fclose(f);
+
+  char * const argv[] = { "sh", "-c", (char *)arguments->alarm_command, 0 };
+  const pid_t pid = fork();
+  if ( pid == 0 ) {
+    dup2(message[0], 0);
+    execve("/bin/sh", argv, environment);
+    _exit(127);
+  }
+  if ( pid < 0 )
+    _sp_error("Alarm command: %s\n", strerror(errno));
+  close(message[0]);
+  free(environment);
+}
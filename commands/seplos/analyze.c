@@ -0,0 +1,158 @@
+#define _GNU_SOURCE /* asprintf() */
+#include "./seplos_cmd.h"
+#include <dirent.h>
+#include <errno.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "internal.h"
+
+/*
+ * Print the trends of the cells of the packs in the stores written with
+ * --store, see analysis.c in the library. --analyze is a store, or a directory
+ * of them, such as the --store of a daemon, in which case every pack of the
+ * site is analyzed, each in a thread of its own up to the number of CPUs, and
+ * printed in the order of the names of the files.
+ */
+
+typedef struct _Job {
+  char *		path;
+  SeplosAnalysis	analysis;
+  int			status;
+} Job;
+
+static Job *		jobs;
+static unsigned int	n_jobs;
+static unsigned int	next_job;
+
+static void *
+work(void * argument)
+{
+  for ( ; ; ) {
+    const unsigned int i = __atomic_fetch_add(&next_job, 1, __ATOMIC_RELAXED);
+    if ( i >= n_jobs )
+      return 0;
+
+    SeplosStore * const s = seplos_store_open(jobs[i].path, false);
+    jobs[i].status = s ? seplos_analyze(s, 0, INT64_MAX, &(jobs[i].analysis)) : -1;
+    seplos_store_close(s);
+  }
+}
+
+static int
+is_store(const struct dirent * d)
+{
+  const size_t length = strlen(d->d_name);
+
+  return length > 6 && strcmp(d->d_name + length - 6, ".store") == 0;
+}
+
+/* The stores to analyze, in the order of their names. */
+static int
+find_stores(const char * path)
+{
+  struct stat		st;
+  struct dirent * *	names;
+
+  if ( stat(path, &st) != 0 ) {
+    _sp_error("%s: %s\n", path, strerror(errno));
+    return -1;
+  }
+  if ( !S_ISDIR(st.st_mode) ) {
+    if ( (jobs = calloc(1, sizeof(*jobs))) == 0 || (jobs[0].path = strdup(path)) == 0 ) {
+      _sp_error("Out of memory.\n");
+      return -1;
+    }
+    n_jobs = 1;
+    return 0;
+  }
+
+  const int n = scandir(path, &names, is_store, alphasort);
+  if ( n < 0 ) {
+    _sp_error("%s: %s\n", path, strerror(errno));
+    return -1;
+  }
+  if ( (jobs = calloc(n + 1, sizeof(*jobs))) == 0 ) {
+    _sp_error("Out of memory.\n");
+    return -1;
+  }
+  for ( int i = 0; i < n; i++ ) {
+    if ( asprintf(&(jobs[i].path), "%s/%s", path, names[i]->d_name) < 0 ) {
+      _sp_error("Out of memory.\n");
+      return -1;
+    }
+    free(names[i]);
+  }
+  free(names);
+  if ( n == 0 ) {
+    _sp_error("%s: There are no stores in this directory.\n", path);
+    return -1;
+  }
+  n_jobs = n;
+  return 0;
+}
+
+int
+seplos_analyze_stores(const struct arguments * arguments)
+{
+  long		cpus = sysconf(_SC_NPROCESSORS_ONLN);
+  pthread_t *	threads;
+  unsigned int	n_threads;
+  int		failed = 0;
+
+  if ( find_stores(arguments->analyze) != 0 )
+    return 1;
+
+  if ( cpus < 1 )
+    cpus = 1;
+  n_threads = n_jobs < cpus ? n_jobs : cpus;
+  if ( (threads = calloc(n_threads + 1, sizeof(*threads))) == 0 ) {
+    _sp_error("Out of memory.\n");
+    return 1;
+  }
+  /* This thread is one of the workers. */
+  for ( unsigned int i = 1; i < n_threads; i++ ) {
+    const int status = pthread_create(&(threads[i]), 0, work, 0);
+    if ( status != 0 ) {
+      _sp_error("Analyze: %s\n", strerror(status));
+      n_threads = i;
+      break;
+    }
+  }
+  work(0);
+  for ( unsigned int i = 1; i < n_threads; i++ )
+    pthread_join(threads[i], 0);
+  free(threads);
+
+  if ( arguments->format == HTML )
+    fprintf(stdout, "<!DOCTYPE html>\n<html><head><title>SEPLOS Battery Analysis</title></head><body>\n");
+  for ( unsigned int i = 0; i < n_jobs; i++ ) {
+    if ( jobs[i].status != 0 ) {
+      failed = 1;
+      continue;
+    }
+    switch ( arguments->format ) {
+    case TEXT:
+      if ( i > 0 )
+        fprintf(stdout, "\n");
+      seplos_analysis_text(stdout, &(jobs[i].analysis));
+      break;
+    case HTML:
+      seplos_analysis_html(stdout, &(jobs[i].analysis));
+      break;
+    case JSON:
+      seplos_analysis_json(stdout, &(jobs[i].analysis));
+      break;
+    }
+  }
+  if ( arguments->format == HTML )
+    fprintf(stdout, "</body></html>\n");
+
+  for ( unsigned int i = 0; i < n_jobs; i++ )
+    free(jobs[i].path);
+  free(jobs);
+  return failed;
+}
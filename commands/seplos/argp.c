@@ -1,9 +1,29 @@
 #include "./seplos_cmd.h"
 #include "internal.h"
+#include <stdlib.h>
 #include <string.h>
 
 static error_t parse_opt(int key, char *arg, struct argp_state *state);
 
+/*
+ * A decimal number of --target, from s up to the next ',' or the end, into
+ * *value. Returns where it ended, or 0 if it isn't a number from 0 to 255.
+ * Decimal, so that a leading 0 doesn't make it octal.
+ */
+static char *
+target_number(char * s, unsigned int * value)
+{
+  char * end;
+
+  if ( *s < '0' || *s > '9' )
+    return 0;
+  const unsigned long v = strtoul(s, &end, 10);
+  if ( v > 0xff || (*end != ',' && *end != '\0') )
+    return 0;
+  *value = v;
+  return end;
+}
+
 const char * argp_program_version = "seplos 0.1";
 const char * argp_program_bug_address = "Bruce Perens K6BP <bruce@perens.com>";
 
@@ -16,6 +36,25 @@ static const struct argp_option options[] = {
   {"device", 'd', "/dev/tty...", 0, "The serial device used to communicate with the battery."},
   {"longer", 'l', 0, 0, "More information: individual cell states, etc."},
   {"format", 'f', "text|HTML|JSON", 0, "Format of the output: text: text file, HTML: web page, JSON: easy format for communication between programs."},
+  {"target", 't', "DEVICE[,ADDRESS[,PACK]]", 0, "A battery pack to sample. Give this once for each pack. Packs on different devices are sampled in parallel. ADDRESS and PACK are decimal. The default is --device, address 0, pack 1."},
+  {"daemon", 'D', 0, 0, "Keep the serial port open and sample the battery repeatedly until interrupted."},
+  {"telemetry-interval", 'I', "MS", 0, "Milliseconds between polls of the telemetry: voltages, current, temperatures, and charge. The default is --interval."},
+  {"alarm-interval", 'A', "MS", 0, "Milliseconds between polls of the alarms and switch state. The default is --interval."},
+  {"pipeline", 'p', "DEPTH", 0, "Overlap the commands to each battery. 0: off, the default. 1: don't flush or drain between commands. 2: also send both commands before reading a reply, only for buses that allow it."},
+  {"timeout", 'T', "MS", 0, "Milliseconds to wait for the battery to answer a command before giving up. The default is 1000."},
+  {"record", 'r', "FILE", 0, "In daemon mode, append a binary record of each sample to FILE, 112 bytes per sample. The file is created if it doesn't exist."},
+  {"replay", 'R', "FILE", 0, "Print the samples in a record file, in the --format given, rather than sampling the battery."},
+  {"analyze", 'y', "STORE", 0, "Print the trends of the cells over the history in a store written with --store, or in every store in a directory, in the --format given, rather than sampling the battery: the deviation of each cell from the mean, how often it's balanced, its resistance, and the state of health over the cycles."},
+  {"store", 'S', "DIRECTORY", 0, "In daemon mode, add each sample to a memory-mapped time-series store in DIRECTORY, one file per pack, named DEVICE-ADDRESS-PACK.store. The files are created if they don't exist."},
+  {"energy", 'E', "DIRECTORY", 0, "In daemon mode, count the charge and energy into and out of each pack, integrating the current and power of its samples, in a file in DIRECTORY per pack, named DEVICE-ADDRESS-PACK.energy, that keeps the counts across restarts. The counts go to stderr with the statistics."},
+  {"http", 'H', "[ADDRESS:]PORT", 0, "In daemon mode, serve the latest sample of every pack over HTTP: the HTML page at /, JSON at /json, a JSON summary of all of the packs at /fleet, and a stream of Server-Sent Events at /events."},
+  {"shm", 'M', "/NAME", 0, "In daemon mode, publish the latest sample of every pack in the POSIX shared-memory segment /NAME, for local programs to read with seplos_shm_read(), one slot per --target in order."},
+  {"alarm-rules", 'a', "FILE", 0, "In daemon mode, evaluate the alarm rules in FILE over every sample, and notify when one is raised or cleared."},
+  {"alarm-command", 'x', "COMMAND", 0, "With --alarm-rules, run COMMAND with /bin/sh for each notification, with a mail message on its standard input, for example \"sendmail you@example.com\". The default is to print the notifications to stderr."},
+  {"fleet", 'F', 0, 0, "In daemon mode, print a summary of the site after each sweep, rather than each pack: the totals of all of the packs, and the extremes, such as the lowest cell, with the pack they're in. A pack that fails 3 sweeps in a row is left out until it answers again. Can't be used with --changes."},
+  {"changes", 'c', 0, 0, "In daemon mode, print a sample only if it changed since the last one printed, and only the fields that changed. HTML pages are printed whole. Can't be used with --fleet."},
+  {"deadband", 'B', "MV,C,A", 0, "With --changes, how far a cell voltage in mV, a temperature in degrees C, and the current in A must move to be a change. The default is 5,1,0.1."},
+  {"interval", 'i', "MS", 0, "Milliseconds from the start of one sample to the start of the next, in daemon mode. 0 polls as fast as the battery answers. The default is 5000."},
   {}
 };
 
@@ -45,8 +84,119 @@ parse_opt(int key, char *arg, struct argp_state *state)
   case 'l':
     arguments->longer = true;
     break;
-  case ARGP_KEY_ARG:
+  case 'D':
+    arguments->daemon = true;
+    break;
+  case 'r':
+    arguments->record = arg;
+    break;
+  case 'R':
+    arguments->replay = arg;
+    break;
+  case 'y':
+    arguments->analyze = arg;
+    break;
+  case 'S':
+    arguments->store = arg;
+    break;
+  case 'E':
+    arguments->energy = arg;
+    break;
+  case 'H':
+    arguments->http = arg;
+    break;
+  case 'a':
+    arguments->alarm_rules = arg;
+    break;
+  case 'x':
+    arguments->alarm_command = arg;
+    break;
+  case 'M':
+    if ( arg[0] != '/' || strchr(arg + 1, '/') )
+      argp_failure(state, 1, 0, "Parameter to --shm= or -M must be a name that starts with \"/\" and has no other \"/\"");
+    arguments->shm = arg;
+    break;
+  case 'F':
+    arguments->fleet = true;
+    break;
+  case 'c':
+    arguments->changes = true;
+    break;
+  case 'B':
+    {
+      char * end;
+
+      for ( unsigned int i = 0; i < 3; i++ ) {
+        arguments->deadband[i] = strtof(arg, &end);
+        if ( end == arg || arguments->deadband[i] < 0 || *end != (i < 2 ? ',' : '\0') )
+          argp_failure(state, 1, 0, "Parameter to --deadband= or -B must be MV,C,A.");
+        arg = end + 1;
+      }
+      arguments->has_deadband = true;
+    }
+    break;
+  case 'i':
+  case 'I':
+  case 'A':
+    {
+      char * end;
+      const unsigned long value = strtoul(arg, &end, 10);
+      if ( *arg == '\0' || *end != '\0' || value > 86400000 )
+        argp_failure(state, 1, 0, "Parameter to --interval=, --telemetry-interval=, or --alarm-interval= must be a number of milliseconds.");
+      if ( key == 'i' )
+        arguments->interval = value;
+      else if ( key == 'I' )
+        arguments->telemetry_interval = value;
+      else
+        arguments->alarm_interval = value;
+    }
+    break;
+  case 't':
+    {
+      SeplosTarget * const targets = realloc(arguments->targets, (arguments->n_targets + 1) * sizeof(*targets));
+      char * const device = strdup(arg);
+      if ( targets == 0 || device == 0 )
+        argp_failure(state, 1, 0, "Out of memory.");
+      arguments->targets = targets;
+
+      SeplosTarget * const t = &(targets[arguments->n_targets++]);
+      char * end;
+      t->device = device;
+      t->address = 0;
+      t->pack = 1;
+      if ( (end = strchr(device, ',')) != 0 ) {
+        *end++ = '\0';
+        if ( (end = target_number(end, &(t->address))) != 0 && *end == ',' )
+          end = target_number(end + 1, &(t->pack));
+      }
+      if ( *device == '\0' || (strchr(arg, ',') != 0 && (end == 0 || *end != '\0')) )
+        argp_failure(state, 1, 0, "Parameter to --target= or -t must be DEVICE[,ADDRESS[,PACK]], with ADDRESS and PACK decimal numbers from 0 to 255.");
+    }
+    break;
+  case 'p':
+    {
+      char * end;
+      const unsigned long value = strtoul(arg, &end, 10);
+      if ( *arg == '\0' || *end != '\0' || value > 2 )
+        argp_failure(state, 1, 0, "Parameter to --pipeline= or -p must be 0, 1, or 2.");
+      seplos_set_pipeline(value);
+    }
+    break;
+  case 'T':
+    {
+      char * end;
+      const unsigned long value = strtoul(arg, &end, 10);
+      if ( *arg == '\0' || *end != '\0' || value == 0 || value > 3600000 )
+        argp_failure(state, 1, 0, "Parameter to --timeout= or -T must be a number of milliseconds.");
+      seplos_set_timeout(value);
+    }
+    break;
   case ARGP_KEY_END:
+    /* The summary of the site has no previous one to be compared with. */
+    if ( arguments->fleet && arguments->changes )
+      argp_failure(state, 1, 0, "--fleet and --changes can't be used together.");
+    break;
+  case ARGP_KEY_ARG:
   case ARGP_KEY_FINI:
   case ARGP_KEY_INIT:
   case ARGP_KEY_NO_ARGS:
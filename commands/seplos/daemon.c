@@ -0,0 +1,451 @@
+#include "./seplos_cmd.h"
+#include <errno.h>
+#include <math.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <libgen.h>
+#include <time.h>
+#include "internal.h"
+
+/*
+ * Daemon mode: keep the serial ports, their termios settings, and the SeplosData
+ * buffers from one sweep of the targets to the next, and sweep on a fixed cadence.
+ *
+ * The schedule is absolute: sweep n is due at start + (n * interval), so the
+ * time spent talking to the batteries doesn't accumulate as drift. If a sweep
+ * takes longer than the interval, the slots that were missed are skipped
+ * rather than run back-to-back, and counted as overruns.
+ *
+ * Telemetry and alarms are separate commands to the BMS, and each has its
+ * own interval, so that fast-changing telemetry can be polled often without
+ * spending bus time on alarms at the same rate. Each sweep fetches only the
+ * groups that are due.
+ *
+ * With --changes, a sample is printed only if it differs from the last one
+ * printed for its pack, by more than the deadbands, and only what differs.
+ * With --fleet, the packs aren't printed, but a summary of all of them is,
+ * after each sweep, see fleet.c in the library. The two can't be used
+ * together. A pack that hasn't answered for SEPLOS_FLEET_MISSED_SWEEPS sweeps
+ * in a row is taken out of the summary until it answers again. The summary on
+ * the HTML page of --http is the same one.
+ *
+ * With --alarm-rules, the rules are evaluated over every sample, and their
+ * notifications go to --alarm-command, see alarm.c.
+ *
+ * With --http, the latest samples are also served over HTTP, see http.c. With
+ * --shm, they're published in shared memory for local programs, see shm.c in
+ * the library.
+ *
+ * With --record, every sample is also appended to a binary record file, with
+ * the wall-clock time at which its sweep started. With --store, it's added to
+ * the time-series store of its pack, with the same time, which is also the
+ * time of the sample in shared memory. With --energy, the current and power of
+ * the samples are integrated into counts of the charge and energy of each pack,
+ * see energy.c in the library. Those use the same time, so that they carry over
+ * from one run of the daemon to the next.
+ *
+ * Statistics go to stderr every STATISTICS_PERIOD and when the daemon is
+ * stopped with SIGINT or SIGTERM, followed by the link statistics of the
+ * receiver. "Jitter" is how late each sweep started
+ * relative to its slot, which is the figure that matters to anything that
+ * consumes the samples as a time series.
+ */
+
+#define	NS_PER_MS		1000000LL
+#define	NS_PER_SECOND		1000000000LL
+#define STATISTICS_PERIOD	(60 * NS_PER_SECOND)
+/*
+ * The longest interval between two samples of a pack that's integrated into
+ * its energy counts, in microseconds: several missed polls, or a minute.
+ */
+#define	ENERGY_GAP_POLLS	5
+#define	ENERGY_MINIMUM_GAP	60000000LL
+
+struct statistics {
+  long long	start;
+  unsigned long	sweeps;
+  unsigned long	samples;
+  unsigned long	failures;
+  unsigned long	overruns;
+  double	jitter_sum;
+  double	jitter_squares;
+  long long	jitter_max;
+  double	acquisition_sum;
+  long long	acquisition_max;
+};
+
+static volatile sig_atomic_t	stop = 0;
+
+static void
+on_signal(int signal)
+{
+  stop = 1;
+}
+
+static long long
+now(void)
+{
+  struct timespec t;
+
+  clock_gettime(CLOCK_MONOTONIC, &t);
+  return (t.tv_sec * NS_PER_SECOND) + t.tv_nsec;
+}
+
+/* Microseconds since 1970, for the record file. */
+static int64_t
+wall_clock(void)
+{
+  struct timespec t;
+
+  clock_gettime(CLOCK_REALTIME, &t);
+  return ((int64_t)t.tv_sec * 1000000) + (t.tv_nsec / 1000);
+}
+
+static void
+sleep_until(long long deadline)
+{
+  struct timespec t;
+
+  t.tv_sec = deadline / NS_PER_SECOND;
+  t.tv_nsec = deadline % NS_PER_SECOND;
+
+  /* Returns early with EINTR on a signal, so that the daemon stops promptly. */
+  clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &t, 0);
+}
+
+static void
+report(const struct statistics * s, SeplosScheduler * scheduler)
+{
+  SeplosLinkStatistics l;
+  const double	elapsed = (now() - s->start) / (double)NS_PER_SECOND;
+  const unsigned long n = s->sweeps;
+  double	mean = 0.0;
+  double	deviation = 0.0;
+  double	acquisition = 0.0;
+
+  if ( n > 0 ) {
+    mean = s->jitter_sum / n;
+    deviation = sqrt(fmax(0.0, (s->jitter_squares / n) - (mean * mean)));
+    acquisition = s->acquisition_sum / n;
+  }
+
+  _sp_error(
+   "%lu sweeps, %lu samples, %lu failed, %lu overruns in %.1f s: %.3f samples/s. "
+   "Jitter mean %.3f ms, deviation %.3f ms, max %.3f ms. "
+   "Acquisition mean %.3f ms, max %.3f ms.\n",
+   s->sweeps,
+   s->samples,
+   s->failures,
+   s->overruns,
+   elapsed,
+   elapsed > 0.0 ? s->samples / elapsed : 0.0,
+   mean / NS_PER_MS,
+   deviation / NS_PER_MS,
+   s->jitter_max / (double)NS_PER_MS,
+   acquisition / NS_PER_MS,
+   s->acquisition_max / (double)NS_PER_MS);
+
+  seplos_scheduler_link_statistics(scheduler, &l);
+  _sp_error(
+   "Link: %lu packets, %lu bad headers, %lu bad packets, %lu noise characters, %lu timeouts.\n",
+   l.packets,
+   l.bad_headers,
+   l.bad_packets,
+   l.noise,
+   l.timeouts);
+}
+
+/* The file of a target in directory, named for its device, address, and pack. */
+static void
+target_path(char * path, size_t size, const char * directory, const SeplosTarget * t, const char * suffix)
+{
+  char device[256];
+
+  /* basename() may modify its argument. */
+  snprintf(device, sizeof(device), "%s", t->device);
+  snprintf(path, size, "%s/%s-%u-%u.%s", directory, basename(device), t->address, t->pack, suffix);
+}
+
+/* Open the store of each target. */
+static SeplosStore * *
+open_stores(const struct arguments * arguments)
+{
+  SeplosStore * * const stores = calloc(arguments->n_targets, sizeof(*stores));
+
+  if ( stores == 0 ) {
+    _sp_error("Out of memory.\n");
+    return 0;
+  }
+  for ( unsigned int i = 0; i < arguments->n_targets; i++ ) {
+    char path[1024];
+
+    target_path(path, sizeof(path), arguments->store, &(arguments->targets[i]), "store");
+    if ( (stores[i] = seplos_store_open(path, true)) == 0 ) {
+      while ( i > 0 )
+        seplos_store_close(stores[--i]);
+      free(stores);
+      return 0;
+    }
+  }
+  return stores;
+}
+
+/* Open the energy counts of each target. */
+static SeplosEnergy * *
+open_energy(const struct arguments * arguments)
+{
+  SeplosEnergy * * const energy = calloc(arguments->n_targets, sizeof(*energy));
+
+  if ( energy == 0 ) {
+    _sp_error("Out of memory.\n");
+    return 0;
+  }
+  for ( unsigned int i = 0; i < arguments->n_targets; i++ ) {
+    char path[1024];
+
+    target_path(path, sizeof(path), arguments->energy, &(arguments->targets[i]), "energy");
+    if ( (energy[i] = seplos_energy_open(path, true)) == 0 ) {
+      while ( i > 0 )
+        seplos_energy_close(energy[--i]);
+      free(energy);
+      return 0;
+    }
+  }
+  return energy;
+}
+
+static void
+report_energy(const struct arguments * arguments, SeplosEnergy * const * energy)
+{
+  for ( unsigned int i = 0; i < arguments->n_targets; i++ ) {
+    const SeplosTarget * const t = &(arguments->targets[i]);
+    SeplosEnergyCounters c;
+
+    if ( seplos_energy_counters(energy[i], &c) != 0 )
+      continue;
+    _sp_error(
+     "Energy of %s address %u pack %u: in %.3f AH %.1f Wh, out %.3f AH %.1f Wh, over %.0f s, %.0f s in gaps.\n",
+     t->device,
+     t->address,
+     t->pack,
+     c.charge,
+     c.energy_in,
+     c.discharge,
+     c.energy_out,
+     c.integrated,
+     c.gaps);
+  }
+}
+
+/* The groups of fields, each polled on its own schedule. */
+static const unsigned int	groups[] = { SEPLOS_TELEMETRY, SEPLOS_ALARMS };
+#define N_GROUPS		(sizeof(groups) / sizeof(*groups))
+
+int
+seplos_daemon(const struct arguments * arguments, SeplosScheduler * scheduler)
+{
+  struct sigaction	action = {};
+  struct statistics	s = {};
+  const unsigned int	n = arguments->n_targets;
+  SeplosData * const	d = calloc(n, sizeof(*d));
+  int * const		status = calloc(n, sizeof(*status));
+  const long long	interval[N_GROUPS] = {
+   arguments->telemetry_interval * NS_PER_MS,
+   arguments->alarm_interval * NS_PER_MS
+  };
+  long long		due[N_GROUPS];
+  SeplosRecordWriter *	record = 0;
+  SeplosStore * *	stores = 0;
+  SeplosEnergy * *	energy = 0;
+  SeplosShm *		shm = 0;
+  SeplosRules *		rules = 0;
+  SeplosAlarmEvent *	events = 0;
+  SeplosDiff *		diffs = 0;
+  SeplosFleet *		fleet = 0;
+
+  if ( d == 0 || status == 0 ) {
+    _sp_error("Out of memory.\n");
+    return 1;
+  }
+
+  if ( arguments->record && (record = seplos_record_open_writer(arguments->record)) == 0 )
+    return 1;
+  if ( arguments->store && (stores = open_stores(arguments)) == 0 )
+    return 1;
+  if ( arguments->energy && (energy = open_energy(arguments)) == 0 )
+    return 1;
+  if ( arguments->alarm_rules ) {
+    if ( (rules = seplos_rules_load(arguments->alarm_rules, n)) == 0 )
+      return 1;
+    if ( (events = calloc(seplos_rules_count(rules) + 1, sizeof(*events))) == 0 ) {
+      _sp_error("Out of memory.\n");
+      return 1;
+    }
+  }
+  if ( arguments->shm && (shm = seplos_shm_create(arguments->shm, n)) == 0 )
+    return 1;
+  if ( arguments->http && seplos_http_start(arguments) != 0 )
+    return 1;
+  if ( (arguments->fleet || arguments->http) && (fleet = seplos_fleet_open(n)) == 0 )
+    return 1;
+  if ( arguments->changes ) {
+    if ( (diffs = calloc(n, sizeof(*diffs))) == 0 ) {
+      _sp_error("Out of memory.\n");
+      return 1;
+    }
+    for ( unsigned int i = 0; i < n; i++ ) {
+      seplos_diff_init(&(diffs[i]), 0);
+      if ( arguments->has_deadband ) {
+        diffs[i].deadband.cell_voltage = arguments->deadband[0] / 1000;
+        diffs[i].deadband.temperature = arguments->deadband[1];
+        diffs[i].deadband.current = arguments->deadband[2];
+      }
+    }
+  }
+
+  action.sa_handler = on_signal;
+  sigaction(SIGINT, &action, 0);
+  sigaction(SIGTERM, &action, 0);
+  if ( arguments->alarm_command ) {
+    /* The alarm commands aren't waited for, so have the kernel reap them. */
+    struct sigaction reap = {};
+    reap.sa_handler = SIG_DFL;
+    reap.sa_flags = SA_NOCLDWAIT;
+    sigaction(SIGCHLD, &reap, 0);
+  }
+
+  const long long poll_gap = ENERGY_GAP_POLLS * (arguments->telemetry_interval * 1000LL);
+  const int64_t maximum_gap = poll_gap > ENERGY_MINIMUM_GAP ? poll_gap : ENERGY_MINIMUM_GAP;
+
+  s.start = now();
+  for ( unsigned int g = 0; g < N_GROUPS; g++ )
+    due[g] = s.start;
+  long long next_report = s.start + STATISTICS_PERIOD;
+
+  while ( !stop ) {
+    long long slot = due[0];
+    for ( unsigned int g = 1; g < N_GROUPS; g++ ) {
+      if ( due[g] < slot )
+        slot = due[g];
+    }
+
+    sleep_until(slot);
+    if ( stop )
+      break;
+
+    /* Fetch only the groups that are due, usually telemetry alone. */
+    unsigned int selected = 0;
+    for ( unsigned int g = 0; g < N_GROUPS; g++ ) {
+      if ( due[g] <= slot )
+        selected |= groups[g];
+    }
+
+    const long long started = now();
+    const long long late = started - slot;
+    const int64_t timestamp = record || stores || energy || shm || rules ? wall_clock() : 0;
+
+    const int failures = seplos_scheduler_sweep_select(scheduler, selected, d, status);
+
+    const long long finished = now();
+    const long long acquisition = finished - started;
+
+    s.jitter_sum += late;
+    s.jitter_squares += (double)late * late;
+    if ( late > s.jitter_max )
+      s.jitter_max = late;
+    s.acquisition_sum += acquisition;
+    if ( acquisition > s.acquisition_max )
+      s.acquisition_max = acquisition;
+
+    s.sweeps++;
+    s.samples += n - failures;
+    s.failures += failures;
+    for ( unsigned int i = 0; i < n; i++ ) {
+      if ( status[i] == 0 ) {
+        SeplosChanges changes;
+        if ( fleet )
+          seplos_fleet_update(fleet, i, &(d[i]));
+        /* With --fleet, only the summary of the site is printed, below. */
+        if ( !arguments->fleet && diffs == 0 )
+          seplos_output(stdout, arguments, &(d[i]));
+        else if ( diffs && seplos_diff(&(diffs[i]), &(d[i]), &changes) )
+          seplos_output_changes(stdout, arguments, &(d[i]), &changes);
+        /*
+         * Only a new sample of the telemetry, not one kept from the last poll,
+         * which an alarms-only sweep would store again under a new timestamp.
+         */
+        if ( selected & SEPLOS_TELEMETRY ) {
+          if ( record )
+            seplos_record_write(record, timestamp, &(d[i]));
+          if ( stores )
+            seplos_store_append(stores[i], timestamp, &(d[i]));
+          if ( energy )
+            seplos_energy_update(energy[i], timestamp, maximum_gap, &(d[i]));
+        }
+        if ( shm )
+          seplos_shm_publish(shm, i, timestamp, &(d[i]));
+        if ( rules ) {
+          /* On the monotonic clock, so that setting the time of day doesn't move "for" and "limit". */
+          const unsigned int count = seplos_rules_evaluate(rules, i, started / 1000, &(d[i]), events);
+          for ( unsigned int e = 0; e < count; e++ )
+            seplos_alarm_notify(arguments, &(events[e]), &(d[i]), timestamp);
+        }
+      }
+      else if ( fleet )
+        seplos_fleet_missed(fleet, i);
+    }
+    if ( arguments->fleet ) {
+      SeplosFleetSummary summary;
+      seplos_fleet_summary(fleet, &summary);
+      seplos_output_fleet(stdout, arguments, &summary);
+    }
+    fflush(stdout);
+    if ( arguments->http )
+      seplos_http_publish(arguments, d, status, selected, fleet);
+
+    for ( unsigned int g = 0; g < N_GROUPS; g++ ) {
+      if ( (selected & groups[g]) == 0 )
+        continue;
+
+      due[g] += interval[g];
+      if ( interval[g] > 0 && finished > due[g] ) {
+        /* Skip the slots that were missed, rather than bunching up samples. */
+        const long long skipped = ((finished - due[g]) / interval[g]) + 1;
+        s.overruns += skipped;
+        due[g] += skipped * interval[g];
+      }
+      else if ( interval[g] == 0 )
+        due[g] = finished;
+    }
+
+    if ( finished >= next_report ) {
+      report(&s, scheduler);
+      if ( energy )
+        report_energy(arguments, energy);
+      next_report += STATISTICS_PERIOD;
+    }
+  }
+
+  report(&s, scheduler);
+  if ( energy )
+    report_energy(arguments, energy);
+  seplos_http_stop();
+  seplos_shm_close(shm);
+  seplos_rules_close(rules);
+  free(events);
+  seplos_record_close_writer(record);
+  for ( unsigned int i = 0; stores && i < n; i++ )
+    seplos_store_close(stores[i]);
+  free(stores);
+  for ( unsigned int i = 0; energy && i < n; i++ )
+    seplos_energy_close(energy[i]);
+  free(energy);
+  free(diffs);
+  seplos_fleet_close(fleet);
+  seplos_scheduler_close(scheduler);
+  free(status);
+  free(d);
+  return 0;
+}
@@ -0,0 +1,774 @@
+#define _GNU_SOURCE /* accept4(), memmem() */
+#include "./seplos_cmd.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+#include "internal.h"
+
+/*
+ * A small HTTP/1.1 server for daemon mode, so that any number of dashboards
+ * can poll the latest samples without causing any traffic on the RS-485 bus,
+ * and without any rendering per request.
+ *
+ *   /		the HTML page of every pack
+ *   /json	a JSON array of every pack
+ *   /fleet	JSON summary of the site, all of the packs, see fleet.c
+ *   /events	a stream of Server-Sent Events, see below
+ *
+ * After each sweep, the daemon calls seplos_http_publish(), which renders the
+ * pages once, as complete responses with their headers, into a snapshot. The
+ * server runs in its own thread, a single epoll loop of non-blocking sockets.
+ * A request is answered by writing the bytes of the current snapshot as they
+ * are. A connection holds a reference to the snapshot that it's writing, so a
+ * new sample can be published while a slow client is still reading the last.
+ *
+ * Connections are kept alive, as is the default for HTTP/1.1, and requests
+ * pipelined on one are answered in order. Connections idle for IDLE_TIMEOUT
+ * are closed.
+ *
+ * With more than one target, the HTML page starts with the summary of the
+ * site, which is the daemon's, see fleet.c. A pack that has failed
+ * SEPLOS_FLEET_MISSED_SWEEPS sweeps in a row is left out of the summary, at
+ * /fleet too, until it answers again.
+ *
+ * /events pushes every sample to each subscriber as it's taken, so that the
+ * delay from the BMS to the screen is the time of one sweep rather than a
+ * polling period of the dashboard. Each sweep is one block of events, each
+ * event a line of JSON:
+ *
+ *   event: alarm	the alarms of a pack, when they have changed
+ *   event: sample	every pack that answered, in a sweep that polled the telemetry
+ *
+ * with the number of the sweep as the event id. The block is serialized once,
+ * into the snapshot, and written as it is to every subscriber. The daemon wakes
+ * the server through an eventfd when it publishes. The last HISTORY blocks
+ * are kept, so a subscriber that is a little behind is sent every one of them
+ * in order, and one that reconnects with Last-Event-ID gets what it missed.
+ * A subscriber that falls further behind than that skips to the latest block,
+ * the gap showing in the event ids, so that a slow client costs neither memory
+ * nor the freshness of its data. A comment is sent every HEARTBEAT seconds
+ * while no samples are, to keep the connection open through proxies.
+ */
+
+#define	MAXIMUM_REQUEST	4096
+#define	MAXIMUM_EVENTS	64
+#define	IDLE_TIMEOUT	60	/* Seconds */
+#define	HEARTBEAT	15	/* Seconds */
+#define	HISTORY		16	/* Blocks of events */
+
+enum Page {
+  PAGE_HTML,
+  PAGE_JSON,
+  PAGE_FLEET,
+  N_PAGES
+};
+
+typedef struct _Response {
+  char *	data;
+  size_t	length;
+  size_t	header_length;	/* For HEAD */
+} Response;
+
+typedef struct _Snapshot {
+  unsigned int	references;
+  Response	pages[N_PAGES];
+  uint64_t	sequence;	/* Of the events, 0 if there are none */
+  Response	events;		/* The events of the sweep, without headers */
+} Snapshot;
+
+typedef struct _Connection {
+  struct _Connection *	next;
+  struct _Connection *	previous;
+  int			fd;
+  time_t		active;
+  char			in[MAXIMUM_REQUEST];
+  size_t		in_length;
+  Snapshot *		snapshot;	/* Held while writing one of its pages */
+  const char *		out;
+  size_t		out_length;
+  bool			close;		/* After the response has been written */
+  bool			waiting;	/* For the socket to take more output */
+  bool			streaming;	/* Subscribed to /events */
+  uint64_t		sent;		/* The sequence of the last block of events */
+} Connection;
+
+static pthread_mutex_t	lock = PTHREAD_MUTEX_INITIALIZER;
+static Snapshot *	current;
+static Snapshot *	history[HISTORY];	/* By sequence % HISTORY */
+static uint64_t		sequence;	/* Of the last block of events */
+static SeplosData *	last;		/* The last good sample of each target */
+static bool *		valid;
+static SeplosDiff *	alarms;		/* To find the alarm transitions */
+
+static int		listener = -1;
+static int		epoll = -1;
+static int		wake = -1;	/* An eventfd, written on publication, and to stop */
+static bool		stopping;
+static pthread_t	thread;
+static Connection *	connections;
+
+static const char	not_found[] =
+ "HTTP/1.1 404 Not Found\r\nContent-Type: text/plain\r\nContent-Length: 10\r\n\r\nNot found\n";
+static const char	not_allowed[] =
+ "HTTP/1.1 405 Method Not Allowed\r\nAllow: GET, HEAD\r\nContent-Type: text/plain\r\nContent-Length: 19\r\n\r\nMethod not allowed\n";
+static const char	bad_request[] =
+ "HTTP/1.1 400 Bad Request\r\nContent-Type: text/plain\r\nContent-Length: 12\r\nConnection: close\r\n\r\nBad request\n";
+static const char	event_stream[] =
+ "HTTP/1.1 200 OK\r\nContent-Type: text/event-stream\r\nCache-Control: no-cache\r\nX-Accel-Buffering: no\r\n\r\n";
+static const char	heartbeat[] = ":\n\n";
+static const char	unavailable[] =
+ "HTTP/1.1 503 Service Unavailable\r\nContent-Type: text/plain\r\nContent-Length: 21\r\nRetry-After: 1\r\n\r\nNo sample taken yet.\n";
+
+static void
+release(Snapshot * s)
+{
+  if ( s == 0 )
+    return;
+
+  pthread_mutex_lock(&lock);
+  const bool last_reference = --s->references == 0;
+  pthread_mutex_unlock(&lock);
+
+  if ( last_reference ) {
+    for ( unsigned int p = 0; p < N_PAGES; p++ )
+      free(s->pages[p].data);
+    free(s->events.data);
+    free(s);
+  }
+}
+
+static Snapshot *
+acquire(void)
+{
+  pthread_mutex_lock(&lock);
+  Snapshot * const s = current;
+  if ( s )
+    s->references++;
+  pthread_mutex_unlock(&lock);
+  return s;
+}
+
+/* Make a response of the body written to a memory stream, prefixed with its headers. */
+static int
+respond(Response * r, const char * type, const char * modified, char * body, size_t length)
+{
+  char		header[256];
+  const int	header_length = snprintf(
+   header,
+   sizeof(header),
+   "HTTP/1.1 200 OK\r\n"
+   "Content-Type: %s\r\n"
+   "Content-Length: %zu\r\n"
+   "Cache-Control: no-cache\r\n"
+   "Last-Modified: %s\r\n"
+   "\r\n",
+   type,
+   length,
+   modified);
+
+  if ( (r->data = malloc(header_length + length)) == 0 )
+    return -1;
+  memcpy(r->data, header, header_length);
+  memcpy(r->data + header_length, body, length);
+  r->length = header_length + length;
+  r->header_length = header_length;
+  return 0;
+}
+
+/*
+ * Render the pages of the last good sample of every target, and make them
+ * the current snapshot. Called by the daemon after each sweep, with the groups
+ * it polled, see seplos_scheduler_sweep_select(). A sweep of the alarms alone
+ * sends no samples, only the alarms that changed.
+ */
+void
+seplos_http_publish(const struct arguments * arguments, const SeplosData * d, const int * status, unsigned int selected, const SeplosFleet * fleet)
+{
+  const unsigned int	n = arguments->n_targets;
+  Snapshot *		s = calloc(1, sizeof(*s));
+  char *		html = 0;
+  size_t		html_length = 0;
+  char *		json = 0;
+  size_t		json_length = 0;
+  char *		events = 0;
+  size_t		events_length = 0;
+  char			summary[SEPLOS_JSON_SIZE];
+  size_t		summary_length;
+  SeplosFleetSummary	site;
+  char			modified[64];
+  const time_t		now = time(0);
+  struct tm		t;
+
+  if ( listener < 0 || s == 0 ) {
+    free(s);
+    return;
+  }
+
+  for ( unsigned int i = 0; i < n; i++ ) {
+    if ( status[i] == 0 ) {
+      last[i] = d[i];
+      valid[i] = true;
+    }
+  }
+  seplos_fleet_summary(fleet, &site);
+  summary_length = seplos_fleet_json_format(summary, sizeof(summary), &site);
+  if ( summary_length >= sizeof(summary) )
+    summary_length = sizeof(summary) - 1;
+  summary[summary_length++] = '\n';
+  strftime(modified, sizeof(modified), "%a, %d %b %Y %H:%M:%S GMT", gmtime_r(&now, &t));
+
+  FILE * const h = open_memstream(&html, &html_length);
+  FILE * const j = open_memstream(&json, &json_length);
+  FILE * const e = open_memstream(&events, &events_length);
+  if ( h && j && e ) {
+    fprintf(h, "<!DOCTYPE html>\n<html><head><title>SEPLOS Battery Monitor</title>");
+    fprintf(h, "<meta http-equiv=\"refresh\" content=\"%u\"></head><body>\n", arguments->telemetry_interval >= 2000 ? arguments->telemetry_interval / 1000 : 1);
+    if ( n > 1 )
+      seplos_fleet_html(h, &site);
+    bool first = true;
+
+    fprintf(j, "[");
+    for ( unsigned int i = 0; i < n; i++ ) {
+      if ( !valid[i] )
+        continue;
+      seplos_html(h, &(last[i]), arguments->longer);
+
+      char buffer[SEPLOS_JSON_SIZE];
+      const size_t length = seplos_json_format(buffer, sizeof(buffer), &(last[i]), arguments->longer);
+      fprintf(j, "%s%.*s", first ? "" : ",", (int)(length < sizeof(buffer) ? length : sizeof(buffer) - 1), buffer);
+      first = false;
+
+      /* Events only for the packs that answered in this sweep. */
+      if ( status[i] == 0 ) {
+        SeplosChanges changes;
+        const bool initial = !alarms[i].has_reported;
+
+        seplos_diff(&(alarms[i]), &(d[i]), &changes);
+        if ( (changes.fields & SEPLOS_CHANGED_ALARMS) && (!initial || d[i].has_alarm) ) {
+          const SeplosChanges only_alarms = { SEPLOS_CHANGED_ALARMS };
+          char alarm[SEPLOS_JSON_SIZE];
+
+          seplos_json_changes_format(alarm, sizeof(alarm), &(d[i]), &only_alarms);
+          fprintf(e, "event: alarm\nid: %llu\ndata: %s\n\n", (unsigned long long)sequence + 1, alarm);
+        }
+        if ( selected & SEPLOS_TELEMETRY )
+          fprintf(e, "event: sample\nid: %llu\ndata: %s\n\n", (unsigned long long)sequence + 1, buffer);
+      }
+    }
+    fprintf(h, "</body></html>\n");
+    fprintf(j, "]\n");
+  }
+  if ( h )
+    fclose(h);
+  if ( j )
+    fclose(j);
+  if ( e )
+    fclose(e);
+
+  /* Referenced as the current snapshot, and in the history if it has events. */
+  s->references = events_length > 0 ? 2 : 1;
+  s->events.data = events;
+  s->events.length = events_length;
+  if ( h == 0 || j == 0 || e == 0
+   || respond(&(s->pages[PAGE_HTML]), "text/html; charset=utf-8", modified, html, html_length) != 0
+   || respond(&(s->pages[PAGE_JSON]), "application/json", modified, json, json_length) != 0
+   || respond(&(s->pages[PAGE_FLEET]), "application/json", modified, summary, summary_length) != 0 ) {
+    _sp_error("HTTP: Out of memory.\n");
+    s->references = 1;
+    release(s);
+    s = 0;
+  }
+  free(html);
+  free(json);
+  if ( s == 0 )
+    return;
+
+  Snapshot * forgotten = 0;
+
+  pthread_mutex_lock(&lock);
+  Snapshot * const old = current;
+  current = s;
+  if ( events_length > 0 ) {
+    s->sequence = ++sequence;
+    forgotten = history[sequence % HISTORY];
+    history[sequence % HISTORY] = s;
+  }
+  pthread_mutex_unlock(&lock);
+  release(old);
+  release(forgotten);
+
+  if ( events_length > 0 ) {
+    const uint64_t one = 1;
+    write(wake, &one, sizeof(one));
+  }
+}
+
+static void
+close_connection(Connection * c)
+{
+  epoll_ctl(epoll, EPOLL_CTL_DEL, c->fd, 0);
+  close(c->fd);
+  release(c->snapshot);
+  if ( c->previous )
+    c->previous->next = c->next;
+  else
+    connections = c->next;
+  if ( c->next )
+    c->next->previous = c->previous;
+  free(c);
+}
+
+/* Write as much of the output as the socket takes. Returns -1 on an error. */
+static int
+write_out(Connection * c)
+{
+  while ( c->out_length > 0 ) {
+    const ssize_t n = send(c->fd, c->out, c->out_length, MSG_NOSIGNAL);
+    if ( n < 0 ) {
+      if ( errno == EINTR )
+        continue;
+      if ( errno == EAGAIN || errno == EWOULDBLOCK ) {
+        if ( !c->waiting ) {
+          /* Not EPOLLIN too, since the input isn't read until this is written. */
+          struct epoll_event e = { EPOLLOUT, { .ptr = c } };
+          epoll_ctl(epoll, EPOLL_CTL_MOD, c->fd, &e);
+          c->waiting = true;
+        }
+        return 0;
+      }
+      return -1;
+    }
+    c->out += n;
+    c->out_length -= n;
+  }
+
+  release(c->snapshot);
+  c->snapshot = 0;
+  if ( c->waiting ) {
+    struct epoll_event e = { EPOLLIN, { .ptr = c } };
+    epoll_ctl(epoll, EPOLL_CTL_MOD, c->fd, &e);
+    c->waiting = false;
+  }
+  return 0;
+}
+
+/* The next block of events for a subscriber, or 0 if it has them all. */
+static Snapshot *
+next_events(Connection * c)
+{
+  Snapshot *	s = 0;
+
+  pthread_mutex_lock(&lock);
+  if ( sequence > c->sent ) {
+    /* Too far behind for the history, so skip to the latest. */
+    const uint64_t next = sequence - c->sent > HISTORY ? sequence : c->sent + 1;
+    s = history[next % HISTORY];
+    s->references++;
+  }
+  pthread_mutex_unlock(&lock);
+  return s;
+}
+
+/* Write blocks of events to a subscriber until it has all of them, or its socket is full. */
+static int
+stream(Connection * c)
+{
+  while ( c->out_length == 0 ) {
+    Snapshot * const s = next_events(c);
+    if ( s == 0 )
+      break;
+
+    c->snapshot = s;
+    c->sent = s->sequence;
+    c->out = s->events.data;
+    c->out_length = s->events.length;
+    c->active = time(0);
+    if ( write_out(c) < 0 )
+      return -1;
+  }
+  return 0;
+}
+
+/* Write the response, and then what follows it. Returns -1 if the connection is done. */
+static int
+send_response(Connection * c)
+{
+  if ( write_out(c) < 0 )
+    return -1;
+  if ( c->out_length > 0 )
+    return 0;
+  if ( c->close )
+    return -1;
+  if ( c->streaming )
+    return stream(c);
+  return 0;
+}
+
+/* Does the header block have the header name, with a value containing token? */
+static bool
+has_header_token(const char * headers, const char * name, const char * token)
+{
+  const size_t name_length = strlen(name);
+
+  for ( const char * line = headers; *line; ) {
+    const char * end = strstr(line, "\r\n");
+    if ( end == 0 )
+      end = line + strlen(line);
+    if ( strncasecmp(line, name, name_length) == 0 && line[name_length] == ':' ) {
+      for ( const char * p = line + name_length + 1; p + strlen(token) <= end; p++ ) {
+        if ( strncasecmp(p, token, strlen(token)) == 0 )
+          return true;
+      }
+    }
+    line = *end ? end + 2 : end;
+  }
+  return false;
+}
+
+/* The value of a header, as a number, or 0 if it isn't there. */
+static unsigned long long
+header_number(const char * headers, const char * name)
+{
+  const size_t name_length = strlen(name);
+
+  for ( const char * line = headers; *line; ) {
+    const char * end = strstr(line, "\r\n");
+    if ( end == 0 )
+      end = line + strlen(line);
+    if ( strncasecmp(line, name, name_length) == 0 && line[name_length] == ':' )
+      return strtoull(line + name_length + 1, 0, 10);
+    line = *end ? end + 2 : end;
+  }
+  return 0;
+}
+
+/* Answer the first whole request in the input, if there is one. Returns -1 to close. */
+static int
+handle_request(Connection * c)
+{
+  char * const	end = memmem(c->in, c->in_length, "\r\n\r\n", 4);
+
+  if ( end == 0 ) {
+    if ( c->in_length >= sizeof(c->in) - 1 ) {
+      c->out = bad_request;
+      c->out_length = sizeof(bad_request) - 1;
+      c->close = true;
+      return send_response(c);
+    }
+    return 0;
+  }
+  *end = '\0';
+  const size_t request_length = (end + 4) - c->in;
+
+  char		method[8];
+  char		target[256];
+  char		version[16];
+  const char *	headers = strstr(c->in, "\r\n");
+
+  headers = headers ? headers + 2 : end;
+  if ( sscanf(c->in, "%7s %255s %15s", method, target, version) != 3 || strncmp(version, "HTTP/1.", 7) != 0 ) {
+    c->out = bad_request;
+    c->out_length = sizeof(bad_request) - 1;
+    c->close = true;
+    return send_response(c);
+  }
+
+  /* HTTP/1.0 closes after each response, unless asked otherwise. */
+  if ( strcmp(version, "HTTP/1.0") == 0 )
+    c->close = !has_header_token(headers, "Connection", "keep-alive");
+  else
+    c->close = has_header_token(headers, "Connection", "close");
+
+  const bool head = strcmp(method, "HEAD") == 0;
+  enum Page page = N_PAGES;
+
+  if ( strcmp(target, "/") == 0 || strcmp(target, "/index.html") == 0 )
+    page = PAGE_HTML;
+  else if ( strcmp(target, "/json") == 0 )
+    page = PAGE_JSON;
+  else if ( strcmp(target, "/fleet") == 0 )
+    page = PAGE_FLEET;
+  else if ( strcmp(target, "/events") == 0 && !head && strcmp(method, "GET") == 0 ) {
+    const unsigned long long resume = header_number(headers, "Last-Event-ID");
+
+    /* Start with the latest block, or after the last one received if it's still known. */
+    pthread_mutex_lock(&lock);
+    c->sent = sequence > 0 ? sequence - 1 : 0;
+    if ( resume > 0 && resume <= sequence )
+      c->sent = resume;
+    pthread_mutex_unlock(&lock);
+
+    /* Anything sent after this is ignored. */
+    c->streaming = true;
+    c->close = false;
+    c->in_length = 0;
+    c->out = event_stream;
+    c->out_length = sizeof(event_stream) - 1;
+    return send_response(c);
+  }
+
+  if ( !head && strcmp(method, "GET") != 0 ) {
+    /* A request with a body can't be skipped reliably, so close after it. */
+    c->out = not_allowed;
+    c->out_length = sizeof(not_allowed) - 1;
+    c->close = true;
+  }
+  else if ( page == N_PAGES ) {
+    c->out = not_found;
+    c->out_length = sizeof(not_found) - 1;
+  }
+  else if ( (c->snapshot = acquire()) == 0 ) {
+    c->out = unavailable;
+    c->out_length = sizeof(unavailable) - 1;
+  }
+  else {
+    const Response * const r = &(c->snapshot->pages[page]);
+    c->out = r->data;
+    c->out_length = head ? r->header_length : r->length;
+  }
+
+  /* Keep any pipelined requests that follow this one. */
+  memmove(c->in, c->in + request_length, c->in_length - request_length);
+  c->in_length -= request_length;
+  return send_response(c);
+}
+
+/* Answer the requests in the input in order, until one has to wait to be written. */
+static int
+process(Connection * c)
+{
+  while ( c->out_length == 0 && c->in_length > 0 ) {
+    const size_t before = c->in_length;
+    if ( handle_request(c) < 0 )
+      return -1;
+    if ( c->in_length == before )
+      break;
+  }
+  return 0;
+}
+
+static void
+accept_connections(void)
+{
+  for ( ; ; ) {
+    const int fd = accept4(listener, 0, 0, SOCK_NONBLOCK | SOCK_CLOEXEC);
+    if ( fd < 0 )
+      return;
+
+    Connection * const c = calloc(1, sizeof(*c));
+    if ( c == 0 ) {
+      close(fd);
+      continue;
+    }
+    c->fd = fd;
+    c->active = time(0);
+    c->next = connections;
+    if ( connections )
+      connections->previous = c;
+    connections = c;
+
+    struct epoll_event e = { EPOLLIN, { .ptr = c } };
+    epoll_ctl(epoll, EPOLL_CTL_ADD, fd, &e);
+  }
+}
+
+static void
+connection_event(Connection * c, uint32_t events)
+{
+  c->active = time(0);
+
+  if ( events & (EPOLLERR | EPOLLHUP) ) {
+    close_connection(c);
+    return;
+  }
+  if ( c->out_length > 0 ) {
+    /* Still writing the last response. Requests after it wait in the socket. */
+    if ( send_response(c) < 0 || (!c->streaming && process(c) < 0) )
+      close_connection(c);
+    return;
+  }
+
+  const ssize_t n = recv(c->fd, c->in + c->in_length, sizeof(c->in) - 1 - c->in_length, 0);
+  if ( n == 0 || (n < 0 && errno != EAGAIN && errno != EINTR) ) {
+    close_connection(c);
+    return;
+  }
+  if ( n > 0 )
+    c->in_length += n;
+  if ( c->streaming )
+    c->in_length = 0;
+  else if ( process(c) < 0 )
+    close_connection(c);
+}
+
+/* Send the new events to every subscriber that isn't still writing the last. */
+static void
+publish_events(void)
+{
+  uint64_t value;
+
+  read(wake, &value, sizeof(value));
+  for ( Connection * c = connections, * next; c; c = next ) {
+    next = c->next;
+    if ( c->streaming && c->out_length == 0 && stream(c) < 0 )
+      close_connection(c);
+  }
+}
+
+static void *
+serve(void * argument)
+{
+  struct epoll_event	events[MAXIMUM_EVENTS];
+  time_t		swept = time(0);
+
+  for ( ; ; ) {
+    const int n = epoll_wait(epoll, events, MAXIMUM_EVENTS, 1000);
+    bool woken = false;
+
+    for ( int i = 0; i < n; i++ ) {
+      if ( events[i].data.ptr == &listener )
+        accept_connections();
+      else if ( events[i].data.ptr == &wake )
+        woken = true;
+      else
+        connection_event(events[i].data.ptr, events[i].events);
+    }
+
+    /*
+     * Publishing may close any subscriber, so it waits until the events of
+     * this batch, which may point to them, have all been handled.
+     */
+    if ( woken ) {
+      if ( __atomic_load_n(&stopping, __ATOMIC_ACQUIRE) )
+        return 0;
+      publish_events();
+    }
+
+    const time_t now = time(0);
+    if ( now != swept ) {
+      swept = now;
+      for ( Connection * c = connections, * next; c; c = next ) {
+        next = c->next;
+        if ( c->streaming ) {
+          if ( c->out_length == 0 && now - c->active >= HEARTBEAT ) {
+            c->active = now;
+            c->out = heartbeat;
+            c->out_length = sizeof(heartbeat) - 1;
+            if ( write_out(c) < 0 )
+              close_connection(c);
+          }
+        }
+        else if ( now - c->active > IDLE_TIMEOUT )
+          close_connection(c);
+      }
+    }
+  }
+}
+
+/*
+ * Listen on arguments->http, [ADDRESS:]PORT, and start serving. Until the
+ * first seplos_http_publish(), requests are answered with 503.
+ */
+int
+seplos_http_start(const struct arguments * arguments)
+{
+  struct addrinfo	hints = {};
+  struct addrinfo *	addresses = 0;
+  char			host[256];
+  const char *		port = arguments->http;
+  const char *		colon = strrchr(arguments->http, ':');
+  int			status;
+
+  host[0] = '\0';
+  if ( colon ) {
+    snprintf(host, sizeof(host), "%.*s", (int)(colon - arguments->http), arguments->http);
+    port = colon + 1;
+  }
+
+  hints.ai_family = AF_UNSPEC;
+  hints.ai_socktype = SOCK_STREAM;
+  hints.ai_flags = AI_PASSIVE;
+  if ( (status = getaddrinfo(host[0] ? host : 0, port, &hints, &addresses)) != 0 ) {
+    _sp_error("HTTP: %s: %s\n", arguments->http, gai_strerror(status));
+    return -1;
+  }
+
+  for ( struct addrinfo * a = addresses; a && listener < 0; a = a->ai_next ) {
+    const int yes = 1;
+
+    listener = socket(a->ai_family, a->ai_socktype | SOCK_NONBLOCK | SOCK_CLOEXEC, a->ai_protocol);
+    if ( listener < 0 )
+      continue;
+    setsockopt(listener, SOL_SOCKET, SO_REUSEADDR, &yes, sizeof(yes));
+    if ( bind(listener, a->ai_addr, a->ai_addrlen) != 0 || listen(listener, 64) != 0 ) {
+      close(listener);
+      listener = -1;
+    }
+  }
+  freeaddrinfo(addresses);
+  if ( listener < 0 ) {
+    _sp_error("HTTP: Can't listen on %s: %s\n", arguments->http, strerror(errno));
+    return -1;
+  }
+
+  last = calloc(arguments->n_targets, sizeof(*last));
+  valid = calloc(arguments->n_targets, sizeof(*valid));
+  alarms = calloc(arguments->n_targets, sizeof(*alarms));
+  epoll = epoll_create1(EPOLL_CLOEXEC);
+  wake = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+  if ( last == 0 || valid == 0 || alarms == 0 || epoll < 0 || wake < 0 ) {
+    _sp_error("HTTP: %s\n", strerror(errno));
+    return -1;
+  }
+
+  struct epoll_event e = { EPOLLIN, { .ptr = &listener } };
+  struct epoll_event w = { EPOLLIN, { .ptr = &wake } };
+  epoll_ctl(epoll, EPOLL_CTL_ADD, listener, &e);
+  epoll_ctl(epoll, EPOLL_CTL_ADD, wake, &w);
+  for ( unsigned int i = 0; i < arguments->n_targets; i++ )
+    seplos_diff_init(&(alarms[i]), 0);
+
+  if ( (status = pthread_create(&thread, 0, serve, 0)) != 0 ) {
+    _sp_error("HTTP: %s\n", strerror(status));
+    return -1;
+  }
+  return 0;
+}
+
+void
+seplos_http_stop(void)
+{
+  if ( listener < 0 )
+    return;
+
+  const uint64_t one = 1;
+  __atomic_store_n(&stopping, true, __ATOMIC_RELEASE);
+  write(wake, &one, sizeof(one));
+  pthread_join(thread, 0);
+
+  while ( connections )
+    close_connection(connections);
+  close(listener);
+  close(epoll);
+  close(wake);
+  listener = -1;
+  release(current);
+  current = 0;
+  for ( unsigned int i = 0; i < HISTORY; i++ ) {
+    release(history[i]);
+    history[i] = 0;
+  }
+  free(last);
+  free(valid);
+  free(alarms);
+}
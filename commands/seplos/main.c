@@ -1,39 +1,60 @@
 #include "./seplos_cmd.h"
 #include <stdio.h>
+#include <stdlib.h>
 #include "seplos.h"
 
 int
 main(int argc, char * * argv)
 {
-  const char *		device = "/dev/ttyUSB0";
   struct arguments	arguments = {};
+  SeplosTarget		target = {};
 
   arguments.device = "/dev/ttyUSB0";
   arguments.format = TEXT;
+  arguments.interval = 5000;
+  arguments.telemetry_interval = INTERVAL_UNSET;
+  arguments.alarm_interval = INTERVAL_UNSET;
 
   argp_parse(&argp, argc, argv, 0, 0, &arguments);
 
-  int fd = seplos_open(arguments.device);
+  if ( arguments.telemetry_interval == INTERVAL_UNSET )
+    arguments.telemetry_interval = arguments.interval;
+  if ( arguments.alarm_interval == INTERVAL_UNSET )
+    arguments.alarm_interval = arguments.interval;
+
+  if ( arguments.replay )
+    return seplos_replay(&arguments);
+  if ( arguments.analyze )
+    return seplos_analyze_stores(&arguments);
+
+  if ( arguments.n_targets == 0 ) {
+    target.device = arguments.device;
+    target.address = 0;
+    target.pack = 0x01;
+    arguments.targets = &target;
+    arguments.n_targets = 1;
+  }
+
+  SeplosScheduler * s = seplos_scheduler_open(arguments.targets, arguments.n_targets);
+
+  if ( s == 0 )
+    return 1;
+
+  if ( arguments.daemon )
+    return seplos_daemon(&arguments, s);
 
-  SeplosData d;
+  SeplosData * d = calloc(arguments.n_targets, sizeof(*d));
+  int * status = calloc(arguments.n_targets, sizeof(*status));
 
-  if ( fd < 0 )
+  if ( d == 0 || status == 0 )
     return 1;
 
-  seplos_data(fd, 0, 0x01, &d);
-
-  switch ( arguments.format ) {
-  case TEXT:
-    seplos_text(stdout, &d, arguments.longer);
-    break;
-  case HTML:
-    fprintf(stdout, "<!DOCTYPE html>\n<html><head><title>SEPLOS Battery Monitor</title></head><body>\n");
-    seplos_html(stdout, &d, arguments.longer);
-    fprintf(stdout, "</body></html>\n");
-    break;
-  case JSON:
-    seplos_json(stdout, &d, arguments.longer);
-    break;
+  const int failures = seplos_scheduler_sweep(s, d, status);
+
+  for ( unsigned int i = 0; i < arguments.n_targets; i++ ) {
+    if ( status[i] == 0 )
+      seplos_output(stdout, &arguments, &(d[i]));
   }
-  return 0;
+  seplos_scheduler_close(s);
+  return failures ? 1 : 0;
 }
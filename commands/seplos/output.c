@@ -0,0 +1,55 @@
+#include "./seplos_cmd.h"
+#include <stdio.h>
+
+void
+seplos_output(FILE * f, const struct arguments * arguments, const SeplosData * d)
+{
+  switch ( arguments->format ) {
+  case TEXT:
+    seplos_text(f, d, arguments->longer);
+    break;
+  case HTML:
+    fprintf(f, "<!DOCTYPE html>\n<html><head><title>SEPLOS Battery Monitor</title></head><body>\n");
+    seplos_html(f, d, arguments->longer);
+    fprintf(f, "</body></html>\n");
+    break;
+  case JSON:
+    seplos_json(f, d, arguments->longer);
+    break;
+  }
+}
+
+/* HTML is a whole page, so a page that changed is printed whole. */
+void
+seplos_output_changes(FILE * f, const struct arguments * arguments, const SeplosData * d, const SeplosChanges * changes)
+{
+  switch ( arguments->format ) {
+  case TEXT:
+    seplos_text_changes(f, d, changes);
+    break;
+  case HTML:
+    seplos_output(f, arguments, d);
+    break;
+  case JSON:
+    seplos_json_changes(f, d, changes);
+    break;
+  }
+}
+
+void
+seplos_output_fleet(FILE * f, const struct arguments * arguments, const SeplosFleetSummary * s)
+{
+  switch ( arguments->format ) {
+  case TEXT:
+    seplos_fleet_text(f, s);
+    break;
+  case HTML:
+    fprintf(f, "<!DOCTYPE html>\n<html><head><title>SEPLOS Battery Monitor</title></head><body>\n");
+    seplos_fleet_html(f, s);
+    fprintf(f, "</body></html>\n");
+    break;
+  case JSON:
+    seplos_fleet_json(f, s);
+    break;
+  }
+}
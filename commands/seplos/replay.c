@@ -0,0 +1,30 @@
+#include "./seplos_cmd.h"
+#include <stdio.h>
+#include <time.h>
+
+/* Print each sample of a record file written with --record, with its time. */
+int
+seplos_replay(const struct arguments * arguments)
+{
+  SeplosRecordReader * const r = seplos_record_open_reader(arguments->replay);
+  SeplosData		d;
+  int64_t		timestamp;
+  int			status;
+
+  if ( r == 0 )
+    return 1;
+
+  while ( (status = seplos_record_read(r, &timestamp, &d)) > 0 ) {
+    if ( arguments->format == TEXT ) {
+      const time_t	seconds = timestamp / 1000000;
+      struct tm		t;
+      char		s[64];
+
+      strftime(s, sizeof(s), "%Y-%m-%d %H:%M:%S", localtime_r(&seconds, &t));
+      printf("%s.%03d\n", s, (int)((timestamp % 1000000) / 1000));
+    }
+    seplos_output(stdout, arguments, &d);
+  }
+  seplos_record_close_reader(r);
+  return status < 0 ? 1 : 0;
+}
@@ -1,5 +1,6 @@
 #include <stdbool.h>
 #include <argp.h>
+#include "seplos.h"
 
 extern const struct argp	argp;
 
@@ -9,10 +10,42 @@ enum Format {
   JSON
 };
 
+/* --telemetry-interval and --alarm-interval default to --interval. */
+#define INTERVAL_UNSET	(~0U)
+
 struct arguments
 {
   char *	device;	/* Serial device connected to the battery */
   enum Format	format; /* text, HTML, or JSON. */
   bool		longer; /* More information but not necessarily verbose */
+  bool		daemon; /* Keep the port open and poll until interrupted */
+  unsigned int	interval; /* Milliseconds between the start of each sample */
+  unsigned int	telemetry_interval; /* Milliseconds between telemetry polls */
+  unsigned int	alarm_interval; /* Milliseconds between alarm polls */
+  const char *	record; /* File to append binary records of the samples to */
+  const char *	replay; /* Record file to print, rather than sampling */
+  const char *	analyze; /* Store, or directory of them, to analyze, rather than sampling */
+  const char *	store; /* Directory of a time-series store for each pack */
+  const char *	energy; /* Directory of a file of the charge and energy counts of each pack */
+  const char *	http; /* [ADDRESS:]PORT to serve the latest samples on */
+  const char *	shm; /* Shared-memory segment to publish the latest samples in */
+  const char *	alarm_rules; /* File of alarm rules to evaluate */
+  const char *	alarm_command; /* To run for each notification of the alarm rules */
+  bool		fleet; /* In daemon mode, print a summary of the site, not each pack */
+  bool		changes; /* In daemon mode, print only what changed */
+  bool		has_deadband; /* deadband was given, rather than the default */
+  float		deadband[3]; /* mV, C, and A that a value must move to be a change */
+  SeplosTarget *	targets; /* Battery packs to sample */
+  unsigned int	n_targets;
 };
 
+extern int	seplos_daemon(const struct arguments * arguments, SeplosScheduler * scheduler);
+extern int	seplos_replay(const struct arguments * arguments);
+extern int	seplos_analyze_stores(const struct arguments * arguments);
+extern void	seplos_alarm_notify(const struct arguments * arguments, const SeplosAlarmEvent * e, const SeplosData * d, int64_t timestamp);
+extern int	seplos_http_start(const struct arguments * arguments);
+extern void	seplos_http_publish(const struct arguments * arguments, const SeplosData * d, const int * status, unsigned int selected, const SeplosFleet * fleet);
+extern void	seplos_http_stop(void);
+extern void	seplos_output(FILE * f, const struct arguments * arguments, const SeplosData * d);
+extern void	seplos_output_changes(FILE * f, const struct arguments * arguments, const SeplosData * d, const SeplosChanges * changes);
+extern void	seplos_output_fleet(FILE * f, const struct arguments * arguments, const SeplosFleetSummary * s);
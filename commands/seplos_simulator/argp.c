@@ -0,0 +1,81 @@
+#include "./simulator_cmd.h"
+#include "internal.h"
+#include <stdlib.h>
+#include <string.h>
+
+static error_t parse_opt(int key, char *arg, struct argp_state *state);
+
+const char * argp_program_version = "seplos_simulator 0.1";
+const char * argp_program_bug_address = "Bruce Perens K6BP <bruce@perens.com>";
+
+static const char args_doc[] = "";
+static const char doc[] = \
+  "Simulate SEPLOS battery-management systems on a pseudo-terminal, so that the " \
+  "seplos command and the library can be run without a battery." \
+  "";
+
+static const struct argp_option options[] = {
+  {"script", 's', "FILE", 0, "Commands that set the state of the packs, some of them at a later time. See script.c."},
+  {"link", 'L', "PATH", 0, "Make a symbolic link with this name to the pseudo-terminal, so that its name is predictable."},
+  {"packs", 'n', "N", 0, "Simulate N packs, at addresses 0 through N - 1. The default is 1."},
+  {"latency", 'l', "MS", 0, "Milliseconds between the end of a request and the start of its reply. The default is 0."},
+  {"baud", 'b', "RATE", 0, "Take as long to send and receive as a serial line at this bit rate, with 10 bits per character. The default is 0, as fast as possible."},
+  {"verbose", 'v', 0, 0, "Log each request to stderr."},
+  {}
+};
+
+const struct argp argp = {
+  options, parse_opt, args_doc, doc
+};
+
+static unsigned long
+number(struct argp_state * state, const char * arg, unsigned long limit, const char * message)
+{
+  char * end;
+  const unsigned long value = strtoul(arg, &end, 10);
+
+  if ( *arg == '\0' || *end != '\0' || value > limit )
+    argp_failure(state, 1, 0, "%s", message);
+  return value;
+}
+
+static error_t
+parse_opt(int key, char *arg, struct argp_state *state)
+{
+  struct arguments * arguments = state->input;
+
+  switch ( key ) {
+  case 's':
+    arguments->script = arg;
+    break;
+  case 'L':
+    arguments->link = arg;
+    break;
+  case 'n':
+    arguments->packs = number(state, arg, 256, "Parameter to --packs= or -n must be a number from 0 to 256.");
+    break;
+  case 'l':
+    arguments->latency = number(state, arg, 60000, "Parameter to --latency= or -l must be a number of milliseconds.");
+    break;
+  case 'b':
+    arguments->baud = number(state, arg, 4000000, "Parameter to --baud= or -b must be a bit rate.");
+    break;
+  case 'v':
+    arguments->verbose = true;
+    break;
+  case ARGP_KEY_ARG:
+  case ARGP_KEY_END:
+  case ARGP_KEY_FINI:
+  case ARGP_KEY_INIT:
+  case ARGP_KEY_NO_ARGS:
+  case ARGP_KEY_SUCCESS:
+    break;
+  case ARGP_KEY_ERROR:
+    _sp_error("parse_opt() got ARGP_KEY_ERROR for argument %s\n", arg);
+    break;
+  default:
+    _sp_error("parse_opt(key=%x) was not understood.\n", key);
+    break;
+  }
+  return 0;
+}
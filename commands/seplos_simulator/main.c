@@ -0,0 +1,187 @@
+#define _GNU_SOURCE /* ptsname_r() */
+#include "./simulator_cmd.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <termios.h>
+#include <time.h>
+#include <unistd.h>
+#include "internal.h"
+#include "communication.h"
+
+/*
+ * A battery simulator: one or more SEPLOS BMS, answering protocol 2.0 requests
+ * on a pseudo-terminal. Point the seplos command, or anything else that uses
+ * the library, at the name it prints, for testing and benchmarking without a
+ * battery. Requests are parsed with the library's own receiver, and replies
+ * encoded with its own frame encoder.
+ *
+ * With --baud, each request and reply takes as long as it would on a serial
+ * line, and they're serialized as they would be on a half-duplex bus: a reply
+ * can't start until the request before it has been answered.
+ */
+
+#define	NS_PER_MS		1000000LL
+#define	NS_PER_SECOND		1000000000LL
+/* How often the script's timed commands are checked while the bus is idle. */
+#define	IDLE_PERIOD_MS		100
+
+static volatile sig_atomic_t	stop = 0;
+
+static void
+on_signal(int signal)
+{
+  stop = 1;
+}
+
+static void
+sleep_until(int64_t deadline)
+{
+  struct timespec t;
+
+  t.tv_sec = deadline / NS_PER_SECOND;
+  t.tv_nsec = deadline % NS_PER_SECOND;
+  while ( clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &t, 0) == EINTR && !stop )
+    ;
+}
+
+/* Nanoseconds to send size characters of 10 bits each, at baud bits per second. */
+static int64_t
+transmission_time(size_t size, unsigned int baud)
+{
+  return baud ? (int64_t)size * 10 * NS_PER_SECOND / baud : 0;
+}
+
+/*
+ * Open the pseudo-terminal. The simulator keeps the slave side open too, so
+ * that the master doesn't see a hang-up each time a client closes it, and so
+ * that the raw mode set here persists from one client to the next.
+ */
+static int
+open_pty(char * name, size_t size, int * slave)
+{
+  struct termios t = {};
+  const int master = posix_openpt(O_RDWR|O_NOCTTY|O_CLOEXEC);
+
+  if ( master < 0 || grantpt(master) != 0 || unlockpt(master) != 0 || ptsname_r(master, name, size) != 0 ) {
+    _sp_error("Can't open a pseudo-terminal: %s\n", strerror(errno));
+    return -1;
+  }
+  if ( (*slave = open(name, O_RDWR|O_NOCTTY|O_CLOEXEC)) < 0 ) {
+    _sp_error("%s: %s\n", name, strerror(errno));
+    return -1;
+  }
+  tcgetattr(*slave, &t);
+  cfmakeraw(&t);
+  tcsetattr(*slave, TCSANOW, &t);
+  return master;
+}
+
+int
+main(int argc, char * * argv)
+{
+  struct arguments	arguments = {};
+  struct sigaction	action = {};
+  static Seplos_2_0_Reply request;
+  static Seplos_2_0	reply;
+  char			name[256];
+  int			slave;
+
+  arguments.packs = 1;
+
+  argp_parse(&argp, argc, argv, 0, 0, &arguments);
+
+  for ( unsigned int i = 0; i < arguments.packs; i++ ) {
+    if ( simulator_pack(i, true) == 0 )
+      return 1;
+  }
+  if ( arguments.script && simulator_script_load(arguments.script) != 0 )
+    return 1;
+
+  const int master = open_pty(name, sizeof(name), &slave);
+  if ( master < 0 )
+    return 1;
+
+  SeplosConnection * const c = _sp_connection(master);
+  if ( c == 0 )
+    return 1;
+
+  if ( arguments.link ) {
+    unlink(arguments.link);
+    if ( symlink(name, arguments.link) != 0 ) {
+      _sp_error("%s: %s\n", arguments.link, strerror(errno));
+      return 1;
+    }
+  }
+
+  action.sa_handler = on_signal;
+  sigaction(SIGINT, &action, 0);
+  sigaction(SIGTERM, &action, 0);
+
+  printf("%s\n", name);
+  fflush(stdout);
+
+  const int64_t	start = _sp_monotonic_time();
+  int64_t	bus_free = start; /* When the last reply finished transmission */
+
+  while ( !stop ) {
+    simulator_script_run((_sp_monotonic_time() - start) / (double)NS_PER_SECOND);
+
+    /*
+     * Wait here while the bus is idle, rather than in the receiver, which
+     * would report each idle period as a timeout.
+     */
+    struct pollfd idle = { master, POLLIN };
+    if ( c->head == c->tail && poll(&idle, 1, IDLE_PERIOD_MS) <= 0 )
+      continue;
+
+    if ( _sp_receive_frame(c, _sp_monotonic_time() + NS_PER_SECOND, &request) != 0 ) {
+      if ( errno != ETIMEDOUT && errno != EINTR ) {
+        _sp_error("Receive: %s\n", strerror(errno));
+        break;
+      }
+      continue;
+    }
+
+    const unsigned int address = request.header.address;
+    const unsigned int command = request.header.function;
+    const unsigned int pack = request.header.length > 0 ? request.info[0] : 0;
+    const SimulatedPack * const p = simulator_pack(address, false);
+
+    if ( arguments.verbose )
+      _sp_error("Address %u command 0x%02x pack %u%s\n", address, command, pack, p ? "" : ": no such pack");
+
+    /* On a real bus, nothing answers an address that isn't there. */
+    if ( p == 0 )
+      continue;
+
+    /*
+     * A request that was already waiting while the last reply was being sent
+     * is treated as arriving after it, as on a half-duplex bus.
+     */
+    int64_t received = _sp_monotonic_time();
+    if ( received < bus_free )
+      received = bus_free;
+    received += transmission_time(request.frame.size, arguments.baud);
+
+    const size_t size = simulator_reply(p, command, pack, (char *)&reply);
+    bus_free = received + (arguments.latency * NS_PER_MS) + transmission_time(size, arguments.baud);
+
+    /* The reply is written whole once it would have finished transmission. */
+    sleep_until(bus_free);
+    if ( _sp_write_serial(master, &reply, size) != (int)size ) {
+      _sp_error("Write: %s\n", strerror(errno));
+      break;
+    }
+  }
+
+  if ( arguments.link )
+    unlink(arguments.link);
+  close(slave);
+  close(master);
+  return 0;
+}
@@ -0,0 +1,154 @@
+#include "./simulator_cmd.h"
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+#include "internal.h"
+#include "communication.h"
+
+/*
+ * The simulated packs, one per address on the bus. A request to an address
+ * that has no pack gets no reply, as it would on a real bus.
+ */
+static SimulatedPack *	packs[256];
+
+static void
+defaults(SimulatedPack * p)
+{
+  for ( unsigned int i = 0; i < SEPLOS_N_CELLS; i++ )
+    p->cell_voltage[i] = 3.300;
+  for ( unsigned int i = 0; i < SEPLOS_N_TEMPERATURES; i++ )
+    p->temperature[i] = 25.0;
+  p->current = 0.0;
+  p->state_of_charge = 80.0;
+  p->battery_capacity = 100.0;
+  p->rated_capacity = 100.0;
+  p->number_of_cycles = 10;
+  p->state_of_health = 100.0;
+  p->on_off_state = 0x03; /* Discharge and charge switches on */
+  p->system_state = 0x10; /* Standby */
+}
+
+SimulatedPack *
+simulator_pack(unsigned int address, bool create)
+{
+  if ( address >= sizeof(packs) / sizeof(*packs) )
+    return 0;
+
+  if ( packs[address] == 0 && create ) {
+    SimulatedPack * const p = calloc(1, sizeof(*p));
+    if ( p == 0 ) {
+      _sp_error("Out of memory.\n");
+      return 0;
+    }
+    p->address = address;
+    defaults(p);
+    packs[address] = p;
+  }
+  return packs[address];
+}
+
+static void
+put16(uint8_t b[2], unsigned int value)
+{
+  b[0] = (value >> 8) & 0xff;
+  b[1] = value & 0xff;
+}
+
+/* Convert to the BMS's fixed point: the value times scale, rounded. */
+static unsigned int
+fixed(float value, float scale)
+{
+  return (unsigned int)lrintf(value * scale) & 0xffff;
+}
+
+static unsigned int
+telemetry(const SimulatedPack * p, unsigned int pack, uint8_t * binary)
+{
+  Seplos_2_0_Telemetry_Binary * const t = (Seplos_2_0_Telemetry_Binary *)binary;
+  float total = 0.0;
+
+  memset(t, 0, sizeof(*t));
+  t->command_group = pack;
+  t->number_of_cells = SEPLOS_N_CELLS;
+  for ( unsigned int i = 0; i < SEPLOS_N_CELLS; i++ ) {
+    put16(t->cell_voltage[i], fixed(p->cell_voltage[i], 1000.0));
+    total += p->cell_voltage[i];
+  }
+  t->number_of_temperatures = SEPLOS_N_TEMPERATURES;
+  for ( unsigned int i = 0; i < SEPLOS_N_TEMPERATURES; i++ )
+    put16(t->temperature[i], fixed(p->temperature[i], 10.0) + 2731);
+
+  put16(t->charge_discharge_current, fixed(p->current, 100.0));
+  put16(t->total_battery_voltage, fixed(total, 100.0));
+  put16(t->residual_capacity, fixed(p->battery_capacity * p->state_of_charge / 100.0, 100.0));
+  t->number_of_custom_fields = 10;
+  put16(t->battery_capacity, fixed(p->battery_capacity, 100.0));
+  put16(t->state_of_charge, fixed(p->state_of_charge, 10.0));
+  put16(t->rated_capacity, fixed(p->rated_capacity, 100.0));
+  put16(t->number_of_cycles, p->number_of_cycles);
+  put16(t->state_of_health, fixed(p->state_of_health, 10.0));
+  put16(t->port_voltage, fixed(total, 100.0));
+
+  return sizeof(*t);
+}
+
+static unsigned int
+telecommand(const SimulatedPack * p, unsigned int pack, uint8_t * binary)
+{
+  Seplos_2_0_Telecommand_Binary * const c = (Seplos_2_0_Telecommand_Binary *)binary;
+
+  memset(c, 0, sizeof(*c));
+  c->command_group = pack;
+  c->number_of_cells = SEPLOS_N_CELLS;
+  memcpy(c->cell_alarm, p->cell_alarm, sizeof(c->cell_alarm));
+  c->number_of_temperatures = SEPLOS_N_TEMPERATURES;
+  memcpy(c->temperature_alarm, p->temperature_alarm, sizeof(c->temperature_alarm));
+  c->charge_discharge_current_alarm = p->charge_discharge_current_alarm;
+  c->total_battery_voltage_alarm = p->total_battery_voltage_alarm;
+  c->number_of_custom_alarms = 20;
+  memcpy(c->alarm_1_through_6, p->bit_alarm, sizeof(c->alarm_1_through_6));
+  c->on_off_state = p->on_off_state;
+  /* seplos_data() reads these two-byte fields low byte first. */
+  c->equilibrium_state[0] = p->equilibrium_state & 0xff;
+  c->equilibrium_state[1] = p->equilibrium_state >> 8;
+  c->system_state = p->system_state;
+  c->disconnection_state[0] = p->disconnection_state & 0xff;
+  c->disconnection_state[1] = p->disconnection_state >> 8;
+  c->alarm_7_and_8[0] = p->bit_alarm[6];
+  c->alarm_7_and_8[1] = p->bit_alarm[7];
+
+  return sizeof(*c);
+}
+
+/*
+ * Encode the reply of pack p to command into packet, which must have room for
+ * the largest packet. Returns the size of the packet.
+ */
+size_t
+simulator_reply(const SimulatedPack * p, unsigned int command, unsigned int pack, char * packet)
+{
+  uint8_t	binary[SEPLOS_BINARY_INFO_SIZE];
+  char		info[sizeof(binary) * 2];
+  unsigned int	length = 0;
+  unsigned int	status = NORMAL;
+
+  switch ( command ) {
+  case TELEMETRY_GET:
+    length = telemetry(p, pack, binary);
+    break;
+  case TELECOMMAND_GET:
+    length = telecommand(p, pack, binary);
+    break;
+  case PROTOCOL_VER_GET:
+    /* The version is in the header of the reply, there's no info. */
+    break;
+  default:
+    status = CID2_ERROR;
+    break;
+  }
+
+  for ( unsigned int i = 0; i < length; i++ )
+    _sp_hex2(binary[i], &(info[i * 2]));
+
+  return _sp_frame_encode((Seplos_2_0 *)packet, p->address, status, info, length * 2);
+}
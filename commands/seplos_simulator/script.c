@@ -0,0 +1,316 @@
+#include "./simulator_cmd.h"
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "internal.h"
+
+/*
+ * The script sets the state of the simulated packs. It's a text file of one
+ * command per line, '#' starts a comment:
+ *
+ *   pack ADDRESS			Following commands apply to this pack, created if need be
+ *   cell N VOLTS			Voltage of cell N
+ *   cells VOLTS			Voltage of every cell
+ *   temperature N CELSIUS		Temperature sensor N
+ *   temperatures CELSIUS		Every temperature sensor
+ *   current AMPS			Negative is discharge
+ *   soc PERCENT
+ *   soh PERCENT
+ *   capacity AH
+ *   rated AH
+ *   cycles N
+ *   cell-alarm N normal|low|high|other
+ *   temperature-alarm N normal|low|high|other
+ *   current-alarm normal|low|high|other
+ *   voltage-alarm normal|low|high|other
+ *   alarm N on|off			Bit alarm N, as in seplos_bit_alarm_names
+ *   balancing N on|off			Equilibrium of cell N
+ *   disconnected N on|off		Disconnection of cell N
+ *   switch N on|off			Bit N of the on-off state
+ *   state N on|off			Bit N of the system state
+ *   at SECONDS COMMAND ...		Run the command when SECONDS have passed since start-up
+ *
+ * Cells, sensors, and bits count from 0, as the seplos command shows them.
+ * Commands without "at" are run when the script is loaded. Timed commands
+ * apply to the pack that was current where they appear in the script.
+ */
+
+typedef struct _Event {
+  double	time;
+  unsigned int	address;
+  unsigned int	line;
+  char *	command;
+} Event;
+
+static Event *		events;
+static unsigned int	n_events;
+static unsigned int	next_event;
+static const char *	script_path;
+
+static int
+fail(unsigned int line, const char * message, const char * word)
+{
+  _sp_error("%s:%u: %s%s%s\n", script_path, line, message, word ? ": " : "", word ? word : "");
+  return -1;
+}
+
+static int
+index_of(const char * word, unsigned int limit, unsigned int line)
+{
+  char * end;
+  const unsigned long n = word ? strtoul(word, &end, 10) : 0;
+
+  if ( word == 0 || *word == '\0' || *end != '\0' || n >= limit ) {
+    fail(line, "Expected a number from 0 to one less than the count of the item", word);
+    return -1;
+  }
+  return n;
+}
+
+static int
+value_of(const char * word, float * value, unsigned int line)
+{
+  char * end;
+
+  if ( word == 0 || *word == '\0' || (*value = strtof(word, &end), *end != '\0') )
+    return fail(line, "Expected a number", word);
+  return 0;
+}
+
+static int
+switch_of(const char * word, unsigned int line)
+{
+  if ( word && strcmp(word, "on") == 0 )
+    return 1;
+  if ( word && strcmp(word, "off") == 0 )
+    return 0;
+  return fail(line, "Expected \"on\" or \"off\"", word);
+}
+
+static int
+alarm_of(const char * word, uint8_t * alarm, unsigned int line)
+{
+  if ( word && strcmp(word, "normal") == 0 )
+    *alarm = NORMAL;
+  else if ( word && strcmp(word, "low") == 0 )
+    *alarm = LOW_LIMIT_HIT;
+  else if ( word && strcmp(word, "high") == 0 )
+    *alarm = HIGH_LIMIT_HIT;
+  else if ( word && strcmp(word, "other") == 0 )
+    *alarm = OTHER_ALARM;
+  else
+    return fail(line, "Expected \"normal\", \"low\", \"high\", or \"other\"", word);
+  return 0;
+}
+
+/* Set or clear bit n of an array of bytes. */
+static void
+set_bit(uint8_t * bytes, unsigned int n, int on)
+{
+  if ( on )
+    bytes[n / 8] |= 1 << (n % 8);
+  else
+    bytes[n / 8] &= ~(1 << (n % 8));
+}
+
+static void
+set_bit16(uint16_t * word, unsigned int n, int on)
+{
+  if ( on )
+    *word |= 1 << n;
+  else
+    *word &= ~(1 << n);
+}
+
+/* Run one command, other than "pack" and "at", on pack p. */
+static int
+command(SimulatedPack * p, char * text, unsigned int line)
+{
+  char *	save;
+  const char *	name = strtok_r(text, " \t", &save);
+  const char *	a = strtok_r(0, " \t", &save);
+  const char *	b = strtok_r(0, " \t", &save);
+  int		n;
+  int		on;
+  float		value;
+
+  if ( strcmp(name, "cell") == 0 ) {
+    if ( (n = index_of(a, SEPLOS_N_CELLS, line)) < 0 || value_of(b, &value, line) < 0 )
+      return -1;
+    p->cell_voltage[n] = value;
+  }
+  else if ( strcmp(name, "cells") == 0 ) {
+    if ( value_of(a, &value, line) < 0 )
+      return -1;
+    for ( unsigned int i = 0; i < SEPLOS_N_CELLS; i++ )
+      p->cell_voltage[i] = value;
+  }
+  else if ( strcmp(name, "temperature") == 0 ) {
+    if ( (n = index_of(a, SEPLOS_N_TEMPERATURES, line)) < 0 || value_of(b, &value, line) < 0 )
+      return -1;
+    p->temperature[n] = value;
+  }
+  else if ( strcmp(name, "temperatures") == 0 ) {
+    if ( value_of(a, &value, line) < 0 )
+      return -1;
+    for ( unsigned int i = 0; i < SEPLOS_N_TEMPERATURES; i++ )
+      p->temperature[i] = value;
+  }
+  else if ( strcmp(name, "current") == 0 )
+    return value_of(a, &(p->current), line);
+  else if ( strcmp(name, "soc") == 0 )
+    return value_of(a, &(p->state_of_charge), line);
+  else if ( strcmp(name, "soh") == 0 )
+    return value_of(a, &(p->state_of_health), line);
+  else if ( strcmp(name, "capacity") == 0 )
+    return value_of(a, &(p->battery_capacity), line);
+  else if ( strcmp(name, "rated") == 0 )
+    return value_of(a, &(p->rated_capacity), line);
+  else if ( strcmp(name, "cycles") == 0 ) {
+    if ( value_of(a, &value, line) < 0 )
+      return -1;
+    p->number_of_cycles = value;
+  }
+  else if ( strcmp(name, "cell-alarm") == 0 ) {
+    if ( (n = index_of(a, SEPLOS_N_CELLS, line)) < 0 )
+      return -1;
+    return alarm_of(b, &(p->cell_alarm[n]), line);
+  }
+  else if ( strcmp(name, "temperature-alarm") == 0 ) {
+    if ( (n = index_of(a, SEPLOS_N_TEMPERATURES, line)) < 0 )
+      return -1;
+    return alarm_of(b, &(p->temperature_alarm[n]), line);
+  }
+  else if ( strcmp(name, "current-alarm") == 0 )
+    return alarm_of(a, &(p->charge_discharge_current_alarm), line);
+  else if ( strcmp(name, "voltage-alarm") == 0 )
+    return alarm_of(a, &(p->total_battery_voltage_alarm), line);
+  else if ( strcmp(name, "alarm") == 0 ) {
+    if ( (n = index_of(a, SEPLOS_N_BIT_ALARMS, line)) < 0 || (on = switch_of(b, line)) < 0 )
+      return -1;
+    set_bit(p->bit_alarm, n, on);
+  }
+  else if ( strcmp(name, "balancing") == 0 ) {
+    if ( (n = index_of(a, SEPLOS_N_CELLS, line)) < 0 || (on = switch_of(b, line)) < 0 )
+      return -1;
+    set_bit16(&(p->equilibrium_state), n, on);
+  }
+  else if ( strcmp(name, "disconnected") == 0 ) {
+    if ( (n = index_of(a, SEPLOS_N_CELLS, line)) < 0 || (on = switch_of(b, line)) < 0 )
+      return -1;
+    set_bit16(&(p->disconnection_state), n, on);
+  }
+  else if ( strcmp(name, "switch") == 0 ) {
+    if ( (n = index_of(a, 8, line)) < 0 || (on = switch_of(b, line)) < 0 )
+      return -1;
+    set_bit(&(p->on_off_state), n, on);
+  }
+  else if ( strcmp(name, "state") == 0 ) {
+    if ( (n = index_of(a, 8, line)) < 0 || (on = switch_of(b, line)) < 0 )
+      return -1;
+    set_bit(&(p->system_state), n, on);
+  }
+  else
+    return fail(line, "Unknown command", name);
+
+  return 0;
+}
+
+static int
+add_event(double time, unsigned int address, unsigned int line, const char * text)
+{
+  Event * const e = realloc(events, (n_events + 1) * sizeof(*e));
+  char * const copy = strdup(text);
+
+  if ( e == 0 || copy == 0 ) {
+    _sp_error("Out of memory.\n");
+    return -1;
+  }
+  events = e;
+  events[n_events++] = (Event){ time, address, line, copy };
+  return 0;
+}
+
+static int
+by_time(const void * a, const void * b)
+{
+  const Event * const e = a;
+  const Event * const f = b;
+
+  /* Events at the same time run in the order they appear in the script. */
+  if ( e->time != f->time )
+    return e->time < f->time ? -1 : 1;
+  return (int)e->line - (int)f->line;
+}
+
+int
+simulator_script_load(const char * path)
+{
+  FILE * const	f = fopen(path, "r");
+  char		text[1024];
+  unsigned int	line = 0;
+  unsigned int	address = 0;
+  int		status = 0;
+
+  if ( f == 0 ) {
+    _sp_error("%s: %s\n", path, strerror(errno));
+    return -1;
+  }
+  script_path = path;
+
+  while ( status == 0 && fgets(text, sizeof(text), f) ) {
+    char * s = text;
+    char * end;
+
+    line++;
+    if ( (end = strpbrk(s, "#\r\n")) != 0 )
+      *end = '\0';
+    s += strspn(s, " \t");
+    if ( *s == '\0' )
+      continue;
+
+    if ( strncmp(s, "pack", 4) == 0 && (s[4] == ' ' || s[4] == '\t') ) {
+      address = strtoul(s + 5, &end, 10);
+      if ( *(end + strspn(end, " \t")) != '\0' || simulator_pack(address, true) == 0 )
+        status = fail(line, "Expected an address from 0 to 255", s + 5);
+    }
+    else if ( strncmp(s, "at", 2) == 0 && (s[2] == ' ' || s[2] == '\t') ) {
+      const double time = strtod(s + 3, &end);
+      end += strspn(end, " \t");
+      if ( end == s + 3 || *end == '\0' || time < 0 )
+        status = fail(line, "Expected \"at SECONDS COMMAND\"", s);
+      else if ( simulator_pack(address, true) == 0 )
+        status = -1;
+      else
+        status = add_event(time, address, line, end);
+    }
+    else {
+      SimulatedPack * const p = simulator_pack(address, true);
+      status = p ? command(p, s, line) : -1;
+    }
+  }
+  fclose(f);
+
+  if ( events )
+    qsort(events, n_events, sizeof(*events), by_time);
+
+  /* Check the timed commands now, rather than failing when they come due. */
+  for ( unsigned int i = 0; status == 0 && i < n_events; i++ ) {
+    SimulatedPack scratch = *simulator_pack(events[i].address, false);
+    char * const copy = strdup(events[i].command);
+    status = copy ? command(&scratch, copy, events[i].line) : -1;
+    free(copy);
+  }
+  return status;
+}
+
+/* Run the timed commands that have come due by elapsed seconds since start-up. */
+void
+simulator_script_run(double elapsed)
+{
+  for ( ; next_event < n_events && events[next_event].time <= elapsed; next_event++ ) {
+    Event * const e = &(events[next_event]);
+    command(simulator_pack(e->address, false), e->command, e->line);
+  }
+}
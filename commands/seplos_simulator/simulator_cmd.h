@@ -0,0 +1,45 @@
+#include <stdbool.h>
+#include <argp.h>
+#include "seplos.h"
+
+extern const struct argp	argp;
+
+struct arguments
+{
+  const char *	script;	 /* File of commands that set the state of the packs */
+  const char *	link;	 /* Symbolic link to create to the PTY */
+  unsigned int	packs;	 /* Number of packs, at addresses 0 through packs - 1 */
+  unsigned int	latency; /* Milliseconds between a request and the start of its reply */
+  unsigned int	baud;	 /* Emulated bit rate of the bus, or 0 for no emulation */
+  bool		verbose; /* Log each request to stderr */
+};
+
+/*
+ * The state of one simulated battery pack, in the units that the script uses.
+ * It's converted to the BMS's fixed-point values when a reply is encoded.
+ */
+typedef struct _SimulatedPack {
+  unsigned int	address;
+  float		cell_voltage[SEPLOS_N_CELLS];	/* V */
+  float		temperature[SEPLOS_N_TEMPERATURES]; /* C */
+  float		current;			/* A, negative is discharge */
+  float		state_of_charge;		/* % */
+  float		battery_capacity;		/* AH */
+  float		rated_capacity;			/* AH */
+  unsigned int	number_of_cycles;
+  float		state_of_health;		/* % */
+  uint8_t	cell_alarm[SEPLOS_N_CELLS];
+  uint8_t	temperature_alarm[SEPLOS_N_TEMPERATURES];
+  uint8_t	charge_discharge_current_alarm;
+  uint8_t	total_battery_voltage_alarm;
+  uint8_t	bit_alarm[SEPLOS_N_BIT_ALARMS / 8];
+  uint8_t	on_off_state;
+  uint8_t	system_state;
+  uint16_t	equilibrium_state;
+  uint16_t	disconnection_state;
+} SimulatedPack;
+
+extern SimulatedPack *	simulator_pack(unsigned int address, bool create);
+extern size_t		simulator_reply(const SimulatedPack * p, unsigned int command, unsigned int pack, char * packet);
+extern int		simulator_script_load(const char * path);
+extern void		simulator_script_run(double elapsed);
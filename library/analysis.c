@@ -0,0 +1,276 @@
+#include "./internal.h"
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+
+/*
+ * Trends of the cells of a pack, over the history in its store: how far each
+ * cell sits from the others, how often the BMS balances it, its resistance,
+ * and how the state of health falls with the cycles.
+ *
+ * For each sample, the deviation of a cell is its voltage less the mean of the
+ * cells of the sample. The mean, RMS, and extremes of that over the history
+ * show a cell that is drifting away from the rest of the pack, long before it
+ * trips an alarm. Balancing is the share of the samples with the equilibrium
+ * bit of the cell set. A cell that the BMS is always balancing is one that it
+ * can't keep up with.
+ *
+ * The resistance is estimated from the steps in the current: where it changes
+ * by at least MINIMUM_STEP between two samples no more than MAXIMUM_STEP_TIME
+ * apart, the step in each cell voltage over the step in the current is a
+ * measure of the resistance of the cell, as it is at the sampling interval,
+ * rather than the AC resistance that a meter measures. It's the least-squares
+ * fit over all of the steps, sum(dV * dI) / sum(dI * dI), so that the many
+ * small steps count for less than the few large ones that the resolution of
+ * the voltages can resolve.
+ *
+ * The work is in the columns of the store, where they are, a span of up to
+ * ANALYSIS_SPAN samples at a time: all of the voltages of cell 0, then of cell
+ * 1, and so on. The deviations and steps are integers, and the kernel that
+ * sums them runs across the samples, 8 at a time, with AVX2 where the CPU has
+ * it. The balancing runs across the 16 cells of a sample at a time. The AVX2
+ * kernel must return exactly what the scalar one does.
+ */
+
+/* Of the current, 0.01 A */
+#define	MINIMUM_STEP		200
+#define	MAXIMUM_STEP_TIME	10000000LL	/* Microseconds */
+
+static void	analyze_scalar(const AnalysisSpan * s, unsigned int count, AnalysisSums * sums);
+static void	analyze_select(const AnalysisSpan * s, unsigned int count, AnalysisSums * sums);
+
+static void	(*analyze)(const AnalysisSpan *, unsigned int, AnalysisSums *) = analyze_select;
+
+void
+_sp_analyze_scalar(const AnalysisSpan * s, unsigned int from, unsigned int to, AnalysisSums * sums)
+{
+  const unsigned int n = s->number_of_cells;
+
+  for ( unsigned int t = from; t < to; t++ ) {
+    const int32_t	step = s->steps[t];
+    const uint16_t	equilibrium = s->equilibrium[t];
+    int32_t		total = 0;
+
+    for ( unsigned int c = 0; c < n; c++ )
+      total += s->cells[c][t];
+
+    for ( unsigned int c = 0; c < n; c++ ) {
+      const int32_t v = s->cells[c][t];
+      const int32_t before = t > 0 ? s->cells[c][t - 1] : s->previous[c];
+      const int32_t d = ((int32_t)n * v) - total;
+
+      sums->deviation[c] += d;
+      sums->squares[c] += (int64_t)d * d;
+      if ( d < sums->lowest[c] )
+        sums->lowest[c] = d;
+      if ( d > sums->highest[c] )
+        sums->highest[c] = d;
+      sums->products[c] += (int64_t)(v - before) * step;
+    }
+    for ( unsigned int c = 0; c < SEPLOS_N_CELLS; c++ )
+      sums->balancing[c] += (equilibrium >> c) & 1;
+  }
+}
+
+static void
+analyze_scalar(const AnalysisSpan * s, unsigned int count, AnalysisSums * sums)
+{
+  _sp_analyze_scalar(s, 0, count, sums);
+}
+
+/*
+ * On the first call, select the fastest kernel that this CPU supports. They
+ * all return the same sums, so it doesn't matter if two threads race.
+ */
+static void
+analyze_select(const AnalysisSpan * s, unsigned int count, AnalysisSums * sums)
+{
+  analyze = analyze_scalar;
+#if defined(__x86_64__) || defined(__i386__)
+  if ( __builtin_cpu_supports("avx2") )
+    analyze = _sp_analyze_avx2;
+#endif
+  analyze(s, count, sums);
+}
+
+/* Add the sums of a span of count samples to sums, which must be initialized. */
+void
+_sp_analyze(const AnalysisSpan * s, unsigned int count, AnalysisSums * sums)
+{
+  analyze(s, count, sums);
+}
+
+/* The first sample of the block at or after timestamp, or count if there's none. */
+static unsigned int
+find(const int64_t * times, unsigned int from, unsigned int count, int64_t timestamp)
+{
+  unsigned int low = from;
+  unsigned int high = count;
+
+  while ( low < high ) {
+    const unsigned int middle = low + ((high - low) / 2);
+    if ( times[middle] < timestamp )
+      low = middle + 1;
+    else
+      high = middle;
+  }
+  return low;
+}
+
+/*
+ * Analyze the samples of the store from timestamp from, up to but not
+ * including to. 0 and INT64_MAX are the whole history.
+ */
+int
+seplos_analyze(SeplosStore * s, int64_t from, int64_t to, SeplosAnalysis * a)
+{
+  const uint64_t	samples = seplos_store_samples(s);
+  const unsigned int	per_block = seplos_store_block_samples(s);
+  uint64_t		sample = seplos_store_find(s, from);
+  SeplosData		m;
+  int64_t		timestamp;
+  double		deviation[SEPLOS_N_CELLS] = {};
+  double		squares[SEPLOS_N_CELLS] = {};
+  int32_t		lowest[SEPLOS_N_CELLS];
+  int32_t		highest[SEPLOS_N_CELLS];
+  int64_t		balancing[SEPLOS_N_CELLS] = {};
+  double		products[SEPLOS_N_CELLS] = {};
+  double		step_squares = 0;
+  /* Of the fit of the state of health to the cycles, from the first sample. */
+  double		x = 0, y = 0, xx = 0, xy = 0;
+  int16_t		steps[ANALYSIS_SPAN];
+  AnalysisSpan		span = {};
+  bool			has_previous = false;
+  int64_t		previous_time = 0;
+  int32_t		previous_current = 0;
+  uint16_t		first_health = 0;
+
+  memset(a, 0, sizeof(*a));
+  if ( sample >= samples )
+    return 0;
+  if ( seplos_store_read(s, 0, &timestamp, &m) != 0 )
+    return -1;
+
+  const unsigned int n = m.number_of_cells < SEPLOS_N_CELLS ? m.number_of_cells : SEPLOS_N_CELLS;
+  a->controller_address = m.controller_address;
+  a->battery_pack_number = m.battery_pack_number;
+  a->number_of_cells = n;
+  span.number_of_cells = n;
+  span.steps = steps;
+  for ( unsigned int c = 0; c < SEPLOS_N_CELLS; c++ ) {
+    lowest[c] = INT32_MAX;
+    highest[c] = INT32_MIN;
+  }
+
+  while ( sample < samples ) {
+    const uint64_t	block = sample / per_block;
+    unsigned int	count;
+    const int64_t * const times = seplos_store_column(s, block, SEPLOS_COLUMN_TIMESTAMP, &count);
+
+    if ( times == 0 )
+      break;
+    const unsigned int begin = sample % per_block;
+    const unsigned int end = times[count - 1] < to ? count : find(times, begin, count, to);
+    if ( begin >= end )
+      break;
+
+    const int16_t * const current = seplos_store_column(s, block, SEPLOS_COLUMN_CURRENT, &count);
+    const uint16_t * const equilibrium = seplos_store_column(s, block, SEPLOS_COLUMN_EQUILIBRIUM, &count);
+    const uint16_t * const cycles = seplos_store_column(s, block, SEPLOS_COLUMN_CYCLES, &count);
+    const uint16_t * const health = seplos_store_column(s, block, SEPLOS_COLUMN_STATE_OF_HEALTH, &count);
+
+    if ( a->samples == 0 ) {
+      a->first = times[begin];
+      a->first_cycles = cycles[begin];
+      first_health = health[begin];
+      a->first_state_of_health = first_health / 10.0;
+    }
+
+    for ( unsigned int start = begin; start < end; start += ANALYSIS_SPAN ) {
+      const unsigned int length = end - start < ANALYSIS_SPAN ? end - start : ANALYSIS_SPAN;
+      int64_t span_x = 0, span_y = 0, span_xx = 0, span_xy = 0, span_steps = 0;
+      AnalysisSums sums = {};
+
+      for ( unsigned int c = 0; c < n; c++ ) {
+        span.cells[c] = (const uint16_t *)seplos_store_column(s, block, SEPLOS_COLUMN_CELL_VOLTAGE + c, &count) + start;
+        span.previous[c] = has_previous ? span.previous[c] : span.cells[c][0];
+      }
+      span.equilibrium = equilibrium + start;
+
+      for ( unsigned int t = 0; t < length; t++ ) {
+        const int64_t	interval = times[start + t] - previous_time;
+        int32_t		step = current[start + t] - previous_current;
+
+        if ( !has_previous || interval <= 0 || interval > MAXIMUM_STEP_TIME || abs(step) < MINIMUM_STEP )
+          step = 0;
+        else if ( step > INT16_MAX || step < -INT16_MAX )
+          step = step > 0 ? INT16_MAX : -INT16_MAX;
+        steps[t] = step;
+        a->steps += step != 0;
+        span_steps += step * step;
+        previous_time = times[start + t];
+        previous_current = current[start + t];
+        has_previous = true;
+
+        const int64_t dx = cycles[start + t] - (int64_t)a->first_cycles;
+        const int64_t dy = health[start + t] - (int64_t)first_health;
+        span_x += dx;
+        span_y += dy;
+        span_xx += dx * dx;
+        span_xy += dx * dy;
+      }
+
+      for ( unsigned int c = 0; c < SEPLOS_N_CELLS; c++ ) {
+        sums.lowest[c] = INT32_MAX;
+        sums.highest[c] = INT32_MIN;
+      }
+      _sp_analyze(&span, length, &sums);
+
+      for ( unsigned int c = 0; c < SEPLOS_N_CELLS; c++ ) {
+        deviation[c] += sums.deviation[c];
+        squares[c] += sums.squares[c];
+        if ( sums.lowest[c] < lowest[c] )
+          lowest[c] = sums.lowest[c];
+        if ( sums.highest[c] > highest[c] )
+          highest[c] = sums.highest[c];
+        balancing[c] += sums.balancing[c];
+        products[c] += sums.products[c];
+      }
+      step_squares += span_steps;
+      x += span_x;
+      y += span_y;
+      xx += span_xx;
+      xy += span_xy;
+      for ( unsigned int c = 0; c < n; c++ )
+        span.previous[c] = span.cells[c][length - 1];
+      a->samples += length;
+    }
+
+    a->last = times[end - 1];
+    a->last_cycles = cycles[end - 1];
+    a->last_state_of_health = health[end - 1] / 10.0;
+    if ( end < count )
+      break;
+    sample = (block + 1) * per_block;
+  }
+
+  if ( a->samples == 0 || n == 0 )
+    return 0;
+
+  const double samples_analyzed = a->samples;
+  for ( unsigned int c = 0; c < n; c++ ) {
+    a->mean_deviation[c] = deviation[c] / samples_analyzed / n;
+    a->rms_deviation[c] = sqrt(squares[c] / samples_analyzed) / n;
+    a->lowest_deviation[c] = (float)lowest[c] / n;
+    a->highest_deviation[c] = (float)highest[c] / n;
+    a->balancing[c] = (100.0 * balancing[c]) / samples_analyzed;
+    /* mV / 0.01 A is 100 mOhm. */
+    a->resistance[c] = step_squares > 0 ? (100.0 * products[c]) / step_squares : 0;
+  }
+
+  /* The slope of the least-squares line of the state of health over the cycles. */
+  const double spread = (samples_analyzed * xx) - (x * x);
+  if ( spread > 0 )
+    a->state_of_health_per_100_cycles = 100 * (((samples_analyzed * xy) - (x * y)) / spread) / 10.0;
+  return 0;
+}
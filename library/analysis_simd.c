@@ -0,0 +1,143 @@
+#include "./internal.h"
+
+/*
+ * The AVX2 version of the kernel of analysis.c, selected at run time if the
+ * CPU supports it. It must return exactly the sums of _sp_analyze_scalar(), for
+ * every input.
+ *
+ * The deviations and the steps run across the samples, 8 at a time, each in a
+ * 32-bit lane: the voltages of 8 samples of each cell are loaded from the
+ * columns, added up across the cells, and then each cell is compared to the
+ * total. The squares and products are summed in 64-bit lanes, the even and odd
+ * lanes of each vector separately, since there's no 32 x 32 bit multiply to 64
+ * bits for all 8 lanes. The sums of the deviations stay in 32 bits, which holds
+ * them for ANALYSIS_SPAN samples.
+ *
+ * The balancing runs across the 16 cells, in 16-bit lanes, one sample at a
+ * time: the equilibrium bits of the sample in every lane, each compared with
+ * the bit of its cell.
+ */
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+
+typedef struct _Lanes {
+  __m256i	deviation[SEPLOS_N_CELLS];
+  __m256i	squares[SEPLOS_N_CELLS];
+  __m256i	lowest[SEPLOS_N_CELLS];
+  __m256i	highest[SEPLOS_N_CELLS];
+  __m256i	products[SEPLOS_N_CELLS];
+} Lanes;
+
+/* The products of the even and of the odd 32-bit lanes, added in 64 bits. */
+__attribute__((target("avx2")))
+static inline __m256i
+multiply_add(__m256i sum, __m256i a, __m256i b)
+{
+  const __m256i even = _mm256_mul_epi32(a, b);
+  const __m256i odd = _mm256_mul_epi32(_mm256_srli_epi64(a, 32), _mm256_srli_epi64(b, 32));
+
+  return _mm256_add_epi64(sum, _mm256_add_epi64(even, odd));
+}
+
+/*
+ * Samples from..to, which must be whole vectors, and from must be at least 1.
+ * Inlined with n constant for the usual 16 cells, so the loops over the cells
+ * unroll and the voltages stay in registers.
+ */
+__attribute__((target("avx2"), always_inline))
+static inline void
+samples(const AnalysisSpan * s, unsigned int n, unsigned int from, unsigned int to, Lanes * l)
+{
+  const __m256i cells = _mm256_set1_epi32(n);
+
+  for ( unsigned int t = from; t < to; t += 8 ) {
+    __m256i	v[SEPLOS_N_CELLS];
+    __m256i	total = _mm256_setzero_si256();
+
+    for ( unsigned int c = 0; c < n; c++ ) {
+      v[c] = _mm256_cvtepu16_epi32(_mm_loadu_si128((const __m128i *)(s->cells[c] + t)));
+      total = _mm256_add_epi32(total, v[c]);
+    }
+    const __m256i step = _mm256_cvtepi16_epi32(_mm_loadu_si128((const __m128i *)(s->steps + t)));
+
+    for ( unsigned int c = 0; c < n; c++ ) {
+      const __m256i before = _mm256_cvtepu16_epi32(_mm_loadu_si128((const __m128i *)(s->cells[c] + t - 1)));
+      const __m256i d = _mm256_sub_epi32(_mm256_mullo_epi32(v[c], cells), total);
+
+      l->deviation[c] = _mm256_add_epi32(l->deviation[c], d);
+      l->squares[c] = multiply_add(l->squares[c], d, d);
+      l->lowest[c] = _mm256_min_epi32(l->lowest[c], d);
+      l->highest[c] = _mm256_max_epi32(l->highest[c], d);
+      l->products[c] = multiply_add(l->products[c], _mm256_sub_epi32(v[c], before), step);
+    }
+  }
+}
+
+__attribute__((target("avx2")))
+void
+_sp_analyze_avx2(const AnalysisSpan * s, unsigned int count, AnalysisSums * sums)
+{
+  const unsigned int	n = s->number_of_cells;
+  /* The first sample is compared with previous, rather than the sample before it. */
+  const unsigned int	from = count < 1 ? count : 1;
+  const unsigned int	to = from + ((count - from) & ~7U);
+  Lanes			l;
+
+  for ( unsigned int c = 0; c < SEPLOS_N_CELLS; c++ ) {
+    l.deviation[c] = _mm256_setzero_si256();
+    l.squares[c] = _mm256_setzero_si256();
+    l.lowest[c] = _mm256_set1_epi32(INT32_MAX);
+    l.highest[c] = _mm256_set1_epi32(INT32_MIN);
+    l.products[c] = _mm256_setzero_si256();
+  }
+  if ( n == SEPLOS_N_CELLS )
+    samples(s, SEPLOS_N_CELLS, from, to, &l);
+  else
+    samples(s, n, from, to, &l);
+
+  for ( unsigned int c = 0; c < n; c++ ) {
+    int32_t	deviation[8];
+    int64_t	squares[4];
+    int32_t	lowest[8];
+    int32_t	highest[8];
+    int64_t	products[4];
+
+    _mm256_storeu_si256((__m256i *)deviation, l.deviation[c]);
+    _mm256_storeu_si256((__m256i *)squares, l.squares[c]);
+    _mm256_storeu_si256((__m256i *)lowest, l.lowest[c]);
+    _mm256_storeu_si256((__m256i *)highest, l.highest[c]);
+    _mm256_storeu_si256((__m256i *)products, l.products[c]);
+    for ( unsigned int i = 0; i < 8; i++ ) {
+      sums->deviation[c] += deviation[i];
+      if ( lowest[i] < sums->lowest[c] )
+        sums->lowest[c] = lowest[i];
+      if ( highest[i] > sums->highest[c] )
+        sums->highest[c] = highest[i];
+    }
+    for ( unsigned int i = 0; i < 4; i++ ) {
+      sums->squares[c] += squares[i];
+      sums->products[c] += products[i];
+    }
+  }
+
+  /* The balancing of the same samples, a cell in each 16-bit lane. */
+  const __m256i	bits = _mm256_setr_epi16(
+   0x0001, 0x0002, 0x0004, 0x0008, 0x0010, 0x0020, 0x0040, 0x0080,
+   0x0100, 0x0200, 0x0400, 0x0800, 0x1000, 0x2000, 0x4000, (short)0x8000);
+  __m256i	balancing = _mm256_setzero_si256();
+  uint16_t	counts[SEPLOS_N_CELLS];
+
+  for ( unsigned int t = from; t < to; t++ ) {
+    const __m256i e = _mm256_and_si256(_mm256_set1_epi16(s->equilibrium[t]), bits);
+    /* A set bit compares to -1, so subtracting counts it. */
+    balancing = _mm256_sub_epi16(balancing, _mm256_cmpeq_epi16(e, bits));
+  }
+  _mm256_storeu_si256((__m256i *)counts, balancing);
+  for ( unsigned int c = 0; c < SEPLOS_N_CELLS; c++ )
+    sums->balancing[c] += counts[c];
+
+  _sp_analyze_scalar(s, 0, from, sums);
+  _sp_analyze_scalar(s, to, count, sums);
+}
+#endif
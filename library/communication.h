@@ -37,6 +37,54 @@ typedef struct _Seplos_2_0_Telecommand {
   uint8_t	reserved[6][2];
 } Seplos_2_0_Telecommand;
 
+/*
+ * The same layouts after the info field has been converted from ASCII
+ * hexidecimal to binary. Each field is half of the length of the ASCII field.
+ * 16-bit values are big-endian, read them with _sp_be16().
+ */
+typedef struct _Seplos_2_0_Telemetry_Binary {
+  uint8_t	data_flag;
+  uint8_t	command_group;
+  uint8_t	number_of_cells;
+  uint8_t	cell_voltage[16][2];
+  uint8_t	number_of_temperatures;
+  uint8_t	temperature[6][2];
+  uint8_t	charge_discharge_current[2];
+  uint8_t	total_battery_voltage[2];
+  uint8_t	residual_capacity[2];
+  uint8_t	number_of_custom_fields;
+  uint8_t	battery_capacity[2];
+  uint8_t	state_of_charge[2];
+  uint8_t	rated_capacity[2];
+  uint8_t	number_of_cycles[2];
+  uint8_t	state_of_health[2];
+  uint8_t	port_voltage[2];
+  uint8_t	reserved[4][2];
+} Seplos_2_0_Telemetry_Binary;
+
+typedef struct _Seplos_2_0_Telecommand_Binary {
+  uint8_t	data_flag;
+  uint8_t	command_group;
+  uint8_t	number_of_cells;
+  uint8_t	cell_alarm[16];
+  uint8_t	number_of_temperatures;
+  uint8_t	temperature_alarm[6];
+  uint8_t	charge_discharge_current_alarm;
+  uint8_t	total_battery_voltage_alarm;
+  uint8_t	number_of_custom_alarms;
+  uint8_t	alarm_1_through_6[6];
+  uint8_t	on_off_state;
+  uint8_t	equilibrium_state[2];
+  uint8_t	system_state;
+  uint8_t	disconnection_state[2];
+  uint8_t	alarm_7_and_8[2];
+  uint8_t	reserved[6];
+} Seplos_2_0_Telecommand_Binary;
+
+/* The binary info field, and the overall checksum that follows it. */
+#define SEPLOS_BINARY_INFO_SIZE	((4095 / 2) + 2)
+
+
 typedef struct _Seplos_2_0 {
   char  start;      /* Always '~' */
   char  version[2]; /* Always '2', '0' for protocol version 2.0 */
@@ -51,6 +99,68 @@ typedef struct _Seplos_2_0 {
   };
 } Seplos_2_0;
 
+/* Results of _sp_header_decode() and _sp_info_decode(). */
+enum _sp_frame_error {
+  FRAME_VALID = 0,
+  FRAME_NO_START,		/* The packet doesn't start with '~' */
+  FRAME_NOT_HEXIDECIMAL,	/* A character that should be hexidecimal isn't */
+  FRAME_VERSION,		/* The major protocol version isn't 2 */
+  FRAME_LENGTH_CHECKSUM,	/* The length checksum doesn't match the length */
+  FRAME_ODD_LENGTH,		/* The info field isn't whole pairs of characters */
+  FRAME_TOO_SHORT,		/* Fewer characters than the length calls for */
+  FRAME_CHECKSUM		/* The overall checksum doesn't match */
+};
+
+/*
+ * A view of a whole packet, from the '~' through the '\r'. When it comes from
+ * _sp_receive_frame(), it points into the connection's receive buffer, and is
+ * only valid until the next receive on that connection.
+ */
+typedef struct _Seplos_2_0_Frame {
+  const Seplos_2_0 *	packet;
+  size_t		size;
+} Seplos_2_0_Frame;
+
+/* A reply after validation and conversion to binary. */
+typedef struct _Seplos_2_0_Reply {
+  Seplos_2_0_Frame	frame;
+  Seplos_2_0_Binary	header;
+  uint8_t		info[SEPLOS_BINARY_INFO_SIZE];
+} Seplos_2_0_Reply;
+
+/*
+ * The largest packet is 18 bytes of header, checksum and '\r', and 4095 of info.
+ * The receive buffer holds two of them, so that there is always room to finish
+ * receiving a packet after moving its start to the start of the buffer.
+ */
+#define SEPLOS_MAX_PACKET	(18 + 4095)
+#define SEPLOS_RECEIVE_BUFFER	(SEPLOS_MAX_PACKET * 2)
+
+/*
+ * The state kept for each open serial device. Received characters go into
+ * buffer at tail, and packets are parsed in place starting at head. Once
+ * everything received has been parsed, head and tail go back to the start of
+ * the buffer, so in the usual exchange of one request and one reply, nothing is
+ * ever copied or cleared. transmit holds a request while it's being encoded.
+ * outstanding and clean are used by _sp_bms_send() and _sp_bms_receive().
+ */
+typedef struct _SeplosConnection {
+  seplos_device	fd;
+  size_t	head;
+  size_t	tail;
+  unsigned int	outstanding;	/* Requests sent, whose replies haven't been received */
+  bool		clean;		/* The receiver is known to be in step with the BMS */
+  SeplosLinkStatistics statistics;
+  char		buffer[SEPLOS_RECEIVE_BUFFER];
+  Seplos_2_0	transmit;
+} SeplosConnection;
+
+static inline uint16_t
+_sp_be16(const uint8_t b[2])
+{
+  return (b[0] << 8) | b[1];
+}
+
 extern int
 _sp_bms_command(
  seplos_device	       fd,
@@ -58,4 +168,24 @@ _sp_bms_command(
  const unsigned int    command,
  const void * restrict info,
  const unsigned int    info_length,
- Seplos_2_0 *	       result);
+ Seplos_2_0_Reply *    reply);
+
+extern int	_sp_bms_receive(SeplosConnection * c, int64_t deadline, Seplos_2_0_Reply * reply);
+extern int
+_sp_bms_send(
+ SeplosConnection *    c,
+ const unsigned int    address,
+ const unsigned int    command,
+ const void * restrict info,
+ const unsigned int    info_length);
+
+extern SeplosConnection *	_sp_connection(seplos_device fd);
+extern void	_sp_connection_close(seplos_device fd);
+extern void	_sp_connection_discard(SeplosConnection * c);
+extern int	_sp_receive_frame(SeplosConnection * c, int64_t deadline, Seplos_2_0_Reply * reply);
+
+extern const char *	_sp_frame_error_message(int error);
+extern size_t	_sp_frame_encode(Seplos_2_0 * encoded, unsigned int address, unsigned int function, const void * restrict info, unsigned int info_length);
+extern int	_sp_frame_decode(const Seplos_2_0 * frame, size_t size, Seplos_2_0_Reply * reply);
+extern int	_sp_header_decode(const Seplos_2_0 * frame, Seplos_2_0_Binary * header);
+extern int	_sp_info_decode(const Seplos_2_0 * frame, const Seplos_2_0_Binary * header, uint8_t * binary);
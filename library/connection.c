@@ -0,0 +1,200 @@
+#include <errno.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include "./internal.h"
+#include "./communication.h"
+
+/*
+ * Connections are found by their file descriptor, so that seplos_device can
+ * remain a plain descriptor in the API. The table is only changed when a
+ * connection is opened or closed, but is locked for lookups as well, because
+ * growing it moves it.
+ */
+static pthread_mutex_t		lock = PTHREAD_MUTEX_INITIALIZER;
+static SeplosConnection * *	connections = 0;
+static size_t			n_connections = 0;
+
+/*
+ * Get the connection state for fd, creating it if this is the first use. A
+ * descriptor that the caller opened without seplos_open() gets its state here.
+ */
+SeplosConnection *
+_sp_connection(seplos_device fd)
+{
+  SeplosConnection * c = 0;
+
+  if ( fd < 0 )
+    return 0;
+
+  pthread_mutex_lock(&lock);
+
+  if ( (size_t)fd >= n_connections ) {
+    const size_t size = fd + 16;
+    SeplosConnection * * const table = realloc(connections, size * sizeof(*table));
+    if ( table == 0 ) {
+      pthread_mutex_unlock(&lock);
+      _sp_error("Out of memory.\n");
+      return 0;
+    }
+    memset(table + n_connections, 0, (size - n_connections) * sizeof(*table));
+    connections = table;
+    n_connections = size;
+  }
+
+  if ( (c = connections[fd]) == 0 ) {
+    /* Not calloc: the buffers are written before they are read. */
+    if ( (c = malloc(sizeof(*c))) != 0 ) {
+      c->fd = fd;
+      c->head = c->tail = 0;
+      c->outstanding = 0;
+      c->clean = false;
+      memset(&(c->statistics), 0, sizeof(c->statistics));
+      connections[fd] = c;
+    }
+    else
+      _sp_error("Out of memory.\n");
+  }
+
+  pthread_mutex_unlock(&lock);
+  return c;
+}
+
+void
+_sp_connection_close(seplos_device fd)
+{
+  pthread_mutex_lock(&lock);
+  if ( fd >= 0 && (size_t)fd < n_connections ) {
+    free(connections[fd]);
+    connections[fd] = 0;
+  }
+  pthread_mutex_unlock(&lock);
+}
+
+/* Throw away anything received, and any pending I/O in the driver. */
+void
+_sp_connection_discard(SeplosConnection * c)
+{
+  c->head = c->tail = 0;
+  _sp_discard_serial_input(c->fd);
+}
+
+/*
+ * Make sure that at least size characters have been received after head.
+ * Returns 0, or the failure of _sp_read_serial().
+ */
+static int
+fill(SeplosConnection * c, size_t size, int64_t deadline)
+{
+  if ( c->head + size > sizeof(c->buffer) ) {
+    /* The rest of the packet won't fit. Move the part received to the start. */
+    memmove(c->buffer, c->buffer + c->head, c->tail - c->head);
+    c->tail -= c->head;
+    c->head = 0;
+  }
+
+  while ( c->tail - c->head < size ) {
+    const int ret = _sp_read_serial(c->fd, c->buffer + c->tail, sizeof(c->buffer) - c->tail, deadline);
+    if ( ret < 0 )
+      return ret;
+    c->tail += ret;
+  }
+  return 0;
+}
+
+/*
+ * Receive one packet, validate it, and convert it to binary. reply->frame is
+ * a view of the packet in the receive buffer: it isn't copied anywhere.
+ *
+ * This is a resynchronizing parser for a noisy line. Characters before a '~'
+ * are discarded. The header, and its length checksum, are checked before
+ * waiting for the rest of the packet, so a corrupted length can't make the
+ * receiver wait for thousands of characters that aren't coming. After a bad
+ * header or packet, the search for '~' starts again at the character after
+ * the bad packet's '~', so a good packet that follows noise is still found.
+ */
+int
+_sp_receive_frame(SeplosConnection * c, int64_t deadline, Seplos_2_0_Reply * reply)
+{
+  SeplosLinkStatistics * const s = &(c->statistics);
+  int last_error = FRAME_VALID;
+  int failure;
+
+  for ( ; ; ) {
+    if ( c->head < c->tail ) {
+      const char * const start = memchr(c->buffer + c->head, '~', c->tail - c->head);
+      const size_t skip = start ? (size_t)(start - (c->buffer + c->head)) : c->tail - c->head;
+
+      s->noise += skip;
+      c->head += skip;
+    }
+    if ( c->head == c->tail )
+      c->head = c->tail = 0;
+
+    /*
+     * There should always be at least 18 bytes in a properly-formed packet, but
+     * 13 are enough to validate the header.
+     * Timeout of the read here is an unusual event, and likely means that the BMC got
+     * unplugged or went into hibernation.
+     */
+    if ( (failure = fill(c, 1, deadline)) != 0 )
+      break;
+    if ( c->buffer[c->head] != '~' )
+      continue; /* Noise arrived, go back and skip it. */
+
+    if ( (failure = fill(c, 13, deadline)) != 0 )
+      break;
+
+    const int header_error = _sp_header_decode((const Seplos_2_0 *)(c->buffer + c->head), &(reply->header));
+    if ( header_error != FRAME_VALID ) {
+      s->bad_headers++;
+      last_error = header_error;
+      c->head++;
+      continue;
+    }
+
+    const size_t size = reply->header.length + 18;
+
+    if ( (failure = fill(c, size, deadline)) != 0 )
+      break;
+
+    const Seplos_2_0 * const packet = (const Seplos_2_0 *)(c->buffer + c->head);
+
+    /* Validation and conversion of the info field and checksum are one pass. */
+    const int info_error = _sp_info_decode(packet, &(reply->header), reply->info);
+    if ( info_error != FRAME_VALID ) {
+      s->bad_packets++;
+      last_error = info_error;
+      c->head++;
+      continue;
+    }
+
+    s->packets++;
+    reply->frame.packet = packet;
+    reply->frame.size = size;
+
+    c->head += size;
+    if ( c->head == c->tail )
+      c->head = c->tail = 0;
+
+    return 0;
+  }
+
+  if ( failure == SERIAL_TIMED_OUT )
+    s->timeouts++;
+  if ( last_error != FRAME_VALID )
+    _sp_error("No valid reply. The last bad packet was: %s.\n", _sp_frame_error_message(last_error));
+  return -1;
+}
+
+int
+seplos_link_statistics(seplos_device fd, SeplosLinkStatistics * statistics)
+{
+  SeplosConnection * const c = _sp_connection(fd);
+
+  if ( c == 0 )
+    return -1;
+
+  *statistics = c->statistics;
+  return 0;
+}
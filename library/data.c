@@ -1,54 +1,22 @@
+#include <string.h>
 #include "./internal.h"
 #include "./communication.h"
 
-int
-seplos_data(seplos_device fd, unsigned int address, unsigned int pack, SeplosData * m)
-{
-  Seplos_2_0	telemetry = {};
-  Seplos_2_0	telecommand = {};
-  uint8_t	pack_info[2];
-  bool		invalid;
-
-  _sp_hex2(pack, pack_info);
-
-  int status = _sp_bms_command(
-   fd,
-   address,		/* Address */
-   TELEMETRY_GET,	/* command */
-   &pack_info,		/* pack number */
-   sizeof(pack_info),	/* length of the above */
-   &telemetry);
-
-  if ( status != NORMAL ) {
-    _sp_error("Bad response %x from SEPLOS BMS.\n", status);
-    return -1;
-  }
-
-  status = _sp_bms_command(
-   fd,
-   address,		/* Address */
-   TELECOMMAND_GET,	/* command */
-   &pack_info,		/* pack number */
-   sizeof(pack_info),	/* length of the above */
-   &telecommand);
+/*
+ * The decoders work from the binary info field, which _sp_bms_command() has
+ * already validated and converted from hexidecimal in one pass. Field access is
+ * then a byte load, or two for a 16-bit value.
+ */
 
-  if ( status != 0 ) {
-    _sp_error("Bad response %x from SEPLOS BMS.\n", status);
-    return -1;
-  }
-
-  const Seplos_2_0_Telemetry const * t = &(telemetry.telemetry);
-  const Seplos_2_0_Telecommand const * c = &(telecommand.telecommand);
-
-  m->controller_address = address;
-  m->battery_pack_number = pack;
-
-  m->number_of_cells = _sp_hex2b(t->number_of_cells, &invalid);
+static void
+decode_telemetry(const Seplos_2_0_Telemetry_Binary * t, SeplosData * m)
+{
+  m->number_of_cells = t->number_of_cells;
 
   m->lowest_cell_voltage = 1000.0;
   m->highest_cell_voltage = -1000.0;
-  for ( int i = 0; i < 16; i++ ) {
-    const float value = _sp_hex4b(t->cell_voltage[i], &invalid) / 1000.0;
+  for ( int i = 0; i < SEPLOS_N_CELLS; i++ ) {
+    const float value = _sp_be16(t->cell_voltage[i]) / 1000.0;
     m->cell_voltage[i] = value;
     if ( value > m->highest_cell_voltage )
       m->highest_cell_voltage = value;
@@ -58,8 +26,8 @@ seplos_data(seplos_device fd, unsigned int address, unsigned int pack, SeplosDat
 
   m->lowest_temperature = 1000.0;
   m->highest_temperature = -1000.0;
-  for ( int i = 0; i < 6; i++ ) {
-    const float value = (_sp_hex4b(t->temperature[i], &invalid) - 2731) / 10.0;
+  for ( int i = 0; i < SEPLOS_N_TEMPERATURES; i++ ) {
+    const float value = (_sp_be16(t->temperature[i]) - 2731) / 10.0;
     m->temperature[i] = value;
     if ( value > m->highest_temperature )
       m->highest_temperature = value;
@@ -68,128 +36,283 @@ seplos_data(seplos_device fd, unsigned int address, unsigned int pack, SeplosDat
   }
 
   /* Charge-discharge current is a twos-complement number. */
-  int current = _sp_hex4b(t->charge_discharge_current, &invalid);
-  if ( current & 0x8000 )
-    m->charge_discharge_current = (~current) / -100.0;
-  else
-    m->charge_discharge_current = current / 100.0;
-
-  m->total_battery_voltage = _sp_hex4b(t->total_battery_voltage, &invalid) / 100.0;
-  m->residual_capacity = _sp_hex4b(t->residual_capacity, &invalid) / 100.0;
-  m->battery_capacity = _sp_hex4b(t->battery_capacity, &invalid) / 100.0;
-  m->state_of_charge = _sp_hex4b(t->state_of_charge, &invalid) / 10.0;
-  m->rated_capacity = _sp_hex4b(t->rated_capacity, &invalid) / 100.0;
-  m->number_of_cycles = _sp_hex4b(t->number_of_cycles, &invalid);
-  m->state_of_health = _sp_hex4b(t->state_of_health, &invalid) / 10.0;
-  m->port_voltage = _sp_hex4b(t->port_voltage, &invalid) / 100.0;
-
-  for (int i = 0; i < SEPLOS_N_CELLS; i++ ) {
-    m->cell_alarm[i] = _sp_hex2b(c->cell_alarm[i], &invalid);
-  }
-  for (int i = 0; i < SEPLOS_N_TEMPERATURES; i++ ) {
-    m->temperature_alarm[i] = _sp_hex2b(c->temperature_alarm[i], &invalid);
-  }
-  m->charge_discharge_current_alarm = _sp_hex2b(c->charge_discharge_current_alarm, &invalid);
-  m->total_battery_voltage_alarm = _sp_hex2b(c->total_battery_voltage_alarm, &invalid);
+  m->charge_discharge_current = (int16_t)_sp_be16(t->charge_discharge_current) / 100.0;
+
+  m->total_battery_voltage = _sp_be16(t->total_battery_voltage) / 100.0;
+  m->residual_capacity = _sp_be16(t->residual_capacity) / 100.0;
+  m->battery_capacity = _sp_be16(t->battery_capacity) / 100.0;
+  m->state_of_charge = _sp_be16(t->state_of_charge) / 10.0;
+  m->rated_capacity = _sp_be16(t->rated_capacity) / 100.0;
+  m->number_of_cycles = _sp_be16(t->number_of_cycles);
+  m->state_of_health = _sp_be16(t->state_of_health) / 10.0;
+  m->port_voltage = _sp_be16(t->port_voltage) / 100.0;
+}
+
+static void
+decode_telecommand(const Seplos_2_0_Telecommand_Binary * c, SeplosData * m)
+{
+  memcpy(m->cell_alarm, c->cell_alarm, sizeof(m->cell_alarm));
+  memcpy(m->temperature_alarm, c->temperature_alarm, sizeof(m->temperature_alarm));
+  m->charge_discharge_current_alarm = c->charge_discharge_current_alarm;
+  m->total_battery_voltage_alarm = c->total_battery_voltage_alarm;
 
-  m->bit_alarm[0] = _sp_hex2b(c->alarm_1_through_6[0], &invalid) \
-   | (_sp_hex2b(c->alarm_1_through_6[1], &invalid) << 8) \
-   | (_sp_hex2b(c->alarm_1_through_6[2], &invalid) << 16) \
-   | (_sp_hex2b(c->alarm_1_through_6[3], &invalid) << 24);
+  m->bit_alarm[0] = c->alarm_1_through_6[0] \
+   | (c->alarm_1_through_6[1] << 8) \
+   | (c->alarm_1_through_6[2] << 16) \
+   | ((uint32_t)c->alarm_1_through_6[3] << 24);
 
-  m->bit_alarm[1] = _sp_hex2b(c->alarm_1_through_6[4], &invalid) \
-   | (_sp_hex2b(c->alarm_1_through_6[5], &invalid) << 8) \
-   | (_sp_hex2b(c->alarm_7_and_8[0], &invalid) << 16) \
-   | (_sp_hex2b(c->alarm_7_and_8[1], &invalid) << 24);
+  m->bit_alarm[1] = c->alarm_1_through_6[4] \
+   | (c->alarm_1_through_6[5] << 8) \
+   | (c->alarm_7_and_8[0] << 16) \
+   | ((uint32_t)c->alarm_7_and_8[1] << 24);
 
-  m->equilibrium_state = _sp_hex2b(c->equilibrium_state[0], &invalid) \
-   | (_sp_hex2b(c->equilibrium_state[1], &invalid) << 8);
+  m->equilibrium_state = c->equilibrium_state[0] | (c->equilibrium_state[1] << 8);
 
-  m->disconnection_state = _sp_hex2b(c->disconnection_state[0], &invalid) \
-   | (_sp_hex2b(c->disconnection_state[1], &invalid) << 8);
+  m->disconnection_state = c->disconnection_state[0] | (c->disconnection_state[1] << 8);
 
-  uint8_t state = _sp_hex2b(c->on_off_state, &invalid);
+  uint8_t state = c->on_off_state;
   m->discharge_switch = !!(state & 0x01);
   m->charge_switch = !!(state & 0x02);
   m->current_limit_switch = !!(state & 0x04);
   m->heating_switch = !!(state & 0x08);
 
-  state = _sp_hex2b(c->system_state, &invalid);
+  state = c->system_state;
   m->discharge = (state & 0x01);
   m->charge = (state & 0x02);
   m->floating_charge = (state & 0x04);
   m->standby = (state & 0x10);
   m->shutdown = (state & 0x20);
+}
 
-  if ( m->total_battery_voltage_alarm != NORMAL ) {
-    m->has_alarm = m->has_voltage_or_current_alarm = true;
-    switch ( m->total_battery_voltage_alarm ) {
-    case LOW_LIMIT_HIT:
-      m->depleted = true;
-      break;
-    case HIGH_LIMIT_HIT:
-      m->overcharge = true;
-      break;
-    case OTHER_ALARM:
-    default:
-      m->other_or_undocumented_alarm_state = true;
-    }
+/*
+ * Eight byte alarms at a time, as the bytes of a word, from the least
+ * significant. The bytes past count are zero, which is NORMAL.
+ */
+static uint64_t
+load_bytes(const uint8_t * bytes, unsigned int count)
+{
+  uint64_t word = 0;
+
+  for ( unsigned int i = 0; i < count && i < 8; i++ )
+    word |= (uint64_t)bytes[i] << (i * 8);
+  return word;
+}
+
+#define	BYTES(b)	(0x0101010101010101ULL * (b))
+
+/* 0x80 in each byte of word that is zero, and 0 in the others. */
+static inline uint64_t
+zero_bytes(uint64_t word)
+{
+  return ~(((word & BYTES(0x7f)) + BYTES(0x7f)) | word | BYTES(0x7f));
+}
+
+/* The top bit of each byte, gathered into a bit for each byte. */
+static inline unsigned int
+gather(uint64_t word)
+{
+  return ((word >> 7) * 0x0102040810204080ULL) >> 56;
+}
+
+/* The masks of up to 16 byte alarms, a word of them at a time. */
+static void
+alarm_masks(const uint8_t * bytes, unsigned int count, SeplosAlarmMasks * a)
+{
+  a->low = a->high = a->other = 0;
+  for ( unsigned int i = 0; i < count; i += 8 ) {
+    const uint64_t word = load_bytes(bytes + i, count - i);
+    const uint64_t low = zero_bytes(word ^ BYTES(LOW_LIMIT_HIT));
+    const uint64_t high = zero_bytes(word ^ BYTES(HIGH_LIMIT_HIT));
+    const uint64_t other = ~zero_bytes(word) & BYTES(0x80) & ~low & ~high;
+
+    a->low |= gather(low) << i;
+    a->high |= gather(high) << i;
+    a->other |= gather(other) << i;
   }
+}
+
+void
+_sp_summarize_alarms(SeplosData * m)
+{
+  /*
+   * A polling loop reuses the same SeplosData for every sample, so the alarm
+   * summary from the last sample must not carry over into this one. Every
+   * flag is set here, from the masks, so none does.
+   */
+  alarm_masks(m->cell_alarm, SEPLOS_N_CELLS, &(m->cell_alarms));
+  alarm_masks(m->temperature_alarm, SEPLOS_N_TEMPERATURES, &(m->temperature_alarms));
+
+  const uint8_t voltage = m->total_battery_voltage_alarm;
+  const uint8_t current = m->charge_discharge_current_alarm;
+  const SeplosAlarmMasks * const cells = &(m->cell_alarms);
+  const SeplosAlarmMasks * const temperatures = &(m->temperature_alarms);
+
+  m->has_cell_alarm = seplos_any_alarm(cells) != 0;
+  m->has_temperature_alarm = seplos_any_alarm(temperatures) != 0;
+  m->has_voltage_or_current_alarm = voltage != NORMAL || current != NORMAL;
+  m->has_bit_alarm = seplos_bit_alarms(m) != 0;
+  m->depleted = cells->low || voltage == LOW_LIMIT_HIT;
+  m->overcharge = cells->high || voltage == HIGH_LIMIT_HIT;
+  m->cold = temperatures->low != 0;
+  m->hot = temperatures->high != 0;
+  m->other_or_undocumented_alarm_state = cells->other || temperatures->other
+   || (voltage != NORMAL && voltage != LOW_LIMIT_HIT && voltage != HIGH_LIMIT_HIT)
+   || (current != NORMAL && current != LOW_LIMIT_HIT && current != HIGH_LIMIT_HIT);
+  m->has_alarm = m->has_cell_alarm || m->has_temperature_alarm || m->has_voltage_or_current_alarm || m->has_bit_alarm;
+}
+
+/*
+ * The BMS may send a shorter info field than the layout, for example if it has
+ * fewer custom fields. The fields that it didn't send read as zero, as they
+ * did when the replies were received into a cleared buffer.
+ */
+static void
+clear_unsent(Seplos_2_0_Reply * reply, size_t size)
+{
+  const size_t received = reply->header.length / 2;
 
-  if ( m->charge_discharge_current_alarm != NORMAL ) {
-    m->has_alarm = m->has_voltage_or_current_alarm = true;
-    switch ( m->charge_discharge_current_alarm ) {
-    case LOW_LIMIT_HIT:
-    case HIGH_LIMIT_HIT:
-      break;
-    case OTHER_ALARM:
-    default:
-      m->other_or_undocumented_alarm_state = true;
-    }
+  if ( received < size )
+    memset(reply->info + received, 0, size - received);
+}
+
+static void
+decode(Seplos_2_0_Reply * telemetry, Seplos_2_0_Reply * telecommand, unsigned int address, unsigned int pack, SeplosData * m)
+{
+  clear_unsent(telemetry, sizeof(Seplos_2_0_Telemetry_Binary));
+  clear_unsent(telecommand, sizeof(Seplos_2_0_Telecommand_Binary));
+
+  m->controller_address = address;
+  m->battery_pack_number = pack;
+
+  decode_telemetry((const Seplos_2_0_Telemetry_Binary *)telemetry->info, m);
+  decode_telecommand((const Seplos_2_0_Telecommand_Binary *)telecommand->info, m);
+  _sp_summarize_alarms(m);
+}
+
+/*
+ * With pipelining, the reply to the telecommand request may still be on the
+ * line when the telemetry reply was bad. It would be read as the reply to the
+ * next request, so the next send is made to flush it instead.
+ */
+static void
+abandon_outstanding(SeplosConnection * c)
+{
+  if ( c->outstanding > 0 ) {
+    c->clean = false;
+    c->outstanding = 0;
   }
+}
+
+static int
+bad_response(SeplosConnection * c, int status)
+{
+  abandon_outstanding(c);
+  _sp_error("Bad response %x from SEPLOS BMS.\n", status);
+  return -1;
+}
+
+/*
+ * Fetch and decode only the groups of fields given: SEPLOS_TELEMETRY,
+ * SEPLOS_ALARMS, or both. The fields of a group that isn't fetched keep the
+ * values that they had in m, so a caller can poll telemetry often and alarms
+ * less often into the same SeplosData.
+ *
+ * With pipelining, see seplos_set_pipeline(), the telemetry reply is decoded
+ * after the telecommand request has been sent, so the decoding overlaps the
+ * transmission of the request and the BMS's preparation of its reply. At a
+ * depth of 2 or more, both requests are sent before the first reply is read.
+ */
+int
+seplos_data_select(seplos_device fd, unsigned int address, unsigned int pack, unsigned int groups, SeplosData * m)
+{
+  SeplosConnection * const c = _sp_connection(fd);
+  const unsigned int pipeline = seplos_pipeline();
+  const bool	telemetry = (groups & SEPLOS_TELEMETRY) != 0;
+  const bool	alarms = (groups & SEPLOS_ALARMS) != 0;
+  Seplos_2_0_Reply telemetry_reply;
+  Seplos_2_0_Reply telecommand_reply;
+  uint8_t	pack_info[2];
+  int		status;
+
+  if ( c == 0 )
+    return -1;
+
+  _sp_hex2(pack, pack_info);
+
+  int64_t deadline = _sp_deadline();
+
+  if ( telemetry ) {
+    if ( _sp_bms_send(c, address, TELEMETRY_GET, &pack_info, sizeof(pack_info)) != 0 )
+      return -1;
+
+    if ( alarms && pipeline >= 2 && _sp_bms_send(c, address, TELECOMMAND_GET, &pack_info, sizeof(pack_info)) != 0 )
+      return -1;
 
-  for ( unsigned int i = 0; i < SEPLOS_N_CELLS; i++ ) {
-    const uint8_t value = m->cell_alarm[i];
-    if ( value != 0 ) {
-      m->has_alarm = m->has_cell_alarm = true;
-      switch ( value ) {
-      case LOW_LIMIT_HIT:
-        m->depleted = true;
-        break;
-      case HIGH_LIMIT_HIT:
-        m->overcharge = true;
-        break;
-      case OTHER_ALARM:
-      default:
-        m->other_or_undocumented_alarm_state = true;
-      }
-      break;
-    }
+    if ( (status = _sp_bms_receive(c, deadline, &telemetry_reply)) != NORMAL )
+      return bad_response(c, status);
+
+    /* The time for the second reply starts when the first one has been received. */
+    deadline = _sp_deadline();
+  }
+
+  if ( alarms && (!telemetry || pipeline < 2) \
+   && _sp_bms_send(c, address, TELECOMMAND_GET, &pack_info, sizeof(pack_info)) != 0 )
+    return -1;
+
+  m->controller_address = address;
+  m->battery_pack_number = pack;
+
+  if ( telemetry ) {
+    clear_unsent(&telemetry_reply, sizeof(Seplos_2_0_Telemetry_Binary));
+    decode_telemetry((const Seplos_2_0_Telemetry_Binary *)telemetry_reply.info, m);
   }
 
-  for ( unsigned int i = 0; i < SEPLOS_N_TEMPERATURES; i++ ) {
-    const uint8_t value = m->temperature_alarm[i];
-    if ( value != NORMAL ) {
-      m->has_alarm = m->has_temperature_alarm = true;
-      switch ( value ) {
-      case LOW_LIMIT_HIT:
-        m->cold = true;
-        break;
-      case HIGH_LIMIT_HIT:
-        m->hot = true;
-        break;
-      case OTHER_ALARM:
-      default:
-        m->other_or_undocumented_alarm_state = true;
-        break;
-      }
-    }
+  if ( alarms ) {
+    if ( (status = _sp_bms_receive(c, deadline, &telecommand_reply)) != NORMAL )
+      return bad_response(c, status);
+
+    clear_unsent(&telecommand_reply, sizeof(Seplos_2_0_Telecommand_Binary));
+    decode_telecommand((const Seplos_2_0_Telecommand_Binary *)telecommand_reply.info, m);
+    _sp_summarize_alarms(m);
   }
+  return 0;
+}
+
+int
+seplos_data(seplos_device fd, unsigned int address, unsigned int pack, SeplosData * m)
+{
+  return seplos_data_select(fd, address, pack, SEPLOS_ALL, m);
+}
+
+/*
+ * Decode a pair of replies that were received earlier, for example from a log
+ * of the serial line, without any serial I/O. Each is a whole packet, from the
+ * '~' through the checksum, in the form that the BMS sent it. The controller
+ * address is taken from the telemetry reply.
+ */
+int
+seplos_decode(
+ const char *	telemetry,
+ size_t		telemetry_size,
+ const char *	telecommand,
+ size_t		telecommand_size,
+ unsigned int	pack,
+ SeplosData *	m)
+{
+  Seplos_2_0_Reply telemetry_reply;
+  Seplos_2_0_Reply telecommand_reply;
 
-  for ( int i = 0; i < (sizeof(m->bit_alarm) / sizeof(*(m->bit_alarm))); i++ ) {
-    if ( m->bit_alarm[i] ) {
-      m->has_alarm = m->has_bit_alarm = true;
-      break;
-    }
+  if ( _sp_frame_decode((const Seplos_2_0 *)telemetry, telemetry_size, &telemetry_reply) != 0 \
+   || _sp_frame_decode((const Seplos_2_0 *)telecommand, telecommand_size, &telecommand_reply) != 0 )
+    return -1;
+
+  const unsigned int status = telemetry_reply.header.function != NORMAL ? \
+   telemetry_reply.header.function : telecommand_reply.header.function;
+  if ( status != NORMAL ) {
+    _sp_error("Bad response %x from SEPLOS BMS.\n", status);
+    return -1;
   }
+
+  decode(&telemetry_reply, &telecommand_reply, telemetry_reply.header.address, pack, m);
+  return 0;
 }
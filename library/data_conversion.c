@@ -2,6 +2,32 @@
 
 static const char hex[] = "0123456789ABCDEF";
 
+/*
+ * The value of each hexidecimal character, indexed by the character. X, for
+ * every other character, has the high bits set so that a decoder can OR
+ * together all of the values it looks up, and test once at the end.
+ */
+#define X 0xff
+static const uint8_t hex_value[256] = {
+  X, X, X, X, X, X, X, X, X, X, X, X, X, X, X, X,
+  X, X, X, X, X, X, X, X, X, X, X, X, X, X, X, X,
+  X, X, X, X, X, X, X, X, X, X, X, X, X, X, X, X,
+  0, 1, 2, 3, 4, 5, 6, 7, 8, 9, X, X, X, X, X, X,
+  X, 10, 11, 12, 13, 14, 15, X, X, X, X, X, X, X, X, X,
+  X, X, X, X, X, X, X, X, X, X, X, X, X, X, X, X,
+  X, 10, 11, 12, 13, 14, 15, X, X, X, X, X, X, X, X, X,
+  X, X, X, X, X, X, X, X, X, X, X, X, X, X, X, X,
+  X, X, X, X, X, X, X, X, X, X, X, X, X, X, X, X,
+  X, X, X, X, X, X, X, X, X, X, X, X, X, X, X, X,
+  X, X, X, X, X, X, X, X, X, X, X, X, X, X, X, X,
+  X, X, X, X, X, X, X, X, X, X, X, X, X, X, X, X,
+  X, X, X, X, X, X, X, X, X, X, X, X, X, X, X, X,
+  X, X, X, X, X, X, X, X, X, X, X, X, X, X, X, X,
+  X, X, X, X, X, X, X, X, X, X, X, X, X, X, X, X,
+  X, X, X, X, X, X, X, X, X, X, X, X, X, X, X, X,
+};
+#undef X
+
 float
 _sp_farenheit(float c)
 {
@@ -33,16 +59,13 @@ _sp_hex4(uint16_t value, char ascii[4])
 uint8_t
 _sp_hex1b(uint8_t c, bool * invalid)
 {
-  if ( c >= '0' && c <= '9' )
-    return c - '0';
-  else if ( c >= 'a' && c <= 'f' )
-    return c - 'a' + 10;
-  else if ( c >= 'A' && c <= 'F' )
-    return c - 'A' + 10;
-  else {
+  const uint8_t value = hex_value[c];
+
+  if ( value > 0xf ) {
     *invalid = true;
     return 0;
   }
+  return value;
 }
 
 uint8_t
@@ -58,6 +81,28 @@ _sp_hex4b(const char ascii[4], bool * invalid)
    (_sp_hex1b(ascii[2], invalid) << 4) | _sp_hex1b(ascii[3], invalid);
 }
 
+/*
+ * Convert length bytes of binary from (length * 2) hexidecimal characters in one
+ * pass, validating as it goes. Returns true if all of the characters were valid.
+ * If any of them were not, the binary is still written, with 0xf for each of
+ * those characters, and the SIMD versions must write the same.
+ */
+bool
+_sp_hex_decode_scalar(const char * restrict ascii, uint8_t * restrict binary, unsigned int length)
+{
+  const uint8_t * a = (const uint8_t *)ascii;
+  uint8_t invalid = 0;
+
+  for ( unsigned int i = 0; i < length; i++ ) {
+    const uint8_t high = hex_value[a[0]];
+    const uint8_t low = hex_value[a[1]];
+    invalid |= high | low;
+    binary[i] = (high << 4) | (low & 0xf);
+    a += 2;
+  }
+  return (invalid & 0xf0) == 0;
+}
+
 unsigned int
 _sp_length_checksum(unsigned int length)
 {
@@ -66,7 +111,7 @@ _sp_length_checksum(unsigned int length)
 }
 
 unsigned int
-_sp_overall_checksum(const char * restrict data, unsigned int length)
+_sp_overall_checksum_scalar(const char * restrict data, unsigned int length)
 {
   unsigned int sum = 0;
 
@@ -76,3 +121,53 @@ _sp_overall_checksum(const char * restrict data, unsigned int length)
 
   return ((~sum) & 0xffff) + 1;
 }
+
+/*
+ * _sp_hex_decode() and _sp_overall_checksum() run over every character of every
+ * packet. On the first call, each selects the fastest version that this CPU
+ * supports, and calls it directly after that. The versions all return the same
+ * results, so it doesn't matter if two threads race to make the selection.
+ */
+static bool		hex_decode_select(const char * restrict ascii, uint8_t * restrict binary, unsigned int length);
+static unsigned int	overall_checksum_select(const char * restrict data, unsigned int length);
+
+static bool		(*hex_decode)(const char * restrict, uint8_t * restrict, unsigned int) = hex_decode_select;
+static unsigned int	(*overall_checksum)(const char * restrict, unsigned int) = overall_checksum_select;
+
+static bool
+hex_decode_select(const char * restrict ascii, uint8_t * restrict binary, unsigned int length)
+{
+  hex_decode = _sp_hex_decode_scalar;
+#if defined(__x86_64__) || defined(__i386__)
+  if ( __builtin_cpu_supports("avx2") )
+    hex_decode = _sp_hex_decode_avx2;
+  else if ( __builtin_cpu_supports("sse2") )
+    hex_decode = _sp_hex_decode_sse2;
+#endif
+  return hex_decode(ascii, binary, length);
+}
+
+static unsigned int
+overall_checksum_select(const char * restrict data, unsigned int length)
+{
+  overall_checksum = _sp_overall_checksum_scalar;
+#if defined(__x86_64__) || defined(__i386__)
+  if ( __builtin_cpu_supports("avx2") )
+    overall_checksum = _sp_overall_checksum_avx2;
+  else if ( __builtin_cpu_supports("sse2") )
+    overall_checksum = _sp_overall_checksum_sse2;
+#endif
+  return overall_checksum(data, length);
+}
+
+bool
+_sp_hex_decode(const char * restrict ascii, uint8_t * restrict binary, unsigned int length)
+{
+  return hex_decode(ascii, binary, length);
+}
+
+unsigned int
+_sp_overall_checksum(const char * restrict data, unsigned int length)
+{
+  return overall_checksum(data, length);
+}
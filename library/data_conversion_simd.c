@@ -0,0 +1,175 @@
+#include "./internal.h"
+
+/*
+ * SSE2 and AVX2 versions of the two loops that run over the whole of every
+ * packet: the overall checksum, and the hexidecimal conversion of the info
+ * field. data_conversion.c selects one at run time, based on what the CPU
+ * supports. They must return exactly what the scalar versions do, for every
+ * input, including input that isn't valid.
+ */
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#include <limits.h>
+
+/*
+ * The scalar checksum adds plain char, which is signed on x86. psadbw adds
+ * unsigned bytes, so the bytes are biased by 0x80 first, and the bias taken
+ * back out of the total at the end.
+ */
+#if CHAR_MIN < 0
+#define CHECKSUM_BIAS	0x80
+#else
+#define CHECKSUM_BIAS	0
+#endif
+
+static unsigned int
+checksum_tail(const char * restrict data, unsigned int length, unsigned int sum)
+{
+  for ( unsigned int i = 0; i < length; i++ )
+    sum += *data++;
+
+  return ((~sum) & 0xffff) + 1;
+}
+
+__attribute__((target("sse2")))
+unsigned int
+_sp_overall_checksum_sse2(const char * restrict data, unsigned int length)
+{
+  const __m128i	zero = _mm_setzero_si128();
+  const __m128i	bias = _mm_set1_epi8((char)CHECKSUM_BIAS);
+  __m128i	total = zero;
+  unsigned int	i = 0;
+
+  for ( ; i + 16 <= length; i += 16 ) {
+    const __m128i v = _mm_xor_si128(_mm_loadu_si128((const __m128i *)(data + i)), bias);
+    total = _mm_add_epi64(total, _mm_sad_epu8(v, zero));
+  }
+
+  const unsigned int sum = _mm_cvtsi128_si32(total) + _mm_cvtsi128_si32(_mm_srli_si128(total, 8)) \
+   - (i * CHECKSUM_BIAS);
+
+  return checksum_tail(data + i, length - i, sum);
+}
+
+__attribute__((target("avx2")))
+unsigned int
+_sp_overall_checksum_avx2(const char * restrict data, unsigned int length)
+{
+  const __m256i	zero = _mm256_setzero_si256();
+  const __m256i	bias = _mm256_set1_epi8((char)CHECKSUM_BIAS);
+  __m256i	total = zero;
+  unsigned int	i = 0;
+
+  for ( ; i + 32 <= length; i += 32 ) {
+    const __m256i v = _mm256_xor_si256(_mm256_loadu_si256((const __m256i *)(data + i)), bias);
+    total = _mm256_add_epi64(total, _mm256_sad_epu8(v, zero));
+  }
+
+  const __m128i half = _mm_add_epi64(_mm256_castsi256_si128(total), _mm256_extracti128_si256(total, 1));
+  const unsigned int sum = _mm_cvtsi128_si32(half) + _mm_cvtsi128_si32(_mm_srli_si128(half, 8)) \
+   - (i * CHECKSUM_BIAS);
+
+  return checksum_tail(data + i, length - i, sum);
+}
+
+/*
+ * Convert 16 hexidecimal characters to their values, one per byte, and clear
+ * bytes of *valid for any character that isn't hexidecimal. 'A' to 'F' are
+ * folded into 'a' to 'f' by setting bit 5, which maps no other character into
+ * that range. SSE2 has no unsigned byte compare, x <= n is min(x, n) == x.
+ * A character that isn't hexidecimal converts to 0xf, as in the scalar
+ * version, so that the binary is the same even when the input isn't valid.
+ */
+__attribute__((target("sse2")))
+static inline __m128i
+nibbles_sse2(__m128i c, __m128i * valid)
+{
+  const __m128i digit = _mm_sub_epi8(c, _mm_set1_epi8('0'));
+  const __m128i letter = _mm_sub_epi8(_mm_or_si128(c, _mm_set1_epi8(0x20)), _mm_set1_epi8('a'));
+  const __m128i is_digit = _mm_cmpeq_epi8(_mm_min_epu8(digit, _mm_set1_epi8(9)), digit);
+  const __m128i is_letter = _mm_cmpeq_epi8(_mm_min_epu8(letter, _mm_set1_epi8(5)), letter);
+
+  const __m128i ok = _mm_or_si128(is_digit, is_letter);
+
+  *valid = _mm_and_si128(*valid, ok);
+
+  return _mm_or_si128(
+   _mm_or_si128(_mm_and_si128(is_digit, digit), _mm_andnot_si128(ok, _mm_set1_epi8(0xf))),
+   _mm_and_si128(is_letter, _mm_add_epi8(letter, _mm_set1_epi8(10))));
+}
+
+/*
+ * Each pair of characters is one 16-bit lane, the first character in the low
+ * byte. Make each lane (first << 4) | second, which fits in the low byte, for
+ * packus to gather.
+ */
+__attribute__((target("sse2")))
+static inline __m128i
+pairs_sse2(__m128i n)
+{
+  return _mm_or_si128(_mm_slli_epi16(_mm_and_si128(n, _mm_set1_epi16(0xff)), 4), _mm_srli_epi16(n, 8));
+}
+
+__attribute__((target("sse2")))
+bool
+_sp_hex_decode_sse2(const char * restrict ascii, uint8_t * restrict binary, unsigned int length)
+{
+  __m128i	valid = _mm_set1_epi8(-1);
+  unsigned int	i = 0;
+
+  for ( ; i + 16 <= length; i += 16 ) {
+    const __m128i a = nibbles_sse2(_mm_loadu_si128((const __m128i *)(ascii + (i * 2))), &valid);
+    const __m128i b = nibbles_sse2(_mm_loadu_si128((const __m128i *)(ascii + (i * 2) + 16)), &valid);
+    _mm_storeu_si128((__m128i *)(binary + i), _mm_packus_epi16(pairs_sse2(a), pairs_sse2(b)));
+  }
+
+  const bool tail = _sp_hex_decode_scalar(ascii + (i * 2), binary + i, length - i);
+  return _mm_movemask_epi8(valid) == 0xffff && tail;
+}
+
+__attribute__((target("avx2")))
+static inline __m256i
+nibbles_avx2(__m256i c, __m256i * valid)
+{
+  const __m256i digit = _mm256_sub_epi8(c, _mm256_set1_epi8('0'));
+  const __m256i letter = _mm256_sub_epi8(_mm256_or_si256(c, _mm256_set1_epi8(0x20)), _mm256_set1_epi8('a'));
+  const __m256i is_digit = _mm256_cmpeq_epi8(_mm256_min_epu8(digit, _mm256_set1_epi8(9)), digit);
+  const __m256i is_letter = _mm256_cmpeq_epi8(_mm256_min_epu8(letter, _mm256_set1_epi8(5)), letter);
+
+  const __m256i ok = _mm256_or_si256(is_digit, is_letter);
+
+  *valid = _mm256_and_si256(*valid, ok);
+
+  return _mm256_or_si256(
+   _mm256_or_si256(_mm256_and_si256(is_digit, digit), _mm256_andnot_si256(ok, _mm256_set1_epi8(0xf))),
+   _mm256_and_si256(is_letter, _mm256_add_epi8(letter, _mm256_set1_epi8(10))));
+}
+
+__attribute__((target("avx2")))
+static inline __m256i
+pairs_avx2(__m256i n)
+{
+  return _mm256_or_si256(_mm256_slli_epi16(_mm256_and_si256(n, _mm256_set1_epi16(0xff)), 4), _mm256_srli_epi16(n, 8));
+}
+
+__attribute__((target("avx2")))
+bool
+_sp_hex_decode_avx2(const char * restrict ascii, uint8_t * restrict binary, unsigned int length)
+{
+  __m256i	valid = _mm256_set1_epi8(-1);
+  unsigned int	i = 0;
+
+  for ( ; i + 32 <= length; i += 32 ) {
+    const __m256i a = nibbles_avx2(_mm256_loadu_si256((const __m256i *)(ascii + (i * 2))), &valid);
+    const __m256i b = nibbles_avx2(_mm256_loadu_si256((const __m256i *)(ascii + (i * 2) + 32)), &valid);
+    /* packus works within each 128-bit half, put the four quarters back in order. */
+    const __m256i packed = _mm256_packus_epi16(pairs_avx2(a), pairs_avx2(b));
+    _mm256_storeu_si256((__m256i *)(binary + i), _mm256_permute4x64_epi64(packed, 0xd8));
+  }
+
+  const bool tail = _sp_hex_decode_sse2(ascii + (i * 2), binary + i, length - i);
+  return _mm256_movemask_epi8(valid) == -1 && tail;
+}
+
+#endif
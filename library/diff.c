@@ -0,0 +1,121 @@
+#include "./internal.h"
+#include <math.h>
+#include <string.h>
+
+/*
+ * Change detection over successive samples of a pack. Each value is compared
+ * with the value that was last reported, rather than with the sample before,
+ * so that a slow drift is reported once it adds up to more than the deadband,
+ * rather than never. Alarms, the switches, and the system state are compared
+ * exactly, since any change of them matters.
+ */
+
+static const SeplosDeadband	default_deadband = {
+  0.005,	/* cell_voltage, V */
+  1.0,		/* temperature, C */
+  0.1,		/* current, A */
+  0.1,		/* voltage, V */
+  0.1,		/* capacity, AH */
+  1.0		/* percentage */
+};
+
+void
+seplos_diff_init(SeplosDiff * d, const SeplosDeadband * deadband)
+{
+  memset(d, 0, sizeof(*d));
+  d->deadband = deadband ? *deadband : default_deadband;
+}
+
+/* Is value further than deadband from *reported? If so, it becomes the reported value. */
+static bool
+moved(float * reported, float value, float deadband, bool all)
+{
+  if ( all || fabsf(value - *reported) > deadband ) {
+    *reported = value;
+    return true;
+  }
+  return false;
+}
+
+static bool
+differs(void * reported, const void * value, size_t size, bool all)
+{
+  if ( all || memcmp(reported, value, size) != 0 ) {
+    memcpy(reported, value, size);
+    return true;
+  }
+  return false;
+}
+
+#define DIFFERS(field)	differs(&(r->field), &(m->field), sizeof(m->field), all)
+
+/*
+ * Compare m with the last sample reported through d, and set changes to what
+ * is different. Returns true if anything is. The first sample is all changes.
+ */
+bool
+seplos_diff(SeplosDiff * d, const SeplosData * m, SeplosChanges * changes)
+{
+  SeplosData * const		r = &(d->reported);
+  const SeplosDeadband * const	band = &(d->deadband);
+  const bool			all = !d->has_reported;
+  uint32_t			f = 0;
+
+  memset(changes, 0, sizeof(*changes));
+
+  if ( all ) {
+    r->controller_address = m->controller_address;
+    r->battery_pack_number = m->battery_pack_number;
+    r->number_of_cells = m->number_of_cells;
+    d->has_reported = true;
+  }
+
+  for ( unsigned int i = 0; i < SEPLOS_N_CELLS; i++ ) {
+    if ( moved(&(r->cell_voltage[i]), m->cell_voltage[i], band->cell_voltage, all) )
+      changes->cell_voltage |= 1 << i;
+    if ( DIFFERS(cell_alarm[i]) )
+      changes->cell_alarm |= 1 << i;
+  }
+  for ( unsigned int i = 0; i < SEPLOS_N_TEMPERATURES; i++ ) {
+    if ( moved(&(r->temperature[i]), m->temperature[i], band->temperature, all) )
+      changes->temperature |= 1 << i;
+    if ( DIFFERS(temperature_alarm[i]) )
+      changes->temperature_alarm |= 1 << i;
+  }
+
+  if ( moved(&(r->charge_discharge_current), m->charge_discharge_current, band->current, all) )
+    f |= SEPLOS_CHANGED_CURRENT;
+  if ( moved(&(r->total_battery_voltage), m->total_battery_voltage, band->voltage, all) )
+    f |= SEPLOS_CHANGED_VOLTAGE;
+  if ( moved(&(r->port_voltage), m->port_voltage, band->voltage, all) )
+    f |= SEPLOS_CHANGED_PORT_VOLTAGE;
+  if ( moved(&(r->residual_capacity), m->residual_capacity, band->capacity, all) )
+    f |= SEPLOS_CHANGED_RESIDUAL_CAPACITY;
+  if ( moved(&(r->battery_capacity), m->battery_capacity, band->capacity, all) )
+    f |= SEPLOS_CHANGED_BATTERY_CAPACITY;
+  if ( moved(&(r->state_of_charge), m->state_of_charge, band->percentage, all) )
+    f |= SEPLOS_CHANGED_STATE_OF_CHARGE;
+  if ( moved(&(r->state_of_health), m->state_of_health, band->percentage, all) )
+    f |= SEPLOS_CHANGED_STATE_OF_HEALTH;
+  if ( DIFFERS(rated_capacity) )
+    f |= SEPLOS_CHANGED_RATED_CAPACITY;
+  if ( DIFFERS(number_of_cycles) )
+    f |= SEPLOS_CHANGED_CYCLES;
+
+  /* |, not ||, so that every field that differs is copied, not just the first. */
+  if ( DIFFERS(discharge) | DIFFERS(charge) | DIFFERS(floating_charge) | DIFFERS(standby) | DIFFERS(shutdown) )
+    f |= SEPLOS_CHANGED_STATE;
+  if ( DIFFERS(discharge_switch) | DIFFERS(charge_switch) | DIFFERS(current_limit_switch) | DIFFERS(heating_switch) )
+    f |= SEPLOS_CHANGED_SWITCHES;
+  if ( DIFFERS(equilibrium_state) )
+    f |= SEPLOS_CHANGED_EQUILIBRIUM;
+  if ( DIFFERS(disconnection_state) )
+    f |= SEPLOS_CHANGED_DISCONNECTION;
+  if ( DIFFERS(charge_discharge_current_alarm) | DIFFERS(total_battery_voltage_alarm) | DIFFERS(bit_alarm) )
+    f |= SEPLOS_CHANGED_ALARMS;
+  if ( changes->cell_alarm || changes->temperature_alarm )
+    f |= SEPLOS_CHANGED_ALARMS;
+
+  changes->fields = f;
+  return f || changes->cell_voltage || changes->temperature;
+}
@@ -0,0 +1,239 @@
+#include "./internal.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+/*
+ * Coulomb counting: running totals of the charge and energy into and out of
+ * one pack, integrated from its samples, kept in a memory-mapped file so that
+ * they carry over from one run of the daemon to the next.
+ *
+ * The residual capacity and state of charge that the BMS reports are coarse,
+ * and say nothing of how much went through the pack. Between two samples the
+ * current and voltage are taken to be straight lines, and the area under them
+ * is added: the trapezoidal rule. Where the current crosses zero between the
+ * samples, the interval is split there, so that charge and discharge are each
+ * counted, rather than netted against each other. The power is integrated the
+ * same way, so the Wh counts the voltage as it sagged and rose with the load.
+ *
+ * A missed poll just makes an interval longer, and the straight line across it
+ * is still a fair estimate. But across a long gap, such as the daemon being
+ * stopped, or a pack not answering, a straight line is a guess, so an interval
+ * longer than maximum_gap isn't integrated, and its length is counted in gaps
+ * instead. The counters then start again from the sample after the gap. The
+ * last sample is kept in the file, so a daemon that is restarted quickly
+ * carries on integrating from where the last one stopped.
+ *
+ * The file is updated in place by the writer, so a crash loses nothing, though
+ * the kernel may not have written the page when the power fails. Readers may
+ * map the same file. The writer makes the sequence odd while it updates the
+ * counters, and a reader that sees it odd or changed reads again, as in shm.c.
+ * Since the sequence is in the file, a writer that was killed in mid-update
+ * leaves it odd, and the next writer to open the file makes it even again.
+ */
+
+#define	BYTE_ORDER_MARK	0x01020304
+#define	MAXIMUM_TRIES	1000000
+
+typedef struct _EnergyFile {
+  char			magic[8];	/* "SEPLOSEN" */
+  uint32_t		version;
+  uint32_t		byte_order;	/* BYTE_ORDER_MARK, as the writing host stores it */
+  uint64_t		sequence;	/* Odd while the counters are being written */
+  int64_t		timestamp;	/* Of the last sample, 0 if there was none */
+  float			current;	/* A, of the last sample */
+  float			voltage;	/* V, of the last sample */
+  SeplosEnergyCounters	counters;
+} EnergyFile;
+
+struct _SeplosEnergy {
+  int		fd;
+  bool		writable;
+  EnergyFile *	file;
+};
+
+static const char	magic[8] = { 'S', 'E', 'P', 'L', 'O', 'S', 'E', 'N' };
+
+/* Add an interval over which the current doesn't change sign. */
+static void
+add(SeplosEnergyCounters * c, double hours, double i0, double i1, double p0, double p1)
+{
+  const double charge = hours * (i0 + i1) / 2;
+  const double energy = hours * (p0 + p1) / 2;
+
+  if ( charge >= 0 ) {
+    c->charge += charge;
+    c->energy_in += energy;
+  }
+  else {
+    c->discharge -= charge;
+    c->energy_out -= energy;
+  }
+}
+
+static void
+integrate(SeplosEnergyCounters * c, double seconds, double i0, double i1, double v0, double v1)
+{
+  const double	hours = seconds / 3600;
+  const double	p0 = i0 * v0;
+  const double	p1 = i1 * v1;
+
+  if ( (i0 > 0 && i1 < 0) || (i0 < 0 && i1 > 0) ) {
+    /* Where the line of the current crosses zero, and so does the power. */
+    const double f = i0 / (i0 - i1);
+
+    add(c, hours * f, i0, 0, p0, 0);
+    add(c, hours * (1 - f), 0, i1, 0, p1);
+  }
+  else
+    add(c, hours, i0, i1, p0, p1);
+}
+
+/*
+ * Open the counters of a pack. If writable, the file is created, with the
+ * counters at zero, if it doesn't exist. Only one writer at a time may have it
+ * open, but any number of readers.
+ */
+SeplosEnergy *
+seplos_energy_open(const char * path, bool writable)
+{
+  struct stat		st;
+  SeplosEnergy * const	e = calloc(1, sizeof(*e));
+
+  if ( e == 0 ) {
+    _sp_error("Out of memory.\n");
+    return 0;
+  }
+  e->writable = writable;
+
+  e->fd = open(path, (writable ? O_RDWR|O_CREAT : O_RDONLY)|O_CLOEXEC, 0644);
+  if ( e->fd < 0 || fstat(e->fd, &st) != 0 ) {
+    _sp_error("%s: %s\n", path, strerror(errno));
+    seplos_energy_close(e);
+    return 0;
+  }
+
+  if ( st.st_size == 0 && writable ) {
+    EnergyFile f = {};
+
+    memcpy(f.magic, magic, sizeof(magic));
+    f.version = SEPLOS_ENERGY_VERSION;
+    f.byte_order = BYTE_ORDER_MARK;
+    if ( pwrite(e->fd, &f, sizeof(f), 0) != sizeof(f) ) {
+      _sp_error("%s: %s\n", path, strerror(errno));
+      seplos_energy_close(e);
+      return 0;
+    }
+  }
+  else {
+    EnergyFile f;
+
+    if ( st.st_size != sizeof(f) || pread(e->fd, &f, sizeof(f), 0) != sizeof(f)
+     || memcmp(f.magic, magic, sizeof(magic)) != 0 ) {
+      _sp_error("%s: Not a SEPLOS energy file.\n", path);
+      seplos_energy_close(e);
+      return 0;
+    }
+    if ( f.byte_order != BYTE_ORDER_MARK ) {
+      _sp_error("%s: Was written by a host of another byte order.\n", path);
+      seplos_energy_close(e);
+      return 0;
+    }
+    if ( f.version != SEPLOS_ENERGY_VERSION ) {
+      _sp_error("%s: Energy file version %u can't be read by this version of the library.\n", path, f.version);
+      seplos_energy_close(e);
+      return 0;
+    }
+  }
+
+  const int protection = PROT_READ | (writable ? PROT_WRITE : 0);
+  void * const m = mmap(0, sizeof(EnergyFile), protection, MAP_SHARED, e->fd, 0);
+  if ( m == MAP_FAILED ) {
+    _sp_error("%s: mmap failed: %s\n", path, strerror(errno));
+    seplos_energy_close(e);
+    return 0;
+  }
+  e->file = m;
+
+  /*
+   * A writer that was killed while updating the counters left the sequence
+   * odd. Readers would wait for it forever, so the writer that takes over
+   * makes it even. The counters may be left part-way through that one
+   * update, which is no more than one interval's worth.
+   */
+  if ( writable && (e->file->sequence & 1) )
+    __atomic_store_n(&(e->file->sequence), e->file->sequence + 1, __ATOMIC_RELEASE);
+  return e;
+}
+
+/*
+ * Integrate from the last sample to this one, taken at timestamp, microseconds
+ * since 1970 UTC. An interval longer than maximum_gap microseconds, or one that
+ * goes backwards because the clock was set, isn't integrated.
+ */
+void
+seplos_energy_update(SeplosEnergy * e, int64_t timestamp, int64_t maximum_gap, const SeplosData * m)
+{
+  EnergyFile * const	f = e->file;
+  SeplosEnergyCounters	c = f->counters;
+  const int64_t		interval = timestamp - f->timestamp;
+
+  if ( c.since == 0 )
+    c.since = timestamp;
+  else if ( interval > 0 && interval <= maximum_gap ) {
+    integrate(&c, interval / 1e6, f->current, m->charge_discharge_current, f->voltage, m->total_battery_voltage);
+    c.integrated += interval / 1e6;
+  }
+  else if ( interval > 0 )
+    c.gaps += interval / 1e6;
+  c.samples++;
+
+  const uint64_t sequence = f->sequence;
+
+  __atomic_store_n(&(f->sequence), sequence + 1, __ATOMIC_RELAXED);
+  __atomic_thread_fence(__ATOMIC_RELEASE);
+  f->timestamp = timestamp;
+  f->current = m->charge_discharge_current;
+  f->voltage = m->total_battery_voltage;
+  f->counters = c;
+  __atomic_store_n(&(f->sequence), sequence + 2, __ATOMIC_RELEASE);
+}
+
+/* Copy the counters, consistently even while the writer is updating them. */
+int
+seplos_energy_counters(const SeplosEnergy * e, SeplosEnergyCounters * c)
+{
+  const EnergyFile * const f = e->file;
+
+  for ( unsigned int tries = 0; tries < MAXIMUM_TRIES; tries++ ) {
+    const uint64_t before = __atomic_load_n(&(f->sequence), __ATOMIC_ACQUIRE);
+    if ( before & 1 )
+      continue;
+
+    *c = f->counters;
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    if ( __atomic_load_n(&(f->sequence), __ATOMIC_RELAXED) == before )
+      return 0;
+  }
+  _sp_error("Energy counters are stuck in mid-write.\n");
+  return -1;
+}
+
+void
+seplos_energy_close(SeplosEnergy * e)
+{
+  if ( e == 0 )
+    return;
+  if ( e->file ) {
+    if ( e->writable )
+      msync(e->file, sizeof(EnergyFile), MS_ASYNC);
+    munmap(e->file, sizeof(EnergyFile));
+  }
+  if ( e->fd >= 0 )
+    close(e->fd);
+  free(e);
+}
@@ -0,0 +1,263 @@
+#include "./internal.h"
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+
+/*
+ * A summary of a site of many packs, kept up to date one pack at a time.
+ *
+ * The totals are sums, so a new sample of a pack subtracts what its last
+ * sample added and adds its own, in constant time. They're kept in double, so
+ * that the rounding of a long run of those doesn't add up to anything that
+ * shows in a float.
+ *
+ * The extremes, such as the lowest cell of the site, can't be taken back out
+ * like that, so they're kept in a segment tree: a binary tree over the packs,
+ * in an array, in which each node holds the extremes of the packs below it. A
+ * new sample of a pack changes its leaf and then each node from there to the
+ * root, log2(packs) of them, and the root is the summary of the site. So a
+ * poll costs O(packs that changed * log packs) rather than a pass over all of
+ * them, and reading the summary costs nothing.
+ *
+ * A tie goes to the pack with the lower index, so the summary doesn't depend
+ * on the order of the updates.
+ */
+
+enum Extreme {
+  LOW_CELL,
+  HIGH_CELL,
+  COLD,
+  HOT,
+  LOW_STATE_OF_CHARGE,
+  HIGH_STATE_OF_CHARGE,
+  N_EXTREMES
+};
+
+typedef struct _Node {
+  SeplosFleetExtreme	extreme[N_EXTREMES];
+} Node;
+
+/* What one pack adds to the totals. */
+typedef struct _Contribution {
+  bool		present;
+  bool		alarm;
+  double	current;
+  double	power;
+  double	residual_capacity;
+  double	battery_capacity;
+  double	energy;
+} Contribution;
+
+struct _SeplosFleet {
+  unsigned int		packs;
+  unsigned int		leaves;	/* packs, rounded up to a power of 2 */
+  Node *		tree;	/* 1 is the root, and n has children 2n and 2n + 1 */
+  Contribution *	contribution;
+  unsigned int *	missed;	/* Sweeps in a row without a sample, by pack */
+  SeplosFleetSummary	totals;
+  double		current;
+  double		power;
+  double		residual_capacity;
+  double		battery_capacity;
+  double		energy;
+};
+
+/* Whether the extreme is a minimum, rather than a maximum. */
+static const bool lowest[N_EXTREMES] = { true, false, true, false, true, false };
+
+/* The node of no packs, which loses to any that has one. */
+static void
+empty(Node * n)
+{
+  for ( unsigned int e = 0; e < N_EXTREMES; e++ ) {
+    memset(&(n->extreme[e]), 0, sizeof(n->extreme[e]));
+    n->extreme[e].value = lowest[e] ? INFINITY : -INFINITY;
+    n->extreme[e].pack = ~0U;
+  }
+}
+
+static void
+combine(Node * n, const Node * left, const Node * right)
+{
+  for ( unsigned int e = 0; e < N_EXTREMES; e++ ) {
+    const SeplosFleetExtreme * const l = &(left->extreme[e]);
+    const SeplosFleetExtreme * const r = &(right->extreme[e]);
+    const bool right_wins = lowest[e] ? r->value < l->value : r->value > l->value;
+
+    n->extreme[e] = right_wins ? *r : *l;
+  }
+}
+
+static void
+set(SeplosFleetExtreme * e, float value, unsigned int pack, const SeplosData * m, unsigned int element)
+{
+  e->value = value;
+  e->pack = pack;
+  e->controller_address = m->controller_address;
+  e->battery_pack_number = m->battery_pack_number;
+  e->element = element;
+}
+
+/* The leaf of one pack: its own extremes, and which cell or sensor they are. */
+static void
+leaf(Node * n, unsigned int pack, const SeplosData * m)
+{
+  const unsigned int cells = m->number_of_cells <= SEPLOS_N_CELLS ? m->number_of_cells : SEPLOS_N_CELLS;
+  unsigned int	low = 0;
+  unsigned int	high = 0;
+  unsigned int	cold = 0;
+  unsigned int	hot = 0;
+
+  for ( unsigned int i = 1; i < cells; i++ ) {
+    if ( m->cell_voltage[i] < m->cell_voltage[low] )
+      low = i;
+    if ( m->cell_voltage[i] > m->cell_voltage[high] )
+      high = i;
+  }
+  for ( unsigned int i = 1; i < SEPLOS_N_TEMPERATURES; i++ ) {
+    if ( m->temperature[i] < m->temperature[cold] )
+      cold = i;
+    if ( m->temperature[i] > m->temperature[hot] )
+      hot = i;
+  }
+
+  empty(n);
+  if ( cells > 0 ) {
+    set(&(n->extreme[LOW_CELL]), m->cell_voltage[low], pack, m, low);
+    set(&(n->extreme[HIGH_CELL]), m->cell_voltage[high], pack, m, high);
+  }
+  set(&(n->extreme[COLD]), m->temperature[cold], pack, m, cold);
+  set(&(n->extreme[HOT]), m->temperature[hot], pack, m, hot);
+  set(&(n->extreme[LOW_STATE_OF_CHARGE]), m->state_of_charge, pack, m, 0);
+  set(&(n->extreme[HIGH_STATE_OF_CHARGE]), m->state_of_charge, pack, m, 0);
+}
+
+/* A summary of count packs, numbered from 0, none of which has a sample yet. */
+SeplosFleet *
+seplos_fleet_open(unsigned int count)
+{
+  SeplosFleet * const f = calloc(1, sizeof(*f));
+
+  if ( f == 0 ) {
+    _sp_error("Out of memory.\n");
+    return 0;
+  }
+  f->packs = count;
+  for ( f->leaves = 1; f->leaves < count; f->leaves *= 2 )
+    ;
+  f->tree = malloc(2 * f->leaves * sizeof(*(f->tree)));
+  f->contribution = calloc(count + 1, sizeof(*(f->contribution)));
+  f->missed = calloc(count + 1, sizeof(*(f->missed)));
+  if ( f->tree == 0 || f->contribution == 0 || f->missed == 0 ) {
+    _sp_error("Out of memory.\n");
+    seplos_fleet_close(f);
+    return 0;
+  }
+  for ( unsigned int i = 1; i < 2 * f->leaves; i++ )
+    empty(&(f->tree[i]));
+  return f;
+}
+
+/* Replace what a pack adds to the totals. */
+static void
+contribute(SeplosFleet * f, unsigned int pack, const Contribution * n)
+{
+  Contribution * const c = &(f->contribution[pack]);
+
+  f->totals.packs += n->present - c->present;
+  f->totals.alarms += n->alarm - c->alarm;
+  f->current += n->current - c->current;
+  f->power += n->power - c->power;
+  f->residual_capacity += n->residual_capacity - c->residual_capacity;
+  f->battery_capacity += n->battery_capacity - c->battery_capacity;
+  f->energy += n->energy - c->energy;
+  *c = *n;
+}
+
+/* The nodes from the leaf of a pack that has changed up to the root. */
+static void
+rebuild(SeplosFleet * f, unsigned int pack)
+{
+  for ( unsigned int i = (f->leaves + pack) / 2; i > 0; i /= 2 )
+    combine(&(f->tree[i]), &(f->tree[2 * i]), &(f->tree[(2 * i) + 1]));
+}
+
+/* Replace the sample of one pack. */
+void
+seplos_fleet_update(SeplosFleet * f, unsigned int pack, const SeplosData * m)
+{
+  const Contribution n = {
+    true,
+    m->has_alarm,
+    m->charge_discharge_current,
+    (double)m->charge_discharge_current * m->total_battery_voltage,
+    m->residual_capacity,
+    m->battery_capacity,
+    (double)m->residual_capacity * m->total_battery_voltage
+  };
+
+  f->missed[pack] = 0;
+  contribute(f, pack, &n);
+  leaf(&(f->tree[f->leaves + pack]), pack, m);
+  rebuild(f, pack);
+}
+
+/*
+ * Take a pack out of the summary, as if it had never had a sample, for example
+ * when it has stopped answering, so that its last sample doesn't stay in the
+ * totals and extremes of the site as if it were live.
+ */
+void
+seplos_fleet_remove(SeplosFleet * f, unsigned int pack)
+{
+  const Contribution none = {};
+
+  if ( !f->contribution[pack].present )
+    return;
+  contribute(f, pack, &none);
+  empty(&(f->tree[f->leaves + pack]));
+  rebuild(f, pack);
+}
+
+/*
+ * Count a sweep in which a pack didn't answer. At SEPLOS_FLEET_MISSED_SWEEPS in
+ * a row, it's removed, until its next sample.
+ */
+void
+seplos_fleet_missed(SeplosFleet * f, unsigned int pack)
+{
+  if ( f->missed[pack] < SEPLOS_FLEET_MISSED_SWEEPS && ++f->missed[pack] == SEPLOS_FLEET_MISSED_SWEEPS )
+    seplos_fleet_remove(f, pack);
+}
+
+/* The summary of every pack that has a sample. */
+void
+seplos_fleet_summary(const SeplosFleet * f, SeplosFleetSummary * s)
+{
+  const Node * const root = &(f->tree[1]);
+
+  *s = f->totals;
+  s->current = f->current;
+  s->power = f->power;
+  s->residual_capacity = f->residual_capacity;
+  s->battery_capacity = f->battery_capacity;
+  s->energy = f->energy;
+  s->state_of_charge = f->battery_capacity > 0 ? (100 * f->residual_capacity) / f->battery_capacity : 0;
+  s->lowest_cell = root->extreme[LOW_CELL];
+  s->highest_cell = root->extreme[HIGH_CELL];
+  s->coldest = root->extreme[COLD];
+  s->hottest = root->extreme[HOT];
+  s->lowest_state_of_charge = root->extreme[LOW_STATE_OF_CHARGE];
+  s->highest_state_of_charge = root->extreme[HIGH_STATE_OF_CHARGE];
+}
+
+void
+seplos_fleet_close(SeplosFleet * f)
+{
+  if ( f == 0 )
+    return;
+  free(f->tree);
+  free(f->contribution);
+  free(f->missed);
+  free(f);
+}
@@ -0,0 +1,155 @@
+#include <assert.h>
+#include <string.h>
+#include "./internal.h"
+#include "./communication.h"
+
+static const char * const messages[] = {
+  "Valid packet",
+  "Packet doesn't start with '~'",
+  "Non-hexidecimal character where only hexidecimal was expected",
+  "SEPLOS protocol not implemented",
+  "Length code incorrect",
+  "Info length is odd, it must be pairs of hexidecimal characters",
+  "Packet is too short",
+  "Checksum mismatch"
+};
+
+const char *
+_sp_frame_error_message(int error)
+{
+  if ( error < 0 || (size_t)error >= sizeof(messages) / sizeof(*messages) )
+    return "Unknown packet error";
+  return messages[error];
+}
+
+/*
+ * Validate the 13-character header of a packet, and convert it to binary. The
+ * length in the binary header is the length of the ASCII info field, with the
+ * length checksum removed.
+ *
+ * This and _sp_info_decode() don't report errors, they return a FRAME_ code,
+ * because the resynchronizing parser expects to see bad packets on a noisy line.
+ */
+int
+_sp_header_decode(const Seplos_2_0 * frame, Seplos_2_0_Binary * header)
+{
+  uint8_t	b[6];
+
+  if ( frame->start != '~' )
+    return FRAME_NO_START;
+
+  if ( !_sp_hex_decode(frame->version, b, sizeof(b)) )
+    return FRAME_NOT_HEXIDECIMAL;
+
+  header->version = b[0];
+  header->address = b[1];
+  header->device = b[2];
+  header->function = b[3];
+  header->length = _sp_be16(&b[4]);
+
+  /* Abort if the major protocol version isn't 2. Accept any minor version */
+  if ( header->version > 0x2f || header->version < 0x20 )
+    return FRAME_VERSION;
+
+  if ( _sp_length_checksum(header->length & 0x0fff) != (header->length & 0xf000) )
+    return FRAME_LENGTH_CHECKSUM;
+
+  header->length &= 0x0fff;
+
+  if ( header->length & 1 )
+    return FRAME_ODD_LENGTH;
+
+  return FRAME_VALID;
+}
+
+/*
+ * Convert the info field and the overall checksum that follows it to binary in
+ * one pass, and verify the checksum. binary must have room for
+ * (header->length / 2) + 2 bytes, the last two are the checksum.
+ */
+int
+_sp_info_decode(const Seplos_2_0 * frame, const Seplos_2_0_Binary * header, uint8_t * binary)
+{
+  const unsigned int length = header->length / 2;
+
+  if ( !_sp_hex_decode(frame->info, binary, length + 2) )
+    return FRAME_NOT_HEXIDECIMAL;
+
+  if ( _sp_be16(&binary[length]) != _sp_overall_checksum(frame->version, header->length + 12) )
+    return FRAME_CHECKSUM;
+
+  return FRAME_VALID;
+}
+
+/*
+ * Validate and convert a whole packet that has already been received, for
+ * example one from a log of the serial line.
+ */
+int
+_sp_frame_decode(const Seplos_2_0 * frame, size_t size, Seplos_2_0_Reply * reply)
+{
+  if ( size < 18 ) {
+    _sp_error("%s: %.*s\n", _sp_frame_error_message(FRAME_TOO_SHORT), (int)size, (const char *)frame);
+    return -1;
+  }
+
+  int error = _sp_header_decode(frame, &(reply->header));
+
+  if ( error == FRAME_VALID && size < (size_t)reply->header.length + 18 )
+    error = FRAME_TOO_SHORT;
+
+  if ( error == FRAME_VALID ) {
+    reply->frame.packet = frame;
+    reply->frame.size = reply->header.length + 18;
+    error = _sp_info_decode(frame, &(reply->header), reply->info);
+  }
+
+  if ( error != FRAME_VALID ) {
+    _sp_error("%s: %.*s\n", _sp_frame_error_message(error), (int)size, &(frame->start));
+    return -1;
+  }
+  return 0;
+}
+
+/*
+ * Encode a packet to a battery: a request from the host, or a reply from a
+ * simulated BMS, in which case function is the return code. info is already
+ * ASCII hexidecimal. Returns the size of the packet.
+ */
+size_t
+_sp_frame_encode(
+ Seplos_2_0 *		encoded,
+ unsigned int		address,
+ unsigned int		function,
+ const void * restrict	info,
+ unsigned int		info_length)
+{
+  Seplos_2_0_Binary s = {};
+
+  s.version = 0x20; /* Protocol version 2.0 */
+  s.address = address;
+  s.device = 0x46;  /* Code for a battery */
+  s.function = function;
+  s.length = _sp_length_checksum(info_length) | (info_length & 0x0fff);
+
+  _sp_hex2(s.version, encoded->version);
+  _sp_hex2(s.address, encoded->address);
+  _sp_hex2(s.device, encoded->device);
+  _sp_hex2(s.function, encoded->function);
+  _sp_hex4(s.length, encoded->length);
+
+  encoded->start = '~';
+  assert(info_length < 4096);
+
+  char * i = encoded->info;
+  memcpy(i, info, info_length);
+  i += info_length;
+
+  const uint16_t checksum = _sp_overall_checksum(encoded->version, info_length + 12);
+  _sp_hex4(checksum, i);
+  i += 4;
+
+  *i++ = '\r';
+
+  return info_length + 18;
+}
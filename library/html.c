@@ -1,4 +1,5 @@
 #include "./internal.h"
+#include <time.h>
 
 static void
 cell_state_html(FILE * f, const SeplosData const * m, int offset, int length)
@@ -20,7 +21,7 @@ cell_state_html(FILE * f, const SeplosData const * m, int offset, int length)
   fprintf(f, "</tr>\n<tr><th style=\"text-align: right;\">Disconnected</th>");
   for ( int i = 0; i < length; i++ ) {
     const unsigned int index = i + offset;
-    fprintf(f, "<td style=\"text-align: center;\">%s</td>", (m->equilibrium_state & (1 << index)) ? "&#2713;" : "&#x00b7;");
+    fprintf(f, "<td style=\"text-align: center;\">%s</td>", (m->disconnection_state & (1 << index)) ? "&#x2713;" : "&#x00b7;");
   }
   fprintf(f, "</tr>\n<tr><th style=\"text-align: right;\">Temperature</th>");
   for ( int i = 0; i < length / 4; i++ ) {
@@ -90,66 +91,53 @@ seplos_html(FILE * f, const SeplosData const * m, bool longer)
 
     if ( m->has_cell_alarm ) {
       fprintf(f, "<strong>The battery indicates an issue with one or more of the cells:</strong><br/>\n");
-      for ( unsigned int i = 0; i < SEPLOS_N_CELLS; i++ ) {
-        uint8_t value = m->cell_alarm[i];
-    
-        if ( value != NORMAL ) {
-          const char * s = "undefined cell alarm state.";
-    
-          switch ( value ) {
-          case LOW_LIMIT_HIT:
-            s = "exhausted: voltage was depleted below the lower limit.";
-            break;
-          case HIGH_LIMIT_HIT:
-            s = "overcharged: voltage has exceeded the upper limit.";
-            break;
-          case OTHER_ALARM:
-            s = "controller reports \"other\" cell alarm state.\n";
-            break;
-          }
-           
-          fprintf(f, "<strong>Cell %d: %s</strong><br/>\n", i, s);
+      for ( uint64_t cells = seplos_any_alarm(&(m->cell_alarms)); cells; ) {
+        const unsigned int i = seplos_next_alarm(&cells);
+        const char * s = "undefined cell alarm state.";
+
+        switch ( m->cell_alarm[i] ) {
+        case LOW_LIMIT_HIT:
+          s = "exhausted: voltage was depleted below the lower limit.";
+          break;
+        case HIGH_LIMIT_HIT:
+          s = "overcharged: voltage has exceeded the upper limit.";
+          break;
+        case OTHER_ALARM:
+          s = "controller reports \"other\" cell alarm state.\n";
+          break;
         }
+
+        fprintf(f, "<strong>Cell %d: %s</strong><br/>\n", i, s);
       }
       fprintf(f, "\n");
     }
 
-    if ( m->temperature_alarm ) {
+    if ( m->has_temperature_alarm ) {
       fprintf(f, "<strong>The battery temperature is out of bounds:</strong><br/>\n");
 
-      for ( unsigned int i = 0; i < SEPLOS_N_TEMPERATURES; i++ ) {
-        uint8_t value = m->temperature_alarm[i];
-  
-        if ( value != NORMAL ) {
-          fprintf(f, "%s: \n", seplos_temperature_names[i]);
-          const char * s = "undefined temperature state.";
-   
-          switch ( value ) {
-          case LOW_LIMIT_HIT:
-            s = "too cold: below the lower limit.";
-            break;
-          case HIGH_LIMIT_HIT:
-            s = "too hot: above the upper limit.";
-            break;
-          case OTHER_ALARM:
-            s = "controller reports &#201c;other&#201d; temperature state.\n";
-          }
-          fprintf(f, "<strong>Cell %d: %s</strong><br/>\n", s);
+      for ( uint64_t sensors = seplos_any_alarm(&(m->temperature_alarms)); sensors; ) {
+        const unsigned int i = seplos_next_alarm(&sensors);
+        const char * s = "undefined temperature state.";
+
+        switch ( m->temperature_alarm[i] ) {
+        case LOW_LIMIT_HIT:
+          s = "too cold: below the lower limit.";
+          break;
+        case HIGH_LIMIT_HIT:
+          s = "too hot: above the upper limit.";
+          break;
+        case OTHER_ALARM:
+          s = "controller reports &#x201c;other&#x201d; temperature state.\n";
         }
+        fprintf(f, "<strong>%s: %s</strong><br/>\n", seplos_temperature_names[i], s);
       }
     }
-    if ( m->has_bit_alarm ) {
-      for ( int i = 0; i < (sizeof(m->bit_alarm) / sizeof(*m->bit_alarm)); i++ ) {
-        uint32_t value = m->bit_alarm[i];
-        if ( value != 0 ) {
-          for ( int j = 0; j < 32; j++ ) {
-            const uint32_t mask = 1 << j;
-            if ( (value & mask) != 0 ) {
-              fprintf(f, "<strong>Alarm: %s.</strong><br/>\n", seplos_bit_alarm_names[(i * 32) + j]);
-            }
-          }
-        }
-      }
+    for ( uint64_t bits = seplos_bit_alarms(m); bits; ) {
+      const unsigned int i = seplos_next_alarm(&bits);
+      if ( seplos_bit_alarm_names[i] )
+        fprintf(f, "<strong>Alarm: %s.</strong><br/>\n", seplos_bit_alarm_names[i]);
+      else
+        fprintf(f, "<strong>Alarm: Undocumented alarm %u.</strong><br/>\n", i);
     }
   }
   else {
@@ -182,3 +170,83 @@ seplos_html(FILE * f, const SeplosData const * m, bool longer)
     fprintf(f, "</table>\n");
   }
 }
+
+void
+seplos_fleet_html(FILE * f, const SeplosFleetSummary * s)
+{
+  fprintf(f, "<h2>Site: %u packs</h2>\n", s->packs);
+  if ( s->alarms )
+    fprintf(f, "<p><strong>&#x26a0;&nbsp;%u in an alarm state. &#x26a0;</strong></p>\n", s->alarms);
+  else
+    fprintf(f, "<p>&#x263a;&nbsp;No Alarms.</p>\n");
+  if ( s->packs == 0 )
+    return;
+
+  fprintf(f, "<table>\n");
+  fprintf(f, "<tr><th style=\"text-align: right;\">Current</th><td>%.2f A</td></tr>\n", s->current);
+  fprintf(f, "<tr><th style=\"text-align: right;\">Power</th><td>%.0f W</td></tr>\n", s->power);
+  fprintf(f, "<tr><th style=\"text-align: right;\">Stored Energy</th><td>%.2f kWh, %.2f of %.2f AH, %.0f%%</td></tr>\n", s->energy / 1000, s->residual_capacity, s->battery_capacity, s->state_of_charge);
+  fprintf(f, "<tr><th style=\"text-align: right;\">State of Charge</th><td>%.0f%% - %.0f%% (spread %.0f%%), lowest at controller %x, battery pack %x</td></tr>\n", s->lowest_state_of_charge.value, s->highest_state_of_charge.value, s->highest_state_of_charge.value - s->lowest_state_of_charge.value, s->lowest_state_of_charge.controller_address, s->lowest_state_of_charge.battery_pack_number);
+  fprintf(f, "<tr><th style=\"text-align: right;\">Lowest Cell</th><td>%.3f V, cell %u of controller %x, battery pack %x</td></tr>\n", s->lowest_cell.value, s->lowest_cell.element, s->lowest_cell.controller_address, s->lowest_cell.battery_pack_number);
+  fprintf(f, "<tr><th style=\"text-align: right;\">Highest Cell</th><td>%.3f V, cell %u of controller %x, battery pack %x</td></tr>\n", s->highest_cell.value, s->highest_cell.element, s->highest_cell.controller_address, s->highest_cell.battery_pack_number);
+  fprintf(f, "<tr><th style=\"text-align: right;\">Coldest</th><td>%.0f C, %.0f F, %s of controller %x, battery pack %x</td></tr>\n", s->coldest.value, _sp_farenheit(s->coldest.value), seplos_temperature_names[s->coldest.element], s->coldest.controller_address, s->coldest.battery_pack_number);
+  fprintf(f, "<tr><th style=\"text-align: right;\">Hottest</th><td>%.0f C, %.0f F, %s of controller %x, battery pack %x</td></tr>\n", s->hottest.value, _sp_farenheit(s->hottest.value), seplos_temperature_names[s->hottest.element], s->hottest.controller_address, s->hottest.battery_pack_number);
+  fprintf(f, "</table>\n");
+}
+
+static void
+date_html(FILE * f, int64_t timestamp)
+{
+  const time_t	seconds = timestamp / 1000000;
+  struct tm	t;
+  char		s[64];
+
+  strftime(s, sizeof(s), "%Y-%m-%d %H:%M:%S", localtime_r(&seconds, &t));
+  fputs(s, f);
+}
+
+void
+seplos_analysis_html(FILE * f, const SeplosAnalysis * a)
+{
+  fprintf(f, "<h2>Controller %x, battery pack %x:</h2>\n", a->controller_address, a->battery_pack_number);
+  fprintf(f, "<table>\n");
+  fprintf(f, "<tr><th style=\"text-align: right;\">Samples</th><td>%llu", (unsigned long long)a->samples);
+  if ( a->samples > 0 ) {
+    fprintf(f, ", ");
+    date_html(f, a->first);
+    fprintf(f, " to ");
+    date_html(f, a->last);
+  }
+  fprintf(f, "</td></tr>\n");
+  if ( a->samples == 0 ) {
+    fprintf(f, "</table>\n");
+    return;
+  }
+  fprintf(f, "<tr><th style=\"text-align: right;\">Cycles</th><td>%u - %u</td></tr>\n", a->first_cycles, a->last_cycles);
+  fprintf(f, "<tr><th style=\"text-align: right;\">State of Health</th><td>%.1f%% - %.1f%%", a->first_state_of_health, a->last_state_of_health);
+  if ( a->last_cycles > a->first_cycles )
+    fprintf(f, ", %.2f%% per 100 cycles", a->state_of_health_per_100_cycles);
+  fprintf(f, "</td></tr>\n");
+  fprintf(f, "<tr><th style=\"text-align: right;\">Resistance From</th><td>%llu steps of the current</td></tr>\n", (unsigned long long)a->steps);
+  fprintf(f, "</table>\n");
+
+  fprintf(f, "<table>\n");
+  fprintf(f, "<tr><th rowspan=\"2\">Cell</th><th colspan=\"4\">Deviation from the Mean, mV</th><th rowspan=\"2\">Balancing</th><th rowspan=\"2\">Resistance, m&#x2126;</th></tr>\n");
+  fprintf(f, "<tr><th>Mean</th><th>RMS</th><th>Lowest</th><th>Highest</th></tr>\n");
+  for ( unsigned int c = 0; c < a->number_of_cells; c++ ) {
+    fprintf(
+     f,
+     "<tr><th>%u</th><td>%.2f</td><td>%.2f</td><td>%.2f</td><td>%.2f</td><td>%.1f%%</td>",
+     c,
+     a->mean_deviation[c],
+     a->rms_deviation[c],
+     a->lowest_deviation[c],
+     a->highest_deviation[c],
+     a->balancing[c]);
+    if ( a->steps > 0 )
+      fprintf(f, "<td>%.3f</td></tr>\n", a->resistance[c]);
+    else
+      fprintf(f, "<td>-</td></tr>\n");
+  }
+  fprintf(f, "</table>\n");
+}
@@ -8,6 +8,77 @@ typedef struct _Seplos_2_O_Binary {
   uint16_t	length;
 } Seplos_2_0_Binary;
 
+/*
+ * The layout of a record, see record.c. The store in store.c keeps the same
+ * fields, in columns.
+ */
+typedef struct _SeplosRecord {
+  uint8_t	timestamp[8];		/* Microseconds since 1970, UTC */
+  uint8_t	controller_address;
+  uint8_t	battery_pack_number;
+  uint8_t	number_of_cells;
+  uint8_t	system_state;		/* As the BMS sends it */
+  uint8_t	on_off_state;		/* As the BMS sends it */
+  uint8_t	reserved;
+  uint8_t	cell_voltage[SEPLOS_N_CELLS][2];	/* mV */
+  uint8_t	temperature[SEPLOS_N_TEMPERATURES][2];	/* 0.1 K */
+  uint8_t	charge_discharge_current[2];	/* 0.01 A, signed */
+  uint8_t	total_battery_voltage[2];	/* 0.01 V */
+  uint8_t	residual_capacity[2];		/* 0.01 AH */
+  uint8_t	battery_capacity[2];		/* 0.01 AH */
+  uint8_t	state_of_charge[2];		/* 0.1 % */
+  uint8_t	rated_capacity[2];		/* 0.01 AH */
+  uint8_t	number_of_cycles[2];
+  uint8_t	state_of_health[2];		/* 0.1 % */
+  uint8_t	port_voltage[2];		/* 0.01 V */
+  uint8_t	equilibrium_state[2];
+  uint8_t	disconnection_state[2];
+  uint8_t	cell_alarm[SEPLOS_N_CELLS];
+  uint8_t	temperature_alarm[SEPLOS_N_TEMPERATURES];
+  uint8_t	charge_discharge_current_alarm;
+  uint8_t	total_battery_voltage_alarm;
+  uint8_t	bit_alarm[SEPLOS_N_BIT_ALARMS / 8];
+} SeplosRecord;
+
+_Static_assert(sizeof(SeplosRecord) == SEPLOS_RECORD_SIZE, "SeplosRecord must have no padding.");
+
+/*
+ * A span of the columns of a store, for the kernels of analysis.c. steps[t] is
+ * the step in the current from sample t - 1, in 0.01 A, or 0 if it isn't one
+ * to estimate resistance from. previous is the cell voltages of the sample
+ * before the first.
+ */
+typedef struct _AnalysisSpan {
+  const uint16_t *	cells[SEPLOS_N_CELLS];
+  const uint16_t *	equilibrium;
+  const int16_t *	steps;
+  uint16_t		previous[SEPLOS_N_CELLS];
+  unsigned int		number_of_cells;
+} AnalysisSpan;
+
+/*
+ * The sums of the kernels over a span, each by cell. A deviation is
+ * number_of_cells * the cell voltage - the total of the cell voltages, in mV,
+ * so that it's an integer.
+ */
+typedef struct _AnalysisSums {
+  int64_t	deviation[SEPLOS_N_CELLS];
+  int64_t	squares[SEPLOS_N_CELLS];
+  int32_t	lowest[SEPLOS_N_CELLS];
+  int32_t	highest[SEPLOS_N_CELLS];
+  int64_t	balancing[SEPLOS_N_CELLS];	/* Samples with the equilibrium bit set */
+  int64_t	products[SEPLOS_N_CELLS];	/* Of the steps of the cell voltage and current */
+} AnalysisSums;
+
+/* The most samples in a span, so that the kernels can't overflow. */
+#define	ANALYSIS_SPAN	4096
+
+/* Returned by _sp_read_serial() when the deadline passes, rather than -1. */
+#define	SERIAL_TIMED_OUT	(-2)
+
+extern void		_sp_analyze(const AnalysisSpan * s, unsigned int count, AnalysisSums * sums);
+extern void		_sp_analyze_scalar(const AnalysisSpan * s, unsigned int from, unsigned int to, AnalysisSums * sums);
+extern int64_t		_sp_deadline(void);
 extern void		_sp_discard_serial_input(seplos_device fd);
 extern void		_sp_error(const char * restrict pattern, ...);
 extern float		_sp_farenheit(float c);
@@ -17,8 +88,21 @@ extern void		_sp_hex4(uint16_t value, char ascii[4]);
 extern uint8_t		_sp_hex1b(uint8_t c, bool * invalid);
 extern uint8_t		_sp_hex2b(const char ascii[2], bool * invalid);
 extern uint16_t		_sp_hex4b(const char ascii[4], bool * invalid);
+extern bool		_sp_hex_decode(const char * restrict ascii, uint8_t * restrict binary, unsigned int length);
+extern bool		_sp_hex_decode_scalar(const char * restrict ascii, uint8_t * restrict binary, unsigned int length);
 extern unsigned int	_sp_length_checksum(unsigned int length);
+extern int64_t		_sp_monotonic_time(void);
 extern unsigned int	_sp_overall_checksum(const char * restrict data, unsigned int length);
-extern int		_sp_read_serial(seplos_device fd, void * data, size_t size);
+extern unsigned int	_sp_overall_checksum_scalar(const char * restrict data, unsigned int length);
+extern int		_sp_read_serial(seplos_device fd, void * data, size_t size, int64_t deadline);
+extern void		_sp_summarize_alarms(SeplosData * m);
 extern void		_sp_wait_until_serial_data_is_transmitted(seplos_device fd);
 extern int		_sp_write_serial(seplos_device fd, void * data, size_t size);
+
+#if defined(__x86_64__) || defined(__i386__)
+extern void		_sp_analyze_avx2(const AnalysisSpan * s, unsigned int count, AnalysisSums * sums);
+extern bool		_sp_hex_decode_avx2(const char * restrict ascii, uint8_t * restrict binary, unsigned int length);
+extern bool		_sp_hex_decode_sse2(const char * restrict ascii, uint8_t * restrict binary, unsigned int length);
+extern unsigned int	_sp_overall_checksum_avx2(const char * restrict data, unsigned int length);
+extern unsigned int	_sp_overall_checksum_sse2(const char * restrict data, unsigned int length);
+#endif
@@ -1,6 +1,664 @@
 #include "./internal.h"
+#include <math.h>
+#include <string.h>
+
+/*
+ * The JSON is written into the caller's buffer by hand, without stdio or
+ * allocation, so that serializing a sample costs a microsecond or two.
+ * Numbers are printed in fixed point, with as many decimal places as the BMS
+ * reports, which is all that the values mean and is exact where "%g" would
+ * print 3.2999999.
+ *
+ * Like snprintf(), seplos_json_format() returns the length of the whole JSON,
+ * and writes as much of it as fits into the buffer, always terminated with
+ * '\0' if size isn't 0. SEPLOS_JSON_SIZE is enough for any SeplosData.
+ */
+
+typedef struct _Writer {
+  char *	p;
+  char *	end;	/* The last byte of the buffer, kept for the '\0' */
+  size_t	length;
+} Writer;
+
+static inline void
+put_char(Writer * w, char c)
+{
+  if ( w->p < w->end )
+    *w->p++ = c;
+  w->length++;
+}
+
+static void
+put_raw(Writer * w, const char * s, size_t length)
+{
+  const size_t room = w->end - w->p;
+  const size_t n = length < room ? length : room;
+
+  memcpy(w->p, s, n);
+  w->p += n;
+  w->length += length;
+}
+
+#define PUT(w, literal)	put_raw((w), (literal), sizeof(literal) - 1)
+
+static void
+put_string(Writer * w, const char * s)
+{
+  static const char hex[] = "0123456789abcdef";
+
+  put_char(w, '"');
+  for ( ; *s; s++ ) {
+    const unsigned char c = *s;
+
+    if ( c == '"' || c == '\\' ) {
+      put_char(w, '\\');
+      put_char(w, c);
+    }
+    else if ( c < 0x20 ) {
+      PUT(w, "\\u00");
+      put_char(w, hex[c >> 4]);
+      put_char(w, hex[c & 0xf]);
+    }
+    else
+      put_char(w, c);
+  }
+  put_char(w, '"');
+}
+
+static void
+put_unsigned(Writer * w, unsigned long long value)
+{
+  char		digits[20];
+  unsigned int	n = 0;
+
+  do {
+    digits[n++] = '0' + (value % 10);
+    value /= 10;
+  } while ( value != 0 );
+
+  while ( n > 0 )
+    put_char(w, digits[--n]);
+}
+
+/* value, rounded to decimals places, at most 6. */
+static void
+put_fixed(Writer * w, double value, unsigned int decimals)
+{
+  static const unsigned long scales[] = { 1, 10, 100, 1000, 10000, 100000, 1000000 };
+  const unsigned long scale = scales[decimals];
+
+  /* JSON has no representation of these, and any reader will take null. */
+  if ( !isfinite(value) || fabs(value) >= 1e12 ) {
+    PUT(w, "null");
+    return;
+  }
+
+  const long long fixed = llround(value * scale);
+  unsigned long long magnitude = fixed < 0 ? -fixed : fixed;
+
+  if ( fixed < 0 )
+    put_char(w, '-');
+  put_unsigned(w, magnitude / scale);
+  if ( decimals > 0 ) {
+    char	fraction[6];
+    unsigned long remainder = magnitude % scale;
+
+    put_char(w, '.');
+    for ( unsigned int i = decimals; i > 0; i-- ) {
+      fraction[i - 1] = '0' + (remainder % 10);
+      remainder /= 10;
+    }
+    put_raw(w, fraction, decimals);
+  }
+}
+
+static void
+put_bool(Writer * w, bool value)
+{
+  if ( value )
+    PUT(w, "true");
+  else
+    PUT(w, "false");
+}
+
+/* "name": with the comma before it, for all but the first member of an object. */
+static void
+put_name(Writer * w, const char * name, bool * first)
+{
+  if ( !*first )
+    put_char(w, ',');
+  *first = false;
+  put_char(w, '"');
+  put_raw(w, name, strlen(name));
+  PUT(w, "\":");
+}
+
+static const char *
+byte_alarm_name(uint8_t value)
+{
+  switch ( value ) {
+  case NORMAL:
+    return "normal";
+  case LOW_LIMIT_HIT:
+    return "low";
+  case HIGH_LIMIT_HIT:
+    return "high";
+  case OTHER_ALARM:
+    return "other";
+  default:
+    return "undefined";
+  }
+}
+
+/* A list of the cells whose bit is set in state. */
+static void
+put_cells(Writer * w, uint16_t state)
+{
+  bool first = true;
+
+  put_char(w, '[');
+  for ( unsigned int i = 0; i < SEPLOS_N_CELLS; i++ ) {
+    if ( state & (1 << i) ) {
+      if ( !first )
+        put_char(w, ',');
+      first = false;
+      put_unsigned(w, i);
+    }
+  }
+  put_char(w, ']');
+}
+
+static void
+put_alarms(Writer * w, const SeplosData * m)
+{
+  bool first = true;
+  bool first_element;
+
+  put_char(w, '{');
+  put_name(w, "depleted", &first);
+  put_bool(w, m->depleted);
+  put_name(w, "overcharge", &first);
+  put_bool(w, m->overcharge);
+  put_name(w, "cold", &first);
+  put_bool(w, m->cold);
+  put_name(w, "hot", &first);
+  put_bool(w, m->hot);
+  put_name(w, "other_or_undocumented", &first);
+  put_bool(w, m->other_or_undocumented_alarm_state);
+  put_name(w, "total_battery_voltage", &first);
+  put_string(w, byte_alarm_name(m->total_battery_voltage_alarm));
+  put_name(w, "charge_discharge_current", &first);
+  put_string(w, byte_alarm_name(m->charge_discharge_current_alarm));
+
+  /* Only the cells and sensors that aren't normal, usually none. */
+  put_name(w, "cells", &first);
+  put_char(w, '[');
+  first_element = true;
+  for ( uint64_t cells = seplos_any_alarm(&(m->cell_alarms)); cells; ) {
+    const unsigned int i = seplos_next_alarm(&cells);
+    if ( !first_element )
+      put_char(w, ',');
+    first_element = false;
+    PUT(w, "{\"cell\":");
+    put_unsigned(w, i);
+    PUT(w, ",\"state\":");
+    put_string(w, byte_alarm_name(m->cell_alarm[i]));
+    put_char(w, '}');
+  }
+  put_char(w, ']');
+
+  put_name(w, "temperatures", &first);
+  put_char(w, '[');
+  first_element = true;
+  for ( uint64_t sensors = seplos_any_alarm(&(m->temperature_alarms)); sensors; ) {
+    const unsigned int i = seplos_next_alarm(&sensors);
+    if ( !first_element )
+      put_char(w, ',');
+    first_element = false;
+    PUT(w, "{\"sensor\":");
+    put_string(w, seplos_temperature_names[i]);
+    PUT(w, ",\"state\":");
+    put_string(w, byte_alarm_name(m->temperature_alarm[i]));
+    put_char(w, '}');
+  }
+  put_char(w, ']');
+
+  put_name(w, "bits", &first);
+  put_char(w, '[');
+  first_element = true;
+  for ( uint64_t bits = seplos_bit_alarms(m); bits; ) {
+    const unsigned int i = seplos_next_alarm(&bits);
+    if ( !first_element )
+      put_char(w, ',');
+    first_element = false;
+    if ( seplos_bit_alarm_names[i] )
+      put_string(w, seplos_bit_alarm_names[i]);
+    else {
+      /* Bits that SEPLOS didn't document have no name. */
+      PUT(w, "\"Undocumented alarm ");
+      put_unsigned(w, i);
+      put_char(w, '"');
+    }
+  }
+  put_char(w, ']');
+  put_char(w, '}');
+}
+
+size_t
+seplos_json_format(char * buffer, size_t size, const SeplosData * m, bool longer)
+{
+  Writer	w = { buffer, buffer + (size > 0 ? size - 1 : 0), 0 };
+  bool		first = true;
+
+  put_char(&w, '{');
+  put_name(&w, "controller_address", &first);
+  put_unsigned(&w, m->controller_address);
+  put_name(&w, "battery_pack_number", &first);
+  put_unsigned(&w, m->battery_pack_number);
+  put_name(&w, "has_alarm", &first);
+  put_bool(&w, m->has_alarm);
+  put_name(&w, "alarms", &first);
+  put_alarms(&w, m);
+
+  put_name(&w, "total_battery_voltage", &first);
+  put_fixed(&w, m->total_battery_voltage, 2);
+  put_name(&w, "charge_discharge_current", &first);
+  put_fixed(&w, m->charge_discharge_current, 2);
+  put_name(&w, "state_of_charge", &first);
+  put_fixed(&w, m->state_of_charge, 1);
+  put_name(&w, "residual_capacity", &first);
+  put_fixed(&w, m->residual_capacity, 2);
+  put_name(&w, "battery_capacity", &first);
+  put_fixed(&w, m->battery_capacity, 2);
+  put_name(&w, "rated_capacity", &first);
+  put_fixed(&w, m->rated_capacity, 2);
+  put_name(&w, "state_of_health", &first);
+  put_fixed(&w, m->state_of_health, 1);
+  put_name(&w, "number_of_cycles", &first);
+  put_unsigned(&w, m->number_of_cycles);
+  put_name(&w, "port_voltage", &first);
+  put_fixed(&w, m->port_voltage, 2);
+  put_name(&w, "lowest_cell_voltage", &first);
+  put_fixed(&w, m->lowest_cell_voltage, 3);
+  put_name(&w, "highest_cell_voltage", &first);
+  put_fixed(&w, m->highest_cell_voltage, 3);
+  put_name(&w, "lowest_temperature", &first);
+  put_fixed(&w, m->lowest_temperature, 1);
+  put_name(&w, "highest_temperature", &first);
+  put_fixed(&w, m->highest_temperature, 1);
+
+  put_name(&w, "discharge", &first);
+  put_bool(&w, m->discharge);
+  put_name(&w, "charge", &first);
+  put_bool(&w, m->charge);
+  put_name(&w, "floating_charge", &first);
+  put_bool(&w, m->floating_charge);
+  put_name(&w, "standby", &first);
+  put_bool(&w, m->standby);
+  put_name(&w, "shutdown", &first);
+  put_bool(&w, m->shutdown);
+  put_name(&w, "discharge_switch", &first);
+  put_bool(&w, m->discharge_switch);
+  put_name(&w, "charge_switch", &first);
+  put_bool(&w, m->charge_switch);
+  put_name(&w, "current_limit_switch", &first);
+  put_bool(&w, m->current_limit_switch);
+  put_name(&w, "heating_switch", &first);
+  put_bool(&w, m->heating_switch);
+
+  if ( longer ) {
+    put_name(&w, "cell_voltage", &first);
+    put_char(&w, '[');
+    for ( unsigned int i = 0; i < SEPLOS_N_CELLS; i++ ) {
+      if ( i > 0 )
+        put_char(&w, ',');
+      put_fixed(&w, m->cell_voltage[i], 3);
+    }
+    put_char(&w, ']');
+
+    put_name(&w, "temperature", &first);
+    put_char(&w, '{');
+    for ( unsigned int i = 0; i < SEPLOS_N_TEMPERATURES; i++ ) {
+      if ( i > 0 )
+        put_char(&w, ',');
+      put_string(&w, seplos_temperature_names[i]);
+      put_char(&w, ':');
+      put_fixed(&w, m->temperature[i], 1);
+    }
+    put_char(&w, '}');
+
+    /* The numbers of the cells that are balancing, or disconnected. */
+    put_name(&w, "equilibrium", &first);
+    put_cells(&w, m->equilibrium_state);
+    put_name(&w, "disconnected", &first);
+    put_cells(&w, m->disconnection_state);
+  }
+  put_char(&w, '}');
+
+  if ( size > 0 )
+    *w.p = '\0';
+  return w.length;
+}
+
+/*
+ * Only the fields in changes, as seplos_diff() sets them, with the same names
+ * as in seplos_json_format(). Cell voltages and temperatures are objects, with
+ * the number of the cell or the name of the sensor for each that changed. Any
+ * change of the alarms prints all of them, since one alarm can't be understood
+ * without the others.
+ */
+size_t
+seplos_json_changes_format(char * buffer, size_t size, const SeplosData * m, const SeplosChanges * changes)
+{
+  Writer	w = { buffer, buffer + (size > 0 ? size - 1 : 0), 0 };
+  bool		first = true;
+  bool		first_element;
+  const uint32_t f = changes->fields;
+
+  put_char(&w, '{');
+  put_name(&w, "controller_address", &first);
+  put_unsigned(&w, m->controller_address);
+  put_name(&w, "battery_pack_number", &first);
+  put_unsigned(&w, m->battery_pack_number);
+
+  if ( f & SEPLOS_CHANGED_ALARMS ) {
+    put_name(&w, "has_alarm", &first);
+    put_bool(&w, m->has_alarm);
+    put_name(&w, "alarms", &first);
+    put_alarms(&w, m);
+  }
+  if ( f & SEPLOS_CHANGED_VOLTAGE ) {
+    put_name(&w, "total_battery_voltage", &first);
+    put_fixed(&w, m->total_battery_voltage, 2);
+  }
+  if ( f & SEPLOS_CHANGED_CURRENT ) {
+    put_name(&w, "charge_discharge_current", &first);
+    put_fixed(&w, m->charge_discharge_current, 2);
+  }
+  if ( f & SEPLOS_CHANGED_STATE_OF_CHARGE ) {
+    put_name(&w, "state_of_charge", &first);
+    put_fixed(&w, m->state_of_charge, 1);
+  }
+  if ( f & SEPLOS_CHANGED_RESIDUAL_CAPACITY ) {
+    put_name(&w, "residual_capacity", &first);
+    put_fixed(&w, m->residual_capacity, 2);
+  }
+  if ( f & SEPLOS_CHANGED_BATTERY_CAPACITY ) {
+    put_name(&w, "battery_capacity", &first);
+    put_fixed(&w, m->battery_capacity, 2);
+  }
+  if ( f & SEPLOS_CHANGED_RATED_CAPACITY ) {
+    put_name(&w, "rated_capacity", &first);
+    put_fixed(&w, m->rated_capacity, 2);
+  }
+  if ( f & SEPLOS_CHANGED_STATE_OF_HEALTH ) {
+    put_name(&w, "state_of_health", &first);
+    put_fixed(&w, m->state_of_health, 1);
+  }
+  if ( f & SEPLOS_CHANGED_CYCLES ) {
+    put_name(&w, "number_of_cycles", &first);
+    put_unsigned(&w, m->number_of_cycles);
+  }
+  if ( f & SEPLOS_CHANGED_PORT_VOLTAGE ) {
+    put_name(&w, "port_voltage", &first);
+    put_fixed(&w, m->port_voltage, 2);
+  }
+  if ( f & SEPLOS_CHANGED_STATE ) {
+    put_name(&w, "discharge", &first);
+    put_bool(&w, m->discharge);
+    put_name(&w, "charge", &first);
+    put_bool(&w, m->charge);
+    put_name(&w, "floating_charge", &first);
+    put_bool(&w, m->floating_charge);
+    put_name(&w, "standby", &first);
+    put_bool(&w, m->standby);
+    put_name(&w, "shutdown", &first);
+    put_bool(&w, m->shutdown);
+  }
+  if ( f & SEPLOS_CHANGED_SWITCHES ) {
+    put_name(&w, "discharge_switch", &first);
+    put_bool(&w, m->discharge_switch);
+    put_name(&w, "charge_switch", &first);
+    put_bool(&w, m->charge_switch);
+    put_name(&w, "current_limit_switch", &first);
+    put_bool(&w, m->current_limit_switch);
+    put_name(&w, "heating_switch", &first);
+    put_bool(&w, m->heating_switch);
+  }
+
+  if ( changes->cell_voltage ) {
+    put_name(&w, "cell_voltage", &first);
+    put_char(&w, '{');
+    first_element = true;
+    for ( unsigned int i = 0; i < SEPLOS_N_CELLS; i++ ) {
+      if ( changes->cell_voltage & (1 << i) ) {
+        if ( !first_element )
+          put_char(&w, ',');
+        first_element = false;
+        put_char(&w, '"');
+        put_unsigned(&w, i);
+        PUT(&w, "\":");
+        put_fixed(&w, m->cell_voltage[i], 3);
+      }
+    }
+    put_char(&w, '}');
+  }
+  if ( changes->temperature ) {
+    put_name(&w, "temperature", &first);
+    put_char(&w, '{');
+    first_element = true;
+    for ( unsigned int i = 0; i < SEPLOS_N_TEMPERATURES; i++ ) {
+      if ( changes->temperature & (1 << i) ) {
+        if ( !first_element )
+          put_char(&w, ',');
+        first_element = false;
+        put_string(&w, seplos_temperature_names[i]);
+        put_char(&w, ':');
+        put_fixed(&w, m->temperature[i], 1);
+      }
+    }
+    put_char(&w, '}');
+  }
+  if ( f & SEPLOS_CHANGED_EQUILIBRIUM ) {
+    put_name(&w, "equilibrium", &first);
+    put_cells(&w, m->equilibrium_state);
+  }
+  if ( f & SEPLOS_CHANGED_DISCONNECTION ) {
+    put_name(&w, "disconnected", &first);
+    put_cells(&w, m->disconnection_state);
+  }
+  put_char(&w, '}');
+
+  if ( size > 0 )
+    *w.p = '\0';
+  return w.length;
+}
+
+/*
+ * Write one object per line, so that a stream of them can be read line by line.
+ * The buffer is SEPLOS_JSON_SIZE bytes, formatted with one less as its size to
+ * leave room for the newline, and length is what the format function returned.
+ */
+static void
+put_line(FILE * f, char * buffer, size_t length)
+{
+  if ( length > SEPLOS_JSON_SIZE - 2 ) {
+    _sp_error("JSON truncated, %zu bytes didn't fit.\n", length - (SEPLOS_JSON_SIZE - 2));
+    length = SEPLOS_JSON_SIZE - 2;
+  }
+  buffer[length] = '\n';
+  fwrite(buffer, 1, length + 1, f);
+}
+
+void
+seplos_json_changes(FILE * f, const SeplosData * m, const SeplosChanges * changes)
+{
+  char	buffer[SEPLOS_JSON_SIZE];
+
+  put_line(f, buffer, seplos_json_changes_format(buffer, sizeof(buffer) - 1, m, changes));
+}
 
 void
 seplos_json(FILE * f, const SeplosData const * m, bool longer)
 {
+  char	buffer[SEPLOS_JSON_SIZE];
+
+  put_line(f, buffer, seplos_json_format(buffer, sizeof(buffer) - 1, m, longer));
+}
+
+enum Element {
+  ELEMENT_NONE,
+  ELEMENT_CELL,
+  ELEMENT_SENSOR
+};
+
+/* An extreme of a site: its value, and the pack, and the cell or sensor. */
+static void
+put_extreme(Writer * w, const SeplosFleetExtreme * e, unsigned int decimals, enum Element element)
+{
+  bool first = true;
+
+  put_char(w, '{');
+  put_name(w, "value", &first);
+  put_fixed(w, e->value, decimals);
+  put_name(w, "controller_address", &first);
+  put_unsigned(w, e->controller_address);
+  put_name(w, "battery_pack_number", &first);
+  put_unsigned(w, e->battery_pack_number);
+  if ( element == ELEMENT_CELL ) {
+    put_name(w, "cell", &first);
+    put_unsigned(w, e->element);
+  }
+  else if ( element == ELEMENT_SENSOR ) {
+    put_name(w, "sensor", &first);
+    put_string(w, seplos_temperature_names[e->element]);
+  }
+  put_char(w, '}');
+}
+
+/* The summary of a site, with the extremes as objects, omitted if no pack has a sample. */
+size_t
+seplos_fleet_json_format(char * buffer, size_t size, const SeplosFleetSummary * s)
+{
+  Writer	w = { buffer, buffer + (size > 0 ? size - 1 : 0), 0 };
+  bool		first = true;
+
+  put_char(&w, '{');
+  put_name(&w, "packs", &first);
+  put_unsigned(&w, s->packs);
+  put_name(&w, "alarms", &first);
+  put_unsigned(&w, s->alarms);
+  if ( s->packs > 0 ) {
+    put_name(&w, "current", &first);
+    put_fixed(&w, s->current, 2);
+    put_name(&w, "power", &first);
+    put_fixed(&w, s->power, 0);
+    put_name(&w, "residual_capacity", &first);
+    put_fixed(&w, s->residual_capacity, 2);
+    put_name(&w, "battery_capacity", &first);
+    put_fixed(&w, s->battery_capacity, 2);
+    put_name(&w, "energy", &first);
+    put_fixed(&w, s->energy, 0);
+    put_name(&w, "state_of_charge", &first);
+    put_fixed(&w, s->state_of_charge, 1);
+    put_name(&w, "lowest_cell_voltage", &first);
+    put_extreme(&w, &(s->lowest_cell), 3, ELEMENT_CELL);
+    put_name(&w, "highest_cell_voltage", &first);
+    put_extreme(&w, &(s->highest_cell), 3, ELEMENT_CELL);
+    put_name(&w, "lowest_temperature", &first);
+    put_extreme(&w, &(s->coldest), 1, ELEMENT_SENSOR);
+    put_name(&w, "highest_temperature", &first);
+    put_extreme(&w, &(s->hottest), 1, ELEMENT_SENSOR);
+    put_name(&w, "lowest_state_of_charge", &first);
+    put_extreme(&w, &(s->lowest_state_of_charge), 1, ELEMENT_NONE);
+    put_name(&w, "highest_state_of_charge", &first);
+    put_extreme(&w, &(s->highest_state_of_charge), 1, ELEMENT_NONE);
+  }
+  put_char(&w, '}');
+
+  if ( size > 0 )
+    *w.p = '\0';
+  return w.length;
+}
+
+void
+seplos_fleet_json(FILE * f, const SeplosFleetSummary * s)
+{
+  char	buffer[SEPLOS_JSON_SIZE];
+
+  put_line(f, buffer, seplos_fleet_json_format(buffer, sizeof(buffer) - 1, s));
+}
+
+/* The trends of each cell are an array of objects, in the order of the cells. */
+size_t
+seplos_analysis_json_format(char * buffer, size_t size, const SeplosAnalysis * a)
+{
+  Writer	w = { buffer, buffer + (size > 0 ? size - 1 : 0), 0 };
+  bool		first = true;
+
+  put_char(&w, '{');
+  put_name(&w, "controller_address", &first);
+  put_unsigned(&w, a->controller_address);
+  put_name(&w, "battery_pack_number", &first);
+  put_unsigned(&w, a->battery_pack_number);
+  put_name(&w, "samples", &first);
+  put_unsigned(&w, a->samples);
+  if ( a->samples > 0 ) {
+    put_name(&w, "first", &first);
+    put_unsigned(&w, a->first);
+    put_name(&w, "last", &first);
+    put_unsigned(&w, a->last);
+    put_name(&w, "first_cycles", &first);
+    put_unsigned(&w, a->first_cycles);
+    put_name(&w, "last_cycles", &first);
+    put_unsigned(&w, a->last_cycles);
+    put_name(&w, "first_state_of_health", &first);
+    put_fixed(&w, a->first_state_of_health, 1);
+    put_name(&w, "last_state_of_health", &first);
+    put_fixed(&w, a->last_state_of_health, 1);
+    put_name(&w, "state_of_health_per_100_cycles", &first);
+    put_fixed(&w, a->state_of_health_per_100_cycles, 2);
+    put_name(&w, "steps", &first);
+    put_unsigned(&w, a->steps);
+    put_name(&w, "cells", &first);
+    put_char(&w, '[');
+    for ( unsigned int c = 0; c < a->number_of_cells; c++ ) {
+      bool first_field = true;
+
+      if ( c > 0 )
+        put_char(&w, ',');
+      put_char(&w, '{');
+      put_name(&w, "cell", &first_field);
+      put_unsigned(&w, c);
+      put_name(&w, "mean_deviation", &first_field);
+      put_fixed(&w, a->mean_deviation[c], 2);
+      put_name(&w, "rms_deviation", &first_field);
+      put_fixed(&w, a->rms_deviation[c], 2);
+      put_name(&w, "lowest_deviation", &first_field);
+      put_fixed(&w, a->lowest_deviation[c], 2);
+      put_name(&w, "highest_deviation", &first_field);
+      put_fixed(&w, a->highest_deviation[c], 2);
+      put_name(&w, "balancing", &first_field);
+      put_fixed(&w, a->balancing[c], 1);
+      if ( a->steps > 0 ) {
+        put_name(&w, "resistance", &first_field);
+        put_fixed(&w, a->resistance[c], 3);
+      }
+      put_char(&w, '}');
+    }
+    put_char(&w, ']');
+  }
+  put_char(&w, '}');
+
+  if ( size > 0 )
+    *w.p = '\0';
+  return w.length;
+}
+
+void
+seplos_analysis_json(FILE * f, const SeplosAnalysis * a)
+{
+  char	buffer[SEPLOS_JSON_SIZE];
+
+  put_line(f, buffer, seplos_analysis_json_format(buffer, sizeof(buffer) - 1, a));
 }
@@ -0,0 +1,15 @@
+#include "./internal.h"
+
+static unsigned int	pipeline = 0;
+
+void
+seplos_set_pipeline(unsigned int depth)
+{
+  pipeline = depth;
+}
+
+unsigned int
+seplos_pipeline(void)
+{
+  return pipeline;
+}
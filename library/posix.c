@@ -1,5 +1,6 @@
 #include "./internal.h"
 #include <termios.h>
+#include <time.h>
 #include <unistd.h>
 
 void
@@ -17,3 +18,13 @@ _sp_write_serial(seplos_device fd, void * data, size_t size)
 {
   return write(fd, data, size);
 }
+
+/* Nanoseconds on a clock that isn't changed by setting the time of day. */
+int64_t
+_sp_monotonic_time(void)
+{
+  struct timespec t;
+
+  clock_gettime(CLOCK_MONOTONIC, &t);
+  return (t.tv_sec * 1000000000LL) + t.tv_nsec;
+}
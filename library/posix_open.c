@@ -1,4 +1,5 @@
 #include "./internal.h"
+#include "./communication.h"
 #include <errno.h>
 #include <fcntl.h>
 #include <termios.h>
@@ -19,8 +20,27 @@ seplos_open(const char * serial_device)
   tcgetattr(fd, &t);
   cfsetspeed(&t, 19200);
   cfmakeraw(&t);
+  /*
+   * Reads return as soon as one character is available. The per-transaction
+   * deadline is enforced with poll() in _sp_read_serial(), not by VTIME, because
+   * VTIME is an inter-character timer with a 25.5 second limit.
+   */
+  t.c_cc[VMIN] = 1;
+  t.c_cc[VTIME] = 0;
   tcflush(fd, TCIOFLUSH); /* Throw away any pending I/O */
   tcsetattr(fd, TCSANOW, &t);
 
+  /* Allocate the receive buffer now, rather than failing on the first command. */
+  if ( _sp_connection(fd) == 0 ) {
+    close(fd);
+    return -1;
+  }
   return fd;
 }
+
+void
+seplos_close(seplos_device fd)
+{
+  _sp_connection_close(fd);
+  close(fd);
+}
@@ -1,31 +1,55 @@
 #include "./internal.h"
 #include <errno.h>
+#include <poll.h>
 #include <unistd.h>
 #include <string.h>
 
+/*
+ * Wait for input until the monotonic clock passes deadline, then read as much
+ * as is available, up to size. Returns the number of bytes read, which is at
+ * least one, SERIAL_TIMED_OUT if the deadline passed, or -1 for any other
+ * failure, such as end-of-file, which doesn't set errno. The deadline belongs
+ * to the whole transaction rather than to each read, so a battery that
+ * trickles characters can't stretch a transaction out forever.
+ */
 int
-_sp_read_serial(seplos_device fd, void * data, size_t size)
+_sp_read_serial(seplos_device fd, void * data, size_t size, int64_t deadline)
 {
-  /* FIX: Fill in the timeout here. */
+  for ( ; ; ) {
+    const int64_t remaining = deadline - _sp_monotonic_time();
+    if ( remaining <= 0 ) {
+      _sp_error("Serial read timed out.\n");
+      errno = ETIMEDOUT;
+      return SERIAL_TIMED_OUT;
+    }
 
-  size_t received_amount = 0;
+    struct pollfd p = {};
+    p.fd = fd;
+    p.events = POLLIN;
 
-  while ( received_amount < size ) {
-    int ret = read(fd, data, size - received_amount);
+    /* Round up, so that the poll doesn't return a millisecond early and spin. */
+    const int ret = poll(&p, 1, (remaining + 999999) / 1000000);
     if ( ret < 0 ) {
-      _sp_error("Read failed: %s\n", strerror(errno));
+      if ( errno == EINTR )
+        continue;
+      _sp_error("Poll failed: %s\n", strerror(errno));
       return ret;
     }
-    else if ( ret == 0 ) {
-      /* Read should always block until it receives at least one character */
+    else if ( ret == 0 )
+      continue; /* The deadline check above reports the timeout. */
+
+    const ssize_t amount = read(fd, data, size);
+    if ( amount < 0 ) {
+      if ( errno == EINTR || errno == EAGAIN )
+        continue;
+      _sp_error("Read failed: %s\n", strerror(errno));
+      return amount;
+    }
+    else if ( amount == 0 ) {
+      /* Poll only reports a readable descriptor with no data at hang-up. */
       _sp_error("Serial end-of-file.\n");
       return -1;
     }
-    else {
-      received_amount += ret;
-      data += ret;
-    }
+    return amount;
   }
-  return received_amount;
 }
-
@@ -4,7 +4,7 @@
 float
 seplos_protocol_version(seplos_device fd, unsigned int address)
 {
-  Seplos_2_0	response = {};
+  Seplos_2_0_Reply reply;
   /*
    * For this command: BMS parses the address, but not the pack number.
    */
@@ -16,15 +16,14 @@ seplos_protocol_version(seplos_device fd, unsigned int address)
    PROTOCOL_VER_GET,	/* command */
    &pack_info,		/* pack number */
    sizeof(pack_info),	/* length of the above */
-   &response);
+   &reply);
 
   if ( status != NORMAL ) {
     _sp_error("Bad response %x from SEPLOS BMS.\n", status);
     return -1.0;
   }
 
-  bool invalid = false;
-  uint16_t version = _sp_hex2b(response.version, &invalid);
+  const uint8_t version = reply.header.version;
 
   return ((version >> 4) & 0xf) + ((version & 0xf) * 0.1);
 }
@@ -0,0 +1,453 @@
+#include "./internal.h"
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+
+/*
+ * Alarm rules, evaluated over the successive samples of each pack, which
+ * notify only when a rule changes between raised and cleared.
+ *
+ * The rules are text, one to a line, with # starting a comment:
+ *
+ *   NAME CONDITION [clear VALUE] [for SECONDS] [limit SECONDS]
+ *
+ * where CONDITION is one of
+ *
+ *   alarm			any alarm of the BMS, has_alarm
+ *   depleted, overcharge, hot, cold	the summary alarms of the BMS
+ *   bit N			bit alarm N, the index in seplos_bit_alarm_names[]
+ *   cell-alarm [N]		the byte alarm of cell N, from 0, or of any cell
+ *   temperature-alarm [N]	the byte alarm of sensor N, or of any sensor
+ *   current-alarm		the byte alarm of the current
+ *   voltage-alarm		the byte alarm of the battery voltage
+ *   METRIC > VALUE		a threshold, or METRIC < VALUE
+ *
+ * and METRIC is one of
+ *
+ *   spread		highest_cell_voltage - lowest_cell_voltage, V
+ *   cell		the highest cell voltage for >, the lowest for <, V
+ *   temperature	the highest temperature for >, the lowest for <, C
+ *   current		charge_discharge_current, A, negative when discharging
+ *   voltage		total_battery_voltage, V
+ *   soc		state_of_charge, %
+ *
+ * For example:
+ *
+ *   imbalance	spread > 0.05 clear 0.03 for 60
+ *   too-hot	temperature > 45 clear 42
+ *   low		soc < 20 clear 25 limit 3600
+ *   short		bit 37
+ *
+ * A threshold with "clear" has hysteresis: once raised, the rule clears only
+ * when the metric is back past the clear value, so that a value that sits on
+ * the threshold doesn't raise and clear on every sample. "for" is how long the
+ * condition must hold before the rule is raised. It clears at once.
+ *
+ * "limit" is the fewest seconds between two notifications of the rule for a
+ * pack, DEFAULT_LIMIT if not given. A rule that changes again within that
+ * time isn't notified until the time is up, and then only if it's still in
+ * the other state, with the count of its changes since the last notification.
+ * So a flapping alarm is at most one notification per limit, and the last
+ * notification of a rule is always its present state.
+ *
+ * The rules are compiled to a table when they're read, and evaluating one is a
+ * test of one field, or two, of the sample, so that every rule can be run for
+ * every pack after every poll.
+ */
+
+#define	DEFAULT_LIMIT	60	/* Seconds */
+#define	US_PER_SECOND	1000000LL
+
+enum Input {
+  INPUT_ALARM,
+  INPUT_DEPLETED,
+  INPUT_OVERCHARGE,
+  INPUT_HOT,
+  INPUT_COLD,
+  INPUT_BIT,
+  INPUT_CELL_ALARM,
+  INPUT_TEMPERATURE_ALARM,
+  INPUT_CURRENT_ALARM,
+  INPUT_VOLTAGE_ALARM,
+  /* The thresholds */
+  INPUT_SPREAD,
+  INPUT_CELL,
+  INPUT_TEMPERATURE,
+  INPUT_CURRENT,
+  INPUT_VOLTAGE,
+  INPUT_STATE_OF_CHARGE
+};
+
+typedef struct _Rule {
+  char		name[SEPLOS_RULE_NAME_SIZE];
+  enum Input	input;
+  int		index;	/* The bit, cell, or sensor, or -1 for any */
+  bool		above;	/* The threshold is raised above set, rather than below */
+  float		set;
+  float		clear;
+  int64_t	hold;	/* Microseconds */
+  int64_t	limit;	/* Microseconds */
+} Rule;
+
+/* The state of one rule for one target. */
+typedef struct _RuleState {
+  bool		active;		/* The condition, with hysteresis */
+  bool		raised;		/* active, once it has held for long enough */
+  bool		notified;	/* The state last notified */
+  int64_t	since;		/* When active last changed */
+  int64_t	next;		/* The earliest time of the next notification */
+  unsigned int	changes;	/* Of raised, since the last notification */
+} RuleState;
+
+struct _SeplosRules {
+  unsigned int	count;
+  unsigned int	targets;
+  Rule *	rules;
+  RuleState *	state;	/* count for each target */
+};
+
+static const struct {
+  const char *	name;
+  enum Input	input;
+} inputs[] = {
+  { "alarm", INPUT_ALARM },
+  { "depleted", INPUT_DEPLETED },
+  { "overcharge", INPUT_OVERCHARGE },
+  { "hot", INPUT_HOT },
+  { "cold", INPUT_COLD },
+  { "bit", INPUT_BIT },
+  { "cell-alarm", INPUT_CELL_ALARM },
+  { "temperature-alarm", INPUT_TEMPERATURE_ALARM },
+  { "current-alarm", INPUT_CURRENT_ALARM },
+  { "voltage-alarm", INPUT_VOLTAGE_ALARM },
+  { "spread", INPUT_SPREAD },
+  { "cell", INPUT_CELL },
+  { "temperature", INPUT_TEMPERATURE },
+  { "current", INPUT_CURRENT },
+  { "voltage", INPUT_VOLTAGE },
+  { "soc", INPUT_STATE_OF_CHARGE },
+};
+
+static bool
+number(const char * s, float * value)
+{
+  char * end;
+
+  if ( s == 0 )
+    return false;
+  errno = 0;
+  *value = strtof(s, &end);
+  return end != s && *end == '\0' && errno == 0;
+}
+
+static bool
+index_number(const char * s, unsigned int limit, int * value)
+{
+  char * end;
+
+  if ( s == 0 )
+    return false;
+  const unsigned long n = strtoul(s, &end, 10);
+  if ( end == s || *end != '\0' || n >= limit )
+    return false;
+  *value = n;
+  return true;
+}
+
+/* Compile the rule in line, which is modified. Returns 1 if the line is blank. */
+static int
+compile(Rule * r, char * line, const char * source, unsigned int line_number)
+{
+  char *	words[12];
+  unsigned int	n = 0;
+  unsigned int	w = 0;
+  char *	save;
+
+  if ( (save = strchr(line, '#')) != 0 )
+    *save = '\0';
+  for ( char * word = strtok_r(line, " \t\r\n", &save); word; word = strtok_r(0, " \t\r\n", &save) ) {
+    if ( n == sizeof(words) / sizeof(*words) ) {
+      _sp_error("%s:%u: Too many words in the rule.\n", source, line_number);
+      return -1;
+    }
+    words[n++] = word;
+  }
+  if ( n == 0 )
+    return 1;
+  if ( n < 2 ) {
+    _sp_error("%s:%u: A rule is a name and a condition.\n", source, line_number);
+    return -1;
+  }
+
+  memset(r, 0, sizeof(*r));
+  if ( strlen(words[0]) >= sizeof(r->name) ) {
+    _sp_error("%s:%u: The name of the rule is longer than %u characters.\n", source, line_number, (unsigned int)sizeof(r->name) - 1);
+    return -1;
+  }
+  strcpy(r->name, words[0]);
+  r->index = -1;
+  r->limit = DEFAULT_LIMIT * US_PER_SECOND;
+
+  unsigned int i;
+  for ( i = 0; i < sizeof(inputs) / sizeof(*inputs); i++ ) {
+    if ( strcasecmp(words[1], inputs[i].name) == 0 )
+      break;
+  }
+  if ( i == sizeof(inputs) / sizeof(*inputs) ) {
+    _sp_error("%s:%u: \"%s\" isn't a condition.\n", source, line_number, words[1]);
+    return -1;
+  }
+  r->input = inputs[i].input;
+  w = 2;
+
+  switch ( r->input ) {
+  case INPUT_BIT:
+    if ( !index_number(w < n ? words[w] : 0, SEPLOS_N_BIT_ALARMS, &(r->index)) ) {
+      _sp_error("%s:%u: bit must be followed by the number of a bit alarm, 0 to %u.\n", source, line_number, SEPLOS_N_BIT_ALARMS - 1);
+      return -1;
+    }
+    w++;
+    break;
+  case INPUT_CELL_ALARM:
+  case INPUT_TEMPERATURE_ALARM:
+    {
+      const unsigned int limit = r->input == INPUT_CELL_ALARM ? SEPLOS_N_CELLS : SEPLOS_N_TEMPERATURES;
+      if ( w < n && index_number(words[w], limit, &(r->index)) )
+        w++;
+    }
+    break;
+  case INPUT_SPREAD:
+  case INPUT_CELL:
+  case INPUT_TEMPERATURE:
+  case INPUT_CURRENT:
+  case INPUT_VOLTAGE:
+  case INPUT_STATE_OF_CHARGE:
+    if ( w + 1 >= n || (strcmp(words[w], ">") != 0 && strcmp(words[w], "<") != 0) || !number(words[w + 1], &(r->set)) ) {
+      _sp_error("%s:%u: %s must be followed by > or <, and a number.\n", source, line_number, words[1]);
+      return -1;
+    }
+    r->above = words[w][0] == '>';
+    r->clear = r->set;
+    w += 2;
+    break;
+  default:
+    break;
+  }
+
+  for ( ; w < n; w += 2 ) {
+    float value;
+
+    if ( w + 1 >= n || !number(words[w + 1], &value) ) {
+      _sp_error("%s:%u: \"%s\" must be followed by a number.\n", source, line_number, words[w]);
+      return -1;
+    }
+    if ( strcasecmp(words[w], "clear") == 0 && r->input >= INPUT_SPREAD ) {
+      if ( r->above ? value > r->set : value < r->set ) {
+        _sp_error("%s:%u: The clear value must be on the other side of the threshold.\n", source, line_number);
+        return -1;
+      }
+      r->clear = value;
+    }
+    else if ( strcasecmp(words[w], "for") == 0 && value >= 0 )
+      r->hold = value * US_PER_SECOND;
+    else if ( strcasecmp(words[w], "limit") == 0 && value >= 0 )
+      r->limit = value * US_PER_SECOND;
+    else {
+      _sp_error("%s:%u: \"%s %s\" isn't an option of this rule.\n", source, line_number, words[w], words[w + 1]);
+      return -1;
+    }
+  }
+  return 0;
+}
+
+/*
+ * Compile the rules in text, for count targets. source names the text in
+ * error messages.
+ */
+SeplosRules *
+seplos_rules_parse(const char * text, const char * source, unsigned int targets)
+{
+  SeplosRules * const	r = calloc(1, sizeof(*r));
+  char * const		copy = strdup(text);
+  unsigned int		capacity = 0;
+  unsigned int		line_number = 0;
+
+  if ( r == 0 || copy == 0 ) {
+    _sp_error("Out of memory.\n");
+    free(copy);
+    free(r);
+    return 0;
+  }
+  r->targets = targets;
+
+  for ( char * line = copy; line; ) {
+    char * const end = strchr(line, '\n');
+    if ( end )
+      *end = '\0';
+    line_number++;
+
+    if ( r->count == capacity ) {
+      Rule * const rules = realloc(r->rules, (capacity = capacity ? capacity * 2 : 16) * sizeof(*rules));
+      if ( rules == 0 ) {
+        _sp_error("Out of memory.\n");
+        free(copy);
+        seplos_rules_close(r);
+        return 0;
+      }
+      r->rules = rules;
+    }
+    const int status = compile(&(r->rules[r->count]), line, source, line_number);
+    if ( status < 0 ) {
+      free(copy);
+      seplos_rules_close(r);
+      return 0;
+    }
+    if ( status == 0 )
+      r->count++;
+    line = end ? end + 1 : 0;
+  }
+  free(copy);
+
+  if ( (r->state = calloc((size_t)r->count * targets + 1, sizeof(*(r->state)))) == 0 ) {
+    _sp_error("Out of memory.\n");
+    seplos_rules_close(r);
+    return 0;
+  }
+  return r;
+}
+
+/* Read and compile the rules in a file, for count targets. */
+SeplosRules *
+seplos_rules_load(const char * path, unsigned int targets)
+{
+  FILE * const	f = fopen(path, "r");
+  char *	text = 0;
+  size_t	size = 0;
+
+  if ( f == 0 ) {
+    _sp_error("%s: %s\n", path, strerror(errno));
+    return 0;
+  }
+  const ssize_t length = getdelim(&text, &size, '\0', f);
+  const int error = ferror(f) ? errno : 0;
+  fclose(f);
+  if ( error ) {
+    _sp_error("%s: %s\n", path, strerror(error));
+    free(text);
+    return 0;
+  }
+
+  SeplosRules * const r = seplos_rules_parse(length > 0 ? text : "", path, targets);
+  free(text);
+  return r;
+}
+
+unsigned int
+seplos_rules_count(const SeplosRules * r)
+{
+  return r->count;
+}
+
+/* The value of the input of a rule, which is 0 for an alarm that isn't set. */
+static float
+input(const Rule * r, const SeplosData * m)
+{
+  switch ( r->input ) {
+  case INPUT_ALARM:
+    return m->has_alarm;
+  case INPUT_DEPLETED:
+    return m->depleted;
+  case INPUT_OVERCHARGE:
+    return m->overcharge;
+  case INPUT_HOT:
+    return m->hot;
+  case INPUT_COLD:
+    return m->cold;
+  case INPUT_BIT:
+    return (m->bit_alarm[r->index / 32] >> (r->index % 32)) & 1;
+  case INPUT_CELL_ALARM:
+    return r->index < 0 ? m->has_cell_alarm : m->cell_alarm[r->index];
+  case INPUT_TEMPERATURE_ALARM:
+    return r->index < 0 ? m->has_temperature_alarm : m->temperature_alarm[r->index];
+  case INPUT_CURRENT_ALARM:
+    return m->charge_discharge_current_alarm;
+  case INPUT_VOLTAGE_ALARM:
+    return m->total_battery_voltage_alarm;
+  case INPUT_SPREAD:
+    return m->highest_cell_voltage - m->lowest_cell_voltage;
+  case INPUT_CELL:
+    return r->above ? m->highest_cell_voltage : m->lowest_cell_voltage;
+  case INPUT_TEMPERATURE:
+    return r->above ? m->highest_temperature : m->lowest_temperature;
+  case INPUT_CURRENT:
+    return m->charge_discharge_current;
+  case INPUT_VOLTAGE:
+    return m->total_battery_voltage;
+  case INPUT_STATE_OF_CHARGE:
+    return m->state_of_charge;
+  }
+  return 0;
+}
+
+/*
+ * Evaluate every rule over a sample of a target, taken at timestamp, in
+ * microseconds. The timestamp only times "for" and "limit", so it should be
+ * of a clock that isn't set, such as CLOCK_MONOTONIC, rather than the time of
+ * day: if the time of day were set back an hour, every notification would be
+ * held back for that hour. The rules that are to be notified are written to
+ * events, which has room for seplos_rules_count(). Returns the number of them.
+ */
+unsigned int
+seplos_rules_evaluate(SeplosRules * r, unsigned int target, int64_t timestamp, const SeplosData * m, SeplosAlarmEvent * events)
+{
+  RuleState * const	states = &(r->state[(size_t)target * r->count]);
+  unsigned int		n = 0;
+
+  for ( unsigned int i = 0; i < r->count; i++ ) {
+    const Rule * const	rule = &(r->rules[i]);
+    RuleState * const	s = &(states[i]);
+    const float		value = input(rule, m);
+    bool		active;
+
+    if ( rule->input < INPUT_SPREAD )
+      active = value != 0;
+    else {
+      const float threshold = s->active ? rule->clear : rule->set;
+      active = rule->above ? value > threshold : value < threshold;
+    }
+    if ( active != s->active ) {
+      s->active = active;
+      s->since = timestamp;
+    }
+
+    const bool raised = active && timestamp - s->since >= rule->hold;
+    if ( raised != s->raised ) {
+      s->raised = raised;
+      s->changes++;
+    }
+    if ( s->raised != s->notified && timestamp >= s->next ) {
+      SeplosAlarmEvent * const e = &(events[n++]);
+
+      e->rule = rule->name;
+      e->target = target;
+      e->raised = s->raised;
+      e->value = value;
+      e->changes = s->changes;
+      s->notified = s->raised;
+      s->next = timestamp + rule->limit;
+      s->changes = 0;
+    }
+  }
+  return n;
+}
+
+void
+seplos_rules_close(SeplosRules * r)
+{
+  if ( r == 0 )
+    return;
+  free(r->rules);
+  free(r->state);
+  free(r);
+}
@@ -0,0 +1,183 @@
+#include "./internal.h"
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+
+/*
+ * A bus is one serial device, and the targets on it. The bus thread is the
+ * only user of the device during a sweep, which serializes the transactions
+ * on that bus without any locking.
+ */
+typedef struct _SeplosBus {
+  SeplosScheduler *	scheduler;
+  const char *		device;
+  seplos_device		fd;
+  unsigned int *	targets; /* Indices into scheduler->targets */
+  unsigned int		count;
+  pthread_t		thread;
+  unsigned int		groups;
+  SeplosData *		data;
+  int *			status;
+} SeplosBus;
+
+struct _SeplosScheduler {
+  SeplosTarget *	targets;
+  unsigned int		count;
+  SeplosBus *		buses;
+  unsigned int		n_buses;
+};
+
+static void *
+bus_sweep(void * arg)
+{
+  SeplosBus * const bus = arg;
+  const SeplosTarget * const targets = bus->scheduler->targets;
+
+  for ( unsigned int i = 0; i < bus->count; i++ ) {
+    const unsigned int t = bus->targets[i];
+    bus->status[t] = seplos_data_select(bus->fd, targets[t].address, targets[t].pack, bus->groups, &(bus->data[t]));
+  }
+  return 0;
+}
+
+SeplosScheduler *
+seplos_scheduler_open(const SeplosTarget * targets, unsigned int count)
+{
+  SeplosScheduler * s = calloc(1, sizeof(*s));
+
+  if ( s == 0 ) {
+    _sp_error("Out of memory.\n");
+    return 0;
+  }
+
+  s->targets = calloc(count, sizeof(*s->targets));
+  s->buses = calloc(count, sizeof(*s->buses));
+  if ( count == 0 || s->targets == 0 || s->buses == 0 ) {
+    _sp_error(count == 0 ? "No targets to schedule.\n" : "Out of memory.\n");
+    seplos_scheduler_close(s);
+    return 0;
+  }
+  memcpy(s->targets, targets, count * sizeof(*targets));
+  s->count = count;
+
+  /* Group the targets by device, keeping the order in which they were given. */
+  for ( unsigned int i = 0; i < count; i++ ) {
+    SeplosBus * bus = 0;
+
+    for ( unsigned int j = 0; j < s->n_buses; j++ ) {
+      if ( strcmp(s->buses[j].device, targets[i].device) == 0 ) {
+        bus = &(s->buses[j]);
+        break;
+      }
+    }
+
+    if ( bus == 0 ) {
+      bus = &(s->buses[s->n_buses++]);
+      bus->scheduler = s;
+      bus->device = targets[i].device;
+      bus->fd = -1;
+      bus->targets = calloc(count, sizeof(*bus->targets));
+      if ( bus->targets == 0 ) {
+        _sp_error("Out of memory.\n");
+        seplos_scheduler_close(s);
+        return 0;
+      }
+      if ( (bus->fd = seplos_open(bus->device)) < 0 ) {
+        seplos_scheduler_close(s);
+        return 0;
+      }
+    }
+    bus->targets[bus->count++] = i;
+  }
+  return s;
+}
+
+/*
+ * Sample every target once. data and status are indexed like the targets given
+ * to seplos_scheduler_open(), status[n] is the return value of seplos_data() for
+ * target n. Returns the number of targets that failed.
+ */
+int
+seplos_scheduler_sweep(SeplosScheduler * s, SeplosData * data, int * status)
+{
+  return seplos_scheduler_sweep_select(s, SEPLOS_ALL, data, status);
+}
+
+/*
+ * As seplos_scheduler_sweep(), but fetch only the groups of fields given, as
+ * seplos_data_select() does. The other fields of data keep their values.
+ */
+int
+seplos_scheduler_sweep_select(SeplosScheduler * s, unsigned int groups, SeplosData * data, int * status)
+{
+  unsigned int	started = 0;
+  int		failures = 0;
+
+  for ( unsigned int i = 0; i < s->n_buses; i++ ) {
+    s->buses[i].groups = groups;
+    s->buses[i].data = data;
+    s->buses[i].status = status;
+  }
+
+  /*
+   * The last bus is swept by the calling thread, so that a single bus costs
+   * nothing more than calling seplos_data() directly.
+   */
+  for ( ; started + 1 < s->n_buses; started++ ) {
+    SeplosBus * const bus = &(s->buses[started]);
+    const int error = pthread_create(&(bus->thread), 0, bus_sweep, bus);
+    if ( error != 0 ) {
+      _sp_error("pthread_create: %s\n", strerror(error));
+      break;
+    }
+  }
+  /* If a thread couldn't be created, the remaining buses are swept here. */
+  for ( unsigned int i = started; i < s->n_buses; i++ )
+    bus_sweep(&(s->buses[i]));
+
+  for ( unsigned int i = 0; i < started; i++ )
+    pthread_join(s->buses[i].thread, 0);
+
+  for ( unsigned int i = 0; i < s->count; i++ ) {
+    if ( status[i] != 0 )
+      failures++;
+  }
+  return failures;
+}
+
+void
+seplos_scheduler_close(SeplosScheduler * s)
+{
+  if ( s == 0 )
+    return;
+
+  if ( s->buses ) {
+    for ( unsigned int i = 0; i < s->n_buses; i++ ) {
+      if ( s->buses[i].fd >= 0 )
+        seplos_close(s->buses[i].fd);
+      free(s->buses[i].targets);
+    }
+  }
+  free(s->buses);
+  free(s->targets);
+  free(s);
+}
+
+/* The sum of the link statistics of all of the buses. */
+void
+seplos_scheduler_link_statistics(SeplosScheduler * s, SeplosLinkStatistics * total)
+{
+  memset(total, 0, sizeof(*total));
+
+  for ( unsigned int i = 0; i < s->n_buses; i++ ) {
+    SeplosLinkStatistics l;
+
+    if ( seplos_link_statistics(s->buses[i].fd, &l) == 0 ) {
+      total->packets += l.packets;
+      total->noise += l.noise;
+      total->bad_headers += l.bad_headers;
+      total->bad_packets += l.bad_packets;
+      total->timeouts += l.timeouts;
+    }
+  }
+}
@@ -1,3 +1,5 @@
+#ifndef _SEPLOS_H_
+#define _SEPLOS_H_
 #include <stdbool.h>
 #include <stdint.h>
 #include <stdio.h>
@@ -8,6 +10,16 @@
 
 typedef int	seplos_device; /* File descriptor on POSIX */
 
+/*
+ * The byte alarms of the cells, or of the temperature sensors, packed: a bit
+ * for each cell or sensor, in each of the alarm states.
+ */
+typedef struct _SeplosAlarmMasks {
+  uint16_t	low;	/* LOW_LIMIT_HIT */
+  uint16_t	high;	/* HIGH_LIMIT_HIT */
+  uint16_t	other;	/* OTHER_ALARM, or any undocumented state */
+} SeplosAlarmMasks;
+
 /*
  * This is the structure that all other software will use to montior the battery.
  * All of the communications, validation, and data conversion to the native data
@@ -139,8 +151,93 @@ typedef struct _SeplosData {
   uint8_t	total_battery_voltage_alarm;
   /* Bit alarms are in a bit-field here, rather than bool, to make them quick to scan. */
   uint32_t	bit_alarm[(SEPLOS_N_BIT_ALARMS / 32) + !!(SEPLOS_N_BIT_ALARMS % 32)];
+  /*
+   * cell_alarm[] and temperature_alarm[] again, as masks, set wherever the
+   * arrays are. "Is any cell low" is one test of these, and
+   * seplos_next_alarm() visits only the cells or sensors that are in alarm.
+   */
+  SeplosAlarmMasks	cell_alarms;
+  SeplosAlarmMasks	temperature_alarms;
 } SeplosData;
 
+/* All 64 bit alarms, bit n being alarm n of seplos_bit_alarm_names[]. */
+static inline uint64_t
+seplos_bit_alarms(const SeplosData * m)
+{
+  return ((uint64_t)m->bit_alarm[1] << 32) | m->bit_alarm[0];
+}
+
+/* The cells or sensors in any alarm state. */
+static inline uint16_t
+seplos_any_alarm(const SeplosAlarmMasks * a)
+{
+  return a->low | a->high | a->other;
+}
+
+/*
+ * The number of the lowest bit that is set in *mask, which is cleared, to
+ * iterate over the alarms in a mask:
+ *
+ *   for ( uint64_t bits = seplos_bit_alarms(m); bits; ) {
+ *     const unsigned int i = seplos_next_alarm(&bits);
+ *     ...
+ *   }
+ */
+static inline unsigned int
+seplos_next_alarm(uint64_t * mask)
+{
+  const unsigned int i = __builtin_ctzll(*mask);
+
+  *mask &= *mask - 1;
+  return i;
+}
+
+/*
+ * Groups of fields for seplos_data_select(). Each group is one command to the
+ * BMS.
+ * SEPLOS_TELEMETRY: cell voltages, temperatures, current, voltage, capacity,
+ *   state of charge and health, cycles.
+ * SEPLOS_ALARMS: all of the alarms and the alarm summary, the switch and
+ *   system state, equilibrium and disconnection state.
+ */
+#define SEPLOS_TELEMETRY	0x01
+#define SEPLOS_ALARMS		0x02
+#define SEPLOS_ALL		(SEPLOS_TELEMETRY | SEPLOS_ALARMS)
+
+/*
+ * Counts of what the receiver has seen on one serial device. A noisy line
+ * shows up here as noise and bad packets, which the receiver skips by looking
+ * for the next '~', rather than as failed samples.
+ */
+typedef struct _SeplosLinkStatistics {
+  unsigned long	packets;	/* Valid packets received */
+  unsigned long	noise;		/* Characters discarded while looking for '~' */
+  unsigned long	bad_headers;	/* Bad header or length checksum, skipped */
+  unsigned long	bad_packets;	/* Bad info field or checksum, skipped */
+  unsigned long	timeouts;	/* Transactions that reached their deadline */
+} SeplosLinkStatistics;
+
+/*
+ * One battery pack for the scheduler to sample: the serial device of the RS-485
+ * bus that the pack is on, the controller address on that bus, and the pack
+ * number.
+ */
+typedef struct _SeplosTarget {
+  const char *	device;
+  unsigned int	address;
+  unsigned int	pack;
+} SeplosTarget;
+
+/*
+ * The scheduler samples many packs on many buses. Targets that share a device
+ * share a bus, and are sampled one after another, since only one transaction
+ * can be on an RS-485 bus at a time. Each bus is sampled by its own thread, so
+ * a sweep of every target takes about as long as the slowest bus.
+ * The device strings of the targets must remain valid until the scheduler is
+ * closed.
+ */
+typedef struct _SeplosScheduler SeplosScheduler;
+
 /* The comments are as SEPLOS documented the names of these commands */
 enum _seplos_commands {
   TELEMETRY_GET =     0x42,    /* Acquisition of telemetering information */
@@ -179,12 +276,320 @@ enum _seplos_response {
   PERMISSION_ERROR = 0xe4        /* Permission error */
 };
 
+/*
+ * The longest time, in milliseconds, that one command to the BMS may take from
+ * the start of the request to the last character of the reply. An unplugged
+ * or hibernating battery fails the command after this long, rather than hanging
+ * the caller. seplos_data() sends two commands, so it is bounded by twice this.
+ * Change it with seplos_set_timeout().
+ */
+#define SEPLOS_DEFAULT_TIMEOUT 1000
+
+/*
+ * Pipelining, set with seplos_set_pipeline(), overlaps the transactions that
+ * seplos_data() makes. The depth is:
+ * 0: No pipelining, the default. Pending input is flushed before every
+ *    request, and each request is drained before waiting for its reply.
+ * 1: Requests aren't drained, and the flush is only done after a failure or
+ *    unexpected input. The telemetry reply is decoded while the telecommand
+ *    request is going out and the BMS is preparing its reply.
+ * 2: As 1, and both requests are sent before the first reply is read. This
+ *    only works where the BMS and bus accept a request while the BMS is
+ *    replying to the one before, for example a 4-wire RS-422 link. On a
+ *    half-duplex RS-485 bus, the second request would collide with the reply.
+ * With pipelining, the timeout applies to each reply from the time the
+ * receiver starts waiting for it, rather than from its request.
+ */
+
+/*
+ * seplos_json_format() writes the JSON of a sample into a buffer, and returns
+ * its length, like snprintf(). A buffer of SEPLOS_JSON_SIZE always holds the
+ * whole of it. seplos_json() writes the same to a file, followed by a newline.
+ */
+#define SEPLOS_JSON_SIZE	8192
+
+/*
+ * Change detection: seplos_diff() compares a sample with the last one that was
+ * reported through the same SeplosDiff, and sets a bit in SeplosChanges for
+ * each field that moved by more than its deadband. Alarms, switches, and state
+ * are compared exactly. seplos_text_changes() and seplos_json_changes() print
+ * only the fields that changed.
+ *
+ * seplos_diff_init() with a null deadband uses 5 mV, 1 C, 0.1 A, 0.1 V,
+ * 0.1 AH, and 1 percent. A deadband of 0 reports every change.
+ */
+typedef struct _SeplosDeadband {
+  float		cell_voltage;	/* V */
+  float		temperature;	/* C */
+  float		current;	/* A */
+  float		voltage;	/* V, total battery and port */
+  float		capacity;	/* AH, residual and battery */
+  float		percentage;	/* State of charge and health */
+} SeplosDeadband;
+
+#define SEPLOS_CHANGED_CURRENT			0x0001
+#define SEPLOS_CHANGED_VOLTAGE			0x0002
+#define SEPLOS_CHANGED_PORT_VOLTAGE		0x0004
+#define SEPLOS_CHANGED_RESIDUAL_CAPACITY	0x0008
+#define SEPLOS_CHANGED_BATTERY_CAPACITY		0x0010
+#define SEPLOS_CHANGED_STATE_OF_CHARGE		0x0020
+#define SEPLOS_CHANGED_RATED_CAPACITY		0x0040
+#define SEPLOS_CHANGED_CYCLES			0x0080
+#define SEPLOS_CHANGED_STATE_OF_HEALTH		0x0100
+#define SEPLOS_CHANGED_STATE			0x0200	/* discharge ... shutdown */
+#define SEPLOS_CHANGED_SWITCHES			0x0400
+#define SEPLOS_CHANGED_EQUILIBRIUM		0x0800
+#define SEPLOS_CHANGED_DISCONNECTION		0x1000
+#define SEPLOS_CHANGED_ALARMS			0x2000	/* Any alarm */
+
+typedef struct _SeplosChanges {
+  uint32_t	fields;		/* SEPLOS_CHANGED_... */
+  uint16_t	cell_voltage;	/* A bit for each cell */
+  uint16_t	cell_alarm;
+  uint8_t	temperature;	/* A bit for each sensor */
+  uint8_t	temperature_alarm;
+} SeplosChanges;
+
+typedef struct _SeplosDiff {
+  SeplosDeadband	deadband;
+  bool			has_reported;
+  SeplosData		reported;	/* The values last reported */
+} SeplosDiff;
+
+/*
+ * A fixed-width binary record of a sample and its time, for logging, and an
+ * append-only file of them. See record.c for the format.
+ */
+#define SEPLOS_RECORD_VERSION		1
+#define SEPLOS_RECORD_SIZE		112
+#define SEPLOS_RECORD_HEADER_SIZE	16
+
+typedef struct _SeplosRecordWriter SeplosRecordWriter;
+typedef struct _SeplosRecordReader SeplosRecordReader;
+
+/*
+ * A memory-mapped time-series store of the samples of one pack, with each
+ * metric in a column. See store.c for the layout and the type of each column.
+ */
+#define SEPLOS_STORE_VERSION		1
+#define SEPLOS_STORE_BLOCK_SAMPLES	4096
+
+enum {
+  SEPLOS_COLUMN_TIMESTAMP = 0,
+  SEPLOS_COLUMN_CELL_VOLTAGE = 1,
+  SEPLOS_COLUMN_TEMPERATURE = SEPLOS_COLUMN_CELL_VOLTAGE + SEPLOS_N_CELLS,
+  SEPLOS_COLUMN_CURRENT = SEPLOS_COLUMN_TEMPERATURE + SEPLOS_N_TEMPERATURES,
+  SEPLOS_COLUMN_VOLTAGE,
+  SEPLOS_COLUMN_RESIDUAL_CAPACITY,
+  SEPLOS_COLUMN_BATTERY_CAPACITY,
+  SEPLOS_COLUMN_STATE_OF_CHARGE,
+  SEPLOS_COLUMN_RATED_CAPACITY,
+  SEPLOS_COLUMN_CYCLES,
+  SEPLOS_COLUMN_STATE_OF_HEALTH,
+  SEPLOS_COLUMN_PORT_VOLTAGE,
+  SEPLOS_COLUMN_EQUILIBRIUM,
+  SEPLOS_COLUMN_DISCONNECTION,
+  SEPLOS_COLUMN_STATE,
+  SEPLOS_COLUMN_BIT_ALARMS,
+  SEPLOS_COLUMN_BYTE_ALARMS,
+  SEPLOS_STORE_COLUMNS
+};
+
+typedef struct _SeplosStore SeplosStore;
+
+/*
+ * Trends of the cells of a pack, over the history in its store. See
+ * analysis.c.
+ */
+typedef struct _SeplosAnalysis {
+  uint8_t	controller_address;
+  uint8_t	battery_pack_number;
+  uint8_t	number_of_cells;
+  uint64_t	samples;
+  int64_t	first;	/* Microseconds since 1970 UTC */
+  int64_t	last;
+  /* Of each cell from the mean of the cells of its sample, mV */
+  float		mean_deviation[SEPLOS_N_CELLS];
+  float		rms_deviation[SEPLOS_N_CELLS];
+  float		lowest_deviation[SEPLOS_N_CELLS];
+  float		highest_deviation[SEPLOS_N_CELLS];
+  float		balancing[SEPLOS_N_CELLS];	/* %, of the samples */
+  /* mOhm, from the steps in cell voltage at the steps in current, 0 if none */
+  float		resistance[SEPLOS_N_CELLS];
+  uint64_t	steps;		/* Of the current, that the resistance is from */
+  unsigned int	first_cycles;
+  unsigned int	last_cycles;
+  float		first_state_of_health;	/* % */
+  float		last_state_of_health;
+  float		state_of_health_per_100_cycles;	/* %, the fitted slope, 0 without cycles */
+} SeplosAnalysis;
+
+/*
+ * A compressed encoding of a block of samples in the columns of the store, for
+ * archiving. See series.c. SEPLOS_SERIES_SIZE(count) bytes is enough for any
+ * count samples.
+ */
+#define SEPLOS_SERIES_SIZE(count)	(16 + ((size_t)(count) * 155))
+
+/*
+ * The latest sample of each pack, in POSIX shared memory, for local processes
+ * to read without contending for the bus. See shm.c.
+ */
+#define SEPLOS_SHM_VERSION		1
+
+typedef struct _SeplosShm SeplosShm;
+
+/*
+ * Running totals of the charge and energy through one pack, integrated from
+ * its samples, and kept in a file across restarts. See energy.c.
+ */
+#define SEPLOS_ENERGY_VERSION		1
+
+typedef struct _SeplosEnergyCounters {
+  double	charge;		/* AH into the pack */
+  double	discharge;	/* AH out of the pack */
+  double	energy_in;	/* Wh */
+  double	energy_out;	/* Wh */
+  double	integrated;	/* Seconds of samples that were integrated */
+  double	gaps;		/* Seconds between samples too far apart to integrate */
+  uint64_t	samples;
+  int64_t	since;		/* Of the first sample, microseconds since 1970 UTC */
+} SeplosEnergyCounters;
+
+typedef struct _SeplosEnergy SeplosEnergy;
+
+/*
+ * A summary of a site of many packs, kept up to date one pack at a time as
+ * they're sampled. See fleet.c.
+ */
+typedef struct _SeplosFleet SeplosFleet;
+
+/*
+ * A pack that has missed this many sweeps in a row is taken out of the summary
+ * of the site, so that its last sample doesn't count as live. One or two
+ * missed polls don't, they're usually noise on the bus.
+ */
+#define SEPLOS_FLEET_MISSED_SWEEPS	3
+
+/* The lowest or highest of a value over the site, and where it is. */
+typedef struct _SeplosFleetExtreme {
+  float		value;
+  unsigned int	pack;	/* As given to seplos_fleet_update(), ~0 if no pack has a sample */
+  uint8_t	controller_address;
+  uint8_t	battery_pack_number;
+  uint8_t	element;	/* The cell, or the temperature sensor */
+} SeplosFleetExtreme;
+
+typedef struct _SeplosFleetSummary {
+  unsigned int		packs;	/* That have a sample */
+  unsigned int		alarms;	/* Packs with has_alarm */
+  float			current;	/* A, the sum, negative when discharging */
+  float			power;		/* W, the sum of voltage * current */
+  float			residual_capacity;	/* AH */
+  float			battery_capacity;	/* AH */
+  float			energy;		/* Wh stored, the sum of residual capacity * voltage */
+  float			state_of_charge;	/* %, of the capacity of the site */
+  SeplosFleetExtreme	lowest_cell;	/* V */
+  SeplosFleetExtreme	highest_cell;
+  SeplosFleetExtreme	coldest;	/* C */
+  SeplosFleetExtreme	hottest;
+  SeplosFleetExtreme	lowest_state_of_charge;	/* % */
+  SeplosFleetExtreme	highest_state_of_charge;
+} SeplosFleetSummary;
+
+/*
+ * Alarm rules, evaluated over the samples of each pack, that notify when they
+ * change between raised and cleared, with hysteresis and a rate limit. See
+ * rules.c for the language of the rules.
+ */
+#define SEPLOS_RULE_NAME_SIZE		32
+
+typedef struct _SeplosRules SeplosRules;
+
+typedef struct _SeplosAlarmEvent {
+  const char *	rule;		/* The name of the rule */
+  unsigned int	target;
+  bool		raised;		/* Or cleared */
+  float		value;		/* Of the metric, or of the alarm, 0 if it isn't set */
+  unsigned int	changes;	/* Since the last notification, 1 unless the limit held some back */
+} SeplosAlarmEvent;
+
 extern const char const * seplos_bit_alarm_names[SEPLOS_N_BIT_ALARMS];
 extern const char const * seplos_temperature_names[SEPLOS_N_TEMPERATURES];
 
 extern int		seplos_data(seplos_device fd, unsigned int address, unsigned int pack, SeplosData * m);
+extern int		seplos_data_select(seplos_device fd, unsigned int address, unsigned int pack, unsigned int groups, SeplosData * m);
+extern int		seplos_decode(const char * telemetry, size_t telemetry_size, const char * telecommand, size_t telecommand_size, unsigned int pack, SeplosData * m);
 extern seplos_device	seplos_open(const char * serial_device);
+extern void		seplos_close(seplos_device fd);
 extern float		seplos_protocol_version(seplos_device fd, unsigned int address);
 extern void		seplos_html(FILE * f, const SeplosData const * m, bool longer);
 extern void		seplos_json(FILE * f, const SeplosData const * m, bool longer);
+extern size_t		seplos_json_format(char * buffer, size_t size, const SeplosData * m, bool longer);
 extern void		seplos_text(FILE * f, const SeplosData const * m, bool longer);
+extern void		seplos_diff_init(SeplosDiff * d, const SeplosDeadband * deadband);
+extern bool		seplos_diff(SeplosDiff * d, const SeplosData * m, SeplosChanges * changes);
+extern void		seplos_text_changes(FILE * f, const SeplosData * m, const SeplosChanges * changes);
+extern void		seplos_json_changes(FILE * f, const SeplosData * m, const SeplosChanges * changes);
+extern size_t		seplos_json_changes_format(char * buffer, size_t size, const SeplosData * m, const SeplosChanges * changes);
+extern void		seplos_record_encode(uint8_t record[SEPLOS_RECORD_SIZE], int64_t timestamp, const SeplosData * m);
+extern void		seplos_record_decode(const uint8_t record[SEPLOS_RECORD_SIZE], int64_t * timestamp, SeplosData * m);
+extern SeplosRecordWriter *	seplos_record_open_writer(const char * path);
+extern int		seplos_record_write(SeplosRecordWriter * w, int64_t timestamp, const SeplosData * m);
+extern void		seplos_record_close_writer(SeplosRecordWriter * w);
+extern SeplosRecordReader *	seplos_record_open_reader(const char * path);
+extern int		seplos_record_read(SeplosRecordReader * r, int64_t * timestamp, SeplosData * m);
+extern void		seplos_record_close_reader(SeplosRecordReader * r);
+extern SeplosStore *	seplos_store_open(const char * path, bool writable);
+extern int		seplos_store_append(SeplosStore * s, int64_t timestamp, const SeplosData * m);
+extern uint64_t		seplos_store_samples(const SeplosStore * s);
+extern unsigned int	seplos_store_block_samples(const SeplosStore * s);
+extern const void *	seplos_store_column(SeplosStore * s, uint64_t block, unsigned int column, unsigned int * count);
+extern uint64_t		seplos_store_find(SeplosStore * s, int64_t timestamp);
+extern int		seplos_store_read(SeplosStore * s, uint64_t sample, int64_t * timestamp, SeplosData * m);
+extern int		seplos_store_refresh(SeplosStore * s);
+extern void		seplos_store_close(SeplosStore * s);
+extern int		seplos_analyze(SeplosStore * s, int64_t from, int64_t to, SeplosAnalysis * a);
+extern void		seplos_analysis_text(FILE * f, const SeplosAnalysis * a);
+extern void		seplos_analysis_html(FILE * f, const SeplosAnalysis * a);
+extern size_t		seplos_analysis_json_format(char * buffer, size_t size, const SeplosAnalysis * a);
+extern void		seplos_analysis_json(FILE * f, const SeplosAnalysis * a);
+extern size_t		seplos_store_compress(SeplosStore * s, uint64_t block, uint8_t * out, size_t size);
+extern size_t		seplos_series_encode(uint8_t * out, size_t size, const void * const columns[SEPLOS_STORE_COLUMNS], unsigned int count);
+extern int		seplos_series_decode(const uint8_t * in, size_t length, void * const columns[SEPLOS_STORE_COLUMNS], unsigned int capacity, unsigned int * count);
+extern SeplosShm *	seplos_shm_create(const char * name, unsigned int count);
+extern void		seplos_shm_publish(SeplosShm * s, unsigned int slot, int64_t timestamp, const SeplosData * m);
+extern SeplosShm *	seplos_shm_open(const char * name);
+extern unsigned int	seplos_shm_slots(const SeplosShm * s);
+extern int		seplos_shm_read(SeplosShm * s, unsigned int slot, int64_t * timestamp, SeplosData * m);
+extern void		seplos_shm_close(SeplosShm * s);
+extern SeplosEnergy *	seplos_energy_open(const char * path, bool writable);
+extern void		seplos_energy_update(SeplosEnergy * e, int64_t timestamp, int64_t maximum_gap, const SeplosData * m);
+extern int		seplos_energy_counters(const SeplosEnergy * e, SeplosEnergyCounters * c);
+extern void		seplos_energy_close(SeplosEnergy * e);
+extern SeplosFleet *	seplos_fleet_open(unsigned int count);
+extern void		seplos_fleet_update(SeplosFleet * f, unsigned int pack, const SeplosData * m);
+extern void		seplos_fleet_remove(SeplosFleet * f, unsigned int pack);
+extern void		seplos_fleet_missed(SeplosFleet * f, unsigned int pack);
+extern void		seplos_fleet_summary(const SeplosFleet * f, SeplosFleetSummary * s);
+extern void		seplos_fleet_close(SeplosFleet * f);
+extern void		seplos_fleet_text(FILE * f, const SeplosFleetSummary * s);
+extern void		seplos_fleet_html(FILE * f, const SeplosFleetSummary * s);
+extern size_t		seplos_fleet_json_format(char * buffer, size_t size, const SeplosFleetSummary * s);
+extern void		seplos_fleet_json(FILE * f, const SeplosFleetSummary * s);
+extern SeplosRules *	seplos_rules_parse(const char * text, const char * source, unsigned int targets);
+extern SeplosRules *	seplos_rules_load(const char * path, unsigned int targets);
+extern unsigned int	seplos_rules_count(const SeplosRules * r);
+extern unsigned int	seplos_rules_evaluate(SeplosRules * r, unsigned int target, int64_t timestamp, const SeplosData * m, SeplosAlarmEvent * events);
+extern void		seplos_rules_close(SeplosRules * r);
+extern SeplosScheduler *	seplos_scheduler_open(const SeplosTarget * targets, unsigned int count);
+extern int		seplos_scheduler_sweep(SeplosScheduler * s, SeplosData * data, int * status);
+extern int		seplos_scheduler_sweep_select(SeplosScheduler * s, unsigned int groups, SeplosData * data, int * status);
+extern void		seplos_scheduler_close(SeplosScheduler * s);
+extern void		seplos_scheduler_link_statistics(SeplosScheduler * s, SeplosLinkStatistics * total);
+extern int		seplos_link_statistics(seplos_device fd, SeplosLinkStatistics * statistics);
+extern void		seplos_set_pipeline(unsigned int depth);
+extern unsigned int	seplos_pipeline(void);
+extern void		seplos_set_timeout(unsigned int milliseconds);
+extern unsigned int	seplos_timeout(void);
+#endif /* _SEPLOS_H_ */
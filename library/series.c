@@ -0,0 +1,408 @@
+#include "./internal.h"
+#include <string.h>
+
+/*
+ * A compressed encoding of a block of samples, for archiving the history in
+ * the store to slow or wearable storage, such as an SD card. The input and
+ * output are the columns of the store, see store.c, one array of count values
+ * per column, as seplos_store_column() returns them.
+ *
+ * Samples are taken on a fixed cadence, so the difference between successive
+ * intervals is usually 0 or a little jitter. Voltages change by a few mV, and
+ * the cells of a pack mostly change together. Alarms rarely change at all. So:
+ *
+ *   count			varint
+ *   timestamps		the first, and the first interval, as zigzag varints.
+ *			Then the change in the interval, packed.
+ *   cell 0 voltage	the first value, varint. Then the change from the
+ *			sample before, packed.
+ *   cells 1 to 15	the first value. Then the change from the sample
+ *			before, less the change in cell 0, so that a change
+ *			of the whole pack costs nothing in the other cells.
+ *   other 16-bit columns	as cell 0.
+ *   bit alarms		the number of samples in which they changed, varint,
+ *			then for each: samples since the last change, varint,
+ *			and the bits that changed, varint.
+ *   byte alarms		the number of samples in which they changed, then for
+ *			each: samples since the last change, a 24-bit mask of
+ *			the alarms that changed, and their new values.
+ *
+ * A varint is 7 bits per byte, least significant first, with the high bit set
+ * in all but the last byte. Zigzag maps 0, -1, 1, -2 ... to 0, 1, 2, 3 ...
+ * first, so that small negative numbers are small too.
+ *
+ * Most of the changes are 0 or a few mV, and even a varint would spend a byte
+ * on each, which is most of the size of a sample. So the changes are packed:
+ * zigzagged, in groups of GROUP, each group a byte that is the width in bits
+ * of its largest value, and then every value of the group in that many bits,
+ * least significant first. A column that doesn't change costs a byte per
+ * GROUP samples. The differences of 16-bit values are taken modulo 65536, as
+ * int16_t, so that they never take more than 16 bits and are exactly
+ * reversible, whether the column is signed or not.
+ *
+ * SEPLOS_SERIES_SIZE(count) is enough for any block of count samples.
+ */
+
+#define	BYTE_ALARMS	(SEPLOS_N_CELLS + SEPLOS_N_TEMPERATURES + 2)
+#define	GROUP		64
+
+typedef struct _Output {
+  uint8_t *	p;
+  uint8_t *	end;
+} Output;
+
+typedef struct _Input {
+  const uint8_t *	p;
+  const uint8_t *	end;
+  bool			invalid;
+} Input;
+
+static inline uint64_t
+zigzag(int64_t value)
+{
+  return ((uint64_t)value << 1) ^ (uint64_t)(value >> 63);
+}
+
+static inline int64_t
+unzigzag(uint64_t value)
+{
+  return (int64_t)(value >> 1) ^ -(int64_t)(value & 1);
+}
+
+static inline void
+put_byte(Output * o, uint8_t value)
+{
+  if ( o->p < o->end )
+    *o->p = value;
+  o->p++;
+}
+
+static inline void
+put_varint(Output * o, uint64_t value)
+{
+  while ( value >= 0x80 ) {
+    put_byte(o, (value & 0x7f) | 0x80);
+    value >>= 7;
+  }
+  put_byte(o, value);
+}
+
+static inline void
+put_zigzag(Output * o, int64_t value)
+{
+  put_varint(o, zigzag(value));
+}
+
+static inline uint8_t
+get_byte(Input * i)
+{
+  if ( i->p >= i->end ) {
+    i->invalid = true;
+    return 0;
+  }
+  return *i->p++;
+}
+
+static inline uint64_t
+get_varint(Input * i)
+{
+  uint64_t	value = 0;
+
+  for ( unsigned int shift = 0; shift < 64; shift += 7 ) {
+    const uint8_t b = get_byte(i);
+
+    value |= (uint64_t)(b & 0x7f) << shift;
+    if ( (b & 0x80) == 0 )
+      return value;
+  }
+  i->invalid = true;
+  return 0;
+}
+
+static inline int64_t
+get_zigzag(Input * i)
+{
+  return unzigzag(get_varint(i));
+}
+
+/* The change in a 16-bit value, modulo 65536. */
+static inline int16_t
+delta(uint16_t to, uint16_t from)
+{
+  return (int16_t)(uint16_t)(to - from);
+}
+
+/* Pack n values, at most GROUP, in the width of the largest. */
+static void
+put_packed(Output * o, const uint64_t * values, unsigned int n)
+{
+  uint64_t	all = 0;
+  uint64_t	bits = 0;
+  unsigned int	used = 0;
+
+  for ( unsigned int i = 0; i < n; i++ )
+    all |= values[i];
+
+  const unsigned int width = all ? 64 - __builtin_clzll(all) : 0;
+  put_byte(o, width);
+  if ( width == 0 )
+    return;
+
+  for ( unsigned int i = 0; i < n; i++ ) {
+    /* In two halves, so that bits never holds more than 39 bits. */
+    for ( unsigned int shift = 0; shift < width; shift += 32 ) {
+      const unsigned int w = width - shift < 32 ? width - shift : 32;
+
+      bits |= ((values[i] >> shift) & ((((uint64_t)1) << w) - 1)) << used;
+      used += w;
+      while ( used >= 8 ) {
+        put_byte(o, bits);
+        bits >>= 8;
+        used -= 8;
+      }
+    }
+  }
+  if ( used > 0 )
+    put_byte(o, bits);
+}
+
+static void
+get_packed(Input * i, uint64_t * values, unsigned int n)
+{
+  const unsigned int width = get_byte(i);
+  uint64_t	bits = 0;
+  unsigned int	available = 0;
+
+  if ( width > 64 ) {
+    i->invalid = true;
+    return;
+  }
+  for ( unsigned int v = 0; v < n; v++ ) {
+    values[v] = 0;
+    for ( unsigned int shift = 0; shift < width; shift += 32 ) {
+      const unsigned int w = width - shift < 32 ? width - shift : 32;
+
+      while ( available < w ) {
+        bits |= (uint64_t)get_byte(i) << available;
+        available += 8;
+      }
+      values[v] |= (bits & ((((uint64_t)1) << w) - 1)) << shift;
+      bits >>= w;
+      available -= w;
+    }
+  }
+}
+
+/*
+ * Encode count samples from columns into out, which holds size bytes. Returns
+ * the length of the encoding. If that's more than size, the encoding didn't
+ * fit, and out holds only the start of it.
+ */
+size_t
+seplos_series_encode(uint8_t * out, size_t size, const void * const columns[SEPLOS_STORE_COLUMNS], unsigned int count)
+{
+  Output	o = { out, out + size };
+
+  put_varint(&o, count);
+  if ( count == 0 )
+    return o.p - out;
+
+  uint64_t	group[GROUP];
+  const int64_t * const t = columns[SEPLOS_COLUMN_TIMESTAMP];
+
+  put_zigzag(&o, t[0]);
+  if ( count > 1 )
+    put_zigzag(&o, t[1] - t[0]);
+  for ( unsigned int i = 2; i < count; i += GROUP ) {
+    const unsigned int n = count - i < GROUP ? count - i : GROUP;
+    for ( unsigned int g = 0; g < n; g++ )
+      group[g] = zigzag((t[i + g] - t[i + g - 1]) - (t[i + g - 1] - t[i + g - 2]));
+    put_packed(&o, group, n);
+  }
+
+  const uint16_t * const cell_0 = columns[SEPLOS_COLUMN_CELL_VOLTAGE];
+  for ( unsigned int c = SEPLOS_COLUMN_CELL_VOLTAGE; c < SEPLOS_COLUMN_STATE + 1; c++ ) {
+    const uint16_t * const v = columns[c];
+    const bool correlated = c > SEPLOS_COLUMN_CELL_VOLTAGE && c < SEPLOS_COLUMN_TEMPERATURE;
+
+    put_varint(&o, v[0]);
+    for ( unsigned int i = 1; i < count; i += GROUP ) {
+      const unsigned int n = count - i < GROUP ? count - i : GROUP;
+      for ( unsigned int g = 0; g < n; g++ ) {
+        int16_t d = delta(v[i + g], v[i + g - 1]);
+        if ( correlated )
+          d = (int16_t)(uint16_t)(d - delta(cell_0[i + g], cell_0[i + g - 1]));
+        group[g] = zigzag(d);
+      }
+      put_packed(&o, group, n);
+    }
+  }
+
+  /* The alarms are lists of changes, the first sample being a change from 0. */
+  const uint64_t * const bits = columns[SEPLOS_COLUMN_BIT_ALARMS];
+  unsigned int	changes = 0;
+  unsigned int	last = 0;
+
+  for ( unsigned int i = 0; i < count; i++ )
+    changes += bits[i] != (i > 0 ? bits[i - 1] : 0);
+  put_varint(&o, changes);
+  for ( unsigned int i = 0; i < count; i++ ) {
+    const uint64_t changed = bits[i] ^ (i > 0 ? bits[i - 1] : 0);
+    if ( changed ) {
+      put_varint(&o, i - last);
+      put_varint(&o, changed);
+      last = i;
+    }
+  }
+
+  const uint8_t (* const bytes)[BYTE_ALARMS] = columns[SEPLOS_COLUMN_BYTE_ALARMS];
+  static const uint8_t normal[BYTE_ALARMS];
+
+  changes = 0;
+  last = 0;
+  for ( unsigned int i = 0; i < count; i++ )
+    changes += memcmp(bytes[i], i > 0 ? bytes[i - 1] : normal, BYTE_ALARMS) != 0;
+  put_varint(&o, changes);
+  for ( unsigned int i = 0; i < count; i++ ) {
+    const uint8_t * const before = i > 0 ? bytes[i - 1] : normal;
+    uint32_t mask = 0;
+
+    for ( unsigned int a = 0; a < BYTE_ALARMS; a++ ) {
+      if ( bytes[i][a] != before[a] )
+        mask |= (uint32_t)1 << a;
+    }
+    if ( mask ) {
+      put_varint(&o, i - last);
+      put_byte(&o, mask & 0xff);
+      put_byte(&o, (mask >> 8) & 0xff);
+      put_byte(&o, mask >> 16);
+      for ( unsigned int a = 0; a < BYTE_ALARMS; a++ ) {
+        if ( mask & ((uint32_t)1 << a) )
+          put_byte(&o, bytes[i][a]);
+      }
+      last = i;
+    }
+  }
+
+  return o.p - out;
+}
+
+/*
+ * Decode an encoding of length bytes into columns, each of which holds
+ * capacity values. Sets *count to the number of samples. Returns 0, or -1 if
+ * the encoding is damaged or there are more than capacity samples.
+ */
+int
+seplos_series_decode(const uint8_t * in, size_t length, void * const columns[SEPLOS_STORE_COLUMNS], unsigned int capacity, unsigned int * count)
+{
+  Input		i = { in, in + length, false };
+  const uint64_t n = get_varint(&i);
+
+  *count = 0;
+  if ( i.invalid || n > capacity ) {
+    _sp_error("The compressed samples are damaged, or too many.\n");
+    return -1;
+  }
+  if ( n == 0 )
+    return 0;
+
+  uint64_t	group[GROUP];
+  int64_t * const t = columns[SEPLOS_COLUMN_TIMESTAMP];
+  int64_t	interval = 0;
+
+  t[0] = get_zigzag(&i);
+  if ( n > 1 ) {
+    interval = get_zigzag(&i);
+    t[1] = t[0] + interval;
+  }
+  for ( unsigned int s = 2; s < n; s += GROUP ) {
+    const unsigned int m = n - s < GROUP ? n - s : GROUP;
+    get_packed(&i, group, m);
+    for ( unsigned int g = 0; g < m; g++ ) {
+      interval += unzigzag(group[g]);
+      t[s + g] = t[s + g - 1] + interval;
+    }
+  }
+
+  const uint16_t * const cell_0 = columns[SEPLOS_COLUMN_CELL_VOLTAGE];
+  for ( unsigned int c = SEPLOS_COLUMN_CELL_VOLTAGE; c < SEPLOS_COLUMN_STATE + 1; c++ ) {
+    uint16_t * const v = columns[c];
+    const bool correlated = c > SEPLOS_COLUMN_CELL_VOLTAGE && c < SEPLOS_COLUMN_TEMPERATURE;
+
+    v[0] = get_varint(&i);
+    for ( unsigned int s = 1; s < n; s += GROUP ) {
+      const unsigned int m = n - s < GROUP ? n - s : GROUP;
+      get_packed(&i, group, m);
+      for ( unsigned int g = 0; g < m; g++ ) {
+        uint16_t d = unzigzag(group[g]);
+        if ( correlated )
+          d += cell_0[s + g] - cell_0[s + g - 1];
+        v[s + g] = v[s + g - 1] + d;
+      }
+    }
+  }
+
+  uint64_t * const bits = columns[SEPLOS_COLUMN_BIT_ALARMS];
+  uint64_t	changes = get_varint(&i);
+  uint64_t	at = 0;
+  uint64_t	value = 0;
+  unsigned int	s = 0;
+
+  for ( ; changes > 0 && !i.invalid; changes-- ) {
+    at += get_varint(&i);
+    if ( at >= n ) {
+      i.invalid = true;
+      break;
+    }
+    for ( ; s < at; s++ )
+      bits[s] = value;
+    value ^= get_varint(&i);
+  }
+  for ( ; s < n; s++ )
+    bits[s] = value;
+
+  uint8_t (* const bytes)[BYTE_ALARMS] = columns[SEPLOS_COLUMN_BYTE_ALARMS];
+  uint8_t	levels[BYTE_ALARMS] = {};
+
+  changes = get_varint(&i);
+  at = 0;
+  s = 0;
+  for ( ; changes > 0 && !i.invalid; changes-- ) {
+    at += get_varint(&i);
+    if ( at >= n ) {
+      i.invalid = true;
+      break;
+    }
+    for ( ; s < at; s++ )
+      memcpy(bytes[s], levels, BYTE_ALARMS);
+
+    uint32_t mask = get_byte(&i);
+    mask |= get_byte(&i) << 8;
+    mask |= (uint32_t)get_byte(&i) << 16;
+    for ( unsigned int a = 0; a < BYTE_ALARMS; a++ ) {
+      if ( mask & ((uint32_t)1 << a) )
+        levels[a] = get_byte(&i);
+    }
+  }
+  for ( ; s < n; s++ )
+    memcpy(bytes[s], levels, BYTE_ALARMS);
+
+  if ( i.invalid || i.p != i.end ) {
+    _sp_error("The compressed samples are damaged.\n");
+    return -1;
+  }
+  *count = n;
+  return 0;
+}
+
+/* Encode a block of the store. Returns the length, as seplos_series_encode(). */
+size_t
+seplos_store_compress(SeplosStore * s, uint64_t block, uint8_t * out, size_t size)
+{
+  const void *	columns[SEPLOS_STORE_COLUMNS];
+  unsigned int	count = 0;
+
+  for ( unsigned int c = 0; c < SEPLOS_STORE_COLUMNS; c++ )
+    columns[c] = seplos_store_column(s, block, c, &count);
+  return seplos_series_encode(out, size, columns, count);
+}
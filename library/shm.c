@@ -0,0 +1,272 @@
+#include "./internal.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+/*
+ * The latest sample of every pack, published by the daemon in a POSIX
+ * shared-memory segment, so that any number of local processes can read it
+ * without opening the serial port and contending for the bus.
+ *
+ * The segment is a header, and then a slot for each target of the daemon, in
+ * the order of its --target options. A slot is the SeplosData of the sample as
+ * it is in memory, so reading it is a copy, with no decoding.
+ *
+ * Each slot is a seqlock. The writer makes the sequence odd, writes the
+ * sample, and makes it even again. A reader takes the sequence, copies the
+ * sample, and takes the sequence again, and if it was odd or has changed, the
+ * copy may be torn and it tries again. The writer never waits for a reader, and
+ * readers don't write to the segment at all, so they can't slow the daemon or
+ * each other, and a reader that dies holds nothing. The slots are aligned to
+ * the cache line, so that the writer of one doesn't disturb the readers of
+ * another.
+ *
+ * Since the sample is SeplosData in the layout of the host, the readers must
+ * be built with the same version of seplos.h. The header records its size to
+ * catch a mismatch.
+ *
+ * The writer creates a new segment when it starts, replacing any that was left
+ * by an earlier one that crashed, and removes it when it stops. A reader of a
+ * segment that the writer has closed gets an error from seplos_shm_read(), and
+ * may open the name again to find the next daemon. If the daemon dies without
+ * closing it, the timestamps of the samples stop advancing.
+ */
+
+#define	CACHE_LINE	64
+#define	BYTE_ORDER_MARK	0x01020304
+/* Tries of a reader before it decides that the writer died in mid-write. */
+#define	MAXIMUM_TRIES	1000000
+
+typedef struct _ShmHeader {
+  char		magic[8];	/* "SEPLOSSM" */
+  uint32_t	version;
+  uint32_t	byte_order;	/* BYTE_ORDER_MARK, as the writing host stores it */
+  uint32_t	slots;
+  uint32_t	slot_size;	/* Bytes */
+  uint32_t	data_size;	/* sizeof(SeplosData) of the writer */
+  uint32_t	publishing;	/* Cleared when the writer closes the segment */
+} __attribute__((aligned(CACHE_LINE))) ShmHeader;
+
+typedef struct _ShmSlot {
+  uint64_t	sequence;	/* Odd while the slot is being written, 0 if never written */
+  int64_t	timestamp;	/* Microseconds since 1970 UTC */
+  SeplosData	data;
+} __attribute__((aligned(CACHE_LINE))) ShmSlot;
+
+struct _SeplosShm {
+  char *	name;
+  bool		writable;
+  size_t	size;
+  ShmHeader *	header;
+  ShmSlot *	slots;
+};
+
+static const char	magic[8] = { 'S', 'E', 'P', 'L', 'O', 'S', 'S', 'M' };
+
+/* While waiting for the writer to finish. */
+static inline void
+relax(void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+  __builtin_ia32_pause();
+#endif
+}
+
+static SeplosShm *
+allocate(const char * name, bool writable)
+{
+  SeplosShm * const s = calloc(1, sizeof(*s));
+
+  if ( s == 0 || (s->name = strdup(name)) == 0 ) {
+    free(s);
+    _sp_error("Out of memory.\n");
+    return 0;
+  }
+  s->writable = writable;
+  return s;
+}
+
+static int
+map(SeplosShm * s, int fd, size_t size)
+{
+  const int protection = PROT_READ | (s->writable ? PROT_WRITE : 0);
+  void * const m = mmap(0, size, protection, MAP_SHARED, fd, 0);
+
+  if ( m == MAP_FAILED ) {
+    _sp_error("Shared memory %s: mmap failed: %s\n", s->name, strerror(errno));
+    return -1;
+  }
+  s->size = size;
+  s->header = m;
+  s->slots = (ShmSlot *)((uint8_t *)m + sizeof(ShmHeader));
+  return 0;
+}
+
+/*
+ * Create the segment NAME, which starts with '/', with a slot for each of
+ * count targets, for the writer.
+ */
+SeplosShm *
+seplos_shm_create(const char * name, unsigned int count)
+{
+  const size_t	size = sizeof(ShmHeader) + (count * sizeof(ShmSlot));
+  SeplosShm * const s = allocate(name, true);
+
+  if ( s == 0 )
+    return 0;
+
+  /* A new segment, rather than one that the readers of a crashed writer still map. */
+  shm_unlink(name);
+  const int fd = shm_open(name, O_RDWR|O_CREAT|O_EXCL|O_CLOEXEC, 0644);
+  if ( fd < 0 ) {
+    _sp_error("Shared memory %s: %s\n", name, strerror(errno));
+    seplos_shm_close(s);
+    return 0;
+  }
+  if ( ftruncate(fd, size) != 0 ) {
+    _sp_error("Shared memory %s: %s\n", name, strerror(errno));
+    close(fd);
+    shm_unlink(name);
+    seplos_shm_close(s);
+    return 0;
+  }
+  const int status = map(s, fd, size);
+  close(fd);
+  if ( status != 0 ) {
+    shm_unlink(name);
+    seplos_shm_close(s);
+    return 0;
+  }
+
+  /* The segment is zeroed, so every slot starts with a sequence of 0. */
+  memcpy(s->header->magic, magic, sizeof(magic));
+  s->header->version = SEPLOS_SHM_VERSION;
+  s->header->byte_order = BYTE_ORDER_MARK;
+  s->header->slots = count;
+  s->header->slot_size = sizeof(ShmSlot);
+  s->header->data_size = sizeof(SeplosData);
+  __atomic_store_n(&(s->header->publishing), 1, __ATOMIC_RELEASE);
+  return s;
+}
+
+/* Replace the sample in a slot. */
+void
+seplos_shm_publish(SeplosShm * s, unsigned int slot, int64_t timestamp, const SeplosData * m)
+{
+  ShmSlot * const	p = &(s->slots[slot]);
+  const uint64_t	sequence = p->sequence;
+
+  __atomic_store_n(&(p->sequence), sequence + 1, __ATOMIC_RELAXED);
+  __atomic_thread_fence(__ATOMIC_RELEASE);
+  p->timestamp = timestamp;
+  p->data = *m;
+  __atomic_store_n(&(p->sequence), sequence + 2, __ATOMIC_RELEASE);
+}
+
+/* Open the segment NAME, for a reader. */
+SeplosShm *
+seplos_shm_open(const char * name)
+{
+  struct stat		st;
+  ShmHeader		h;
+  SeplosShm * const	s = allocate(name, false);
+
+  if ( s == 0 )
+    return 0;
+
+  const int fd = shm_open(name, O_RDONLY|O_CLOEXEC, 0);
+  if ( fd < 0 || fstat(fd, &st) != 0 ) {
+    _sp_error("Shared memory %s: %s\n", name, strerror(errno));
+    if ( fd >= 0 )
+      close(fd);
+    seplos_shm_close(s);
+    return 0;
+  }
+  if ( (size_t)st.st_size < sizeof(h) || pread(fd, &h, sizeof(h), 0) != sizeof(h)
+   || memcmp(h.magic, magic, sizeof(magic)) != 0 ) {
+    _sp_error("Shared memory %s: Not a SEPLOS segment.\n", name);
+    close(fd);
+    seplos_shm_close(s);
+    return 0;
+  }
+  if ( h.byte_order != BYTE_ORDER_MARK || h.version != SEPLOS_SHM_VERSION
+   || h.slot_size != sizeof(ShmSlot) || h.data_size != sizeof(SeplosData)
+   || (size_t)st.st_size < sizeof(ShmHeader) + ((size_t)h.slots * sizeof(ShmSlot)) ) {
+    _sp_error("Shared memory %s: Was written by another version of the library.\n", name);
+    close(fd);
+    seplos_shm_close(s);
+    return 0;
+  }
+  const int status = map(s, fd, sizeof(ShmHeader) + ((size_t)h.slots * sizeof(ShmSlot)));
+  close(fd);
+  if ( status != 0 ) {
+    seplos_shm_close(s);
+    return 0;
+  }
+  return s;
+}
+
+unsigned int
+seplos_shm_slots(const SeplosShm * s)
+{
+  return s->header->slots;
+}
+
+/*
+ * Copy the latest sample in a slot, and the time of its sweep. Returns 1 if
+ * nothing has been published in the slot yet.
+ */
+int
+seplos_shm_read(SeplosShm * s, unsigned int slot, int64_t * timestamp, SeplosData * m)
+{
+  if ( slot >= s->header->slots ) {
+    _sp_error("Shared memory %s: There is no slot %u.\n", s->name, slot);
+    return -1;
+  }
+  if ( __atomic_load_n(&(s->header->publishing), __ATOMIC_ACQUIRE) == 0 ) {
+    _sp_error("Shared memory %s: The writer has stopped publishing.\n", s->name);
+    return -1;
+  }
+
+  const ShmSlot * const p = &(s->slots[slot]);
+  for ( unsigned int tries = 0; tries < MAXIMUM_TRIES; tries++ ) {
+    const uint64_t before = __atomic_load_n(&(p->sequence), __ATOMIC_ACQUIRE);
+    if ( before == 0 )
+      return 1;
+    if ( before & 1 ) {
+      relax();
+      continue;
+    }
+
+    *timestamp = p->timestamp;
+    *m = p->data;
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    if ( __atomic_load_n(&(p->sequence), __ATOMIC_RELAXED) == before )
+      return 0;
+  }
+  _sp_error("Shared memory %s: Slot %u is stuck in mid-write.\n", s->name, slot);
+  return -1;
+}
+
+/* Close the segment. If this is the writer, the segment is removed. */
+void
+seplos_shm_close(SeplosShm * s)
+{
+  if ( s == 0 )
+    return;
+
+  if ( s->header ) {
+    if ( s->writable ) {
+      __atomic_store_n(&(s->header->publishing), 0, __ATOMIC_RELEASE);
+      shm_unlink(s->name);
+    }
+    munmap(s->header, s->size);
+  }
+  free(s->name);
+  free(s);
+}
@@ -0,0 +1,545 @@
+#include "./internal.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+/*
+ * A time-series store of the samples of one pack, in a memory-mapped file.
+ *
+ * The samples are kept in blocks of block_samples samples. Within a block,
+ * each metric is a column: all of the timestamps, then all of the voltages of
+ * cell 0, then cell 1, and so on. A scan of one metric over a time range is a
+ * sequential read of one array per block, which is what the cache and the
+ * page-cache read-ahead are best at, rather than a stride through whole
+ * samples. A reader maps the whole file with a single mmap() however long the
+ * history is, and the pages of the columns that aren't read are never touched.
+ * The writer maps only the header and the block that it's appending to, so
+ * that years of history don't use up the address space of a 32-bit host.
+ *
+ * The values are the fixed-point numbers of the binary record, see record.c,
+ * stored in the byte order of the host so that a column can be used in place:
+ *
+ *   SEPLOS_COLUMN_TIMESTAMP		int64_t, microseconds since 1970 UTC
+ *   SEPLOS_COLUMN_CELL_VOLTAGE + n	uint16_t, mV
+ *   SEPLOS_COLUMN_TEMPERATURE + n	uint16_t, 0.1 K
+ *   SEPLOS_COLUMN_CURRENT		int16_t, 0.01 A
+ *   SEPLOS_COLUMN_VOLTAGE ... _PORT_VOLTAGE	uint16_t, as in the record
+ *   SEPLOS_COLUMN_EQUILIBRIUM, _DISCONNECTION	uint16_t, a bit per cell
+ *   SEPLOS_COLUMN_STATE		uint16_t, system state | on-off state << 8
+ *   SEPLOS_COLUMN_BIT_ALARMS		uint64_t, bit alarm n is bit n
+ *   SEPLOS_COLUMN_BYTE_ALARMS		24 bytes: cell, temperature, current, voltage
+ *
+ * The file is a header page, and then the blocks. A sample is appended by
+ * writing its values into the last block, and then incrementing the count of
+ * samples in the header, so a reader that maps the same file never sees a
+ * sample that's half written, and a crash loses at most the sample that was
+ * being written. The file grows by a block at a time.
+ */
+
+#define	HEADER_SIZE	4096
+#define	BYTE_ORDER_MARK	0x01020304
+
+typedef struct _StoreHeader {
+  char		magic[8];	/* "SEPLOSTS" */
+  uint32_t	version;
+  uint32_t	byte_order;	/* BYTE_ORDER_MARK, as the writing host stores it */
+  uint32_t	block_samples;
+  uint32_t	columns;
+  uint64_t	block_size;	/* Bytes */
+  uint64_t	samples;	/* Written and complete */
+  uint8_t	controller_address;
+  uint8_t	battery_pack_number;
+  uint8_t	number_of_cells;
+  uint8_t	reserved[5];
+  uint8_t	width[SEPLOS_STORE_COLUMNS];	/* Bytes per value of each column */
+} StoreHeader;
+
+_Static_assert(sizeof(StoreHeader) <= HEADER_SIZE, "The store header must fit in its page.");
+
+struct _SeplosStore {
+  int		fd;
+  bool		writable;
+  uint8_t *	map;	/* The whole file for a reader, the header for the writer */
+  size_t	map_size;
+  uint64_t	blocks;	/* Blocks that can be used */
+  StoreHeader *	header;
+  /* The writer's mapping of one block. */
+  uint8_t *	window;
+  size_t	window_size;
+  size_t	window_offset;	/* Of the block, within the window */
+  uint64_t	window_block;
+  /* Where each column is within the record, and within a block. */
+  unsigned int	record_offset[SEPLOS_STORE_COLUMNS];
+  unsigned int	width[SEPLOS_STORE_COLUMNS];
+  size_t	block_offset[SEPLOS_STORE_COLUMNS];
+};
+
+static const char	magic[8] = { 'S', 'E', 'P', 'L', 'O', 'S', 'T', 'S' };
+
+/* Where the value of a column is found in a record, and its width. */
+static void
+column_layout(unsigned int column, unsigned int * offset, unsigned int * width)
+{
+  *width = 2;
+
+  if ( column == SEPLOS_COLUMN_TIMESTAMP ) {
+    *offset = offsetof(SeplosRecord, timestamp);
+    *width = 8;
+  }
+  else if ( column < SEPLOS_COLUMN_TEMPERATURE )
+    *offset = offsetof(SeplosRecord, cell_voltage) + ((column - SEPLOS_COLUMN_CELL_VOLTAGE) * 2);
+  else if ( column < SEPLOS_COLUMN_CURRENT )
+    *offset = offsetof(SeplosRecord, temperature) + ((column - SEPLOS_COLUMN_TEMPERATURE) * 2);
+  else if ( column <= SEPLOS_COLUMN_DISCONNECTION )
+    /* These are consecutive 16-bit fields in the record, in the same order. */
+    *offset = offsetof(SeplosRecord, charge_discharge_current) + ((column - SEPLOS_COLUMN_CURRENT) * 2);
+  else if ( column == SEPLOS_COLUMN_STATE )
+    *offset = offsetof(SeplosRecord, system_state);
+  else if ( column == SEPLOS_COLUMN_BIT_ALARMS ) {
+    *offset = offsetof(SeplosRecord, bit_alarm);
+    *width = 8;
+  }
+  else {
+    *offset = offsetof(SeplosRecord, cell_alarm);
+    *width = offsetof(SeplosRecord, bit_alarm) - offsetof(SeplosRecord, cell_alarm);
+  }
+}
+
+static void
+layout(SeplosStore * s, unsigned int block_samples)
+{
+  size_t offset = 0;
+
+  for ( unsigned int c = 0; c < SEPLOS_STORE_COLUMNS; c++ ) {
+    column_layout(c, &(s->record_offset[c]), &(s->width[c]));
+    s->block_offset[c] = offset;
+    offset += (size_t)s->width[c] * block_samples;
+  }
+}
+
+static size_t
+block_size(const SeplosStore * s, unsigned int block_samples)
+{
+  const unsigned int last = SEPLOS_STORE_COLUMNS - 1;
+
+  return s->block_offset[last] + ((size_t)s->width[last] * block_samples);
+}
+
+/*
+ * Map the header and blocks blocks of the file, replacing any earlier mapping.
+ * The writer maps the header alone, and each block as it gets to it.
+ */
+static int
+map(SeplosStore * s, uint64_t blocks)
+{
+  const uint64_t size = HEADER_SIZE + (s->writable ? 0 : blocks * (s->header ? s->header->block_size : 0));
+  const int protection = PROT_READ | (s->writable ? PROT_WRITE : 0);
+
+  if ( size > SIZE_MAX ) {
+    _sp_error("Store: The history is too long to map on this system.\n");
+    return -1;
+  }
+  if ( s->writable && s->map ) {
+    s->blocks = blocks;
+    return 0;
+  }
+  if ( s->map )
+    munmap(s->map, s->map_size);
+  s->map = mmap(0, size, protection, MAP_SHARED, s->fd, 0);
+  if ( s->map == MAP_FAILED ) {
+    s->map = 0;
+    s->header = 0;
+    _sp_error("Store mmap failed: %s\n", strerror(errno));
+    return -1;
+  }
+  s->map_size = size;
+  s->header = (StoreHeader *)s->map;
+  s->blocks = blocks;
+  return 0;
+}
+
+/* The start of block, mapping it first if this is the writer. Returns 0 on error. */
+static uint8_t *
+block_at(SeplosStore * s, uint64_t block)
+{
+  if ( !s->writable )
+    return s->map + HEADER_SIZE + (block * s->header->block_size);
+
+  if ( s->window == 0 || s->window_block != block ) {
+    /* mmap() wants an offset that's a whole number of pages. */
+    const uint64_t offset = HEADER_SIZE + (block * s->header->block_size);
+    const uint64_t page = sysconf(_SC_PAGESIZE);
+    const uint64_t start = offset - (offset % page);
+
+    if ( s->window )
+      munmap(s->window, s->window_size);
+    s->window_offset = offset - start;
+    s->window_size = s->window_offset + s->header->block_size;
+    s->window = mmap(0, s->window_size, PROT_READ|PROT_WRITE, MAP_SHARED, s->fd, start);
+    if ( s->window == MAP_FAILED ) {
+      s->window = 0;
+      _sp_error("Store mmap failed: %s\n", strerror(errno));
+      return 0;
+    }
+    s->window_block = block;
+  }
+  return s->window + s->window_offset;
+}
+
+static int
+create(SeplosStore * s, unsigned int block_samples)
+{
+  StoreHeader h = {};
+
+  layout(s, block_samples);
+  memcpy(h.magic, magic, sizeof(magic));
+  h.version = SEPLOS_STORE_VERSION;
+  h.byte_order = BYTE_ORDER_MARK;
+  h.block_samples = block_samples;
+  h.columns = SEPLOS_STORE_COLUMNS;
+  h.block_size = block_size(s, block_samples);
+  for ( unsigned int c = 0; c < SEPLOS_STORE_COLUMNS; c++ )
+    h.width[c] = s->width[c];
+
+  if ( ftruncate(s->fd, HEADER_SIZE) != 0 || pwrite(s->fd, &h, sizeof(h), 0) != sizeof(h) ) {
+    _sp_error("Store: %s\n", strerror(errno));
+    return -1;
+  }
+  return 0;
+}
+
+static int
+check(SeplosStore * s, const StoreHeader * h, const char * path)
+{
+  if ( memcmp(h->magic, magic, sizeof(magic)) != 0 ) {
+    _sp_error("%s: Not a SEPLOS store.\n", path);
+    return -1;
+  }
+  if ( h->byte_order != BYTE_ORDER_MARK ) {
+    _sp_error("%s: Was written by a host of another byte order.\n", path);
+    return -1;
+  }
+  if ( h->version != SEPLOS_STORE_VERSION || h->columns != SEPLOS_STORE_COLUMNS || h->block_samples == 0 ) {
+    _sp_error("%s: Store version %u can't be read by this version of the library.\n", path, h->version);
+    return -1;
+  }
+  layout(s, h->block_samples);
+  if ( h->block_size != block_size(s, h->block_samples) ) {
+    _sp_error("%s: The store header is damaged.\n", path);
+    return -1;
+  }
+  return 0;
+}
+
+/*
+ * Open a store. If writable, the file is created if it doesn't exist. Only one
+ * writer at a time may have a store open, but any number of readers.
+ */
+SeplosStore *
+seplos_store_open(const char * path, bool writable)
+{
+  StoreHeader	h;
+  struct stat	st;
+  SeplosStore * const s = calloc(1, sizeof(*s));
+
+  if ( s == 0 ) {
+    _sp_error("Out of memory.\n");
+    return 0;
+  }
+  s->writable = writable;
+
+  s->fd = open(path, (writable ? O_RDWR|O_CREAT : O_RDONLY)|O_CLOEXEC, 0644);
+  if ( s->fd < 0 || fstat(s->fd, &st) != 0 ) {
+    _sp_error("%s: %s\n", path, strerror(errno));
+    seplos_store_close(s);
+    return 0;
+  }
+
+  if ( st.st_size == 0 && writable ) {
+    if ( create(s, SEPLOS_STORE_BLOCK_SAMPLES) != 0 ) {
+      seplos_store_close(s);
+      return 0;
+    }
+  }
+  else if ( pread(s->fd, &h, sizeof(h), 0) != sizeof(h) ) {
+    _sp_error("%s: Not a SEPLOS store.\n", path);
+    seplos_store_close(s);
+    return 0;
+  }
+  else if ( check(s, &h, path) != 0 ) {
+    seplos_store_close(s);
+    return 0;
+  }
+
+  /* Map the header alone, to find out how many blocks there are. */
+  if ( map(s, 0) != 0 || seplos_store_refresh(s) < 0 ) {
+    seplos_store_close(s);
+    return 0;
+  }
+  return s;
+}
+
+/*
+ * A file that was cut short, by a full disk or a copy that didn't finish, may
+ * hold fewer blocks than its count of samples calls for, and touching a page
+ * of the mapping past the end of the file is SIGBUS. A reader refuses such a
+ * store. The writer drops the samples of the blocks that aren't there, and
+ * carries on appending from the last whole block.
+ */
+static int
+fit(SeplosStore * s, uint64_t * blocks)
+{
+  struct stat	st;
+
+  if ( fstat(s->fd, &st) != 0 ) {
+    _sp_error("Store: %s\n", strerror(errno));
+    return -1;
+  }
+
+  const uint64_t whole = st.st_size < HEADER_SIZE ? 0 : (st.st_size - HEADER_SIZE) / s->header->block_size;
+  if ( whole >= *blocks )
+    return 0;
+
+  const uint64_t samples = s->header->samples;
+  const uint64_t kept = whole * s->header->block_samples;
+  if ( !s->writable ) {
+    _sp_error("Store: The file is too short for its %llu samples, it was cut short.\n", (unsigned long long)samples);
+    return -1;
+  }
+  _sp_error("Store: The file was cut short, its last %llu samples are lost.\n", (unsigned long long)(samples - kept));
+  __atomic_store_n(&(s->header->samples), kept, __ATOMIC_RELEASE);
+  *blocks = whole;
+  return 0;
+}
+
+/*
+ * Map any blocks that another process has added since the store was opened.
+ * Pointers from seplos_store_column() are invalid after this, or an append,
+ * if it returns 1.
+ */
+int
+seplos_store_refresh(SeplosStore * s)
+{
+  const uint64_t samples = __atomic_load_n(&(s->header->samples), __ATOMIC_ACQUIRE);
+  uint64_t blocks = (samples + s->header->block_samples - 1) / s->header->block_samples;
+
+  if ( blocks <= s->blocks )
+    return 0;
+  if ( fit(s, &blocks) != 0 )
+    return -1;
+  if ( blocks <= s->blocks )
+    return 0;
+  if ( map(s, blocks) != 0 )
+    return -1;
+  return 1;
+}
+
+uint64_t
+seplos_store_samples(const SeplosStore * s)
+{
+  return __atomic_load_n(&(s->header->samples), __ATOMIC_ACQUIRE);
+}
+
+unsigned int
+seplos_store_block_samples(const SeplosStore * s)
+{
+  return s->header->block_samples;
+}
+
+/* Returns 0 if the block couldn't be mapped. */
+static void *
+cell(SeplosStore * s, uint64_t block, unsigned int column, unsigned int index)
+{
+  uint8_t * const b = block_at(s, block);
+
+  if ( b == 0 )
+    return 0;
+  return b + s->block_offset[column] + ((size_t)index * s->width[column]);
+}
+
+/*
+ * The values of column in block, as an array of the type given at the top of
+ * this file. *count is set to the number of samples in the block, which is
+ * block_samples for all but the last block. Returns 0 if there's no such block.
+ * The writer maps one block at a time, so there the pointer is good only until
+ * a column of another block is asked for, or a sample is appended.
+ */
+const void *
+seplos_store_column(SeplosStore * s, uint64_t block, unsigned int column, unsigned int * count)
+{
+  const uint64_t samples = seplos_store_samples(s);
+  const unsigned int n = s->header->block_samples;
+
+  if ( column >= SEPLOS_STORE_COLUMNS || block >= s->blocks || block * n >= samples ) {
+    *count = 0;
+    return 0;
+  }
+  const void * const values = cell(s, block, column, 0);
+  *count = values == 0 ? 0 : samples - (block * n) < n ? samples - (block * n) : n;
+  return values;
+}
+
+int
+seplos_store_append(SeplosStore * s, int64_t timestamp, const SeplosData * m)
+{
+  uint8_t	record[SEPLOS_RECORD_SIZE];
+  const uint64_t samples = s->header->samples;
+  const unsigned int n = s->header->block_samples;
+  const uint64_t block = samples / n;
+  const unsigned int index = samples % n;
+  uint8_t *	values;
+
+  if ( !s->writable ) {
+    _sp_error("The store wasn't opened for writing.\n");
+    return -1;
+  }
+
+  if ( block >= s->blocks ) {
+    const uint64_t size = HEADER_SIZE + ((block + 1) * s->header->block_size);
+    if ( (uint64_t)(off_t)size != size ) {
+      _sp_error("Store: The file would be too large for this system.\n");
+      return -1;
+    }
+    if ( ftruncate(s->fd, size) != 0 ) {
+      _sp_error("Store: %s\n", strerror(errno));
+      return -1;
+    }
+    if ( map(s, block + 1) != 0 )
+      return -1;
+  }
+  if ( (values = block_at(s, block)) == 0 )
+    return -1;
+
+  if ( samples == 0 ) {
+    s->header->controller_address = m->controller_address;
+    s->header->battery_pack_number = m->battery_pack_number;
+    s->header->number_of_cells = m->number_of_cells;
+  }
+
+  /* Transpose the little-endian record into the columns, in host order. */
+  seplos_record_encode(record, timestamp, m);
+  for ( unsigned int c = 0; c < SEPLOS_STORE_COLUMNS; c++ ) {
+    const uint8_t * const v = record + s->record_offset[c];
+    void * const to = values + s->block_offset[c] + ((size_t)index * s->width[c]);
+
+    switch ( s->width[c] ) {
+    case 2:
+      *(uint16_t *)to = v[0] | (v[1] << 8);
+      break;
+    case 8:
+      {
+        uint64_t value = 0;
+        for ( unsigned int i = 0; i < 8; i++ )
+          value |= (uint64_t)v[i] << (i * 8);
+        *(uint64_t *)to = value;
+      }
+      break;
+    default:
+      memcpy(to, v, s->width[c]);
+      break;
+    }
+  }
+
+  __atomic_store_n(&(s->header->samples), samples + 1, __ATOMIC_RELEASE);
+  return 0;
+}
+
+/* Read a whole sample back, as seplos_record_decode() does. */
+int
+seplos_store_read(SeplosStore * s, uint64_t sample, int64_t * timestamp, SeplosData * m)
+{
+  SeplosRecord	r = {};
+  uint8_t *	record = (uint8_t *)&r;
+  const unsigned int n = s->header->block_samples;
+  const uint8_t *	values;
+
+  if ( sample >= seplos_store_samples(s) || (sample / n >= s->blocks && seplos_store_refresh(s) < 0) )
+    return -1;
+  if ( (values = block_at(s, sample / n)) == 0 )
+    return -1;
+
+  r.controller_address = s->header->controller_address;
+  r.battery_pack_number = s->header->battery_pack_number;
+  r.number_of_cells = s->header->number_of_cells;
+
+  for ( unsigned int c = 0; c < SEPLOS_STORE_COLUMNS; c++ ) {
+    const void * const from = values + s->block_offset[c] + ((size_t)(sample % n) * s->width[c]);
+    uint8_t * const v = record + s->record_offset[c];
+
+    switch ( s->width[c] ) {
+    case 2:
+      {
+        const uint16_t value = *(const uint16_t *)from;
+        v[0] = value & 0xff;
+        v[1] = value >> 8;
+      }
+      break;
+    case 8:
+      {
+        const uint64_t value = *(const uint64_t *)from;
+        for ( unsigned int i = 0; i < 8; i++ )
+          v[i] = (value >> (i * 8)) & 0xff;
+      }
+      break;
+    default:
+      memcpy(v, from, s->width[c]);
+      break;
+    }
+  }
+  seplos_record_decode(record, timestamp, m);
+  return 0;
+}
+
+/*
+ * The index of the first sample at or after timestamp, or the number of
+ * samples if there is none. The timestamps must be in order, as they are when
+ * they come from the clock as the samples are taken.
+ */
+uint64_t
+seplos_store_find(SeplosStore * s, int64_t timestamp)
+{
+  uint64_t	low = 0;
+  uint64_t	high = seplos_store_samples(s);
+  const unsigned int n = s->header->block_samples;
+
+  if ( high > s->blocks * n )
+    high = s->blocks * n;
+
+  while ( low < high ) {
+    const uint64_t middle = low + ((high - low) / 2);
+    const int64_t * const t = cell(s, middle / n, SEPLOS_COLUMN_TIMESTAMP, middle % n);
+
+    if ( t == 0 )
+      break;
+    if ( *t < timestamp )
+      low = middle + 1;
+    else
+      high = middle;
+  }
+  return low;
+}
+
+void
+seplos_store_close(SeplosStore * s)
+{
+  if ( s == 0 )
+    return;
+  if ( s->window ) {
+    msync(s->window, s->window_size, MS_ASYNC);
+    munmap(s->window, s->window_size);
+  }
+  if ( s->map ) {
+    if ( s->writable )
+      msync(s->map, s->map_size, MS_ASYNC);
+    munmap(s->map, s->map_size);
+  }
+  if ( s->fd >= 0 )
+    close(s->fd);
+  free(s);
+}
@@ -1,4 +1,5 @@
 #include "./internal.h"
+#include <time.h>
 
 static void
 cell_state_text(FILE * f, const SeplosData const * m, int offset)
@@ -20,7 +21,7 @@ cell_state_text(FILE * f, const SeplosData const * m, int offset)
   fprintf(f, "\nDisconnected: ");
   for ( int i = 0; i < 8; i++ ) {
     const unsigned int index = i + offset;
-    fprintf(f, "  %c   ", (m->equilibrium_state & (1 << index)) ? '*' : '-');
+    fprintf(f, "  %c   ", (m->disconnection_state & (1 << index)) ? '*' : '-');
   }
   fprintf(f, "\nTemperature:  ");
   for ( int i = 0; i < 2; i++ ) {
@@ -88,66 +89,53 @@ seplos_text(FILE * f, const SeplosData const * m, bool longer)
 
     if ( m->has_cell_alarm ) {
       fprintf(f, "\nThe battery indicates an issue with one or more of the cells:\n");
-      for ( unsigned int i = 0; i < SEPLOS_N_CELLS; i++ ) {
-        uint8_t value = m->cell_alarm[i];
-    
-        if ( value != NORMAL ) {
-          const char * s = "undefined cell alarm state.";
-    
-          switch ( value ) {
-          case LOW_LIMIT_HIT:
-            s = "exhausted: voltage was depleted below the lower limit.";
-            break;
-          case HIGH_LIMIT_HIT:
-            s = "overcharged: voltage has exceeded the upper limit.";
-            break;
-          case OTHER_ALARM:
-            s = "controller reports \"other\" cell alarm state.\n";
-            break;
-          }
-           
-          fprintf(f, "Cell %d: %s\n", i, s);
+      for ( uint64_t cells = seplos_any_alarm(&(m->cell_alarms)); cells; ) {
+        const unsigned int i = seplos_next_alarm(&cells);
+        const char * s = "undefined cell alarm state.";
+
+        switch ( m->cell_alarm[i] ) {
+        case LOW_LIMIT_HIT:
+          s = "exhausted: voltage was depleted below the lower limit.";
+          break;
+        case HIGH_LIMIT_HIT:
+          s = "overcharged: voltage has exceeded the upper limit.";
+          break;
+        case OTHER_ALARM:
+          s = "controller reports \"other\" cell alarm state.\n";
+          break;
         }
+
+        fprintf(f, "Cell %d: %s\n", i, s);
       }
       fprintf(f, "\n");
     }
 
-    if ( m->temperature_alarm ) {
+    if ( m->has_temperature_alarm ) {
       fprintf(f, "\nThe battery temperature is out of bounds:\n");
 
-      for ( unsigned int i = 0; i < SEPLOS_N_TEMPERATURES; i++ ) {
-        uint8_t value = m->temperature_alarm[i];
-  
-        if ( value != NORMAL ) {
-          fprintf(f, "%s: \n", seplos_temperature_names[i]);
-          const char * s = "undefined temperature state.";
-   
-          switch ( value ) {
-          case LOW_LIMIT_HIT:
-            s = "too cold: below the lower limit.";
-            break;
-          case HIGH_LIMIT_HIT:
-            s = "too hot: above the upper limit.";
-            break;
-          case OTHER_ALARM:
-            s = "controller reports \"other\" temperature state.\n";
-          }
-          fprintf(f, "Cell %d: %s\n", s);
+      for ( uint64_t sensors = seplos_any_alarm(&(m->temperature_alarms)); sensors; ) {
+        const unsigned int i = seplos_next_alarm(&sensors);
+        const char * s = "undefined temperature state.";
+
+        switch ( m->temperature_alarm[i] ) {
+        case LOW_LIMIT_HIT:
+          s = "too cold: below the lower limit.";
+          break;
+        case HIGH_LIMIT_HIT:
+          s = "too hot: above the upper limit.";
+          break;
+        case OTHER_ALARM:
+          s = "controller reports \"other\" temperature state.\n";
         }
+        fprintf(f, "%s: %s\n", seplos_temperature_names[i], s);
       }
     }
-    if ( m->has_bit_alarm ) {
-      for ( int i = 0; i < (sizeof(m->bit_alarm) / sizeof(*m->bit_alarm)); i++ ) {
-        uint32_t value = m->bit_alarm[i];
-        if ( value != 0 ) {
-          for ( int j = 0; j < 32; j++ ) {
-            const uint32_t mask = 1 << j;
-            if ( (value & mask) != 0 ) {
-              fprintf(f, "Alarm: %s.\n", seplos_bit_alarm_names[(i * 32) + j]);
-            }
-          }
-        }
-      }
+    for ( uint64_t bits = seplos_bit_alarms(m); bits; ) {
+      const unsigned int i = seplos_next_alarm(&bits);
+      if ( seplos_bit_alarm_names[i] )
+        fprintf(f, "Alarm: %s.\n", seplos_bit_alarm_names[i]);
+      else
+        fprintf(f, "Alarm: Undocumented alarm %u.\n", i);
     }
   }
   else {
@@ -184,3 +172,205 @@ seplos_text(FILE * f, const SeplosData const * m, bool longer)
     fprintf(f, "Power electronics temperature: %.0f C, %.0f F\n", m->temperature[5], _sp_farenheit(m->temperature[5]));
   }
 }
+
+static const char *
+level_text(uint8_t value)
+{
+  switch ( value ) {
+  case NORMAL:
+    return "normal";
+  case LOW_LIMIT_HIT:
+    return "below the lower limit";
+  case HIGH_LIMIT_HIT:
+    return "above the upper limit";
+  case OTHER_ALARM:
+    return "\"other\" alarm state";
+  default:
+    return "undefined alarm state";
+  }
+}
+
+static void
+cells_text(FILE * f, const char * label, uint16_t state)
+{
+  fprintf(f, "%s", label);
+  if ( state == 0 )
+    fprintf(f, " none");
+  for ( unsigned int i = 0; i < SEPLOS_N_CELLS; i++ ) {
+    if ( state & (1 << i) )
+      fprintf(f, " %u", i);
+  }
+  fprintf(f, "\n");
+}
+
+/*
+ * One line for each field in changes, as seplos_diff() sets them. When the
+ * alarms change, all of the alarms that are set are printed, or "No Alarms."
+ */
+void
+seplos_text_changes(FILE * f, const SeplosData * m, const SeplosChanges * changes)
+{
+  const uint32_t c = changes->fields;
+
+  fprintf(f, "Controller %x, battery pack %x:\n", m->controller_address, m->battery_pack_number);
+
+  if ( c & SEPLOS_CHANGED_ALARMS ) {
+    if ( !m->has_alarm )
+      fprintf(f, "No Alarms.\n");
+    if ( m->total_battery_voltage_alarm != NORMAL )
+      fprintf(f, "Alarm: Total battery voltage %s.\n", level_text(m->total_battery_voltage_alarm));
+    if ( m->charge_discharge_current_alarm != NORMAL )
+      fprintf(f, "Alarm: Charge or discharge current %s.\n", level_text(m->charge_discharge_current_alarm));
+    for ( uint64_t cells = seplos_any_alarm(&(m->cell_alarms)); cells; ) {
+      const unsigned int i = seplos_next_alarm(&cells);
+      fprintf(f, "Alarm: Cell %u voltage %s.\n", i, level_text(m->cell_alarm[i]));
+    }
+    for ( uint64_t sensors = seplos_any_alarm(&(m->temperature_alarms)); sensors; ) {
+      const unsigned int i = seplos_next_alarm(&sensors);
+      fprintf(f, "Alarm: %s %s.\n", seplos_temperature_names[i], level_text(m->temperature_alarm[i]));
+    }
+    for ( uint64_t bits = seplos_bit_alarms(m); bits; ) {
+      const unsigned int i = seplos_next_alarm(&bits);
+      if ( seplos_bit_alarm_names[i] )
+        fprintf(f, "Alarm: %s.\n", seplos_bit_alarm_names[i]);
+      else
+        fprintf(f, "Alarm: Undocumented alarm %u.\n", i);
+    }
+  }
+
+  if ( c & SEPLOS_CHANGED_VOLTAGE )
+    fprintf(f, "Voltage:          %.2f V\n", m->total_battery_voltage);
+  if ( c & SEPLOS_CHANGED_CURRENT )
+    fprintf(f, "Current:          %.2f A\n", m->charge_discharge_current);
+  if ( c & SEPLOS_CHANGED_STATE_OF_CHARGE )
+    fprintf(f, "State of charge:  %.1f%%\n", m->state_of_charge);
+  if ( c & SEPLOS_CHANGED_RESIDUAL_CAPACITY )
+    fprintf(f, "Residual capacity: %.2f AH\n", m->residual_capacity);
+  if ( c & SEPLOS_CHANGED_PORT_VOLTAGE )
+    fprintf(f, "Port voltage:     %.2f V\n", m->port_voltage);
+  if ( c & SEPLOS_CHANGED_BATTERY_CAPACITY )
+    fprintf(f, "Battery capacity: %.2f AH\n", m->battery_capacity);
+  if ( c & SEPLOS_CHANGED_RATED_CAPACITY )
+    fprintf(f, "Rated capacity:   %.2f AH\n", m->rated_capacity);
+  if ( c & SEPLOS_CHANGED_STATE_OF_HEALTH )
+    fprintf(f, "State of health:  %.1f%%\n", m->state_of_health);
+  if ( c & SEPLOS_CHANGED_CYCLES )
+    fprintf(f, "Lifetime Cycles:  %u\n", m->number_of_cycles);
+
+  if ( c & SEPLOS_CHANGED_STATE ) {
+    fprintf(f, "State:           ");
+    if ( m->discharge )
+      fprintf(f, " discharge");
+    if ( m->charge )
+      fprintf(f, " charge");
+    if ( m->floating_charge )
+      fprintf(f, " floating charge");
+    if ( m->standby )
+      fprintf(f, " standby");
+    if ( m->shutdown )
+      fprintf(f, " shutdown");
+    fprintf(f, "\n");
+  }
+  if ( c & SEPLOS_CHANGED_SWITCHES )
+    fprintf(f, "Switches:         discharge %s, charge %s, current limit %s, heating %s\n",
+     m->discharge_switch ? "ON" : "off",
+     m->charge_switch ? "ON" : "off",
+     m->current_limit_switch ? "ON" : "off",
+     m->heating_switch ? "ON" : "off");
+
+  for ( unsigned int i = 0; i < SEPLOS_N_CELLS; i++ ) {
+    if ( changes->cell_voltage & (1 << i) )
+      fprintf(f, "Cell %2u voltage:  %.3f V\n", i, m->cell_voltage[i]);
+  }
+  for ( unsigned int i = 0; i < SEPLOS_N_TEMPERATURES; i++ ) {
+    if ( changes->temperature & (1 << i) )
+      fprintf(f, "%s: %.0f C, %.0f F\n", seplos_temperature_names[i], m->temperature[i], _sp_farenheit(m->temperature[i]));
+  }
+  if ( c & SEPLOS_CHANGED_EQUILIBRIUM )
+    cells_text(f, "Equilibrium:     ", m->equilibrium_state);
+  if ( c & SEPLOS_CHANGED_DISCONNECTION )
+    cells_text(f, "Disconnected:    ", m->disconnection_state);
+}
+
+/* Where an extreme of a site is. */
+static void
+place_text(FILE * f, const SeplosFleetExtreme * e)
+{
+  fprintf(f, "controller %x, battery pack %x", e->controller_address, e->battery_pack_number);
+}
+
+void
+seplos_fleet_text(FILE * f, const SeplosFleetSummary * s)
+{
+  fprintf(f, "Site: %u packs", s->packs);
+  if ( s->alarms )
+    fprintf(f, ", !!! %u in an alarm state !!!\n", s->alarms);
+  else
+    fprintf(f, ", no alarms.\n");
+  if ( s->packs == 0 )
+    return;
+
+  fprintf(f, "Current:          %.2f A\n", s->current);
+  fprintf(f, "Power:            %.0f W\n", s->power);
+  fprintf(f, "Stored energy:    %.2f kWh, %.2f of %.2f AH, %.0f%%\n", s->energy / 1000, s->residual_capacity, s->battery_capacity, s->state_of_charge);
+  fprintf(f, "State of charge:  %.0f%% - %.0f%% (spread %.0f%%), lowest at ", s->lowest_state_of_charge.value, s->highest_state_of_charge.value, s->highest_state_of_charge.value - s->lowest_state_of_charge.value);
+  place_text(f, &(s->lowest_state_of_charge));
+  fprintf(f, "\nLowest cell:      %.3f V, cell %u of ", s->lowest_cell.value, s->lowest_cell.element);
+  place_text(f, &(s->lowest_cell));
+  fprintf(f, "\nHighest cell:     %.3f V, cell %u of ", s->highest_cell.value, s->highest_cell.element);
+  place_text(f, &(s->highest_cell));
+  fprintf(f, "\nColdest:          %.0f C, %.0f F, %s of ", s->coldest.value, _sp_farenheit(s->coldest.value), seplos_temperature_names[s->coldest.element]);
+  place_text(f, &(s->coldest));
+  fprintf(f, "\nHottest:          %.0f C, %.0f F, %s of ", s->hottest.value, _sp_farenheit(s->hottest.value), seplos_temperature_names[s->hottest.element]);
+  place_text(f, &(s->hottest));
+  fprintf(f, "\n");
+}
+
+/* A time of the history, in local time. */
+static void
+date_text(FILE * f, int64_t timestamp)
+{
+  const time_t	seconds = timestamp / 1000000;
+  struct tm	t;
+  char		s[64];
+
+  strftime(s, sizeof(s), "%Y-%m-%d %H:%M:%S", localtime_r(&seconds, &t));
+  fputs(s, f);
+}
+
+void
+seplos_analysis_text(FILE * f, const SeplosAnalysis * a)
+{
+  fprintf(f, "Controller %x, battery pack %x: %llu samples", a->controller_address, a->battery_pack_number, (unsigned long long)a->samples);
+  if ( a->samples == 0 ) {
+    fprintf(f, ".\n");
+    return;
+  }
+  fprintf(f, ", ");
+  date_text(f, a->first);
+  fprintf(f, " to ");
+  date_text(f, a->last);
+  fprintf(f, "\n");
+  fprintf(f, "Cycles:           %u - %u\n", a->first_cycles, a->last_cycles);
+  fprintf(f, "State of health:  %.1f%% - %.1f%%", a->first_state_of_health, a->last_state_of_health);
+  if ( a->last_cycles > a->first_cycles )
+    fprintf(f, ", %.2f%% per 100 cycles", a->state_of_health_per_100_cycles);
+  fprintf(f, "\nResistance from:  %llu steps of the current\n\n", (unsigned long long)a->steps);
+
+  fprintf(f, "     Deviation from the mean, mV\n");
+  fprintf(f, "Cell    Mean     RMS  Lowest Highest Balancing Resistance\n");
+  for ( unsigned int c = 0; c < a->number_of_cells; c++ ) {
+    fprintf(
+     f,
+     "%4u %7.2f %7.2f %7.2f %7.2f %8.1f%%",
+     c,
+     a->mean_deviation[c],
+     a->rms_deviation[c],
+     a->lowest_deviation[c],
+     a->highest_deviation[c],
+     a->balancing[c]);
+    if ( a->steps > 0 )
+      fprintf(f, " %7.3f mOhm", a->resistance[c]);
+    fprintf(f, "\n");
+  }
+}
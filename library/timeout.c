@@ -0,0 +1,21 @@
+#include "./internal.h"
+
+static unsigned int	timeout = SEPLOS_DEFAULT_TIMEOUT;
+
+void
+seplos_set_timeout(unsigned int milliseconds)
+{
+  timeout = milliseconds;
+}
+
+unsigned int
+seplos_timeout(void)
+{
+  return timeout;
+}
+
+int64_t
+_sp_deadline(void)
+{
+  return _sp_monotonic_time() + (timeout * 1000000LL);
+}
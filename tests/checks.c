@@ -0,0 +1,885 @@
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "internal.h"
+#include "communication.h"
+
+/*
+ * Checks of the library, which "make check" runs. Each check prints what's
+ * wrong to stderr, and returns the number of failures. The exit status is 0
+ * only if every check passed.
+ *
+ * The SSE2 and AVX2 versions of the checksum, the hex conversion and the
+ * analysis kernel are checked against the scalar versions, over valid and
+ * invalid input, where the processor has them, since a fast result that's
+ * wrong is no use. The packed alarm masks are checked against a byte at a
+ * time. The record and the series codec must give back what they were given,
+ * a store that was cut short must be handled, and the alarm rules and the
+ * energy counters are run over samples with known results. The summary of a
+ * site is checked against a scan of its packs.
+ *
+ * The benchmarks are in ../bench.
+ */
+
+/* A sample for the checks that only need one, with a full pack of cells. */
+static SeplosData	sample = { .number_of_cells = SEPLOS_N_CELLS };
+
+#if defined(__x86_64__) || defined(__i386__)
+/*
+ * Compare a SIMD version with the scalar one: the checksum, whether the input
+ * is valid, and every byte converted, which must be the same even when the
+ * input isn't valid. It's done over every length up to the largest info field,
+ * so every length of the tail after the last whole vector, at every alignment
+ * within 32 bytes. The input is all hexidecimal, then all random bytes, and
+ * then hexidecimal with one bad character at each position in turn. Returns
+ * the number of mismatches.
+ */
+static unsigned int
+check(
+ const char * name,
+ bool (*hex_decode)(const char * restrict, uint8_t * restrict, unsigned int),
+ unsigned int (*checksum)(const char * restrict, unsigned int))
+{
+  static const char	digits[] = "0123456789ABCDEFabcdef";
+  static char		input[32 + 4096 + 32];
+  static uint8_t	expected[2048 + 1];
+  static uint8_t	got[2048 + 1];
+  unsigned int		mismatches = 0;
+
+  srandom(1);
+  for ( unsigned int trial = 0; trial < 3; trial++ ) {
+    for ( unsigned int i = 0; i < sizeof(input); i++ )
+      input[i] = trial == 1 ? random() : digits[random() % (sizeof(digits) - 1)];
+
+    for ( unsigned int offset = 0; offset < 32; offset++ ) {
+      for ( unsigned int length = 0; length <= 2047; length++ ) {
+        char * const	a = input + offset;
+        const unsigned int	bad = length > 0 ? random() % (length * 2) : 0;
+        const char	saved = a[bad];
+
+        if ( trial == 2 && length > 0 ) {
+          do
+            a[bad] = random();
+          while ( strchr(digits, a[bad]) && a[bad] != '\0' );
+        }
+
+        /* Odd lengths too, the checksum is over the whole packet. */
+        for ( unsigned int extra = 0; extra < 2; extra++ ) {
+          if ( checksum(a, (length * 2) + extra) != _sp_overall_checksum_scalar(a, (length * 2) + extra) )
+            mismatches++;
+        }
+        /* Past the end must not be written. */
+        memset(expected, 0x55, length + 1);
+        memset(got, 0x55, length + 1);
+        const bool e = _sp_hex_decode_scalar(a, expected, length);
+        const bool g = hex_decode(a, got, length);
+        if ( e != g || memcmp(expected, got, length + 1) != 0 || (trial == 2 && length > 0 && e) )
+          mismatches++;
+
+        a[bad] = saved;
+      }
+    }
+  }
+  if ( mismatches )
+    fprintf(stderr, "%s: %u results differ from the scalar version.\n", name, mismatches);
+  return mismatches;
+}
+
+static void
+start_sums(AnalysisSums * sums)
+{
+  memset(sums, 0, sizeof(*sums));
+  for ( unsigned int c = 0; c < SEPLOS_N_CELLS; c++ ) {
+    sums->lowest[c] = INT32_MAX;
+    sums->highest[c] = INT32_MIN;
+  }
+}
+
+/*
+ * Compare the AVX2 kernel with the scalar one, over every length of span and
+ * number of cells, with voltages and steps from all of their range. Returns the
+ * number of mismatches.
+ */
+static unsigned int
+check_analyze(void)
+{
+  static uint16_t	cells[SEPLOS_N_CELLS][256];
+  static uint16_t	equilibrium[256];
+  static int16_t	steps[256];
+  AnalysisSpan		s = {};
+  AnalysisSums		expected;
+  AnalysisSums		got;
+  unsigned int		mismatches = 0;
+
+  srandom(1);
+  for ( unsigned int c = 0; c < SEPLOS_N_CELLS; c++ ) {
+    for ( unsigned int t = 0; t < 256; t++ )
+      cells[c][t] = random();
+    s.cells[c] = cells[c];
+    s.previous[c] = random();
+  }
+  for ( unsigned int t = 0; t < 256; t++ ) {
+    equilibrium[t] = random();
+    steps[t] = (random() % 65535) - 32767;
+  }
+  s.equilibrium = equilibrium;
+  s.steps = steps;
+
+  for ( unsigned int n = 0; n <= SEPLOS_N_CELLS; n++ ) {
+    s.number_of_cells = n;
+    for ( unsigned int length = 0; length <= 256; length++ ) {
+      start_sums(&expected);
+      start_sums(&got);
+      _sp_analyze_scalar(&s, 0, length, &expected);
+      _sp_analyze_avx2(&s, length, &got);
+      if ( memcmp(&expected, &got, sizeof(got)) != 0 )
+        mismatches++;
+    }
+  }
+  if ( mismatches )
+    fprintf(stderr, "analyze_avx2: %u results differ from the scalar version.\n", mismatches);
+  return mismatches;
+}
+#endif
+
+/* The masks of byte alarms, and the alarm summary, a byte at a time. */
+static void
+plain_masks(const uint8_t * bytes, unsigned int count, SeplosAlarmMasks * a)
+{
+  a->low = a->high = a->other = 0;
+  for ( unsigned int i = 0; i < count; i++ ) {
+    if ( bytes[i] == LOW_LIMIT_HIT )
+      a->low |= 1 << i;
+    else if ( bytes[i] == HIGH_LIMIT_HIT )
+      a->high |= 1 << i;
+    else if ( bytes[i] != NORMAL )
+      a->other |= 1 << i;
+  }
+}
+
+static bool
+plain_other(uint8_t alarm)
+{
+  return alarm != NORMAL && alarm != LOW_LIMIT_HIT && alarm != HIGH_LIMIT_HIT;
+}
+
+static void
+plain_summary(const SeplosData * m, SeplosData * e)
+{
+  bool cells_other = false;
+  bool temperatures_other = false;
+
+  *e = *m;
+  plain_masks(m->cell_alarm, SEPLOS_N_CELLS, &(e->cell_alarms));
+  plain_masks(m->temperature_alarm, SEPLOS_N_TEMPERATURES, &(e->temperature_alarms));
+  e->has_cell_alarm = e->has_temperature_alarm = false;
+  e->depleted = e->total_battery_voltage_alarm == LOW_LIMIT_HIT;
+  e->overcharge = e->total_battery_voltage_alarm == HIGH_LIMIT_HIT;
+  e->cold = e->hot = false;
+  for ( unsigned int i = 0; i < SEPLOS_N_CELLS; i++ ) {
+    e->has_cell_alarm |= m->cell_alarm[i] != NORMAL;
+    e->depleted |= m->cell_alarm[i] == LOW_LIMIT_HIT;
+    e->overcharge |= m->cell_alarm[i] == HIGH_LIMIT_HIT;
+    cells_other |= plain_other(m->cell_alarm[i]);
+  }
+  for ( unsigned int i = 0; i < SEPLOS_N_TEMPERATURES; i++ ) {
+    e->has_temperature_alarm |= m->temperature_alarm[i] != NORMAL;
+    e->cold |= m->temperature_alarm[i] == LOW_LIMIT_HIT;
+    e->hot |= m->temperature_alarm[i] == HIGH_LIMIT_HIT;
+    temperatures_other |= plain_other(m->temperature_alarm[i]);
+  }
+  e->has_voltage_or_current_alarm = m->total_battery_voltage_alarm != NORMAL || m->charge_discharge_current_alarm != NORMAL;
+  e->has_bit_alarm = m->bit_alarm[0] != 0 || m->bit_alarm[1] != 0;
+  e->other_or_undocumented_alarm_state = cells_other || temperatures_other
+   || plain_other(m->total_battery_voltage_alarm) || plain_other(m->charge_discharge_current_alarm);
+  e->has_alarm = e->has_cell_alarm || e->has_temperature_alarm || e->has_voltage_or_current_alarm || e->has_bit_alarm;
+}
+
+/*
+ * The packed masks of the byte alarms, and the alarm summary, against a byte
+ * at a time: each alarm value alone at each cell and sensor, and then random
+ * mixes of them. The current and voltage alarms, which follow the six sensors,
+ * are set, so that reading past the sensors would show in their masks. The
+ * flags are all set beforehand, so that none must carry over. Returns the
+ * number of mismatches.
+ */
+static unsigned int
+check_alarms(void)
+{
+  static const uint8_t	values[] = { NORMAL, LOW_LIMIT_HIT, HIGH_LIMIT_HIT, OTHER_ALARM, 3, 0x7f, 0x80, 0x81, 0xfe, 0xff };
+  const unsigned int	n_values = sizeof(values) / sizeof(*values);
+  const unsigned int	positions = SEPLOS_N_CELLS + SEPLOS_N_TEMPERATURES;
+  unsigned int		failures = 0;
+
+  srandom(4);
+  for ( unsigned int trial = 0; trial < (n_values * positions) + 10000; trial++ ) {
+    SeplosData	m = sample;
+    SeplosData	e;
+
+    if ( trial < n_values * positions ) {
+      const unsigned int position = trial % positions;
+      const uint8_t value = values[trial / positions];
+
+      if ( position < SEPLOS_N_CELLS )
+        m.cell_alarm[position] = value;
+      else
+        m.temperature_alarm[position - SEPLOS_N_CELLS] = value;
+      m.charge_discharge_current_alarm = LOW_LIMIT_HIT;
+      m.total_battery_voltage_alarm = HIGH_LIMIT_HIT;
+    }
+    else {
+      /* Mostly NORMAL, as they are. */
+      for ( unsigned int i = 0; i < SEPLOS_N_CELLS; i++ )
+        m.cell_alarm[i] = random() % 4 ? NORMAL : values[random() % n_values];
+      for ( unsigned int i = 0; i < SEPLOS_N_TEMPERATURES; i++ )
+        m.temperature_alarm[i] = random() % 4 ? NORMAL : values[random() % n_values];
+      m.charge_discharge_current_alarm = values[random() % n_values];
+      m.total_battery_voltage_alarm = values[random() % n_values];
+      m.bit_alarm[random() % 2] = random() % 2 ? 1u << (random() % 32) : 0;
+    }
+    m.has_alarm = m.other_or_undocumented_alarm_state = m.has_cell_alarm = m.has_temperature_alarm = true;
+    m.has_voltage_or_current_alarm = m.has_bit_alarm = m.depleted = m.overcharge = m.cold = m.hot = true;
+
+    plain_summary(&m, &e);
+    _sp_summarize_alarms(&m);
+    if ( memcmp(&(m.cell_alarms), &(e.cell_alarms), sizeof(m.cell_alarms)) != 0
+     || memcmp(&(m.temperature_alarms), &(e.temperature_alarms), sizeof(m.temperature_alarms)) != 0
+     || m.has_alarm != e.has_alarm
+     || m.other_or_undocumented_alarm_state != e.other_or_undocumented_alarm_state
+     || m.has_cell_alarm != e.has_cell_alarm
+     || m.has_temperature_alarm != e.has_temperature_alarm
+     || m.has_voltage_or_current_alarm != e.has_voltage_or_current_alarm
+     || m.has_bit_alarm != e.has_bit_alarm
+     || m.depleted != e.depleted
+     || m.overcharge != e.overcharge
+     || m.cold != e.cold
+     || m.hot != e.hot ) {
+      if ( failures++ == 0 ) {
+        fprintf(
+         stderr,
+         "Alarms: cells %04x %04x %04x, sensors %02x %02x %02x, should be %04x %04x %04x, %02x %02x %02x, or the summary differs.\n",
+         m.cell_alarms.low, m.cell_alarms.high, m.cell_alarms.other,
+         m.temperature_alarms.low, m.temperature_alarms.high, m.temperature_alarms.other,
+         e.cell_alarms.low, e.cell_alarms.high, e.cell_alarms.other,
+         e.temperature_alarms.low, e.temperature_alarms.high, e.temperature_alarms.other);
+      }
+    }
+  }
+  if ( failures )
+    fprintf(stderr, "Alarms: %u samples were summarized wrongly.\n", failures);
+  return failures;
+}
+
+/*
+ * Values through seplos_record_encode() and seplos_record_decode(): the
+ * fixed-point number in the record, little-endian, and the value that comes
+ * back, at the ends of the range of each kind of field, and past them, where
+ * the value is clamped. Then the byte order of the timestamp and the bit
+ * alarms, and the state bits. Returns the number of mismatches.
+ */
+static unsigned int
+check_record(void)
+{
+  enum { CELL, TEMPERATURE, CURRENT };
+  static const struct {
+    int		kind;
+    float	value;
+    unsigned int fixed;	/* In the record */
+    float	decoded;
+  } cases[] = {
+    { CELL, 3.456, 3456, 3.456 },
+    { CELL, 0, 0, 0 },
+    { CELL, -1, 0, 0 },
+    { CELL, 65.535, 65535, 65.535 },
+    { CELL, 70, 65535, 65.535 },
+    { CELL, NAN, 0, 0 },
+    /* 0.1 K, so 0 is -273.1 C. */
+    { TEMPERATURE, 25, 2981, 25 },
+    { TEMPERATURE, -40.5, 2326, -40.5 },
+    { TEMPERATURE, -273.1, 0, -273.1 },
+    { TEMPERATURE, -300, 0, -273.1 },
+    { TEMPERATURE, 6280.4, 65535, 6280.4 },
+    { TEMPERATURE, 7000, 65535, 6280.4 },
+    /* Signed, 0.01 A. */
+    { CURRENT, -123.45, 0xcfc7, -123.45 },
+    { CURRENT, 327.67, 0x7fff, 327.67 },
+    { CURRENT, 400, 0x7fff, 327.67 },
+    { CURRENT, -327.68, 0x8000, -327.68 },
+    { CURRENT, -400, 0x8000, -327.68 },
+    { CURRENT, INFINITY, 0, 0 },
+  };
+  uint8_t		record[SEPLOS_RECORD_SIZE];
+  const SeplosRecord *	r = (const SeplosRecord *)record;
+  SeplosData		m;
+  SeplosData		d;
+  int64_t		timestamp;
+  unsigned int		failures = 0;
+
+  for ( unsigned int i = 0; i < sizeof(cases) / sizeof(*cases); i++ ) {
+    const unsigned int	cell = i % SEPLOS_N_CELLS;
+    const unsigned int	sensor = i % SEPLOS_N_TEMPERATURES;
+    const uint8_t *	fixed;
+    float		decoded;
+
+    m = sample;
+    switch ( cases[i].kind ) {
+    case CELL:
+      m.cell_voltage[cell] = cases[i].value;
+      break;
+    case TEMPERATURE:
+      m.temperature[sensor] = cases[i].value;
+      break;
+    default:
+      m.charge_discharge_current = cases[i].value;
+      break;
+    }
+    seplos_record_encode(record, 0, &m);
+    seplos_record_decode(record, &timestamp, &d);
+    switch ( cases[i].kind ) {
+    case CELL:
+      fixed = r->cell_voltage[cell];
+      decoded = d.cell_voltage[cell];
+      break;
+    case TEMPERATURE:
+      fixed = r->temperature[sensor];
+      decoded = d.temperature[sensor];
+      break;
+    default:
+      fixed = r->charge_discharge_current;
+      decoded = d.charge_discharge_current;
+      break;
+    }
+    if ( (unsigned int)(fixed[0] | (fixed[1] << 8)) != cases[i].fixed || fabsf(decoded - cases[i].decoded) > 0.0005 ) {
+      fprintf(
+       stderr,
+       "Record: %g was stored as 0x%04x and read as %g, rather than 0x%04x and %g.\n",
+       cases[i].value,
+       fixed[0] | (fixed[1] << 8),
+       decoded,
+       cases[i].fixed,
+       cases[i].decoded);
+      failures++;
+    }
+  }
+
+  m = sample;
+  m.bit_alarm[0] = 0x04030201;
+  m.bit_alarm[1] = 0x80706050;
+  m.charge = true;
+  m.shutdown = true;
+  m.heating_switch = true;
+  seplos_record_encode(record, 0x0102030405060708LL, &m);
+  seplos_record_decode(record, &timestamp, &d);
+  for ( unsigned int i = 0; i < 8; i++ ) {
+    static const uint8_t bit_alarm[8] = { 0x01, 0x02, 0x03, 0x04, 0x50, 0x60, 0x70, 0x80 };
+    if ( r->timestamp[i] != 8u - i || r->bit_alarm[i] != bit_alarm[i] ) {
+      fprintf(stderr, "Record: byte %u of the timestamp or the bit alarms isn't little-endian.\n", i);
+      failures++;
+    }
+  }
+  if ( timestamp != 0x0102030405060708LL
+   || d.bit_alarm[0] != m.bit_alarm[0] || d.bit_alarm[1] != m.bit_alarm[1]
+   || !d.charge || !d.shutdown || !d.heating_switch
+   || d.discharge || d.standby || d.discharge_switch ) {
+    fprintf(stderr, "Record: The timestamp, the bit alarms or the state didn't come back.\n");
+    failures++;
+  }
+
+  seplos_record_encode(record, -1700000000000000LL, &m);
+  seplos_record_decode(record, &timestamp, &d);
+  if ( timestamp != -1700000000000000LL ) {
+    fprintf(stderr, "Record: A timestamp before 1970 didn't come back.\n");
+    failures++;
+  }
+  return failures;
+}
+
+/* Blocks of random samples, of every count up to one block, through the series codec and back. */
+#define	SERIES		SEPLOS_STORE_BLOCK_SAMPLES
+#define	BYTE_ALARMS	(SEPLOS_N_CELLS + SEPLOS_N_TEMPERATURES + 2)
+
+static unsigned int
+check_series(void)
+{
+  static int64_t	timestamps[2][SERIES];
+  static uint16_t	values[2][SEPLOS_COLUMN_STATE][SERIES];
+  static uint64_t	bit_alarms[2][SERIES];
+  static uint8_t	byte_alarms[2][SERIES][BYTE_ALARMS];
+  static uint8_t	compressed[SEPLOS_SERIES_SIZE(SERIES)];
+  void *		columns[2][SEPLOS_STORE_COLUMNS];
+  unsigned int		failures = 0;
+
+  srandom(2);
+  for ( unsigned int v = 0; v < 2; v++ ) {
+    columns[v][SEPLOS_COLUMN_TIMESTAMP] = timestamps[v];
+    for ( unsigned int c = SEPLOS_COLUMN_CELL_VOLTAGE; c <= SEPLOS_COLUMN_STATE; c++ )
+      columns[v][c] = values[v][c - 1];
+    columns[v][SEPLOS_COLUMN_BIT_ALARMS] = bit_alarms[v];
+    columns[v][SEPLOS_COLUMN_BYTE_ALARMS] = byte_alarms[v];
+  }
+
+  /* Smooth runs, as of a pack at rest, broken by jumps over the whole range. */
+  for ( unsigned int i = 0; i < SERIES; i++ ) {
+    const bool jump = random() % 64 == 0;
+
+    timestamps[0][i] = i == 0 ? 1700000000000000LL : timestamps[0][i - 1] + (jump ? random() : 5000000 + (random() % 2000));
+    for ( unsigned int c = 0; c < SEPLOS_COLUMN_STATE; c++ )
+      values[0][c][i] = jump || i == 0 ? random() : values[0][c][i - 1] + (random() % 3) - 1;
+    bit_alarms[0][i] = jump ? ((uint64_t)random() << 32) | random() : i == 0 ? 0 : bit_alarms[0][i - 1];
+    for ( unsigned int b = 0; b < BYTE_ALARMS; b++ )
+      byte_alarms[0][i][b] = jump ? random() : i == 0 ? 0 : byte_alarms[0][i - 1][b];
+  }
+
+  for ( unsigned int count = 1; count <= SERIES; count = count < 16 ? count + 1 : count * 2 ) {
+    unsigned int decoded = 0;
+    const size_t length = seplos_series_encode(compressed, sizeof(compressed), (const void * const *)columns[0], count);
+
+    memset(timestamps[1], 0, sizeof(timestamps[1]));
+    if ( length == 0
+     || seplos_series_decode(compressed, length, columns[1], SERIES, &decoded) != 0
+     || decoded != count
+     || memcmp(timestamps[0], timestamps[1], count * sizeof(**timestamps)) != 0
+     || memcmp(bit_alarms[0], bit_alarms[1], count * sizeof(**bit_alarms)) != 0
+     || memcmp(byte_alarms[0], byte_alarms[1], count * sizeof(**byte_alarms)) != 0 ) {
+      fprintf(stderr, "The series codec doesn't give back a block of %u samples.\n", count);
+      failures++;
+      continue;
+    }
+    for ( unsigned int c = 0; c < SEPLOS_COLUMN_STATE; c++ ) {
+      if ( memcmp(values[0][c], values[1][c], count * sizeof(**values[0])) != 0 ) {
+        fprintf(stderr, "The series codec doesn't give back column %u of a block of %u samples.\n", c + 1, count);
+        failures++;
+      }
+    }
+  }
+  return failures;
+}
+
+/*
+ * A store cut short, as by a full disk, so that its count of samples calls
+ * for a block that isn't in the file, must be refused by a reader rather than
+ * mapped, and taken over by a writer from its last whole block.
+ */
+static unsigned int
+check_store(void)
+{
+  char		path[64];
+  SeplosStore *	s;
+  int64_t	timestamp = 0;
+  SeplosData	m;
+  unsigned int	failures = 0;
+
+  snprintf(path, sizeof(path), "/tmp/seplos-bench-%d.store", (int)getpid());
+  unlink(path);
+  if ( (s = seplos_store_open(path, true)) == 0 )
+    return 1;
+  for ( int64_t i = 0; i < 5; i++ )
+    seplos_store_append(s, 1700000000000000LL + i, &sample);
+  seplos_store_close(s);
+
+  /* Into the first block, past the header page. */
+  if ( truncate(path, 4096 + 100) != 0 ) {
+    perror(path);
+    unlink(path);
+    return 1;
+  }
+  if ( (s = seplos_store_open(path, false)) != 0 ) {
+    fprintf(stderr, "A reader opened a store that was cut short.\n");
+    seplos_store_close(s);
+    failures++;
+  }
+  if ( (s = seplos_store_open(path, true)) == 0 )
+    failures++;
+  else {
+    if ( seplos_store_samples(s) != 0 || seplos_store_append(s, 1700000000000005LL, &sample) != 0
+     || seplos_store_read(s, 0, &timestamp, &m) != 0 || timestamp != 1700000000000005LL ) {
+      fprintf(stderr, "A writer didn't carry on from a store that was cut short.\n");
+      failures++;
+    }
+    seplos_store_close(s);
+  }
+  unlink(path);
+  return failures;
+}
+
+/*
+ * A run of samples, at known times, through a rule with hysteresis, one whose
+ * flapping is held back by its limit, and one that must hold for a time before
+ * it's raised. Each step gives the notifications it must make, as +NAME/CHANGES
+ * when raised and -NAME/CHANGES when cleared. Returns the number of steps
+ * that made other notifications.
+ */
+static unsigned int
+check_rules(void)
+{
+  static const char	text[] =
+   "high cell > 3.6 clear 3.5 limit 0\n"
+   "flap current > 10 limit 60\n"
+   "imbalance spread > 0.05 for 30 limit 0\n";
+  static const struct {
+    int64_t		seconds;
+    float		cell;
+    float		current;
+    float		spread;
+    const char *	expected;
+  } steps[] = {
+    { 0, 3.40, 0, 0.01, "" },
+    /* Raised past 3.6, and cleared only past 3.5. */
+    { 1, 3.61, 0, 0.01, "+high/1" },
+    { 2, 3.55, 0, 0.01, "" },
+    { 3, 3.49, 0, 0.01, "-high/1" },
+    { 4, 3.58, 0, 0.01, "" },
+    /* Flapping within the limit, reported when it's up, with the changes. */
+    { 10, 3.40, 11, 0.01, "+flap/1" },
+    { 11, 3.40, 0, 0.01, "" },
+    { 12, 3.40, 11, 0.01, "" },
+    { 13, 3.40, 0, 0.01, "" },
+    { 69, 3.40, 0, 0.01, "" },
+    { 70, 3.40, 0, 0.01, "-flap/3" },
+    /* Raised after holding for 30 seconds, and cleared at once. */
+    { 100, 3.40, 0, 0.1, "" },
+    { 129, 3.40, 0, 0.1, "" },
+    { 130, 3.40, 0, 0.1, "+imbalance/1" },
+    { 131, 3.40, 0, 0.01, "-imbalance/1" },
+    /* Interrupted, so the 30 seconds start again. */
+    { 140, 3.40, 0, 0.1, "" },
+    { 150, 3.40, 0, 0.01, "" },
+    { 175, 3.40, 0, 0.1, "" },
+    { 200, 3.40, 0, 0.1, "" },
+    { 205, 3.40, 0, 0.1, "+imbalance/1" },
+  };
+  SeplosAlarmEvent	events[3];
+  SeplosData		m = {};
+  unsigned int		failures = 0;
+  SeplosRules * const	r = seplos_rules_parse(text, "check_rules", 1);
+
+  if ( r == 0 )
+    return 1;
+
+  for ( unsigned int i = 0; i < sizeof(steps) / sizeof(*steps); i++ ) {
+    char	got[128] = "";
+    size_t	length = 0;
+
+    m.highest_cell_voltage = steps[i].cell;
+    m.lowest_cell_voltage = steps[i].cell - steps[i].spread;
+    m.charge_discharge_current = steps[i].current;
+
+    const unsigned int n = seplos_rules_evaluate(r, 0, steps[i].seconds * 1000000, &m, events);
+    for ( unsigned int e = 0; e < n; e++ ) {
+      length += snprintf(
+       got + length,
+       sizeof(got) - length,
+       "%s%c%s/%u",
+       e ? " " : "",
+       events[e].raised ? '+' : '-',
+       events[e].rule,
+       events[e].changes);
+    }
+    if ( strcmp(got, steps[i].expected) != 0 ) {
+      fprintf(stderr, "Rules at %llds: expected \"%s\", got \"%s\".\n", (long long)steps[i].seconds, steps[i].expected, got);
+      failures++;
+    }
+  }
+  seplos_rules_close(r);
+  return failures;
+}
+
+/*
+ * Energy counters over a run of samples, against totals worked out by hand,
+ * with a maximum gap of an hour. Returns the number of steps that differ.
+ */
+static unsigned int
+check_energy(void)
+{
+  static const struct {
+    int64_t	seconds;
+    float	current;
+    float	voltage;
+    bool	reopen;		/* Close and open the file before this sample */
+    double	charge, discharge, energy_in, energy_out, integrated, gaps;
+  } steps[] = {
+    { 1000, 10, 50, false, 0, 0, 0, 0, 0, 0 },
+    /* A constant 10 A at 50 V for 0.1 h. */
+    { 1360, 10, 50, false, 1, 0, 50, 0, 360, 0 },
+    /*
+     * 10 A to -30 A over 0.1 h crosses zero a quarter of the way: 0.125 AH and
+     * 6.25 Wh in, then 1.125 AH and 0.075 h * 1440 W / 2 = 54 Wh out.
+     */
+    { 1720, -30, 48, false, 1.125, 1.125, 56.25, 54, 720, 0 },
+    /* Two hours later, longer than the maximum gap. */
+    { 8920, -30, 48, false, 1.125, 1.125, 56.25, 54, 720, 7200 },
+    /* Back in time, as when the clock is set. */
+    { 8000, -30, 48, false, 1.125, 1.125, 56.25, 54, 720, 7200 },
+    /* From the last sample in the file: -30 A at 48 V for 0.1 h. */
+    { 8360, -30, 48, true, 1.125, 4.125, 56.25, 198, 1080, 7200 },
+  };
+  char			path[64];
+  SeplosEnergy *	e;
+  SeplosEnergyCounters	c;
+  SeplosData		m = {};
+  unsigned int		failures = 0;
+
+  snprintf(path, sizeof(path), "/tmp/seplos-bench-%d.energy", (int)getpid());
+  unlink(path);
+  if ( (e = seplos_energy_open(path, true)) == 0 )
+    return 1;
+
+  for ( unsigned int i = 0; i < sizeof(steps) / sizeof(*steps); i++ ) {
+    if ( steps[i].reopen ) {
+      seplos_energy_close(e);
+      if ( (e = seplos_energy_open(path, true)) == 0 ) {
+        unlink(path);
+        return 1;
+      }
+    }
+    m.charge_discharge_current = steps[i].current;
+    m.total_battery_voltage = steps[i].voltage;
+    seplos_energy_update(e, steps[i].seconds * 1000000, 3600 * 1000000LL, &m);
+
+    if ( seplos_energy_counters(e, &c) != 0
+     || fabs(c.charge - steps[i].charge) > 1e-9
+     || fabs(c.discharge - steps[i].discharge) > 1e-9
+     || fabs(c.energy_in - steps[i].energy_in) > 1e-9
+     || fabs(c.energy_out - steps[i].energy_out) > 1e-9
+     || fabs(c.integrated - steps[i].integrated) > 1e-6
+     || fabs(c.gaps - steps[i].gaps) > 1e-6
+     || c.samples != i + 1
+     || c.since != 1000 * 1000000LL ) {
+      fprintf(
+       stderr,
+       "Energy at %llds: got %g AH in, %g AH out, %g Wh in, %g Wh out, %gs integrated, %gs of gaps.\n",
+       (long long)steps[i].seconds,
+       c.charge,
+       c.discharge,
+       c.energy_in,
+       c.energy_out,
+       c.integrated,
+       c.gaps);
+      failures++;
+    }
+  }
+  seplos_energy_close(e);
+  unlink(path);
+  return failures;
+}
+
+/* The extreme of one value over the packs that are present, a tie going to the lower pack. */
+static void
+plain_extreme(
+ SeplosFleetExtreme * e,
+ const SeplosData * packs,
+ const bool * present,
+ unsigned int count,
+ bool lowest,
+ unsigned int (*element)(const SeplosData *, bool),
+ float (*value)(const SeplosData *, unsigned int))
+{
+  memset(e, 0, sizeof(*e));
+  e->value = lowest ? INFINITY : -INFINITY;
+  e->pack = ~0U;
+  for ( unsigned int p = 0; p < count; p++ ) {
+    const SeplosData * const m = &(packs[p]);
+    unsigned int i;
+
+    if ( !present[p] || (i = element(m, lowest)) == ~0U )
+      continue;
+    if ( lowest ? value(m, i) < e->value : value(m, i) > e->value ) {
+      e->value = value(m, i);
+      e->pack = p;
+      e->controller_address = m->controller_address;
+      e->battery_pack_number = m->battery_pack_number;
+      e->element = i;
+    }
+  }
+}
+
+/* The first cell or sensor with the lowest or highest value, ~0 if there are no cells. */
+static unsigned int
+cell_element(const SeplosData * m, bool lowest)
+{
+  unsigned int found = ~0U;
+
+  for ( unsigned int i = 0; i < m->number_of_cells; i++ ) {
+    if ( found == ~0U || (lowest ? m->cell_voltage[i] < m->cell_voltage[found] : m->cell_voltage[i] > m->cell_voltage[found]) )
+      found = i;
+  }
+  return found;
+}
+
+static float
+cell_value(const SeplosData * m, unsigned int i)
+{
+  return m->cell_voltage[i];
+}
+
+static unsigned int
+temperature_element(const SeplosData * m, bool lowest)
+{
+  unsigned int found = 0;
+
+  for ( unsigned int i = 1; i < SEPLOS_N_TEMPERATURES; i++ ) {
+    if ( lowest ? m->temperature[i] < m->temperature[found] : m->temperature[i] > m->temperature[found] )
+      found = i;
+  }
+  return found;
+}
+
+static float
+temperature_value(const SeplosData * m, unsigned int i)
+{
+  return m->temperature[i];
+}
+
+static unsigned int
+pack_element(const SeplosData * m, bool lowest)
+{
+  return 0;
+}
+
+static float
+state_of_charge_value(const SeplosData * m, unsigned int i)
+{
+  return m->state_of_charge;
+}
+
+static bool
+same_extreme(const SeplosFleetExtreme * a, const SeplosFleetExtreme * b)
+{
+  return a->value == b->value && a->pack == b->pack && a->controller_address == b->controller_address
+   && a->battery_pack_number == b->battery_pack_number && a->element == b->element;
+}
+
+static bool
+near(float got, double expected)
+{
+  return fabs(got - expected) <= 1e-4 * (1 + fabs(expected));
+}
+
+#define	FLEET_PACKS	37	/* Not a power of two */
+
+/*
+ * Random updates, removals and missed sweeps of the packs of a site whose size
+ * isn't a power of two, with values from a few, so that there are many ties,
+ * and after each the summary against a scan of every pack. Returns the number
+ * of mismatches.
+ */
+static unsigned int
+check_fleet(void)
+{
+  static const unsigned int cells[] = { 0, 1, 8, 15, 16 };
+  SeplosData		packs[FLEET_PACKS];
+  bool			present[FLEET_PACKS] = {};
+  unsigned int		missed[FLEET_PACKS] = {};
+  SeplosFleetSummary	got;
+  SeplosFleetSummary	e;
+  unsigned int		failures = 0;
+  SeplosFleet * const	f = seplos_fleet_open(FLEET_PACKS);
+
+  if ( f == 0 )
+    return 1;
+
+  srandom(5);
+  for ( unsigned int step = 0; step < 20000; step++ ) {
+    const unsigned int p = random() % FLEET_PACKS;
+    const unsigned int operation = random() % 8;
+
+    if ( operation == 0 ) {
+      seplos_fleet_remove(f, p);
+      present[p] = false;
+    }
+    else if ( operation < 3 ) {
+      seplos_fleet_missed(f, p);
+      if ( ++missed[p] == SEPLOS_FLEET_MISSED_SWEEPS )
+        present[p] = false;
+    }
+    else {
+      SeplosData * const m = &(packs[p]);
+
+      *m = sample;
+      m->controller_address = p % 4;
+      m->battery_pack_number = p / 4;
+      m->number_of_cells = cells[random() % (sizeof(cells) / sizeof(*cells))];
+      for ( unsigned int i = 0; i < SEPLOS_N_CELLS; i++ )
+        m->cell_voltage[i] = 3.2 + ((random() % 4) * 0.01);
+      for ( unsigned int i = 0; i < SEPLOS_N_TEMPERATURES; i++ )
+        m->temperature[i] = 20 + (random() % 4);
+      m->state_of_charge = 50 + (random() % 3);
+      m->charge_discharge_current = ((int)(random() % 201) - 100) / 10.0;
+      m->total_battery_voltage = 52 + ((random() % 100) / 100.0);
+      m->residual_capacity = random() % 280;
+      m->battery_capacity = 280;
+      m->has_alarm = random() % 8 == 0;
+      seplos_fleet_update(f, p, m);
+      present[p] = true;
+      missed[p] = 0;
+    }
+
+    double current = 0, power = 0, residual = 0, capacity = 0, energy = 0;
+    memset(&e, 0, sizeof(e));
+    for ( unsigned int i = 0; i < FLEET_PACKS; i++ ) {
+      if ( !present[i] )
+        continue;
+      e.packs++;
+      e.alarms += packs[i].has_alarm;
+      current += packs[i].charge_discharge_current;
+      power += (double)packs[i].charge_discharge_current * packs[i].total_battery_voltage;
+      residual += packs[i].residual_capacity;
+      capacity += packs[i].battery_capacity;
+      energy += (double)packs[i].residual_capacity * packs[i].total_battery_voltage;
+    }
+    plain_extreme(&(e.lowest_cell), packs, present, FLEET_PACKS, true, cell_element, cell_value);
+    plain_extreme(&(e.highest_cell), packs, present, FLEET_PACKS, false, cell_element, cell_value);
+    plain_extreme(&(e.coldest), packs, present, FLEET_PACKS, true, temperature_element, temperature_value);
+    plain_extreme(&(e.hottest), packs, present, FLEET_PACKS, false, temperature_element, temperature_value);
+    plain_extreme(&(e.lowest_state_of_charge), packs, present, FLEET_PACKS, true, pack_element, state_of_charge_value);
+    plain_extreme(&(e.highest_state_of_charge), packs, present, FLEET_PACKS, false, pack_element, state_of_charge_value);
+
+    seplos_fleet_summary(f, &got);
+    if ( got.packs != e.packs || got.alarms != e.alarms
+     || !near(got.current, current) || !near(got.power, power)
+     || !near(got.residual_capacity, residual) || !near(got.battery_capacity, capacity)
+     || !near(got.energy, energy)
+     || !near(got.state_of_charge, capacity > 0 ? (100 * residual) / capacity : 0)
+     || !same_extreme(&(got.lowest_cell), &(e.lowest_cell))
+     || !same_extreme(&(got.highest_cell), &(e.highest_cell))
+     || !same_extreme(&(got.coldest), &(e.coldest))
+     || !same_extreme(&(got.hottest), &(e.hottest))
+     || !same_extreme(&(got.lowest_state_of_charge), &(e.lowest_state_of_charge))
+     || !same_extreme(&(got.highest_state_of_charge), &(e.highest_state_of_charge)) ) {
+      if ( failures++ == 0 )
+        fprintf(stderr, "Fleet: After step %u, the summary of %u packs differs from a scan of them.\n", step, e.packs);
+    }
+  }
+  seplos_fleet_close(f);
+  if ( failures )
+    fprintf(stderr, "Fleet: %u summaries differ from a scan of the packs.\n", failures);
+  return failures;
+}
+
+int
+main(void)
+{
+  unsigned int	failures = 0;
+
+#if defined(__x86_64__) || defined(__i386__)
+  if ( __builtin_cpu_supports("sse2") )
+    failures += check("sse2", _sp_hex_decode_sse2, _sp_overall_checksum_sse2);
+  if ( __builtin_cpu_supports("avx2") ) {
+    failures += check("avx2", _sp_hex_decode_avx2, _sp_overall_checksum_avx2);
+    failures += check_analyze();
+  }
+#endif
+  failures += check_alarms();
+  failures += check_record();
+  failures += check_series();
+  failures += check_store();
+  failures += check_rules();
+  failures += check_energy();
+  failures += check_fleet();
+
+  if ( failures )
+    fprintf(stderr, "%u checks failed.\n", failures);
+  return failures ? 1 : 0;
+}